@@ -74,149 +74,169 @@ struct aircraft *aircraftCreate(struct modesMessage *mm) {
 
     return a;
 }
-void apiClear() {
-    Modes.avLen = 0;
-}
-
-void apiAdd(struct aircraft *a, uint64_t now) {
-    // don't include stale aircraft in the API index
-    if (a->position_valid.source != SOURCE_JAERO && now > a->seen + 60 * 1000)
-        return;
-    if (a->messages < 2)
-        return;
-
-    if (Modes.avLen > API_INDEX_MAX) {
-        fprintf(stderr, "too many aircraft!.\n");
-        return;
+// API spatial index (--net-api-port)
+//
+// Aircraft are kept in a grid of 1 x 1 degree cells which is updated whenever
+// a position is set.  Every aircraft knows its cell (api_cell), cells are
+// small so removal is a scan of the cell.  All of this runs on the decode
+// thread or under lockThreads().
+
+#define API_GRID_LAT 180
+#define API_GRID_LON 360
+
+static struct apiList *apiGrid;
+
+static void apiAppend(struct apiList *l, struct aircraft *a) {
+    if (l->len == l->alloc) {
+        l->alloc = l->alloc ? 2 * l->alloc : 16;
+        l->list = realloc(l->list, l->alloc * sizeof(struct aircraft *));
+        if (!l->list) {
+            fprintf(stderr, "apiAppend(): out of memory!\n");
+            exit(1);
+        }
     }
-    struct av byLat;
-    struct av byLon;
-
-    byLat.addr = a->addr;
-    byLat.value = (int32_t) (a->lat * 1E6);
-
-    byLon.addr = a->addr;
-    byLon.value = (int32_t) (a->lon * 1E6);
-
-    Modes.byLat[Modes.avLen] = byLat;
-    Modes.byLon[Modes.avLen] = byLon;
-
-    Modes.avLen++;
+    l->list[l->len++] = a;
 }
 
-static int compareValue(const void *p1, const void *p2) {
-    struct av *a1 = (struct av*) p1;
-    struct av *a2 = (struct av*) p2;
-    return (a1->value > a2->value) - (a1->value < a2->value);
+static int apiCellLat(double lat) {
+    int i = (int) floor(lat + 90);
+    return i < 0 ? 0 : (i >= API_GRID_LAT ? API_GRID_LAT - 1 : i);
 }
 
-void apiSort() {
-    qsort(Modes.byLat, Modes.avLen, sizeof(struct av), compareValue);
-    qsort(Modes.byLon, Modes.avLen, sizeof(struct av), compareValue);
+static int apiCellLon(double lon) {
+    int i = (int) floor(lon + 180);
+    return i < 0 ? 0 : (i >= API_GRID_LON ? API_GRID_LON - 1 : i);
 }
 
-static struct range findRange(int32_t ref_from, int32_t ref_to, struct av *list, int len) {
-    struct range res = {0, 0};
-    if (len == 0 || ref_from > ref_to)
-        return res;
-
-    // get lower bound
-    int i = 0;
-    int j = len - 1;
-    while (j > i + 1) {
-
-        int pivot = (i + j) / 2;
-
-        if (list[pivot].value < ref_from)
-            i = pivot;
-        else
-            j = pivot;
+void apiInit() {
+    apiGrid = calloc(API_GRID_LAT * API_GRID_LON, sizeof(struct apiList));
+    if (!apiGrid) {
+        fprintf(stderr, "apiInit(): out of memory!\n");
+        exit(1);
     }
-    if (list[j].value < ref_from)
-        res.from = j;
-    else
-        res.from = i;
-
-    // get upper bound (exclusive)
-    i = res.from;
-    j = len - 1;
-    while (j > i + 1) {
+}
 
-        int pivot = (i + j) / 2;
+void apiCleanup() {
+    if (!apiGrid)
+        return;
+    for (int i = 0; i < API_GRID_LAT * API_GRID_LON; i++)
+        free(apiGrid[i].list);
+    free(apiGrid);
+    apiGrid = NULL;
+}
 
-        if (list[pivot].value <= ref_to)
-            i = pivot;
-        else
-            j = pivot;
+void apiRemove(struct aircraft *a) {
+    if (!apiGrid || !a->api_cell)
+        return;
+    struct apiList *l = &apiGrid[a->api_cell - 1];
+    for (int i = 0; i < l->len; i++) {
+        if (l->list[i] == a) {
+            l->list[i] = l->list[--l->len];
+            break;
+        }
     }
-    if (list[j].value > ref_to)
-        res.to = j + 1;
-    else
-        res.to = i + 1;
-
-    return res;
+    a->api_cell = 0;
 }
 
-static int compareUint32(const void *p1, const void *p2) {
-    uint32_t *a1 = (uint32_t *) p1;
-    uint32_t *a2 = (uint32_t *) p2;
-    return (*a1 > *a2) - (*a1 < *a2);
+void apiUpdate(struct aircraft *a) {
+    if (!apiGrid)
+        return;
+    unsigned cell = apiCellLat(a->lat) * API_GRID_LON + apiCellLon(a->lon) + 1;
+    if (cell == a->api_cell)
+        return;
+    apiRemove(a);
+    apiAppend(&apiGrid[cell - 1], a);
+    a->api_cell = cell;
 }
 
-void apiReq(double latMin, double latMax, double lonMin, double lonMax, uint32_t *scratch) {
-
-    int32_t lat1 = (int32_t) (latMin * 1E6);
-    int32_t lat2 = (int32_t) (latMax * 1E6);
-    int32_t lon1 = (int32_t) (lonMin * 1E6);
-    int32_t lon2 = (int32_t) (lonMax * 1E6);
-
-    struct range rangeLat = findRange(lat1, lat2, Modes.byLat, Modes.avLen);
-    struct range rangeLon = findRange(lon1, lon2, Modes.byLon, Modes.avLen);
-
-    int allocLat = rangeLat.to - rangeLat.from;
-    int allocLon = rangeLon.to - rangeLon.from;
+static int apiUse(struct aircraft *a, uint64_t now) {
+    // don't return stale aircraft
+    if (a->position_valid.source != SOURCE_JAERO && now > a->seen_pos + 60 * SECONDS)
+        return 0;
+    if (a->messages < 2)
+        return 0;
+    return 1;
+}
 
-    fprintf(stderr, "%d %d %d %d %d %d\n", allocLat, allocLon, rangeLat.from, rangeLat.to, rangeLon.from, rangeLon.to);
+static void apiCells(struct apiList *res, int lat1, int lat2, int lon1, int lon2,
+        double latMin, double latMax, double lonMin, double lonMax, uint64_t now) {
+    for (int i = lat1; i <= lat2; i++) {
+        for (int j = lon1; j <= lon2; j++) {
+            struct apiList *l = &apiGrid[i * API_GRID_LON + j];
+            for (int k = 0; k < l->len; k++) {
+                struct aircraft *a = l->list[k];
+                if (a->lat < latMin || a->lat > latMax || a->lon < lonMin || a->lon > lonMax)
+                    continue;
+                if (apiUse(a, now))
+                    apiAppend(res, a);
+            }
+        }
+    }
+}
 
-    if (!allocLat || !allocLon) {
-        scratch[0] = 0;
+void apiBox(struct apiList *res, double latMin, double latMax, double lonMin, double lonMax, uint64_t now) {
+    if (!apiGrid || latMin > latMax)
         return;
+    int lat1 = apiCellLat(latMin);
+    int lat2 = apiCellLat(latMax);
+    if (lonMin <= lonMax) {
+        apiCells(res, lat1, lat2, apiCellLon(lonMin), apiCellLon(lonMax), latMin, latMax, lonMin, lonMax, now);
+    } else {
+        // crossing the antimeridian
+        apiCells(res, lat1, lat2, apiCellLon(lonMin), API_GRID_LON - 1, latMin, latMax, lonMin, 180, now);
+        apiCells(res, lat1, lat2, 0, apiCellLon(lonMax), latMin, latMax, -180, lonMax, now);
     }
+}
 
-    uint32_t *listLat = &scratch[1 * API_INDEX_MAX];
-    uint32_t *listLon = &scratch[2 * API_INDEX_MAX];
-
-    for (int i = 0; i < allocLat; i++) {
-        listLat[i] = Modes.byLat[rangeLat.from + i].addr;
+void apiCircle(struct apiList *res, double lat, double lon, double radius, uint64_t now) {
+    if (!apiGrid || radius < 0)
+        return;
+    // bounding box of the circle, then filter by distance
+    double dlat = radius / 6371e3 * (180 / M_PI);
+    double latMin = fmax(-90, lat - dlat);
+    double latMax = fmin(90, lat + dlat);
+    double dlon = 360;
+    if (latMin > -89 && latMax < 89)
+        dlon = dlat / fmin(cos(latMin * (M_PI / 180)), cos(latMax * (M_PI / 180)));
+
+    struct apiList box = { 0 };
+    if (dlon >= 180) {
+        apiBox(&box, latMin, latMax, -180, 180, now);
+    } else {
+        double lonMin = lon - dlon;
+        double lonMax = lon + dlon;
+        if (lonMin < -180)
+            lonMin += 360;
+        if (lonMax > 180)
+            lonMax -= 360;
+        apiBox(&box, latMin, latMax, lonMin, lonMax, now);
     }
-    qsort(listLat, allocLat, sizeof(uint32_t), compareUint32);
-
-    for (int i = 0; i < allocLon; i++) {
-        listLon[i] = Modes.byLon[rangeLon.from + i].addr;
+    for (int i = 0; i < box.len; i++) {
+        struct aircraft *a = box.list[i];
+        if (greatcircle(lat, lon, a->lat, a->lon) <= radius)
+            apiAppend(res, a);
     }
-    qsort(listLon, allocLon, sizeof(uint32_t), compareUint32);
-
-    int i = 0;
-    int j = 0;
-    int k = 0;
-    while (j < allocLat && k < allocLon) {
-        if (listLat[j] < listLon[k]) {
-            j++;
-            continue;
-        }
-        if (listLat[j] > listLon[k]) {
-            k++;
-            continue;
-        }
+    free(box.list);
+}
 
-        scratch[i] = listLat[j];
-        fprintf(stderr, "%06x %06x\n", listLat[j], listLon[k]);
-        i++;
-        j++;
-        k++;
+void apiHex(struct apiList *res, uint32_t addr, uint64_t now) {
+    struct aircraft *a = aircraftGet(addr);
+    if (a && now < a->seen + 60 * SECONDS)
+        apiAppend(res, a);
+}
+
+void apiCallsign(struct apiList *res, const char *prefix, uint64_t now) {
+    size_t len = strlen(prefix);
+    if (len > 8)
+        return;
+    for (int j = 0; j < AIRCRAFT_BUCKETS; j++) {
+        for (struct aircraft *a = Modes.aircraft[j]; a; a = a->next) {
+            if (!trackDataValid(&a->callsign_valid) || now > a->seen + 60 * SECONDS)
+                continue;
+            if (strncmp(a->callsign, prefix, len) == 0)
+                apiAppend(res, a);
+        }
     }
-    scratch[i] = 0;
-    return;
 }
 
 void toBinCraft(struct aircraft *a, struct binCraft *new, uint64_t now) {
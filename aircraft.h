@@ -1,26 +1,28 @@
 #ifndef AIRCRAFT_H
 #define AIRCRAFT_H
 
-#define API_INDEX_MAX 32000
-
 uint32_t aircraftHash(uint32_t addr);
 struct aircraft *aircraftGet(uint32_t addr);
 struct aircraft *aircraftCreate(struct modesMessage *mm);
 
-void apiClear();
-void apiAdd(struct aircraft *a, uint64_t now);
-void apiSort();
-void apiReq(double latMin, double latMax, double lonMin, double lonMax, uint32_t *scratch);
-
-struct av {
-    uint32_t addr;
-    int32_t value;
+// spatial index for the API (--net-api-port), caller holds the decode lock
+struct apiList {
+    struct aircraft **list;
+    int len;
+    int alloc;
 };
 
-struct range {
-    int from; // inclusive
-    int to; // exclusive
-};
+void apiInit();
+void apiCleanup();
+// the position of a changed
+void apiUpdate(struct aircraft *a);
+void apiRemove(struct aircraft *a);
+
+// the queries append the matching aircraft to res
+void apiBox(struct apiList *res, double latMin, double latMax, double lonMin, double lonMax, uint64_t now);
+void apiCircle(struct apiList *res, double lat, double lon, double radius, uint64_t now); // radius in meters
+void apiHex(struct apiList *res, uint32_t addr, uint64_t now);
+void apiCallsign(struct apiList *res, const char *prefix, uint64_t now);
 
 struct binCraft {
   uint32_t hex;
@@ -0,0 +1,386 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// compress.c: gzip compression with reusable per thread contexts, see compress.h
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "readsb.h"
+
+#ifdef ENABLE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+// output chunk size for the streaming writer
+#define ZWRITER_CHUNK (256 * 1024)
+
+// Every thread that compresses keeps one of these around: deflateInit2() and
+// the buffers are only paid for once per thread, later files just reset the stream.
+struct zctx {
+    z_stream strm;
+    int streamInit;
+    int level;
+    z_stream raw; // headerless stream for gzappendBuild()
+    int rawInit;
+    int rawLevel;
+    unsigned char *out;
+    size_t outAlloc;
+#ifdef ENABLE_LIBDEFLATE
+    struct libdeflate_compressor *ld[13];
+#endif
+};
+
+static pthread_key_t zctxKey;
+static pthread_once_t zctxOnce = PTHREAD_ONCE_INIT;
+
+static void zctxFree(void *arg) {
+    struct zctx *ctx = arg;
+    if (ctx->streamInit)
+        deflateEnd(&ctx->strm);
+    if (ctx->rawInit)
+        deflateEnd(&ctx->raw);
+#ifdef ENABLE_LIBDEFLATE
+    for (int i = 0; i < 13; i++) {
+        if (ctx->ld[i])
+            libdeflate_free_compressor(ctx->ld[i]);
+    }
+#endif
+    free(ctx->out);
+    free(ctx);
+}
+
+static void zctxKeyCreate() {
+    if (pthread_key_create(&zctxKey, zctxFree)) {
+        fprintf(stderr, "compress: pthread_key_create failed\n");
+        exit(1);
+    }
+}
+
+static struct zctx *zctxGet() {
+    pthread_once(&zctxOnce, zctxKeyCreate);
+    struct zctx *ctx = pthread_getspecific(zctxKey);
+    if (!ctx) {
+        ctx = calloc(1, sizeof(struct zctx));
+        if (!ctx) {
+            fprintf(stderr, "compress: out of memory\n");
+            exit(1);
+        }
+        pthread_setspecific(zctxKey, ctx);
+    }
+    return ctx;
+}
+
+// prepare the thread's deflate stream for a new gzip member
+static int zctxStream(struct zctx *ctx, int level) {
+    if (!ctx->streamInit) {
+        // 16 + MAX_WBITS: gzip header instead of zlib
+        if (deflateInit2(&ctx->strm, level, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+        ctx->streamInit = 1;
+        ctx->level = level;
+        return 0;
+    }
+    if (deflateReset(&ctx->strm) != Z_OK)
+        return -1;
+    if (ctx->level != level) {
+        // nothing has been compressed since the reset, this doesn't flush anything
+        if (deflateParams(&ctx->strm, level, Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+        ctx->level = level;
+    }
+    return 0;
+}
+
+static int zctxRawStream(struct zctx *ctx, int level) {
+    if (!ctx->rawInit) {
+        if (deflateInit2(&ctx->raw, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+        ctx->rawInit = 1;
+        ctx->rawLevel = level;
+        return 0;
+    }
+    if (deflateReset(&ctx->raw) != Z_OK)
+        return -1;
+    if (ctx->rawLevel != level) {
+        if (deflateParams(&ctx->raw, level, Z_DEFAULT_STRATEGY) != Z_OK)
+            return -1;
+        ctx->rawLevel = level;
+    }
+    return 0;
+}
+
+static int zctxReserve(struct zctx *ctx, size_t size) {
+    if (ctx->outAlloc >= size)
+        return 0;
+    free(ctx->out);
+    ctx->outAlloc = size + size / 8;
+    ctx->out = malloc(ctx->outAlloc);
+    if (!ctx->out) {
+        ctx->outAlloc = 0;
+        return -1;
+    }
+    return 0;
+}
+
+void zAccount(zclass_t zclass, uint64_t in, uint64_t out, const struct timespec *cpu) {
+    // several threads compress at the same time
+    struct stats *st = &Modes.stats_current;
+    __atomic_fetch_add(&st->compress_in[zclass], in, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->compress_out[zclass], out, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&st->compress_cpu_ns[zclass], (uint64_t) cpu->tv_sec * 1000000000ULL + cpu->tv_nsec, __ATOMIC_RELAXED);
+}
+
+static const char *zclassNames[ZCLASS_COUNT] = {
+    "none", "json", "globe_bin", "globe_json", "trace_recent", "trace_full", "history", "state", "heatmap", "http", "net"
+};
+
+const char *zclassName(zclass_t zclass) {
+    if (zclass < 0 || zclass >= ZCLASS_COUNT)
+        return "unknown";
+    return zclassNames[zclass];
+}
+
+// class=level,class=level,...
+int compressParseLevels(const char *arg) {
+    char *copy = strdup(arg);
+    if (!copy) {
+        fprintf(stderr, "--compression-levels: out of memory\n");
+        return -1;
+    }
+    char *save;
+    int res = 0;
+    for (char *tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(tok, '=');
+        int found = 0;
+        if (eq) {
+            *eq = '\0';
+            for (int i = ZCLASS_NONE + 1; i < ZCLASS_COUNT; i++) {
+                if (!strcmp(tok, zclassNames[i])) {
+                    char *endp;
+                    long level = strtol(eq + 1, &endp, 10);
+                    if (*endp || endp == eq + 1 || level < 0 || level > 9)
+                        break;
+                    Modes.compress_level[i] = level;
+                    found = 1;
+                }
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "--compression-levels: invalid entry: %s%s%s (expected class=0..9)\n",
+                    tok, eq ? "=" : "", eq ? eq + 1 : "");
+            res = -1;
+        }
+    }
+    free(copy);
+    return res;
+}
+
+int gzipBuffer(const void *in, size_t len, zclass_t zclass, struct char_buffer *out) {
+    struct zctx *ctx = zctxGet();
+    int level = Modes.compress_level[zclass];
+    struct timespec start, cpu = { 0, 0 };
+    start_cpu_timing(&start);
+
+#ifdef ENABLE_LIBDEFLATE
+    // one shot compression, a good deal faster than zlib for whole buffers
+    if (!ctx->ld[level])
+        ctx->ld[level] = libdeflate_alloc_compressor(level);
+    if (!ctx->ld[level])
+        return -1;
+    size_t bound = libdeflate_gzip_compress_bound(ctx->ld[level], len);
+    if (zctxReserve(ctx, bound))
+        return -1;
+    size_t outLen = libdeflate_gzip_compress(ctx->ld[level], in, len, ctx->out, ctx->outAlloc);
+    if (!outLen)
+        return -1;
+#else
+    if (zctxStream(ctx, level))
+        return -1;
+    if (zctxReserve(ctx, deflateBound(&ctx->strm, len)))
+        return -1;
+    ctx->strm.next_in = (Bytef *) in;
+    ctx->strm.avail_in = len;
+    ctx->strm.next_out = ctx->out;
+    ctx->strm.avail_out = ctx->outAlloc;
+    if (deflate(&ctx->strm, Z_FINISH) != Z_STREAM_END)
+        return -1;
+    size_t outLen = ctx->outAlloc - ctx->strm.avail_out;
+#endif
+
+    end_cpu_timing(&start, &cpu);
+    zAccount(zclass, len, outLen, &cpu);
+
+    out->buffer = (char *) ctx->out;
+    out->len = outLen;
+    return 0;
+}
+
+long gunzipToBuffer(const void *in, size_t len, void *out, size_t outLen) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+        return -1;
+    strm.next_in = (Bytef *) in;
+    strm.avail_in = len;
+    strm.next_out = out;
+    strm.avail_out = outLen;
+    int res = inflate(&strm, Z_FINISH);
+    long outLength = outLen - strm.avail_out;
+    inflateEnd(&strm);
+    return res == Z_STREAM_END ? outLength : -1;
+}
+
+static unsigned char *putLe32(unsigned char *p, uint32_t val) {
+    for (int i = 0; i < 4; i++)
+        *p++ = val >> (8 * i);
+    return p;
+}
+
+size_t gzappendTrailer(const struct gzappend *ga, const char *tail, size_t tailLen, unsigned char *buf) {
+    unsigned char *p = buf;
+    // BFINAL set, BTYPE 00 (stored), the sync flush left the stream byte aligned
+    *p++ = 0x01;
+    *p++ = tailLen & 0xff;
+    *p++ = tailLen >> 8;
+    *p++ = ~tailLen & 0xff;
+    *p++ = (~tailLen >> 8) & 0xff;
+    memcpy(p, tail, tailLen);
+    p += tailLen;
+    p = putLe32(p, crc32(ga->crc, (const Bytef *) tail, tailLen));
+    p = putLe32(p, ga->isize + tailLen);
+    return p - buf;
+}
+
+int gzappendBuild(struct gzappend *ga, const void *in, size_t len, const char *tail, size_t tailLen, zclass_t zclass, struct char_buffer *out) {
+    static const unsigned char gzipHeader[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+    struct zctx *ctx = zctxGet();
+    struct timespec start, cpu = { 0, 0 };
+    start_cpu_timing(&start);
+
+    if (tailLen > GZAPPEND_TAIL_MAX)
+        return -1;
+    if (zctxRawStream(ctx, Modes.compress_level[zclass]))
+        return -1;
+    // deflateBound() doesn't include the sync flush marker
+    if (zctxReserve(ctx, sizeof(gzipHeader) + deflateBound(&ctx->raw, len) + 16 + GZAPPEND_TRAILER_LEN(tailLen)))
+        return -1;
+
+    struct gzappend next = *ga;
+    unsigned char *p = ctx->out;
+    if (!next.size) {
+        memcpy(p, gzipHeader, sizeof(gzipHeader));
+        p += sizeof(gzipHeader);
+        next.crc = crc32(0, NULL, 0);
+        next.isize = 0;
+    }
+
+    ctx->raw.next_in = (Bytef *) in;
+    ctx->raw.avail_in = len;
+    ctx->raw.next_out = p;
+    ctx->raw.avail_out = ctx->outAlloc - (p - ctx->out);
+    if (deflate(&ctx->raw, Z_SYNC_FLUSH) != Z_OK || ctx->raw.avail_in)
+        return -1;
+    p = ctx->raw.next_out;
+
+    next.crc = crc32(next.crc, in, len);
+    next.isize += len;
+    p += gzappendTrailer(&next, tail, tailLen, p);
+    next.size = gzappendOffset(ga, tailLen) + (p - ctx->out);
+    *ga = next;
+
+    end_cpu_timing(&start, &cpu);
+    zAccount(zclass, len, p - ctx->out, &cpu);
+
+    out->buffer = (char *) ctx->out;
+    out->len = p - ctx->out;
+    return 0;
+}
+
+static int writeAll(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t res = write(fd, buf, len);
+        if (res < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+// run deflate until the input is consumed (or the stream is finished) and write the output
+static void zwriterDeflate(struct zwriter *zw, struct zctx *ctx, int flush) {
+    int res;
+    do {
+        ctx->strm.next_out = ctx->out;
+        ctx->strm.avail_out = ZWRITER_CHUNK;
+        res = deflate(&ctx->strm, flush);
+        if (res == Z_STREAM_ERROR) {
+            zw->error = 1;
+            return;
+        }
+        size_t produced = ZWRITER_CHUNK - ctx->strm.avail_out;
+        if (produced && writeAll(zw->fd, ctx->out, produced)) {
+            zw->error = 1;
+            return;
+        }
+        zw->bytesOut += produced;
+    } while (ctx->strm.avail_out == 0 || (flush == Z_FINISH && res != Z_STREAM_END));
+}
+
+// The writer uses the thread's context, don't call gzipBuffer() while a writer is open.
+void zwriterOpen(struct zwriter *zw, int fd, zclass_t zclass) {
+    memset(zw, 0, sizeof(struct zwriter));
+    zw->fd = fd;
+    zw->zclass = zclass;
+    struct zctx *ctx = zctxGet();
+    if (zctxStream(ctx, Modes.compress_level[zclass]) || zctxReserve(ctx, ZWRITER_CHUNK))
+        zw->error = 1;
+}
+
+int zwriterWrite(struct zwriter *zw, const void *buf, size_t len) {
+    if (zw->error)
+        return -1;
+    struct zctx *ctx = zctxGet();
+    struct timespec start;
+    start_cpu_timing(&start);
+
+    ctx->strm.next_in = (Bytef *) buf;
+    ctx->strm.avail_in = len;
+    zwriterDeflate(zw, ctx, Z_NO_FLUSH);
+    zw->bytesIn += len;
+
+    end_cpu_timing(&start, &zw->cpu);
+    return zw->error ? -1 : 0;
+}
+
+int zwriterClose(struct zwriter *zw) {
+    struct zctx *ctx = zctxGet();
+    if (!zw->error) {
+        struct timespec start;
+        start_cpu_timing(&start);
+        ctx->strm.next_in = NULL;
+        ctx->strm.avail_in = 0;
+        zwriterDeflate(zw, ctx, Z_FINISH);
+        end_cpu_timing(&start, &zw->cpu);
+    }
+    if (close(zw->fd) < 0)
+        zw->error = 1;
+    zw->fd = -1;
+
+    zAccount(zw->zclass, zw->bytesIn, zw->bytesOut, &zw->cpu);
+
+    return zw->error ? -1 : 0;
+}
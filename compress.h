@@ -0,0 +1,89 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// compress.h: gzip compression with reusable per thread contexts
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+// gzip compression with reusable per thread contexts
+
+// file classes with their own compression level (--compression-levels)
+typedef enum {
+    ZCLASS_NONE, // not compressed
+    ZCLASS_JSON, // aircraft.json.gz
+    ZCLASS_GLOBE_BIN, // globe_xxxx.binCraft
+    ZCLASS_GLOBE_JSON, // globe_xxxx.json
+    ZCLASS_TRACE_RECENT,
+    ZCLASS_TRACE_FULL,
+    ZCLASS_HISTORY, // globe_history traces
+    ZCLASS_STATE, // state blobs
+    ZCLASS_HEATMAP,
+    ZCLASS_HTTP, // in memory copies for the HTTP server
+    ZCLASS_NET, // compressed network connections (COMPRESS handshake, see net_io.h)
+    ZCLASS_COUNT
+} zclass_t;
+
+// streaming gzip writer to a file descriptor
+struct zwriter {
+    int fd;
+    zclass_t zclass;
+    int error;
+    uint64_t bytesIn;
+    uint64_t bytesOut;
+    struct timespec cpu;
+};
+
+const char *zclassName(zclass_t zclass);
+// add to the compression stats of a class, for streams compressed elsewhere
+void zAccount(zclass_t zclass, uint64_t in, uint64_t out, const struct timespec *cpu);
+int compressParseLevels(const char *arg);
+
+// compress len bytes from in, out points to a per thread buffer that is valid
+// until the next call from the same thread, returns -1 on error
+int gzipBuffer(const void *in, size_t len, zclass_t zclass, struct char_buffer *out);
+
+// decompress one gzip member of len bytes into out (outLen known in advance), returns the decompressed length or -1
+long gunzipToBuffer(const void *in, size_t len, void *out, size_t outLen);
+
+// Appendable gzip files: a single gzip member whose deflate stream is sync flushed after
+// every write and ends in a final stored block holding a short tail (closing brackets).
+// A later write replaces that block and the gzip trailer, everything before it stays.
+#define GZAPPEND_TAIL_MAX 64
+#define GZAPPEND_TRAILER_LEN(tailLen) (5 + (tailLen) + 8)
+struct gzappend {
+    uint64_t size; // file size after the last write, 0: start a new file
+    uint32_t crc; // crc32 and length of the data before the tail
+    uint32_t isize;
+};
+
+// bytes at the end of the file from the last write: final stored block and gzip trailer
+size_t gzappendTrailer(const struct gzappend *ga, const char *tail, size_t tailLen, unsigned char *buf);
+
+// file offset the output of the next gzappendBuild() is written to
+static inline uint64_t gzappendOffset(const struct gzappend *ga, size_t tailLen) {
+    return ga->size ? ga->size - GZAPPEND_TRAILER_LEN(tailLen) : 0;
+}
+
+// compress len bytes from in followed by the tail and update ga, out is a per thread
+// buffer like for gzipBuffer(), returns -1 on error
+int gzappendBuild(struct gzappend *ga, const void *in, size_t len, const char *tail, size_t tailLen, zclass_t zclass, struct char_buffer *out);
+
+void zwriterOpen(struct zwriter *zw, int fd, zclass_t zclass);
+int zwriterWrite(struct zwriter *zw, const void *buf, size_t len);
+// finishes the gzip stream and closes fd, returns -1 if anything failed
+int zwriterClose(struct zwriter *zw);
+
+#endif
@@ -0,0 +1,215 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// compresstests.c - tests for the gzip helpers, appendable gzip files in particular
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "readsb.h"
+
+// compress.c takes the levels from here
+struct _Modes Modes;
+
+// the file written by the appends and the plain data it has to contain
+static struct {
+    unsigned char *file;
+    size_t fileLen;
+    char *plain;
+    size_t plainLen;
+} gzfile;
+
+// decode a complete gzip file with zlib, the trailer crc and length are checked by inflate
+static int gunzipAll(const unsigned char *in, size_t len, char **out, size_t *outLen) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+        return -1;
+
+    size_t alloc = 4096;
+    char *buf = malloc(alloc);
+    int res = Z_OK;
+    strm.next_in = (Bytef *) in;
+    strm.avail_in = len;
+    while (buf && res == Z_OK) {
+        if (strm.total_out == alloc) {
+            char *grown = realloc(buf, 2 * alloc);
+            if (!grown)
+                break;
+            buf = grown;
+            alloc *= 2;
+        }
+        strm.next_out = (Bytef *) buf + strm.total_out;
+        strm.avail_out = alloc - strm.total_out;
+        res = inflate(&strm, Z_NO_FLUSH);
+    }
+    *outLen = strm.total_out;
+    // nothing may follow the gzip member
+    int trailing = strm.avail_in;
+    inflateEnd(&strm);
+    if (res != Z_STREAM_END || trailing) {
+        free(buf);
+        return -1;
+    }
+    *out = buf;
+    return 0;
+}
+
+// one write like globe_index.c does it: overwrite the old trailer, cut the file after the new one
+static int gzappendWrite(struct gzappend *ga, const char *data, size_t len, const char *tail) {
+    struct char_buffer out;
+    size_t tailLen = strlen(tail);
+    uint64_t offset = gzappendOffset(ga, tailLen);
+
+    if (gzappendBuild(ga, data, len, tail, tailLen, ZCLASS_TRACE_FULL, &out) < 0)
+        return -1;
+
+    unsigned char *file = realloc(gzfile.file, offset + out.len);
+    char *plain = realloc(gzfile.plain, gzfile.plainLen + len + 1);
+    if (file)
+        gzfile.file = file;
+    if (plain)
+        gzfile.plain = plain;
+    if (!file || !plain)
+        return -1;
+
+    memcpy(gzfile.file + offset, out.buffer, out.len);
+    gzfile.fileLen = offset + out.len;
+    memcpy(gzfile.plain + gzfile.plainLen, data, len);
+    gzfile.plainLen += len;
+    if (ga->size != gzfile.fileLen)
+        return -1;
+    return 0;
+}
+
+// the file decodes to all the data written so far followed by the current tail
+static int gzappendCheck(const char *tail) {
+    char *decoded;
+    size_t decodedLen;
+    size_t tailLen = strlen(tail);
+    if (gunzipAll(gzfile.file, gzfile.fileLen, &decoded, &decodedLen) < 0)
+        return -1;
+    int res = 0;
+    if (decodedLen != gzfile.plainLen + tailLen
+            || memcmp(decoded, gzfile.plain, gzfile.plainLen)
+            || memcmp(decoded + gzfile.plainLen, tail, tailLen)) {
+        res = -1;
+    }
+    free(decoded);
+    return res;
+}
+
+static void gzappendReset() {
+    free(gzfile.file);
+    free(gzfile.plain);
+    memset(&gzfile, 0, sizeof(gzfile));
+}
+
+static int testGzappend() {
+    int ok = 1;
+    static const char *tails[] = { "\n]}\n", "", "]" };
+
+    for (unsigned t = 0; t < sizeof(tails) / sizeof(tails[0]); ++t) {
+        struct gzappend ga = { 0, 0, 0 };
+        const char *tail = tails[t];
+        int failed = -1;
+        char point[128];
+
+        gzappendReset();
+        srandom(t + 1);
+        for (int i = 0; i < 200 && failed < 0; i++) {
+            int len = snprintf(point, sizeof(point), "%s[%d,%.6f,%.6f,%ld]",
+                    i ? ",\n" : "{\"trace\":[\n", i * 4, 51.0 + i * 0.001, -0.1 - i * 0.002, random() % 40000);
+            if (gzappendWrite(&ga, point, len, tail) < 0 || gzappendCheck(tail) < 0)
+                failed = i;
+        }
+
+        if (failed >= 0) {
+            ok = 0;
+            fprintf(stderr, "testGzappend[%u]: FAIL: file doesn't decode after write %d\n", t, failed);
+        } else {
+            fprintf(stderr, "testGzappend[%u]:  PASS (%zu bytes for %zu)\n", t, gzfile.fileLen, gzfile.plainLen);
+        }
+    }
+
+    // incompressible writes larger than the deflate window and an empty write
+    {
+        struct gzappend ga = { 0, 0, 0 };
+        size_t len = 200 * 1024;
+        char *data = malloc(len);
+        int res = -1;
+        gzappendReset();
+        if (data) {
+            for (size_t i = 0; i < len; i++)
+                data[i] = random();
+            res = gzappendWrite(&ga, data, len, "]}");
+            res = res || gzappendWrite(&ga, "", 0, "]}");
+            res = res || gzappendWrite(&ga, data, len / 3, "]}");
+            res = res || gzappendCheck("]}");
+        }
+        free(data);
+        if (res) {
+            ok = 0;
+            fprintf(stderr, "testGzappend[large]: FAIL\n");
+        } else {
+            fprintf(stderr, "testGzappend[large]:  PASS\n");
+        }
+    }
+
+    // tails that don't fit the trailer are refused without touching the state
+    {
+        struct gzappend ga = { 0, 0, 0 };
+        char tail[GZAPPEND_TAIL_MAX + 2];
+        memset(tail, ']', sizeof(tail) - 1);
+        tail[sizeof(tail) - 1] = '\0';
+        struct char_buffer out;
+        if (gzappendBuild(&ga, "[1]", 3, tail, strlen(tail), ZCLASS_TRACE_FULL, &out) == 0 || ga.size) {
+            ok = 0;
+            fprintf(stderr, "testGzappend[tail]: FAIL: %zu byte tail accepted\n", strlen(tail));
+        } else {
+            fprintf(stderr, "testGzappend[tail]:  PASS\n");
+        }
+    }
+
+    gzappendReset();
+    return ok;
+}
+
+static int testGzipBuffer() {
+    int ok = 1;
+    char plain[5000];
+    char decoded[sizeof(plain)];
+    struct char_buffer out;
+
+    for (size_t i = 0; i < sizeof(plain); i++)
+        plain[i] = "{\"hex\":\"3c6444\",\"alt_baro\":37000},\n"[i % 35];
+
+    long len = -1;
+    if (gzipBuffer(plain, sizeof(plain), ZCLASS_JSON, &out) == 0)
+        len = gunzipToBuffer(out.buffer, out.len, decoded, sizeof(decoded));
+    if (len != (long) sizeof(plain) || memcmp(plain, decoded, sizeof(plain))) {
+        ok = 0;
+        fprintf(stderr, "testGzipBuffer: FAIL: decoded %ld bytes (expected %zu)\n", len, sizeof(plain));
+    } else {
+        fprintf(stderr, "testGzipBuffer:  PASS\n");
+    }
+    return ok;
+}
+
+int main(int __attribute__ ((unused)) argc, char __attribute__ ((unused)) **argv) {
+    int ok = 1;
+    for (int i = 0; i < ZCLASS_COUNT; i++)
+        Modes.compress_level[i] = 6;
+    ok = testGzappend() && ok;
+    ok = testGzipBuffer() && ok;
+    return ok ? 0 : 1;
+}
@@ -372,3 +372,20 @@ int decodeCPRrelative(double reflat, double reflon,
     *out_lon = rlon;
     return (0);
 }
+//
+//=========================================================================
+//
+// The inverse of decodeCPRairborne, the 17 bit values are the fractional
+// position inside the latitude zone and the longitude cell.
+//
+void encodeCPRairborne(double lat, double lon, int fflag, int *out_cprlat, int *out_cprlon) {
+    double dlat = 360.0 / (fflag ? 59.0 : 60.0);
+    int yz = (int) floor(131072 * cprModDouble(lat, dlat) / dlat + 0.5);
+    double rlat = dlat * (yz / 131072.0 + floor(lat / dlat));
+
+    double dlon = cprDlonFunction(rlat, fflag, 0);
+    int xz = (int) floor(131072 * cprModDouble(lon, dlon) / dlon + 0.5);
+
+    *out_cprlat = yz & 0x1FFFF;
+    *out_cprlon = xz & 0x1FFFF;
+}
@@ -40,4 +40,7 @@ int decodeCPRrelative (double reflat, double reflon,
                        int fflag, int surface,
                        double *out_lat, double *out_lon);
 
+void encodeCPRairborne (double lat, double lon, int fflag,
+                        int *out_cprlat, int *out_cprlon);
+
 #endif
@@ -303,10 +303,91 @@ static int testCPRRelative() {
     return ok;
 }
 
+// Encode, then decode globally and relative to the position itself, over a grid
+// of positions.  The first airborne test vectors have to give the exact raw values.
+static int testCPREncode() {
+    int ok = 1;
+    unsigned failed = 0, tested = 0, crossed = 0;
+
+    for (unsigned i = 0; i < 2; ++i) {
+        int cprlat, cprlon, fflag = i;
+        double lat = fflag ? cprGlobalAirborneTests[0].odd_rlat : cprGlobalAirborneTests[0].even_rlat;
+        double lon = fflag ? cprGlobalAirborneTests[0].odd_rlon : cprGlobalAirborneTests[0].even_rlon;
+        int expected_lat = fflag ? cprGlobalAirborneTests[0].odd_cprlat : cprGlobalAirborneTests[0].even_cprlat;
+        int expected_lon = fflag ? cprGlobalAirborneTests[0].odd_cprlon : cprGlobalAirborneTests[0].even_cprlon;
+
+        encodeCPRairborne(lat, lon, fflag, &cprlat, &cprlon);
+        if (cprlat != expected_lat || cprlon != expected_lon) {
+            ok = 0;
+            fprintf(stderr,
+                    "testCPREncode[%s]:  FAIL: encodeCPRairborne(%.6f,%.6f,%d) failed:\n"
+                    " cprlat %d  (expected %d)\n"
+                    " cprlon %d  (expected %d)\n",
+                    fflag ? "ODD" : "EVEN", lat, lon, fflag,
+                    cprlat, expected_lat, cprlon, expected_lon);
+        } else {
+            fprintf(stderr, "testCPREncode[%s]:  PASS\n", fflag ? "ODD" : "EVEN");
+        }
+    }
+
+    // above 80 degrees the longitude cells get too wide for a fixed tolerance
+    for (double lat = -80.0; lat <= 80.0; lat += 0.73) {
+        for (double lon = -179.9; lon < 180.0; lon += 1.37) {
+            int even_cprlat, even_cprlon, odd_cprlat, odd_cprlon;
+            encodeCPRairborne(lat, lon, 0, &even_cprlat, &even_cprlon);
+            encodeCPRairborne(lat, lon, 1, &odd_cprlat, &odd_cprlon);
+
+            for (int fflag = 0; fflag <= 1; ++fflag) {
+                double rlat, rlon, rel_lat, rel_lon;
+                int res = decodeCPRairborne(even_cprlat, even_cprlon, odd_cprlat, odd_cprlon, fflag, &rlat, &rlon);
+                int rel = decodeCPRrelative(lat, lon,
+                        fflag ? odd_cprlat : even_cprlat, fflag ? odd_cprlon : even_cprlon,
+                        fflag, 0, &rel_lat, &rel_lon);
+                tested++;
+
+                // the even and odd latitude can end up in different NL zones, decoding waits for the next pair
+                if (res == -1) {
+                    crossed++;
+                    res = 0;
+                    rlat = rel_lat;
+                    rlon = rel_lon;
+                }
+                double dlon = fabs(rlon - lon);
+                if (dlon > 180)
+                    dlon = 360 - dlon;
+                double rel_dlon = fabs(rel_lon - lon);
+                if (rel_dlon > 180)
+                    rel_dlon = 360 - rel_dlon;
+                double coslat = cos(lat * M_PI / 180.0);
+
+                if (res != 0 || rel != 0 || fabs(rlat - lat) > 1e-4 || dlon * coslat > 1e-4
+                        || fabs(rel_lat - lat) > 1e-4 || rel_dlon * coslat > 1e-4) {
+                    ok = 0;
+                    if (failed++ < 10) {
+                        fprintf(stderr,
+                                "testCPREncode[%.2f,%.2f,%s]:  FAIL: round trip failed:\n"
+                                " global   result %d  lat %.6f  lon %.6f\n"
+                                " relative result %d  lat %.6f  lon %.6f\n",
+                                lat, lon, fflag ? "ODD" : "EVEN",
+                                res, rlat, rlon, rel, rel_lat, rel_lon);
+                    }
+                }
+            }
+        }
+    }
+    if (failed == 0)
+        fprintf(stderr, "testCPREncode[grid]:  PASS (%u positions, %u crossed a zone)\n", tested, crossed);
+    else
+        fprintf(stderr, "testCPREncode[grid]:  FAIL: %u of %u positions\n", failed, tested);
+
+    return ok;
+}
+
 int main(int __attribute__ ((unused)) argc, char __attribute__ ((unused)) **argv) {
     int ok = 1;
     ok = testCPRGlobalAirborne() && ok;
     ok = testCPRGlobalSurface() && ok;
     ok = testCPRRelative() && ok;
+    ok = testCPREncode() && ok;
     return ok ? 0 : 1;
 }
@@ -321,6 +321,7 @@ void demodulate2400(struct mag_buf *mag) {
 
         // compute message receive time as block-start-time + difference in the 12MHz clock
         mm.sysTimestampMsg = mag->sysTimestamp + receiveclock_ms_elapsed(mag->sampleTimestamp, mm.timestampMsg);
+        mm.sysMicros = mag->sysTimestamp * 1000 + receiveclock_ns_elapsed(mag->sampleTimestamp, mm.timestampMsg) / 1000;
 
         mm.score = bestscore;
 
@@ -371,6 +372,7 @@ void demodulate2400(struct mag_buf *mag) {
         j += msglen * 12 / 5;
 
         // Pass data to the next layer
+        statsLatency(LATENCY_DEMOD, microtime() - mm.sysMicros);
         useModesMessage(&mm);
     }
 
@@ -650,10 +652,12 @@ void demodulate2400AC(struct mag_buf *mag) {
 
         // compute message receive time as block-start-time + difference in the 12MHz clock
         mm.sysTimestampMsg = mag->sysTimestamp + receiveclock_ms_elapsed(mag->sampleTimestamp, mm.timestampMsg);
+        mm.sysMicros = mag->sysTimestamp * 1000 + receiveclock_ns_elapsed(mag->sampleTimestamp, mm.timestampMsg) / 1000;
 
         decodeModeAMessage(&mm, modeac);
 
         // Pass data to the next layer
+        statsLatency(LATENCY_DEMOD, microtime() - mm.sysMicros);
         useModesMessage(&mm);
 
         f1_sample += (20 * 87 / 25);
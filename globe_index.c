@@ -2,7 +2,6 @@
 
 #define LEG_FOCUS 0x0
 
-static void mark_legs(struct aircraft *a);
 static void load_blob(int blob);
 
 ssize_t check_write(int fd, const void *buf, size_t count, const char *error_context) {
@@ -153,8 +152,193 @@ void init_globe_index(struct tile *s_tiles) {
         fprintf(stderr, "increase GLOBE_SPECIAL_INDEX please!\n");
 }
 
+//
+// Adaptive tiles (--globe-adaptive)
+//
+// Every 10 degree grid cell can be split into a quadtree down to
+// GLOBE_ADAPTIVE_DEPTH levels.  A node is split when more than the target
+// number of aircraft are in it and merged again when less than half the target
+// remain.  Cells that aren't split keep their usual index, the leaves of split
+// cells get the indexes below GLOBE_MIN_INDEX.  The layout only changes while
+// all threads are locked (globeAdaptiveUpdate() from trackPeriodicUpdate()),
+// globe_tiles.json lists the leaves for clients.
+//
+
+#define GLOBE_CELLS_LAT (180 / GLOBE_INDEX_GRID)
+#define GLOBE_CELLS_LON (360 / GLOBE_INDEX_GRID)
+#define GLOBE_CELLS (GLOBE_CELLS_LAT * GLOBE_CELLS_LON)
+#define GLOBE_ADAPTIVE_DEPTH 3 // down to 1.25 degrees
+#define GLOBE_ADAPTIVE_SUB (1 << GLOBE_ADAPTIVE_DEPTH)
+#define GLOBE_ADAPTIVE_MAX GLOBE_MIN_INDEX
+
+struct adaptive_tile {
+    float south;
+    float west;
+    float north;
+    float east;
+};
+
+static struct {
+    uint32_t split[GLOBE_CELLS]; // split quadtree nodes, bit (4^level - 1) / 3 + y * 2^level + x
+    uint16_t leaf[GLOBE_CELLS][GLOBE_ADAPTIVE_SUB * GLOBE_ADAPTIVE_SUB]; // index of every finest sub cell
+    struct adaptive_tile tiles[GLOBE_ADAPTIVE_MAX];
+    int count;
+    uint64_t retired[GLOBE_MAX_INDEX + 1]; // when the index went out of use, written empty for a while
+    uint32_t sub[GLOBE_CELLS][GLOBE_ADAPTIVE_SUB * GLOBE_ADAPTIVE_SUB]; // aircraft per finest sub cell
+} adaptive;
+
+static int adaptiveCell(double lat, double lon, int *cell, int *sub) {
+    int i = (int) ((lat + 90) / GLOBE_INDEX_GRID);
+    int j = (int) ((lon + 180) / GLOBE_INDEX_GRID);
+    if (i < 0 || i >= GLOBE_CELLS_LAT || j < 0 || j >= GLOBE_CELLS_LON)
+        return -1;
+    int y = (int) ((lat + 90 - i * GLOBE_INDEX_GRID) * GLOBE_ADAPTIVE_SUB / GLOBE_INDEX_GRID);
+    int x = (int) ((lon + 180 - j * GLOBE_INDEX_GRID) * GLOBE_ADAPTIVE_SUB / GLOBE_INDEX_GRID);
+    *cell = i * GLOBE_CELLS_LON + j;
+    *sub = min(y, GLOBE_ADAPTIVE_SUB - 1) * GLOBE_ADAPTIVE_SUB + min(x, GLOBE_ADAPTIVE_SUB - 1);
+    return 0;
+}
+
+static uint32_t adaptiveCount(uint32_t *sub, int level, int x, int y) {
+    int size = GLOBE_ADAPTIVE_SUB >> level;
+    uint32_t count = 0;
+    for (int r = y * size; r < (y + 1) * size; r++) {
+        for (int c = x * size; c < (x + 1) * size; c++)
+            count += sub[r * GLOBE_ADAPTIVE_SUB + c];
+    }
+    return count;
+}
+
+// decide which nodes below this one are split, returns the number of leaves
+static int adaptiveSplit(uint32_t *sub, uint32_t old, uint32_t *mask, int level, int x, int y) {
+    uint32_t target = Modes.globe_adaptive;
+    uint32_t count = adaptiveCount(sub, level, x, y);
+    uint32_t bit = 1u << (((1 << (2 * level)) - 1) / 3 + y * (1 << level) + x);
+    int split;
+    if (old & bit)
+        split = count >= target / 2;
+    else
+        split = count > target;
+    if (level == GLOBE_ADAPTIVE_DEPTH || !split)
+        return 1;
+
+    *mask |= bit;
+    int leaves = 0;
+    for (int dy = 0; dy < 2; dy++) {
+        for (int dx = 0; dx < 2; dx++)
+            leaves += adaptiveSplit(sub, old, mask, level + 1, 2 * x + dx, 2 * y + dy);
+    }
+    return leaves;
+}
+
+static void adaptiveAssign(int cell, int level, int x, int y) {
+    uint32_t bit = 1u << (((1 << (2 * level)) - 1) / 3 + y * (1 << level) + x);
+    if (level < GLOBE_ADAPTIVE_DEPTH && (adaptive.split[cell] & bit)) {
+        for (int dy = 0; dy < 2; dy++) {
+            for (int dx = 0; dx < 2; dx++)
+                adaptiveAssign(cell, level + 1, 2 * x + dx, 2 * y + dy);
+        }
+        return;
+    }
+    int index = adaptive.count++;
+    int size = GLOBE_ADAPTIVE_SUB >> level;
+    for (int r = y * size; r < (y + 1) * size; r++) {
+        for (int c = x * size; c < (x + 1) * size; c++)
+            adaptive.leaf[cell][r * GLOBE_ADAPTIVE_SUB + c] = index;
+    }
+    float step = (float) GLOBE_INDEX_GRID / (1 << level);
+    float south = (cell / GLOBE_CELLS_LON) * GLOBE_INDEX_GRID - 90 + y * step;
+    float west = (cell % GLOBE_CELLS_LON) * GLOBE_INDEX_GRID - 180 + x * step;
+    adaptive.tiles[index] = (struct adaptive_tile) {
+        .south = south, .west = west, .north = south + step, .east = west + step,
+    };
+}
+
+// caller has locked all threads, returns 1 if the layout changed
+int globeAdaptiveUpdate() {
+    if (!Modes.globe_adaptive)
+        return 0;
+
+    memset(adaptive.sub, 0, sizeof(adaptive.sub));
+    for (int j = 0; j < AIRCRAFT_BUCKETS; j++) {
+        for (struct aircraft *a = Modes.aircraft[j]; a; a = a->next) {
+            int cell, sub;
+            if (a->globe_index >= 0 && adaptiveCell(a->lat, a->lon, &cell, &sub) == 0)
+                adaptive.sub[cell][sub]++;
+        }
+    }
+
+    uint32_t split[GLOBE_CELLS];
+    int leaves = 0;
+    for (int cell = 0; cell < GLOBE_CELLS; cell++) {
+        split[cell] = 0;
+        int n = adaptiveSplit(adaptive.sub[cell], adaptive.split[cell], &split[cell], 0, 0, 0);
+        if (n > 1 && leaves + n > GLOBE_ADAPTIVE_MAX) {
+            // out of indexes, this cell stays whole
+            split[cell] = 0;
+            continue;
+        }
+        if (n > 1)
+            leaves += n;
+    }
+    if (!memcmp(split, adaptive.split, sizeof(split)))
+        return 0;
+
+    uint64_t now = mstime();
+    for (int cell = 0; cell < GLOBE_CELLS; cell++) {
+        if (split[cell] && !adaptive.split[cell])
+            adaptive.retired[(cell / GLOBE_CELLS_LON) * GLOBE_LAT_MULT + cell % GLOBE_CELLS_LON + GLOBE_MIN_INDEX] = now;
+    }
+    for (int i = 0; i < adaptive.count; i++)
+        adaptive.retired[i] = now;
+
+    memcpy(adaptive.split, split, sizeof(split));
+    adaptive.count = 0;
+    for (int cell = 0; cell < GLOBE_CELLS; cell++) {
+        if (adaptive.split[cell])
+            adaptiveAssign(cell, 0, 0, 0);
+    }
+
+    // move every aircraft to its tile in the new layout
+    for (int j = 0; j < AIRCRAFT_BUCKETS; j++) {
+        for (struct aircraft *a = Modes.aircraft[j]; a; a = a->next) {
+            if (a->globe_index >= 0)
+                set_globe_index(a, globe_index(a->lat, a->lon));
+        }
+    }
+    return 1;
+}
+
+// tiles below GLOBE_MIN_INDEX in use, returns 0 if there are none
+int globeAdaptiveTile(int index, double *south, double *west, double *north, double *east) {
+    if (!Modes.globe_adaptive || index < 0 || index >= adaptive.count)
+        return 0;
+    struct adaptive_tile *t = &adaptive.tiles[index];
+    *south = t->south;
+    *west = t->west;
+    *north = t->north;
+    *east = t->east;
+    return 1;
+}
+
+int globeAdaptiveCount() {
+    return Modes.globe_adaptive ? adaptive.count : 0;
+}
+
+// the index isn't used anymore but clients may still have it from the previous layout
+int globeAdaptiveRetired(int index, uint64_t now) {
+    return Modes.globe_adaptive && index >= 0 && index <= GLOBE_MAX_INDEX
+        && adaptive.retired[index] && now < adaptive.retired[index] + 2 * MINUTES;
+}
+
 int globe_index(double lat_in, double lon_in) {
     int grid = GLOBE_INDEX_GRID;
+
+    if (Modes.globe_adaptive) {
+        int cell, sub;
+        if (adaptiveCell(lat_in, lon_in, &cell, &sub) == 0 && adaptive.split[cell])
+            return adaptive.leaf[cell][sub];
+    }
     int lat = grid * ((int) ((lat_in + 90) / grid)) - 90;
     int lon = grid * ((int) ((lon_in + 180) / grid)) - 180;
 
@@ -188,10 +372,275 @@ int globe_index_index(int index) {
 }
 
 
+// first trace index for the full (last 24h) and the recent trace file
+void trace_ranges(struct trace_view *v, uint64_t now, int *start24, int *start_recent) {
+    *start24 = 0;
+    for (int i = 0; i < v->len; i++) {
+        if (trace_view_state(v, i)->timestamp > now - (24 * HOURS + 15 * MINUTES)) {
+            *start24 = i;
+            break;
+        }
+    }
+
+    *start_recent = *start24;
+    if (v->len > 142 && v->len - 142 > *start24)
+       *start_recent = (v->len - 142);
+}
+
+// trace_full on /run keeps points older than 24 hours until this much has piled up
+#define TRACE_FULL_SLACK (2 * HOURS)
+
+enum {
+    TRACE_FILE_COPY, // extend a copy of the file which is renamed over the old one, readers and crashes see the old or the new file
+    TRACE_FILE_PACK, // append a record to a history pack (tracepack.h)
+};
+
+// history pack files open for appending, the trace threads share them
+struct trace_pack_file {
+    pthread_mutex_t mutex;
+    int fd;
+    int sealed; // path is sealed, nothing more is appended to it
+    char path[PATH_MAX];
+};
+
+static struct trace_pack_file *tracePackFiles;
+static pthread_t tracePackSealThread;
+static int tracePackSealing;
+
+static int trace_pack_append(const char *path, uint32_t addr, uint16_t flags, uint64_t timestamp,
+        struct char_buffer data, size_t trailer) {
+    struct trace_pack_file *pf = &tracePackFiles[addr % TRACE_PACKS];
+    struct tracepack_record rec = {
+        .magic = TRACE_PACK_MAGIC,
+        .addr = addr,
+        .len = data.len,
+        .trailer = trailer,
+        .flags = flags,
+        .timestamp = timestamp,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = &rec, .iov_len = sizeof(rec) },
+        { .iov_base = data.buffer, .iov_len = data.len },
+    };
+    int res = 0;
+
+    pthread_mutex_lock(&pf->mutex);
+    if (strcmp(pf->path, path) || (pf->fd < 0 && !pf->sealed)) {
+        // a new day
+        if (pf->fd >= 0)
+            close(pf->fd);
+        pf->sealed = 0;
+        pf->path[0] = '\0';
+        pf->fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0644);
+        if (pf->fd < 0) {
+            fprintf(stderr, "trace_pack_append open(): ");
+            perror(path);
+        } else if (tracePackSealed(pf->fd)) {
+            // after a restart late in the day, the record would go after the footer
+            fprintf(stderr, "%s: pack is sealed, not appending to it\n", path);
+            close(pf->fd);
+            pf->fd = -1;
+            pf->sealed = 1;
+            snprintf(pf->path, PATH_MAX, "%s", path);
+        } else {
+            snprintf(pf->path, PATH_MAX, "%s", path);
+            // continuing the pack after a restart: cut off a record torn by a crash
+            int64_t removed = tracePackRepair(pf->fd);
+            if (removed < 0)
+                perror(path);
+            else if (removed > 0)
+                fprintf(stderr, "%s: removed %lld bytes of a partial record\n", path, (long long) removed);
+        }
+    }
+    if (pf->fd < 0) {
+        res = -1;
+    } else {
+        off_t size = lseek(pf->fd, 0, SEEK_END);
+        if (writev(pf->fd, iov, 2) != (ssize_t) (sizeof(rec) + data.len)) {
+            fprintf(stderr, "trace_pack_append writev(): ");
+            perror(path);
+            // a partial record ends the pack for readers, remove it
+            if (size < 0 || ftruncate(pf->fd, size) < 0) {
+                perror(path);
+                close(pf->fd);
+                pf->fd = -1;
+                pf->path[0] = '\0';
+            }
+            res = -1;
+        }
+    }
+    pthread_mutex_unlock(&pf->mutex);
+    return res;
+}
+
+static void *tracePackSealEntry(void *arg) {
+    char *dir = arg;
+    char path[PATH_MAX];
+    int sealed = 0;
+    for (int i = 0; i < TRACE_PACKS; i++) {
+        snprintf(path, PATH_MAX, "%s/pack_%02x", dir, i);
+        // no appends while the index is written or after it
+        struct trace_pack_file *pf = &tracePackFiles[i];
+        pthread_mutex_lock(&pf->mutex);
+        if (!strcmp(pf->path, path) && pf->fd >= 0) {
+            close(pf->fd);
+            pf->fd = -1;
+        }
+        snprintf(pf->path, PATH_MAX, "%s", path);
+        pf->sealed = 1;
+        if (tracePackSeal(path) == 0)
+            sealed++;
+        pthread_mutex_unlock(&pf->mutex);
+    }
+    if (sealed != TRACE_PACKS)
+        fprintf(stderr, "%s: sealing %d history packs failed\n", dir, TRACE_PACKS - sealed);
+    free(dir);
+    return NULL;
+}
+
+// append the index to the packs of a day that is over, in the background
+static void tracePackSealDay(const char *day) {
+    char dir[PATH_MAX];
+    snprintf(dir, PATH_MAX, "%s/%s/traces", Modes.globe_history_dir, day);
+    if (tracePackSealing)
+        pthread_join(tracePackSealThread, NULL);
+    tracePackSealing = 0;
+    if (pthread_create(&tracePackSealThread, NULL, tracePackSealEntry, strdup(dir))) {
+        fprintf(stderr, "tracePackSealDay: pthread_create failed\n");
+        return;
+    }
+    tracePackSealing = 1;
+}
+
+static int trace_file_replace(const char *path, const void *old, size_t oldLen, const void *buf, size_t len) {
+    char tmppath[PATH_MAX + 32];
+    snprintf(tmppath, sizeof(tmppath), "%s.%lx", path, random());
+
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "trace_file_replace open(): ");
+        perror(tmppath);
+        return -1;
+    }
+    if ((oldLen && write(fd, old, oldLen) != (ssize_t) oldLen) || write(fd, buf, len) != (ssize_t) len) {
+        fprintf(stderr, "trace_file_replace write(): ");
+        perror(tmppath);
+        close(fd);
+        unlink(tmppath);
+        return -1;
+    }
+    if (close(fd) < 0 || rename(tmppath, path) == -1) {
+        fprintf(stderr, "trace_file_replace rename(): %s -> %s", tmppath, path);
+        perror("");
+        unlink(tmppath);
+        return -1;
+    }
+    return 0;
+}
+
+// Full traces are appendable gzip files (gzappendBuild() in compress.c): a write only
+// compresses the points added since the previous one.  The file is written from scratch
+// when it doesn't match the mark, when new legs start at points already in the file
+// or when the caller has reset the mark.
+static void trace_file_write(const char *dir, const char *file, struct trace_view *v, int start, int last,
+        struct trace_file_mark *mark, zclass_t zclass, int mode) {
+    struct aircraft *a = v->a;
+    char path[PATH_MAX];
+    const char *tail = TRACE_JSON_TAIL;
+    size_t tailLen = strlen(tail);
+    uint64_t firstTs = trace_view_state(v, start)->timestamp;
+    uint64_t lastTs = trace_view_state(v, last)->timestamp;
+    uint32_t legs = a->legs.count;
+
+    snprintf(path, PATH_MAX, "%s/%s", dir, file);
+    path[PATH_MAX - 1] = 0;
+
+    int append = (mark->gz.size && mark->first <= firstTs && mark->last <= lastTs);
+
+    if (append && legs != mark->legs) {
+        // the leg marker would have to be set on a point that has been written already
+        if (legs < mark->legs || legs - mark->legs > LEG_HISTORY)
+            append = 0;
+        for (uint32_t k = mark->legs; append && k != legs; k++) {
+            if (a->legs.ts[k % LEG_HISTORY] <= mark->last)
+                append = 0;
+        }
+    }
+
+    int from = start;
+    char *old = NULL;
+    uint64_t offset = gzappendOffset(&mark->gz, tailLen);
+
+    if (append) {
+        from = last;
+        while (from >= start && trace_view_state(v, from)->timestamp > mark->last)
+            from--;
+        from++;
+        if (from > last) {
+            mark->legs = legs;
+            return;
+        }
+    }
+
+    // a pack can't be checked, the record chain is only read back after the day is over
+    if (append && mode != TRACE_FILE_PACK) {
+        // make sure the file ends the way it did after the last write
+        unsigned char expect[GZAPPEND_TRAILER_LEN(GZAPPEND_TAIL_MAX)];
+        unsigned char found[sizeof(expect)];
+        size_t expectLen = gzappendTrailer(&mark->gz, tail, tailLen, expect);
+        struct stat st;
+
+        int fd = open(path, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) < 0 || (uint64_t) st.st_size != mark->gz.size
+                || pread(fd, found, expectLen, st.st_size - expectLen) != (ssize_t) expectLen
+                || memcmp(found, expect, expectLen)) {
+            append = 0;
+        }
+        if (append) {
+            old = malloc(offset);
+            if (!old || pread(fd, old, offset, 0) != (ssize_t) offset)
+                append = 0;
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+
+    struct gzappend gz = mark->gz;
+    uint64_t base = mark->first;
+    if (!append) {
+        from = start;
+        base = firstTs;
+        memset(&gz, 0, sizeof(gz));
+    }
+
+    struct char_buffer json = generateTraceJsonPart(v, from, last, base, !append);
+    struct char_buffer out;
+    int res = gzappendBuild(&gz, json.buffer, json.len, tail, tailLen, zclass, &out);
+    free(json.buffer);
+
+    if (res < 0) {
+        fprintf(stderr, "%s: compressing trace failed\n", path);
+    } else if (mode == TRACE_FILE_PACK) {
+        res = trace_pack_append(path, a->addr, append ? 0 : TRACE_PACK_FULL, lastTs, out, GZAPPEND_TRAILER_LEN(tailLen));
+    } else {
+        res = trace_file_replace(path, old, append ? offset : 0, out.buffer, out.len);
+    }
+
+    free(old);
+
+    if (res < 0) {
+        mark->gz.size = 0;
+        return;
+    }
+
+    mark->first = base;
+    mark->last = lastTs;
+    mark->legs = legs;
+    mark->gz = gz;
+}
+
 void write_trace(struct aircraft *a, uint64_t now) {
     struct char_buffer recent;
-    struct char_buffer full;
-    struct char_buffer hist;
     char filename[PATH_MAX];
     static uint32_t count2, count3, count4;
 
@@ -201,8 +650,6 @@ void write_trace(struct aircraft *a, uint64_t now) {
     time_t nineteen_ago = now / 1000 - 19 * 60;
 
     recent.len = 0;
-    full.len = 0;
-    hist.len = 0;
 
     if (Modes.debug_traceCount && ++count2 % 1000 == 0)
         fprintf(stderr, "recent trace write: %u\n", count2);
@@ -212,22 +659,14 @@ void write_trace(struct aircraft *a, uint64_t now) {
     if (!a->trace_alloc)
         return;
 
-    mark_legs(a);
-
-    int start24 = 0;
-    for (int i = 0; i < a->trace_len; i++) {
-        if (a->trace[i].timestamp > now - (24 * HOURS + 15 * MINUTES)) {
-            start24 = i;
-            break;
-        }
-    }
+    struct trace_view view;
+    trace_view_init(&view, a);
 
-    int start_recent = start24;
-    if (a->trace_len > 142 && a->trace_len - 142 > start24)
-       start_recent = (a->trace_len - 142);
+    int start24, start_recent;
+    trace_ranges(&view, now, &start24, &start_recent);
 
     // write recent trace to /run
-    recent = generateTraceJson(a, start_recent, -1);
+    recent = generateTraceJson(&view, start_recent, -1);
 
     if (now > a->trace_next_mw || a->trace_full_write > 35 || now > a->trace_next_fw) {
         int write_perm = 0;
@@ -235,9 +674,6 @@ void write_trace(struct aircraft *a, uint64_t now) {
         if (Modes.debug_traceCount && ++count3 % 1000 == 0)
             fprintf(stderr, "memory trace writes: %u\n", count3);
 
-        // write full trace to /run
-        full = generateTraceJson(a, start24, -1);
-
         if (a->trace_full_write == 0xc0ffee)
             a->trace_next_mw = now + random() % (20 * MINUTES);
         else
@@ -256,11 +692,23 @@ void write_trace(struct aircraft *a, uint64_t now) {
 
         //fprintf(stderr, "%06x\n", a->addr);
 
-        // prepare stuff to be written to disk
-        // written to memory
+        // write full trace to /run
+        snprintf(filename, 256, "traces/%02x/trace_full_%s%06x.json", a->addr % 256, (a->addr & MODES_NON_ICAO_ADDRESS) ? "~" : "", a->addr & 0xFFFFFF);
+        if (start24 < view.len) {
+            struct trace_file_mark *mark = &a->trace_full_mark;
+            if (trace_view_state(&view, start24)->timestamp > mark->first + TRACE_FULL_SLACK)
+                mark->gz.size = 0;
+            trace_file_write(Modes.json_dir, filename, &view, start24, view.len - 1, mark, ZCLASS_TRACE_FULL, TRACE_FILE_COPY);
+        } else {
+            a->trace_full_mark.gz.size = 0;
+            struct char_buffer full = generateTraceJson(&view, start24, -1);
+            writeJsonToGzip(Modes.json_dir, filename, full, ZCLASS_TRACE_FULL);
+            free(full.buffer);
+        }
+
+        // write the permanent history to disk
         if (write_perm) {
-            // prepare writing the permanent history
-            if (a->trace_len > 0 &&
+            if (view.len > 0 &&
                     Modes.globe_history_dir && !(a->addr & MODES_NON_ICAO_ADDRESS)) {
 
                 struct tm utc;
@@ -273,138 +721,172 @@ void write_trace(struct aircraft *a, uint64_t now) {
 
                 int start = -1;
                 int end = -1;
-                for (int i = 0; i < a->trace_len; i++) {
-                    if (start == -1 && a->trace[i].timestamp > start_of_day) {
+                for (int i = 0; i < view.len; i++) {
+                    if (start == -1 && trace_view_state(&view, i)->timestamp > start_of_day) {
                         start = i;
                     }
-                    if (a->trace[i].timestamp < end_of_day) {
+                    if (trace_view_state(&view, i)->timestamp < end_of_day) {
                         end = i;
                     }
                 }
-                if (start >= 0 && end >= 0 && end >= start)
-                    hist = generateTraceJson(a, start, end);
+                if (start >= 0 && end >= 0 && end >= start) {
+                    char tstring[100];
+                    strftime (tstring, 100, "%Y-%m-%d", &utc);
+
+                    if (Modes.history_packs)
+                        snprintf(filename, PATH_MAX, "%s/traces/pack_%02x", tstring, a->addr % TRACE_PACKS);
+                    else
+                        snprintf(filename, PATH_MAX, "%s/traces/%02x/trace_full_%s%06x.json", tstring, a->addr % 256, (a->addr & MODES_NON_ICAO_ADDRESS) ? "~" : "", a->addr & 0xFFFFFF);
+                    filename[PATH_MAX - 101] = 0;
+
+                    // a new day starts a new file, the webserver doesn't read the current days files
+                    struct trace_file_mark *mark = &a->trace_hist_mark;
+                    if (mark->first <= start_of_day)
+                        mark->gz.size = 0;
+                    trace_file_write(Modes.globe_history_dir, filename, &view, start, end, mark, ZCLASS_HISTORY,
+                            Modes.history_packs ? TRACE_FILE_PACK : TRACE_FILE_COPY);
+
+                    if (Modes.debug_traceCount && ++count4 % 100 == 0)
+                        fprintf(stderr, "perm trace writes: %u\n", count4);
+                }
             }
         }
     }
 
-
+    trace_view_free(&view);
 
     if (recent.len > 0) {
         snprintf(filename, 256, "traces/%02x/trace_recent_%s%06x.json", a->addr % 256, (a->addr & MODES_NON_ICAO_ADDRESS) ? "~" : "", a->addr & 0xFFFFFF);
 
-        writeJsonToGzip(Modes.json_dir, filename, recent, 1);
+        writeJsonToGzip(Modes.json_dir, filename, recent, ZCLASS_TRACE_RECENT);
         free(recent.buffer);
     }
-
-    if (full.len > 0) {
-        snprintf(filename, 256, "traces/%02x/trace_full_%s%06x.json", a->addr % 256, (a->addr & MODES_NON_ICAO_ADDRESS) ? "~" : "", a->addr & 0xFFFFFF);
-
-        writeJsonToGzip(Modes.json_dir, filename, full, 7);
-        free(full.buffer);
-    }
-
-    if (hist.len > 0) {
-        char tstring[100];
-        struct tm utc;
-        gmtime_r(&nineteen_ago, &utc);
-        strftime (tstring, 100, "%Y-%m-%d", &utc);
-
-        snprintf(filename, PATH_MAX, "%s/traces/%02x/trace_full_%s%06x.json", tstring, a->addr % 256, (a->addr & MODES_NON_ICAO_ADDRESS) ? "~" : "", a->addr & 0xFFFFFF);
-        filename[PATH_MAX - 101] = 0;
-
-        writeJsonToGzip(Modes.globe_history_dir, filename, hist, 9);
-        free(hist.buffer);
-
-        if (Modes.debug_traceCount && ++count4 % 100 == 0)
-            fprintf(stderr, "perm trace writes: %u\n", count4);
-    }
 }
 
+// returns the number of blobs that couldn't be saved as the thread result
 void *save_state(void *arg) {
     int thread_number = *((int *) arg);
+    intptr_t failed = 0;
     for (int j = 0; j < STATE_BLOBS; j++) {
         if (j % IO_THREADS != thread_number)
             continue;
 
         //fprintf(stderr, "save_blob(%d)\n", j);
-        save_blob(j);
+        if (save_blob(j) < 0)
+            failed++;
     }
-    return NULL;
+    return (void *) failed;
 }
 
-static int writeGz(gzFile gzfp, void *source, int toWrite, char *errorContext) {
-    int res, error;
-    int nwritten = 0;
-    char *p = source;
-    if (!gzfp) {
-        fprintf(stderr, "writeGz: gzfp was NULL .............\n");
-        return -1;
-    }
-    while (toWrite > 0) {
-        int len = toWrite;
-        //if (len > 8 * 1024 * 1024)
-        //    len = 8 * 1024 * 1024;
-        res = gzwrite(gzfp, p, len);
-        if (res <= 0) {
-            fprintf(stderr, "gzwrite of length %d failed: %s (res == %d)\n", toWrite, gzerror(gzfp, &error), res);
-            if (error == Z_ERRNO)
-                perror(errorContext);
+//
+// Startup state loading
+//
+// Loader threads take the next blob from a shared counter and stream it: the
+// blob is inflated STATE_READ_CHUNK at a time into a buffer that only grows to
+// the largest aircraft record, and every aircraft goes into the hash table and
+// the globe index as soon as it is parsed.  The kernel is asked to read the
+// compressed file ahead, so the disk reads overlap with inflating and parsing.
+//
+
+#define STATE_READ_CHUNK (1024 * 1024)
+
+struct state_reader {
+    gzFile gz; // NULL: read uncompressed from fd
+    int fd;
+    char *buf;
+    size_t alloc;
+    char *p; // next unparsed byte
+    char *end; // end of the data read so far
+    int eof;
+    uint64_t bytes; // uncompressed bytes read
+};
+
+static pthread_mutex_t loadGlobeMutex = PTHREAD_MUTEX_INITIALIZER;
+static int loadNext;
+
+static struct {
+    uint64_t ms;
+    uint32_t aircraft;
+    uint64_t bytes;
+} blobLoad[STATE_BLOBS];
+
+static int readerOpen(struct state_reader *r, int fd, int gzip) {
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    if (gzip) {
+        r->gz = gzdopen(fd, "r");
+        if (!r->gz)
             return -1;
-        }
-        p += res;
-        nwritten += res;
-        toWrite -= res;
+        if (gzbuffer(r->gz, GZBUFFER_BIG) < 0)
+            fprintf(stderr, "gzbuffer fail");
     }
-    return nwritten;
-}
-static struct char_buffer readWholeGz(gzFile gzfp) {
-    struct char_buffer cb;
-    int alloc = 32 * 1024 * 1024;
-    cb.buffer = malloc(alloc);
-    cb.len = 0;
-    int res;
-    int toRead = alloc;
-    char *p = cb.buffer;
-    while (true) {
-        res = gzread(gzfp, p, toRead);
-        if (res <= 0)
-            return cb;
-        p += res;
-        cb.len += res;
-        toRead -= res;
-        if (toRead == 0)
-            fprintf(stderr, "readWholeGz ran out of buffer!\n");
+    r->alloc = STATE_READ_CHUNK;
+    r->buf = malloc(r->alloc);
+    if (!r->buf) {
+        fprintf(stderr, "readerOpen: out of memory\n");
+        exit(1);
     }
+    r->p = r->end = r->buf;
+    return 0;
 }
 
-static struct char_buffer readWholeFile(int fd) {
-    struct char_buffer cb;
-    int alloc = 32 * 1024 * 1024;
-    cb.buffer = malloc(alloc);
-    cb.len = 0;
-    int res;
-    int toRead = alloc;
-    char *p = cb.buffer;
-    while (true) {
-        res = read(fd, p, toRead);
-        if (res <= 0)
-            return cb;
-        p += res;
-        cb.len += res;
-        toRead -= res;
-        if (toRead == 0)
-            fprintf(stderr, "readWholeFile ran out of buffer!\n");
+static void readerClose(struct state_reader *r) {
+    if (r->gz)
+        gzclose(r->gz); // closes fd as well
+    else
+        close(r->fd);
+    free(r->buf);
+    r->buf = NULL;
+}
+
+// make at least need bytes available at r->p, returns -1 if the file ends before
+static int readerFill(struct state_reader *r, size_t need) {
+    if ((size_t) (r->end - r->p) >= need)
+        return 0;
+
+    size_t have = r->end - r->p;
+    if (need > r->alloc) {
+        // only a record bigger than the buffer makes it grow
+        size_t alloc = need + STATE_READ_CHUNK;
+        char *buf = malloc(alloc);
+        if (!buf) {
+            fprintf(stderr, "readerFill: out of memory (%zu bytes)\n", alloc);
+            exit(1);
+        }
+        memcpy(buf, r->p, have);
+        free(r->buf);
+        r->buf = buf;
+        r->alloc = alloc;
+    } else {
+        memmove(r->buf, r->p, have);
+    }
+    r->p = r->buf;
+    r->end = r->buf + have;
+
+    while (!r->eof && (size_t) (r->end - r->p) < need) {
+        size_t space = r->buf + r->alloc - r->end;
+        int toRead = space > STATE_READ_CHUNK ? STATE_READ_CHUNK : space;
+        int res = r->gz ? gzread(r->gz, r->end, toRead) : read(r->fd, r->end, toRead);
+        if (res <= 0) {
+            r->eof = 1;
+            break;
+        }
+        r->end += res;
+        r->bytes += res;
     }
+    return (size_t) (r->end - r->p) >= need ? 0 : -1;
 }
 
-static int load_aircraft(char **p, char *end, uint64_t now) {
+static int load_aircraft(struct state_reader *r, uint64_t now) {
 
-    if (end - *p < (long) sizeof(struct aircraft))
+    if (readerFill(r, sizeof(struct aircraft)) < 0)
         return -1;
 
     struct aircraft *a = malloc(sizeof(struct aircraft));
-    memcpy(a, *p, sizeof(struct aircraft));
-    *p += sizeof(struct aircraft);
+    memcpy(a, r->p, sizeof(struct aircraft));
+    r->p += sizeof(struct aircraft);
 
     if (a->size_struct_aircraft != sizeof(struct aircraft)) {
             fprintf(stderr, "sizeof(struct aircraft) has changed, unable to read state!\n");
@@ -412,13 +894,13 @@ static int load_aircraft(char **p, char *end, uint64_t now) {
         return -1;
     }
 
-    a->trace = NULL;
-    a->trace_all = NULL;
-
-    if (!Modes.keep_traces) {
-        a->trace_alloc = 0;
-        a->trace_len = 0;
-    }
+    a->trace_blocks = NULL;
+    a->trace_start = 0;
+    a->trace_queued = 0;
+    a->trace_nchunks = 0;
+    // the pack record chain can't be verified, start it again with a full record
+    if (Modes.history_packs)
+        a->trace_hist_mark.gz.size = 0;
 
     // just in case we have bogus values saved, make sure they time out
     if (a->seen_pos > now + 26 * HOURS)
@@ -437,22 +919,35 @@ static int load_aircraft(char **p, char *end, uint64_t now) {
         int size_all = (a->trace_len + 3) / 4 * sizeof(struct state_all);
 
 
-        if (end - *p < (long) (size_state + size_all)) {
+        if (readerFill(r, size_state + size_all) < 0) {
             // TRACE FAIL
             fprintf(stderr, "read trace fail\n");
-            a->trace = NULL;
-            a->trace_all = NULL;
+            a->trace_alloc = 0;
+            a->trace_len = 0;
+        } else if (!Modes.keep_traces) {
+            // skip it, the next aircraft follows
+            r->p += size_state + size_all;
             a->trace_alloc = 0;
             a->trace_len = 0;
         } else {
             // TRACE SUCCESS
-            a->trace = malloc(a->trace_alloc * sizeof(struct state));
-            a->trace_all = malloc((1 + a->trace_alloc / 4) * sizeof(struct state_all));
+            int len = a->trace_len;
+            a->trace_alloc = 0;
+            a->trace_len = 0;
+            trace_grow(a, len + GLOBE_STEP);
+            a->trace_len = len;
+
+            // points and state_all are stored contiguously, copy them chunk by chunk
+            for (int i = 0, n; i < len; i += n) {
+                n = min(trace_chunk_remaining(a, i), len - i);
+                memcpy(trace_state(a, i), r->p + i * sizeof(struct state), n * sizeof(struct state));
+                memcpy(trace_state_all(a, i), r->p + size_state + i / 4 * sizeof(struct state_all),
+                        (n + 3) / 4 * sizeof(struct state_all));
+            }
+            r->p += size_state + size_all;
 
-            memcpy(a->trace, *p, size_state);
-            *p += size_state;
-            memcpy(a->trace_all, *p, size_all);
-            *p += size_all;
+            // the aircraft isn't visible to other threads yet
+            trace_pack(a);
 
             if (a->addr == LEG_FOCUS) {
                 a->trace_next_fw = now;
@@ -463,8 +958,6 @@ static int load_aircraft(char **p, char *end, uint64_t now) {
         // no or bad trace
         if (a->trace_len > 0)
             fprintf(stderr, "read trace fail\n");
-        a->trace = NULL;
-        a->trace_all = NULL;
         a->trace_len = 0;
         a->trace_alloc = 0;
     }
@@ -477,6 +970,12 @@ static int load_aircraft(char **p, char *end, uint64_t now) {
         a->seen = 0;
 
 
+    // the loader threads work on different blobs and thus on different hash buckets,
+    // only the globe lists are shared
+    int new_index = a->globe_index;
+    a->globe_index = -5;
+    a->api_cell = 0;
+
     struct aircraft *old = aircraftGet(a->addr);
     uint32_t hash = aircraftHash(a->addr);
     if (old) {
@@ -487,30 +986,40 @@ static int load_aircraft(char **p, char *end, uint64_t now) {
         if (*c == old) {
             a->next = old->next;
             *c = a;
+            pthread_mutex_lock(&loadGlobeMutex);
+            set_globe_index(old, -5);
+            apiRemove(old);
+            pthread_mutex_unlock(&loadGlobeMutex);
             freeAircraft(old);
         } else {
             freeAircraft(a);
             fprintf(stderr, "%06x aircraft replacement failed!\n", old->addr);
+            return 0;
         }
     } else {
         a->next = Modes.aircraft[hash];
         Modes.aircraft[hash] = a;
+        __atomic_fetch_add(&Modes.aircraftCount, 1, __ATOMIC_RELAXED);
     }
 
+    pthread_mutex_lock(&loadGlobeMutex);
+    set_globe_index(a, new_index);
+    if (a->seen_pos)
+        apiUpdate(a);
+    updateValidities(a, now);
+    pthread_mutex_unlock(&loadGlobeMutex);
+
     return 0;
 }
 
-void *load_state(void *arg) {
+// old internal state format: one file per aircraft in 256 directories
+static void *load_state(void *arg) {
+    MODES_NOTUSED(arg);
     uint64_t now = mstime();
     char pathbuf[PATH_MAX];
-    //struct stat fileinfo = {0};
-    //fstat(fd, &fileinfo);
-    //off_t len = fileinfo.st_size;
-    int thread_number = *((int *) arg);
     srandom(get_seed());
-    for (int i = 0; i < 256; i++) {
-        if (i % IO_THREADS != thread_number)
-            continue;
+    int i;
+    while ((i = __atomic_fetch_add(&loadNext, 1, __ATOMIC_RELAXED)) < 256) {
         snprintf(pathbuf, PATH_MAX, "%s/%02x", Modes.state_dir, i);
 
         DIR *dp;
@@ -526,15 +1035,14 @@ void *load_state(void *arg) {
             snprintf(pathbuf, PATH_MAX, "%s/%02x/%s", Modes.state_dir, i, ep->d_name);
 
             int fd = open(pathbuf, O_RDONLY);
+            if (fd < 0)
+                continue;
 
-            struct char_buffer cb = readWholeFile(fd);
-            char *p = cb.buffer;
-            char *end = p + cb.len;
-
-            load_aircraft(&p, end, now);
+            struct state_reader r;
+            readerOpen(&r, fd, 0);
+            load_aircraft(&r, now);
+            readerClose(&r);
 
-            free(cb.buffer);
-            close(fd);
             // old internal state format, no longer needed
             unlink(pathbuf);
         }
@@ -544,37 +1052,153 @@ void *load_state(void *arg) {
     return NULL;
 }
 
-void *jsonTraceThreadEntryPoint(void *arg) {
+//
+// Trace write queue
+//
+// Aircraft are queued when their trace changes and written TRACE_WRITE_DELAY
+// later, changes in between are written together.  Every trace thread has
+// its own ring, aircraft go to ring addr % threads.  Idle threads take work
+// from the other rings.
+//
+// All producers hold the decode lock (the decode thread appending positions,
+// trackRemoveStaleAircraft() under lockThreads()), so each ring has one
+// producer at a time and needs no locking: the producer publishes entries by
+// advancing tail, consumers claim them with a CAS on head.  Entries hold the
+// address, not the aircraft: it might be freed while queued.
+//
+
+#define TRACE_WRITE_DELAY (5 * SECONDS)
+#define TRACE_QUEUE_SIZE (1 << 15) // per thread, power of 2
+#define TRACE_BATCH_MS 200 // release the thread mutex at least this often for lockThreads()
+
+struct trace_queue_entry {
+    uint64_t addr;
+    uint64_t queued; // mstime when the aircraft was queued
+};
+
+struct trace_queue {
+    uint64_t head __attribute__ ((aligned (64)));
+    uint64_t tail __attribute__ ((aligned (64)));
+    struct trace_queue_entry *entries;
+};
+
+static struct trace_queue *traceQueues;
+static int traceQueueCount;
+
+void traceQueueInit(int threads) {
+    traceQueues = aligned_alloc(64, threads * sizeof(struct trace_queue));
+    if (!traceQueues) {
+        fprintf(stderr, "traceQueueInit: out of memory\n");
+        exit(1);
+    }
+    memset(traceQueues, 0, threads * sizeof(struct trace_queue));
+    for (int i = 0; i < threads; i++) {
+        traceQueues[i].entries = malloc(TRACE_QUEUE_SIZE * sizeof(struct trace_queue_entry));
+        if (!traceQueues[i].entries) {
+            fprintf(stderr, "traceQueueInit: out of memory\n");
+            exit(1);
+        }
+    }
+    traceQueueCount = threads;
 
-    int thread = * (int *) arg;
+    if (Modes.history_packs) {
+        tracePackFiles = calloc(TRACE_PACKS, sizeof(struct trace_pack_file));
+        if (!tracePackFiles) {
+            fprintf(stderr, "traceQueueInit: out of memory\n");
+            exit(1);
+        }
+        for (int i = 0; i < TRACE_PACKS; i++) {
+            pthread_mutex_init(&tracePackFiles[i].mutex, NULL);
+            tracePackFiles[i].fd = -1;
+        }
+    }
+}
 
-    srandom(get_seed());
+void traceQueueCleanup() {
+    for (int i = 0; i < traceQueueCount; i++)
+        free(traceQueues[i].entries);
+    free(traceQueues);
+    traceQueues = NULL;
+    traceQueueCount = 0;
+
+    if (tracePackSealing)
+        pthread_join(tracePackSealThread, NULL);
+    tracePackSealing = 0;
+    if (tracePackFiles) {
+        for (int i = 0; i < TRACE_PACKS; i++) {
+            if (tracePackFiles[i].fd >= 0)
+                close(tracePackFiles[i].fd);
+            pthread_mutex_destroy(&tracePackFiles[i].mutex);
+        }
+        free(tracePackFiles);
+        tracePackFiles = NULL;
+    }
+}
+
+uint64_t traceQueueLength() {
+    uint64_t len = 0;
+    for (int i = 0; i < traceQueueCount; i++) {
+        struct trace_queue *q = &traceQueues[i];
+        len += __atomic_load_n(&q->tail, __ATOMIC_RELAXED) - __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+    return len;
+}
+
+// signal that the trace of a needs writing, caller must hold the decode lock
+void traceQueue(struct aircraft *a, uint64_t now) {
+    a->trace_write = 1;
+    if (!traceQueueCount)
+        return;
+    // still queued or being written: trackRemoveStaleAircraft() requeues it
+    // if the trace changed during the write
+    if (__atomic_exchange_n(&a->trace_queued, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    struct trace_queue *q = &traceQueues[a->addr % traceQueueCount];
+    uint64_t tail = q->tail;
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) >= TRACE_QUEUE_SIZE) {
+        // full, try again next time
+        __atomic_store_n(&a->trace_queued, 0, __ATOMIC_RELEASE);
+        return;
+    }
+    struct trace_queue_entry *e = &q->entries[tail & (TRACE_QUEUE_SIZE - 1)];
+    __atomic_store_n(&e->addr, a->addr, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->queued, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+}
 
-    int part = 0;
-    int n_parts = 64; // power of 2
+// take the oldest entry if it's due, entries are in queueing order
+static int traceQueuePop(struct trace_queue *q, uint64_t now, uint32_t *addr, uint64_t *queued) {
+    uint64_t head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    while (head != __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+        struct trace_queue_entry *e = &q->entries[head & (TRACE_QUEUE_SIZE - 1)];
+        *addr = __atomic_load_n(&e->addr, __ATOMIC_RELAXED);
+        *queued = __atomic_load_n(&e->queued, __ATOMIC_RELAXED);
+        if (*queued + TRACE_WRITE_DELAY > now)
+            return 0;
+        // a failed CAS means another thread took it (the entry might already be reused), head is reloaded
+        if (__atomic_compare_exchange_n(&q->head, &head, head + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return 1;
+    }
+    return 0;
+}
+
+void *jsonTraceThreadEntryPoint(void *arg) {
 
-    int thread_section_len = (AIRCRAFT_BUCKETS / TRACE_THREADS);
-    int thread_start = thread * thread_section_len;
-    //int thread_end = thread_start + thread_section_len;
-    //fprintf(stderr, "%d %d\n", thread_start, thread_end);
-    int section_len = thread_section_len / n_parts;
+    int thread = * (int *) arg;
 
-    struct timespec slp = {0, 0};
-    // write each part every 10 seconds
-    uint64_t sleep = 10 * SECONDS / n_parts;
+    srandom(get_seed());
 
-    slp.tv_sec =  (sleep / 1000);
-    slp.tv_nsec = (sleep % 1000) * 1000 * 1000;
+    struct timespec idle = {0, 100 * 1000 * 1000}; // 100 ms
+    struct timespec busy = {0, 1 * 1000 * 1000}; // just long enough to let lockThreads() in
+    int backlog = 0;
 
     pthread_mutex_lock(&Modes.jsonTraceThreadMutex[thread]);
 
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-
     while (!Modes.exit) {
-        struct aircraft *a;
-
-        timedWaitIncrement(&ts, &slp);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        timedWaitIncrement(&ts, backlog ? &busy : &idle);
 
         int res = 0;
         while (!Modes.exit && res == 0) {
@@ -586,22 +1210,28 @@ void *jsonTraceThreadEntryPoint(void *arg) {
         struct timespec start_time;
         start_cpu_timing(&start_time);
 
-        int start = thread_start + part * section_len;
-        int end = start + section_len;
-
-        //fprintf(stderr, "%d %d %d\n", part, start, end);
-
         uint64_t now = mstime();
-
-        for (int j = start; j < end; j++) {
-            for (a = Modes.aircraft[j]; a; a = a->next) {
-                if (a->trace_write)
-                    write_trace(a, now);
+        uint64_t batchEnd = now + TRACE_BATCH_MS;
+        uint32_t addr;
+        uint64_t queued;
+
+        // own ring first, then help the others
+        for (int k = 0; k < traceQueueCount && now < batchEnd; ) {
+            struct trace_queue *q = &traceQueues[(thread + k) % traceQueueCount];
+            if (!traceQueuePop(q, now, &addr, &queued)) {
+                k++;
+                continue;
+            }
+            struct aircraft *a = aircraftGet(addr);
+            if (a) {
+                write_trace(a, now);
+                __atomic_store_n(&a->trace_queued, 0, __ATOMIC_RELEASE);
+                statsLatencyShared(LATENCY_TRACE_WRITE, (int64_t) (mstime() - queued) * 1000);
             }
+            now = mstime();
         }
 
-        part++;
-        part %= n_parts;
+        backlog = (now >= batchEnd);
 
         end_cpu_timing(&start_time, &Modes.stats_current.trace_json_cpu[thread]);
     }
@@ -615,310 +1245,268 @@ void *jsonTraceThreadEntryPoint(void *arg) {
 #endif
 }
 
-static void mark_legs(struct aircraft *a) {
-    if (a->trace_len < 20)
-        return;
+// Legs are detected as positions are added to the trace, only the new point is
+// looked at.  The climb / descent threshold is a third of the average altitude
+// of the trace so far.
 
-    int high = 0;
-    int low = 100000;
+void legsReset(struct aircraft *a) {
+    memset(&a->legs, 0, sizeof(struct leg_state));
+    a->legs.low = 100000;
+}
 
-    int last_five[5] = { 0 };
-    uint32_t five_pos = 0;
+// older points might be packed, those are read through a view created on demand
+static struct state *legState(struct aircraft *a, struct trace_view *v, int i) {
+    int pos = a->trace_start + i;
+    if (!a->trace_blocks[pos / TRACE_CHUNK_POINTS].packed)
+        return trace_state(a, i);
+    if (!v->a)
+        trace_view_init(v, a);
+    return trace_view_state(v, i);
+}
 
-    double sum = 0;
+// point i starts a leg
+static void legsAdd(struct aircraft *a, struct trace_view *view, int i) {
+    struct leg_state *l = &a->legs;
+    uint64_t ts = legState(a, view, i)->timestamp;
+    if (l->count > 0 && l->ts[(l->count - 1) % LEG_HISTORY] == ts)
+        return;
+    l->ts[l->count % LEG_HISTORY] = ts;
+    l->count++;
+    a->trace_full_write = 9999; // rewrite the full trace with the new leg
 
-    struct state *last_leg = NULL;
-    struct state *new_leg = NULL;
+    // a packed chunk is marked by trace_pack()
+    int pos = a->trace_start + i;
+    if (!a->trace_blocks[pos / TRACE_CHUNK_POINTS].packed)
+        trace_state(a, i)->flags.leg_marker = 1;
 
-    for (int i = 0; i < a->trace_len; i++) {
-        int32_t altitude = a->trace[i].altitude * 25;
-        int on_ground = a->trace[i].flags.on_ground;
-        int altitude_valid = a->trace[i].flags.altitude_valid;
+    if (a->addr == LEG_FOCUS) {
+        time_t nowish = ts / 1000;
+        struct tm utc;
+        gmtime_r(&nowish, &utc);
+        char tstring[100];
+        strftime (tstring, 100, "%H:%M:%S", &utc);
+        fprintf(stderr, "leg: %s\n", tstring);
+    }
+}
 
-        if (a->trace[i].flags.leg_marker) {
-            a->trace[i].flags.leg_marker = 0;
-            // reset leg marker
-            last_leg = &a->trace[i];
-        }
+static void legsPoint(struct aircraft *a, struct trace_view *view, int i) {
+    struct leg_state *l = &a->legs;
+    struct state *state = legState(a, view, i);
 
-        if (!altitude_valid)
-            continue;
+    int32_t altitude = state->altitude * 25;
+    int on_ground = state->flags.on_ground;
+    int altitude_valid = state->flags.altitude_valid;
 
-        if (on_ground) {
-            int avg = 0;
-            for (int i = 0; i < 5; i++) avg += last_five[i];
-            avg /= 5;
-            altitude = avg;
-        } else {
-            if (five_pos == 0) {
-                for (int i = 0; i < 5; i++)
-                    last_five[i] = altitude;
-            } else {
-                last_five[five_pos % 5] = altitude;
-            }
-            five_pos++;
-        }
+    l->alt_count++;
 
-        sum += altitude;
+    if (i == 0) {
+        l->prev = 0;
+        if (altitude_valid && !on_ground)
+            l->alt_sum += altitude;
+        return;
     }
 
-    int threshold = (int) (sum / (double) (a->trace_len * 3));
+    int prev_index = l->prev;
+    struct state *prev = legState(a, view, prev_index);
+    uint64_t elapsed = state->timestamp - prev->timestamp;
 
-    if (a->addr == LEG_FOCUS) {
-        fprintf(stderr, "threshold: %d\n", threshold);
-        fprintf(stderr, "trace_len: %d\n", a->trace_len);
-    }
+    if (!on_ground && !altitude_valid)
+        return;
 
+    l->prev = i;
 
+    int threshold = (int) (l->alt_sum / (double) (l->alt_count * 3));
     if (threshold > 10000)
         threshold = 10000;
     if (threshold < 200)
         threshold = 200;
 
-    high = 0;
-    low = 100000;
-
-    uint64_t major_climb = 0;
-    uint64_t major_descent = 0;
-    int major_climb_index = 0;
-    int major_descent_index = 0;
-    uint64_t last_high = 0;
-    uint64_t last_low = 0;
-
-    int last_low_index = 0;
-
-    uint64_t last_airborne = 0;
-    uint64_t last_ground = 0;
-
-    int was_ground = 0;
-
-    for (int i = 0; i < 5; i++)
-        last_five[i] = 0;
-    five_pos = 0;
-
-    int prev_tmp = 0;
-    for (int i = 1; i < a->trace_len; i++) {
-        struct state *state = &a->trace[i];
-        int prev_index = prev_tmp;
-        struct state *prev = &a->trace[prev_index];
-
-        uint64_t elapsed = state->timestamp - prev->timestamp;
-
-        int32_t altitude = state->altitude * 25;
-        //int32_t geom_rate = state->geom_rate * 32;
-        //int geom_rate_valid = state->flags.geom_rate_valid;
-        //int stale = state->flags.stale;
-        int on_ground = state->flags.on_ground;
-        int altitude_valid = state->flags.altitude_valid;
-        //int gs_valid = state->flags.gs_valid;
-        //int track_valid = state->flags.track_valid;
-        //int leg_marker = state->flags.leg_marker;
-        //
-        if (!on_ground && !altitude_valid)
-            continue;
-
-        prev_tmp = i;
-
-        if (on_ground) {
-            int avg = 0;
-            for (int i = 0; i < 5; i++)
-                avg += last_five[i];
-            avg /= 5;
-            altitude = avg - threshold / 2;
+    if (on_ground) {
+        int avg = 0;
+        for (int k = 0; k < 5; k++)
+            avg += l->last_five[k];
+        avg /= 5;
+        if (altitude_valid)
+            l->alt_sum += avg;
+        altitude = avg - threshold / 2;
+    } else {
+        if (l->five_pos == 0) {
+            for (int k = 0; k < 5; k++)
+                l->last_five[k] = altitude;
         } else {
-            if (five_pos == 0) {
-                for (int i = 0; i < 5; i++)
-                    last_five[i] = altitude;
-            } else {
-                last_five[five_pos % 5] = altitude;
-            }
-            five_pos++;
+            l->last_five[l->five_pos % 5] = altitude;
         }
+        l->five_pos++;
+        l->alt_sum += altitude;
+    }
 
-        if (!on_ground)
-            last_airborne = state->timestamp;
-        else
-            last_ground = state->timestamp;
+    if (!on_ground)
+        l->last_airborne = state->timestamp;
+    else
+        l->last_ground = state->timestamp;
 
-        if (altitude >= high) {
-            high = altitude;
-        }
-        if (altitude <= low) {
-            low = altitude;
-        }
+    if (altitude >= l->high)
+        l->high = altitude;
+    if (altitude <= l->low)
+        l->low = altitude;
 
-        /*
-        if (state->timestamp > a->trace[i-1].timestamp + 45 * 60 * 1000) {
-            high = low = altitude;
+    if (abs(l->low - altitude) < threshold * 1 / 3 && elapsed < 30 * MINUTES) {
+        l->last_low = state->timestamp;
+        l->last_low_index = i;
+    }
+    if (abs(l->high - altitude) < threshold * 1 / 3)
+        l->last_high = state->timestamp;
+
+    if (l->high - l->low > threshold) {
+        if (l->last_high > l->last_low) {
+            // only set new major climb time if this is after a major descent.
+            // then keep that time associated with the climb
+            // still report continuation of thta climb
+            if (l->major_climb <= l->major_descent) {
+                int bla = min(i, l->last_low_index + 3);
+                l->major_climb = legState(a, view, bla)->timestamp;
+                l->major_climb_index = bla;
+            }
+            l->low = l->high - threshold * 9/10;
+        } else if (l->last_high < l->last_low) {
+            int bla = max(0, l->last_low_index - 3);
+            l->major_descent = legState(a, view, bla)->timestamp;
+            l->major_descent_index = bla;
+            l->high = l->low + threshold * 9/10;
         }
-        */
+    }
 
-        if (abs(low - altitude) < threshold * 1 / 3 && elapsed < 30 * MINUTES) {
-            last_low = state->timestamp;
-            last_low_index = i;
+    int leg_now = 0;
+    if ( (l->major_descent && (on_ground || l->was_ground) && elapsed > 25 * 60 * 1000) ||
+            (l->major_descent && (on_ground || l->was_ground) && state->timestamp > l->last_airborne + 45 * 60 * 1000)
+       )
+    {
+        leg_now = 1;
+    }
+    struct state *last = legState(a, view, i - 1);
+    double distance = greatcircle(
+            (double) state->lat / 1E6,
+            (double) state->lon / 1E6,
+            (double) last->lat / 1E6,
+            (double) last->lon / 1E6
+            );
+
+    if ( elapsed > 30 * 60 * 1000 && distance < 10E3 * (elapsed / (30 * 60 * 1000.0)) && distance > 1)
+        leg_now = 1;
+
+    int leg_float = 0;
+    if (l->major_climb && l->major_descent &&
+            (l->major_climb > l->major_descent + 8 * MINUTES || l->last_ground > l->major_descent - 2 * MINUTES)
+       ) {
+        for (int k = l->major_descent_index + 1; k < l->major_climb_index; k++) {
+            if (legState(a, view, k)->timestamp > legState(a, view, k - 1)->timestamp + 5 * MINUTES)
+                leg_float = 1;
         }
-        if (abs(high - altitude) < threshold * 1 / 3)
-            last_high = state->timestamp;
-
-        if (high - low > threshold) {
-            if (last_high > last_low) {
-                // only set new major climb time if this is after a major descent.
-                // then keep that time associated with the climb
-                // still report continuation of thta climb
-                if (major_climb <= major_descent) {
-                    int bla = min(a->trace_len - 1, last_low_index + 3);
-                    major_climb = a->trace[bla].timestamp;
-                    major_climb_index = bla;
-                }
-                if (a->addr == LEG_FOCUS) {
-                    time_t nowish = major_climb/1000;
-                    struct tm utc;
-                    gmtime_r(&nowish, &utc);
-                    char tstring[100];
-                    strftime (tstring, 100, "%H:%M:%S", &utc);
-                    fprintf(stderr, "climb: %d %s\n", altitude, tstring);
-                }
-                low = high - threshold * 9/10;
-            } else if (last_high < last_low) {
-                int bla = max(0, last_low_index - 3);
-                major_descent = a->trace[bla].timestamp;
-                major_descent_index = bla;
-                if (a->addr == LEG_FOCUS) {
-                    time_t nowish = major_descent/1000;
-                    struct tm utc;
-                    gmtime_r(&nowish, &utc);
-                    char tstring[100];
-                    strftime (tstring, 100, "%H:%M:%S", &utc);
-                    fprintf(stderr, "desc: %d %s\n", altitude, tstring);
-                }
-                high = low + threshold * 9/10;
+    }
+
+    if (!leg_float && !leg_now) {
+        l->was_ground = on_ground;
+        return;
+    }
+
+    int leg_index = -1;
+    if (leg_now) {
+        leg_index = prev_index + 1;
+        if (prev_index + 1 < i && state->timestamp > last->timestamp + 5 * 60 * 1000)
+            leg_index = i;
+    } else if (l->major_descent_index + 1 == l->major_climb_index) {
+        leg_index = l->major_climb_index;
+    } else {
+        for (int k = l->major_climb_index; k > l->major_descent_index; k--) {
+            if (legState(a, view, k)->timestamp > legState(a, view, k - 1)->timestamp + 5 * 60 * 1000) {
+                leg_index = k;
+                break;
             }
         }
-        int leg_now = 0;
-        if ( (major_descent && (on_ground || was_ground) && elapsed > 25 * 60 * 1000) ||
-                (major_descent && (on_ground || was_ground) && state->timestamp > last_airborne + 45 * 60 * 1000)
-           )
-        {
-            if (a->addr == LEG_FOCUS)
-                fprintf(stderr, "ground leg\n");
-            leg_now = 1;
-        }
-        double distance = greatcircle(
-                (double) a->trace[i].lat / 1E6,
-                (double) a->trace[i].lon / 1E6,
-                (double) a->trace[i-1].lat / 1E6,
-                (double) a->trace[i-1].lon / 1E6
-                );
-
-        if ( elapsed > 30 * 60 * 1000 && distance < 10E3 * (elapsed / (30 * 60 * 1000.0)) && distance > 1) {
-            leg_now = 1;
-            if (a->addr == LEG_FOCUS)
-                fprintf(stderr, "time/distance leg, elapsed: %0.fmin, distance: %0.f\n", elapsed / (60 * 1000.0), distance / 1000.0);
-        }
-
-        int leg_float = 0;
-        if (major_climb && major_descent &&
-                (major_climb > major_descent + 8 * MINUTES || last_ground > major_descent - 2 * MINUTES)
-           ) {
-            for (int i = major_descent_index + 1; i < major_climb_index; i++) {
-                if (a->trace[i].timestamp > a->trace[i - 1].timestamp + 5 * MINUTES) {
-                    leg_float = 1;
-                    if (a->addr == LEG_FOCUS)
-                        fprintf(stderr, "float leg\n");
-                }
+        uint64_t half = l->major_descent + (l->major_climb - l->major_descent) / 2;
+        for (int k = l->major_descent_index + 1; k < l->major_climb_index; k++) {
+            if (legState(a, view, k)->timestamp > half) {
+                leg_index = k;
+                break;
             }
         }
+    }
 
+    if (leg_index >= 0)
+        legsAdd(a, view, leg_index);
 
-        if (leg_float || leg_now)
-        {
-            uint64_t leg_ts = 0;
-
-            if (leg_now) {
-                new_leg = &a->trace[prev_index + 1];
-                for (int k = prev_index + 1; k < i; k++) {
-                    struct state *state = &a->trace[i];
-                    struct state *last = &a->trace[i - 1];
-
-                    if (state->timestamp > last->timestamp + 5 * 60 * 1000) {
-                        new_leg = state;
-                        break;
-                    }
-                }
-            } else if (major_descent_index + 1 == major_climb_index) {
-                new_leg = &a->trace[major_climb_index];
-            } else {
-                for (int i = major_climb_index; i > major_descent_index; i--) {
-                    struct state *state = &a->trace[i];
-                    struct state *last = &a->trace[i - 1];
-
-                    if (state->timestamp > last->timestamp + 5 * 60 * 1000) {
-                        new_leg = state;
-                        break;
-                    }
-                }
-                uint64_t half = major_descent + (major_climb - major_descent) / 2;
-                for (int i = major_descent_index + 1; i < major_climb_index; i++) {
-                    struct state *state = &a->trace[i];
+    l->major_climb = 0;
+    l->major_climb_index = 0;
+    l->major_descent = 0;
+    l->major_descent_index = 0;
+    l->low += threshold;
+    l->high -= threshold;
 
-                    if (state->timestamp > half) {
-                        new_leg = state;
-                        break;
-                    }
-                }
-            }
+    l->was_ground = on_ground;
+}
 
-            if (new_leg) {
-                leg_ts = new_leg->timestamp;
-                new_leg->flags.leg_marker = 1;
-                // set leg marker
-            }
+// look at the points added since the last call
+// runs in the decode thread right after a point is appended
+void legsUpdate(struct aircraft *a) {
+    struct trace_view view = { 0 };
+    if (a->legs.next > a->trace_len)
+        a->legs.next = a->trace_len;
+    for (; a->legs.next < a->trace_len; a->legs.next++)
+        legsPoint(a, &view, a->legs.next);
+    if (view.a)
+        trace_view_free(&view);
+}
 
-            major_climb = 0;
-            major_climb_index = 0;
-            major_descent = 0;
-            major_descent_index = 0;
-            low += threshold;
-            high -= threshold;
+// points is the number of points removed from the start of the trace
+void legsDrop(struct aircraft *a, int points) {
+    struct leg_state *l = &a->legs;
+    if (l->alt_count > (uint32_t) points) {
+        // keep the average, just weigh it as the remaining points
+        l->alt_sum *= (l->alt_count - points) / (double) l->alt_count;
+        l->alt_count -= points;
+    } else {
+        l->alt_sum = 0;
+        l->alt_count = 0;
+    }
+    l->next = max(0, l->next - points);
+    l->prev = max(0, l->prev - points);
+    l->last_low_index = max(0, l->last_low_index - points);
+    l->major_climb_index = max(0, l->major_climb_index - points);
+    l->major_descent_index = max(0, l->major_descent_index - points);
+}
 
-            if (a->addr == LEG_FOCUS) {
-                if (new_leg) {
-                    time_t nowish = leg_ts/1000;
-                    struct tm utc;
-                    gmtime_r(&nowish, &utc);
-                    char tstring[100];
-                    strftime (tstring, 100, "%H:%M:%S", &utc);
-                    fprintf(stderr, "leg: %s\n", tstring);
-                } else {
-                    time_t nowish = state->timestamp/1000;
-                    struct tm utc;
-                    gmtime_r(&nowish, &utc);
-                    char tstring[100];
-                    strftime (tstring, 100, "%H:%M:%S", &utc);
-                    fprintf(stderr, "resetting major_c/d without leg: %s\n", tstring);
-                }
-            }
+// the remembered legs in ascending order, returns their number
+// older legs are only known by the leg_marker of their point
+int legsSorted(struct aircraft *a, uint64_t *ts) {
+    uint32_t count = a->legs.count;
+    int n = min(count, LEG_HISTORY);
+    for (int k = 0; k < n; k++) {
+        uint64_t t = a->legs.ts[(count - n + k) % LEG_HISTORY];
+        int j = k;
+        while (j > 0 && ts[j - 1] > t) {
+            ts[j] = ts[j - 1];
+            j--;
         }
-
-        was_ground = on_ground;
-    }
-    if (last_leg != new_leg) {
-        a->trace_full_write = 9999;
-        //fprintf(stderr, "%06x\n", a->addr);
+        ts[j] = t;
     }
+    return n;
 }
 
 void ca_init (struct craftArray *ca) {
     *ca = (struct craftArray) {0};
+    pthread_mutex_init(&ca->mutex, NULL);
 }
 
 void ca_destroy (struct craftArray *ca) {
     if (ca->list)
         free(ca->list);
+    pthread_mutex_destroy(&ca->mutex);
     *ca = (struct craftArray) {0};
 }
 
+// the list is kept dense: every aircraft knows its slot, removal moves the last one into it
 void ca_add (struct craftArray *ca, struct aircraft *a) {
+    pthread_mutex_lock(&ca->mutex);
     if (ca->alloc == 0) {
         ca->alloc = 64;
         ca->list = realloc(ca->list, ca->alloc * sizeof(struct aircraft *));
@@ -931,40 +1519,52 @@ void ca_add (struct craftArray *ca, struct aircraft *a) {
         fprintf(stderr, "ca_add(): out of memory!\n");
         exit(1);
     }
-    for (int i = 0; i < ca->len; i++) {
-        if (a == ca->list[i]) {
-            fprintf(stderr, "ca_add(): double add!\n");
-            return;
-        }
-    }
-    for (int i = 0; i < ca->len; i++) {
-        if (ca->list[i] == NULL) {
-            ca->list[i] = a;
-            return; // added, len stays the same
-        }
+    if (a->globe_slot >= 0 && a->globe_slot < ca->len && ca->list[a->globe_slot] == a) {
+        fprintf(stderr, "ca_add(): double add!\n");
+        pthread_mutex_unlock(&ca->mutex);
+        return;
     }
+    a->globe_slot = ca->len;
     ca->list[ca->len] = a;  // added, len is incremented
     ca->len++;
+    pthread_mutex_unlock(&ca->mutex);
     return;
 }
 
 void ca_remove (struct craftArray *ca, struct aircraft *a) {
-    if (!ca->list)
+    pthread_mutex_lock(&ca->mutex);
+    int i = a->globe_slot;
+    if (!ca->list || i < 0 || i >= ca->len || ca->list[i] != a) {
+        //fprintf(stderr, "hex: %06x, ca_remove(): pointer not in array!\n", a->addr);
+        pthread_mutex_unlock(&ca->mutex);
         return;
-    for (int i = 0; i < ca->len; i++) {
-        if (ca->list[i] == a) {
-            ca->list[i] = NULL;
-
-            if (i == ca->len - 1)
-                ca->len--;
-
-            return;
-        }
     }
-    //fprintf(stderr, "hex: %06x, ca_remove(): pointer not in array!\n", a->addr);
+    struct aircraft *last = ca->list[ca->len - 1];
+    ca->list[i] = last;
+    last->globe_slot = i;
+    ca->len--;
+    a->globe_slot = -1;
+    pthread_mutex_unlock(&ca->mutex);
     return;
 }
 
+// readers outside the decode thread walk a copy, ca_remove() reorders and ca_add() reallocs the list
+// returns NULL for an empty list, otherwise the caller frees the copy
+struct aircraft **ca_copy (struct craftArray *ca, int *len) {
+    struct aircraft **copy = NULL;
+    pthread_mutex_lock(&ca->mutex);
+    *len = ca->len;
+    if (ca->len > 0) {
+        copy = malloc(ca->len * sizeof(struct aircraft *));
+        if (copy)
+            memcpy(copy, ca->list, ca->len * sizeof(struct aircraft *));
+        else
+            *len = 0;
+    }
+    pthread_mutex_unlock(&ca->mutex);
+    return copy;
+}
+
 void set_globe_index (struct aircraft *a, int new_index) {
 
     int old_index = a->globe_index;
@@ -985,15 +1585,17 @@ void set_globe_index (struct aircraft *a, int new_index) {
 
 
 // blobs 00 to ff (0 to 255)
-void save_blob(int blob) {
+int save_blob(int blob) {
     if (!Modes.state_dir)
-        return;
+        return -1;
     //static int count;
     //fprintf(stderr, "Save blob: %02x, count: %d\n", blob, ++count);
     if (blob < 0 || blob > 255)
         fprintf(stderr, "save_blob: invalid argument: %d", blob);
 
+    uint64_t started = mstime();
     int gzip = 1;
+    int failed = 0;
 
     char filename[PATH_MAX];
     char tmppath[PATH_MAX];
@@ -1012,24 +1614,11 @@ void save_blob(int blob) {
     if (fd < 0) {
         fprintf(stderr, "open failed:");
         perror(tmppath);
-        return;
-    }
-    gzFile gzfp = NULL;
-    if (gzip) {
-        int res;
-        gzfp = gzdopen(fd, "wb");
-        if (!gzfp) {
-            fprintf(stderr, "gzdopen failed:");
-            perror(tmppath);
-            close(fd);
-            return;
-        }
-        if (gzbuffer(gzfp, GZBUFFER_BIG) < 0)
-            fprintf(stderr, "gzbuffer fail");
-        res = gzsetparams(gzfp, 1, Z_DEFAULT_STRATEGY);
-        if (res < 0)
-            fprintf(stderr, "gzsetparams fail: %d", res);
+        return -1;
     }
+    struct zwriter zw;
+    if (gzip)
+        zwriterOpen(&zw, fd, ZCLASS_STATE);
 
     int stride = AIRCRAFT_BUCKETS / STATE_BLOBS;
     int start = stride * blob;
@@ -1055,29 +1644,42 @@ void save_blob(int blob) {
             p += sizeof(magic);
 
 
-            int size_state = a->trace_len * sizeof(struct state);
-            int size_all = (a->trace_len + 3) / 4 * sizeof(struct state_all);
+            struct trace_view view;
+            trace_view_init(&view, a);
+
+            int size_state = view.len * sizeof(struct state);
+            int size_all = (view.len + 3) / 4 * sizeof(struct state_all);
 
             if (p + size_state + size_all + sizeof(struct aircraft) < buf + alloc) {
 
                 memcpy(p, a, sizeof(struct aircraft));
+                // positions may have been added since the view was created
+                ((struct aircraft *) p)->trace_len = view.len;
                 p += sizeof(struct aircraft);
-                if (a->trace_len > 0) {
-                    memcpy(p, a->trace, size_state);
-                    p += size_state;
-                    memcpy(p, a->trace_all, size_all);
-                    p += size_all;
+                if (view.len > 0) {
+                    // same layout as before chunked traces: all points, then all state_all
+                    for (int i = 0, n; i < view.len; i += n) {
+                        n = min(trace_view_remaining(&view, i), view.len - i);
+                        memcpy(p + i * sizeof(struct state), trace_view_state(&view, i), n * sizeof(struct state));
+                        memcpy(p + size_state + i / 4 * sizeof(struct state_all), trace_view_all(&view, i),
+                                (n + 3) / 4 * sizeof(struct state_all));
+                    }
+                    p += size_state + size_all;
                 }
             } else {
                 fprintf(stderr, "%06x: too big for save_blob!\n", a->addr);
             }
+            trace_view_free(&view);
 
             if (p - buf > alloc - 4 * 1024 * 1024) {
                 fprintf(stderr, "buffer almost full: loop_write %d KB\n", (int) ((p - buf) / 1024));
                 if (gzip) {
-                    writeGz(gzfp, buf, p - buf, tmppath);
-                } else {
-                    check_write(fd, buf, p - buf, tmppath);
+                    if (zwriterWrite(&zw, buf, p - buf) < 0) {
+                        fprintf(stderr, "save_blob: compressed write failed: %s\n", tmppath);
+                        failed = 1;
+                    }
+                } else if (check_write(fd, buf, p - buf, tmppath) != p - buf) {
+                    failed = 1;
                 }
 
                 p = buf;
@@ -1090,32 +1692,47 @@ void save_blob(int blob) {
 
     //fprintf(stderr, "end_write %d KB\n", (int) ((p - buf) / 1024));
     if (gzip) {
-        writeGz(gzfp, buf, p - buf, tmppath);
-    } else {
-        check_write(fd, buf, p - buf, tmppath);
+        if (zwriterWrite(&zw, buf, p - buf) < 0) {
+            fprintf(stderr, "save_blob: compressed write failed: %s\n", tmppath);
+            failed = 1;
+        }
+    } else if (check_write(fd, buf, p - buf, tmppath) != p - buf) {
+        failed = 1;
     }
     p = buf;
+    free(buf);
 
-    if (gzfp)
-        gzclose(gzfp);
-    else if (fd != -1)
-        close(fd);
+    if (gzip) {
+        if (zwriterClose(&zw) < 0) {
+            fprintf(stderr, "save_blob: writing %s failed\n", tmppath);
+            failed = 1;
+        }
+    } else if (close(fd) < 0) {
+        perror(tmppath);
+        failed = 1;
+    }
+    if (failed) {
+        // keep the previous blob, an incomplete one would lose the aircraft it is missing
+        unlink(tmppath);
+        return -1;
+    }
 
     if (rename(tmppath, filename) == -1) {
         fprintf(stderr, "save_blob rename(): %s -> %s", tmppath, filename);
         perror("");
+        unlink(tmppath);
+        return -1;
     }
-
-    free(buf);
+    if (Modes.state_wal)
+        walBlobSaved(blob, started);
+    return 0;
 }
-void *load_blobs(void *arg) {
-    int thread_number = *((int *) arg);
+static void *load_blobs(void *arg) {
+    MODES_NOTUSED(arg);
     srandom(get_seed());
-    for (int j = 0; j < STATE_BLOBS; j++) {
-        if (j % IO_THREADS != thread_number)
-           continue;
-        load_blob(j);
-    }
+    int blob;
+    while ((blob = __atomic_fetch_add(&loadNext, 1, __ATOMIC_RELAXED)) < STATE_BLOBS)
+        load_blob(blob);
     return NULL;
 }
 
@@ -1127,176 +1744,265 @@ static void load_blob(int blob) {
     uint64_t magic = 0x7ba09e63757913eeULL;
     char filename[1024];
     uint64_t now = mstime();
-    int fd = -1;
-    struct char_buffer cb;
-    char *p;
-    char *end;
+    int gzip = 1;
 
     snprintf(filename, 1024, "%s/blob_%02x.gz", Modes.state_dir, blob);
-    gzFile gzfp = gzopen(filename, "r");
-    if (gzfp) {
-        if (gzbuffer(gzfp, GZBUFFER_BIG) < 0)
-            fprintf(stderr, "gzbuffer fail");
-        cb = readWholeGz(gzfp);
-        gzclose(gzfp);
-    } else {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        gzip = 0;
         snprintf(filename, 1024, "%s/blob_%02x", Modes.state_dir, blob);
         fd = open(filename, O_RDONLY);
-        if (fd == -1) {
-            fprintf(stderr, "missing state blob:");
-            perror(filename);
-            return;
-        }
-        cb = readWholeFile(fd);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "missing state blob:");
+        perror(filename);
+        return;
+    }
+
+    struct state_reader r;
+    if (readerOpen(&r, fd, gzip) < 0) {
+        fprintf(stderr, "load_blob: gzdopen failed: %s\n", filename);
         close(fd);
+        return;
     }
-    p = cb.buffer;
-    end = p + cb.len;
 
-    while (end - p > 0) {
+    uint32_t count = 0;
+    while (1) {
         uint64_t value = 0;
-        if (end - p >= (long) sizeof(value)) {
-            memcpy(&value, p, sizeof(value));
-            p += sizeof(value);
+        if (readerFill(&r, sizeof(value)) < 0) {
+            if (r.end > r.p)
+                fprintf(stderr, "Incomplete state file: %s\n", filename);
+            break;
         }
+        memcpy(&value, r.p, sizeof(value));
+        r.p += sizeof(value);
 
         if (value != magic) {
             if (value != magic - 1)
                 fprintf(stderr, "Incomplete state file: %s\n", filename);
             break;
         }
-        load_aircraft(&p, end, now);
+        if (load_aircraft(&r, now) < 0)
+            break;
+        count++;
     }
-    free(cb.buffer);
-}
 
-void handleHeatmap() {
-    time_t nowish = (mstime() - 30 * MINUTES)/1000;
-    struct tm utc;
-    gmtime_r(&nowish, &utc);
-    int half_hour = utc.tm_hour * 2 + utc.tm_min / 30;
+    blobLoad[blob].ms = mstime() - now;
+    blobLoad[blob].aircraft = count;
+    blobLoad[blob].bytes = r.bytes;
+    readerClose(&r);
+}
 
-    // don't write on startup when persistent state isn't enabled
-    if (!Modes.state_dir && Modes.heatmap_current_interval == -1) {
-        Modes.heatmap_current_interval = half_hour;
-        return;
+static void load_run(void *(*entry)(void *), int threads) {
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    if (!tids) {
+        fprintf(stderr, "load_run: out of memory\n");
+        exit(1);
     }
-    // only do this every 30 minutes.
-    if (half_hour == Modes.heatmap_current_interval)
-        return;
+    loadNext = 0;
+    for (int i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, entry, NULL);
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+}
 
-    utc.tm_hour = half_hour / 2;
-    utc.tm_min = 30 * (half_hour % 2);
-    utc.tm_sec = 0;
-    uint64_t start = 1000 * (uint64_t) (timegm(&utc));
-    uint64_t end = start + 30 * MINUTES;
-    int num_slices = (30 * MINUTES) / Modes.heatmap_interval;
+void load_state_all(int threads) {
+    uint64_t start = mstime();
 
-    Modes.heatmap_current_interval = half_hour;
+    load_run(load_state, threads);
+    load_run(load_blobs, threads);
 
-    char pathbuf[PATH_MAX];
-    char tmppath[PATH_MAX];
-    int len = 0;
-    int len2 = 0;
-    int alloc = 1 * 1024 * 1024;
-    struct heatEntry *buffer = malloc(alloc * sizeof(struct heatEntry));
-    struct heatEntry *buffer2 = malloc(alloc * sizeof(struct heatEntry));
-    int *slices = malloc(alloc * sizeof(int));
-    struct heatEntry index[num_slices];
+    uint64_t bytes = 0;
+    uint64_t sum = 0;
+    int slowest = 0;
+    for (int j = 0; j < STATE_BLOBS; j++) {
+        bytes += blobLoad[j].bytes;
+        sum += blobLoad[j].ms;
+        if (blobLoad[j].ms > blobLoad[slowest].ms)
+            slowest = j;
+        if (blobLoad[j].ms > 1 * SECONDS)
+            fprintf(stderr, "blob_%02x: %u aircraft, %.1f MB in %.1f s\n", j, blobLoad[j].aircraft,
+                    blobLoad[j].bytes / 1e6, blobLoad[j].ms / 1000.0);
+    }
+    fprintf(stderr, "state: %.1f MB in %.1f s using %d threads, per blob %"PRIu64" ms on average, slowest blob_%02x %"PRIu64" ms\n",
+            bytes / 1e6, (mstime() - start) / 1000.0, threads, sum / STATE_BLOBS, slowest, blobLoad[slowest].ms);
+}
 
-    for (int j = 0; j < AIRCRAFT_BUCKETS; j++) {
-        for (struct aircraft *a = Modes.aircraft[j]; a; a = a->next) {
-            if (a->addr & MODES_NON_ICAO_ADDRESS) continue;
-            if (a->trace_len == 0) continue;
+//
+// Heatmap
+//
+// handleHeatmap() runs in the periodic update and only notices that a half
+// hour is complete, the heatmap thread does the work.  It collects the points
+// HEATMAP_STRIDE hash buckets at a time while holding Modes.heatmapMutex,
+// lockThreads() takes that mutex as well so aircraft aren't freed or their
+// traces resized under it.  The entries are then counting sorted by slice in
+// one pass and compressed slice by slice into the file.
+//
+
+#define HEATMAP_STRIDE 256
+
+struct heatmap_job {
+    int half_hour;
+    struct tm utc;
+    uint64_t start;
+    uint64_t end;
+    int num_slices;
+};
+
+struct heatmap_points {
+    struct heatEntry *entries;
+    uint32_t *slices; // slice of each entry
+    uint32_t *counts; // entries per slice
+    size_t len;
+    size_t alloc;
+};
+
+static pthread_t heatmapThread;
+static int heatmapStarted;
+static int heatmapBusy;
+static struct heatmap_job heatmapJob;
+
+static struct heatEntry *heatmapAdd(struct heatmap_points *pts, uint32_t slice) {
+    if (pts->len == pts->alloc) {
+        pts->alloc = pts->alloc ? 2 * pts->alloc : 1024 * 1024;
+        pts->entries = realloc(pts->entries, pts->alloc * sizeof(struct heatEntry));
+        pts->slices = realloc(pts->slices, pts->alloc * sizeof(uint32_t));
+        if (!pts->entries || !pts->slices) {
+            fprintf(stderr, "heatmap: out of memory for %zu entries\n", pts->alloc);
+            exit(1);
+        }
+    }
+    pts->slices[pts->len] = slice;
+    pts->counts[slice]++;
+    return &pts->entries[pts->len++];
+}
 
-            struct state *trace = a->trace;
-            uint64_t next = start;
-            int slice = 0;
-            uint32_t squawk = 8888; // impossible squawk
-            uint64_t callsign = 0; // quackery
+static void heatmapCollect(struct heatmap_job *job, struct heatmap_points *pts, struct aircraft *a) {
+    struct trace_view view;
+    trace_view_init(&view, a);
 
-            for (int i = 0; i < a->trace_len; i++) {
-                if (len >= alloc)
-                    break;
-                if (trace[i].timestamp > end)
-                    break;
-                if (trace[i].timestamp > start && i % 4 == 0) {
-                    struct state_all *all = &(a->trace_all[i/4]);
-                    uint64_t *cs = (uint64_t *) &(all->callsign);
-                    if (*cs != callsign || squawk != all->squawk) {
+    uint64_t next = job->start;
+    int slice = 0;
+    uint32_t squawk = 8888; // impossible squawk
+    uint64_t callsign = 0; // quackery
 
-                        callsign = *cs;
-                        squawk = all->squawk;
+    for (int i = 0; i < view.len; i++) {
+        struct state *state = trace_view_state(&view, i);
+        if (state->timestamp > job->end)
+            break;
+        if (state->timestamp > job->start && i % 4 == 0) {
+            struct state_all *all = trace_view_all(&view, i);
+            uint64_t *cs = (uint64_t *) &(all->callsign);
+            if (*cs != callsign || squawk != all->squawk) {
 
-                        uint32_t s = all->squawk;
-                        int32_t d = (s & 0xF) + 10 * ((s & 0xF0) >> 4) + 100 * ((s & 0xF00) >> 8) + 1000 * ((s & 0xF000) >> 12);
-                        buffer[len].hex = a->addr;
-                        buffer[len].lat = (1 << 30) | d;
+                callsign = *cs;
+                squawk = all->squawk;
 
-                        memcpy(&buffer[len].lon, all->callsign, 8);
+                uint32_t s = all->squawk;
+                int32_t d = (s & 0xF) + 10 * ((s & 0xF0) >> 4) + 100 * ((s & 0xF00) >> 8) + 1000 * ((s & 0xF000) >> 12);
+                if (slice >= job->num_slices)
+                    break;
+                struct heatEntry *e = heatmapAdd(pts, slice);
+                e->hex = a->addr;
+                e->lat = (1 << 30) | d;
 
-                        if (a->addr == LEG_FOCUS) {
-                            fprintf(stderr, "squawk: %d %04x\n", d, s);
-                        }
+                memcpy(&e->lon, all->callsign, 8);
 
-                        slices[len] = slice;
-                        len++;
-                    }
-                }
-                if (trace[i].timestamp < next)
-                    continue;
-                if (!trace[i].flags.altitude_valid)
-                    continue;
-
-                while (trace[i].timestamp > next + Modes.heatmap_interval) {
-                    next += Modes.heatmap_interval;
-                    slice++;
+                if (a->addr == LEG_FOCUS) {
+                    fprintf(stderr, "squawk: %d %04x\n", d, s);
                 }
+            }
+        }
+        if (state->timestamp < next)
+            continue;
+        if (!state->flags.altitude_valid)
+            continue;
 
-                buffer[len].hex = a->addr;
-                buffer[len].lat = trace[i].lat;
-                buffer[len].lon = trace[i].lon;
+        while (state->timestamp > next + Modes.heatmap_interval) {
+            next += Modes.heatmap_interval;
+            slice++;
+        }
+        if (slice >= job->num_slices)
+            break;
 
-                if (!trace[i].flags.on_ground)
-                    buffer[len].alt = trace[i].altitude;
-                else
-                    buffer[len].alt = -123; // on ground
+        struct heatEntry *e = heatmapAdd(pts, slice);
+        e->hex = a->addr;
+        e->lat = state->lat;
+        e->lon = state->lon;
 
-                if (trace[i].flags.gs_valid)
-                    buffer[len].gs = trace[i].gs;
-                else
-                    buffer[len].gs = -1; // invalid
+        if (!state->flags.on_ground)
+            e->alt = state->altitude;
+        else
+            e->alt = -123; // on ground
 
-                slices[len] = slice;
+        if (state->flags.gs_valid)
+            e->gs = state->gs;
+        else
+            e->gs = -1; // invalid
+
+        next += Modes.heatmap_interval;
+        slice++;
+    }
+    trace_view_free(&view);
+}
+
+static void heatmapWrite(struct heatmap_job *job) {
+    int num_slices = job->num_slices;
+    struct heatmap_points pts = { 0 };
+    pts.counts = calloc(num_slices, sizeof(uint32_t));
+    struct heatEntry *index = calloc(num_slices, sizeof(struct heatEntry));
+    size_t *offsets = malloc(num_slices * sizeof(size_t));
+    if (!pts.counts || !index || !offsets) {
+        fprintf(stderr, "heatmap: out of memory\n");
+        exit(1);
+    }
 
-                len++;
+    uint64_t startTime = mstime();
 
-                next += Modes.heatmap_interval;
-                slice++;
+    for (int k = 0; k < AIRCRAFT_BUCKETS; k += HEATMAP_STRIDE) {
+        pthread_mutex_lock(&Modes.heatmapMutex);
+        for (int j = k; j < k + HEATMAP_STRIDE && j < AIRCRAFT_BUCKETS; j++) {
+            for (struct aircraft *a = Modes.aircraft[j]; a; a = a->next) {
+                if (a->addr & MODES_NON_ICAO_ADDRESS) continue;
+                if (a->trace_len == 0) continue;
+                heatmapCollect(job, &pts, a);
             }
         }
+        pthread_mutex_unlock(&Modes.heatmapMutex);
     }
 
+    // counting sort by slice: every slice starts with its special entry, the index points to it
+    size_t pos = 0;
     for (int i = 0; i < num_slices; i++) {
-        struct heatEntry specialSauce = (struct heatEntry) {0};
-        uint64_t slice_stamp = start + i * Modes.heatmap_interval;
-        specialSauce.hex = 0xe7f7c9d;
-        specialSauce.lat = slice_stamp >> 32;
-        specialSauce.lon = slice_stamp & ((1ULL << 32) - 1);
-        specialSauce.alt = Modes.heatmap_interval;
-
-        index[i] = (struct heatEntry) {0};
-        index[i].hex = len2 + num_slices;
-        buffer2[len2++] = specialSauce;
-
-        for (int k = 0; k < len; k++) {
-            if (slices[k] == i)
-                buffer2[len2++] = buffer[k];
-        }
+        index[i].hex = pos + num_slices;
+        offsets[i] = pos + 1;
+        pos += 1 + pts.counts[i];
+    }
+    struct heatEntry *sorted = malloc(pos * sizeof(struct heatEntry));
+    if (!sorted) {
+        fprintf(stderr, "heatmap: out of memory for %zu entries\n", pos);
+        exit(1);
     }
+    for (int i = 0; i < num_slices; i++) {
+        uint64_t slice_stamp = job->start + i * Modes.heatmap_interval;
+        struct heatEntry *specialSauce = &sorted[offsets[i] - 1];
+        *specialSauce = (struct heatEntry) {0};
+        specialSauce->hex = 0xe7f7c9d;
+        specialSauce->lat = slice_stamp >> 32;
+        specialSauce->lon = slice_stamp & ((1ULL << 32) - 1);
+        specialSauce->alt = Modes.heatmap_interval;
+    }
+    for (size_t k = 0; k < pts.len; k++)
+        sorted[offsets[pts.slices[k]]++] = pts.entries[k];
+
+    free(pts.entries);
+    free(pts.slices);
 
+    char pathbuf[PATH_MAX];
+    char tmppath[PATH_MAX];
     char tstring[100];
-    strftime (tstring, 100, "%Y-%m-%d", &utc);
+    strftime (tstring, 100, "%Y-%m-%d", &job->utc);
 
     char *base_dir = Modes.globe_history_dir;
     if (Modes.heatmap_dir) {
@@ -1314,40 +2020,95 @@ void handleHeatmap() {
     if (mkdir(pathbuf, 0755) && errno != EEXIST)
         perror(pathbuf);
 
-    snprintf(pathbuf, PATH_MAX, "%s/%s/heatmap/%02d.bin.ttf", base_dir, tstring, half_hour);
+    snprintf(pathbuf, PATH_MAX, "%s/%s/heatmap/%02d.bin.ttf", base_dir, tstring, job->half_hour);
     snprintf(tmppath, PATH_MAX, "%s/%s/heatmap/temp_%lx_%lx", base_dir, tstring, random(), random());
 
-    //fprintf(stderr, "%s using %d positions\n", pathbuf, len);
+    //fprintf(stderr, "%s using %zu positions\n", pathbuf, pts.len);
 
     int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (fd < 0) {
         perror(tmppath);
     } else {
-        int res;
-        gzFile gzfp = gzdopen(fd, "wb");
-        if (!gzfp)
-            fprintf(stderr, "heatmap: gzdopen fail");
-        else if (gzbuffer(gzfp, GZBUFFER_BIG) < 0)
-            fprintf(stderr, "gzbuffer fail");
-        res = gzsetparams(gzfp, 9, Z_DEFAULT_STRATEGY);
-        if (res < 0)
-            fprintf(stderr, "gzsetparams fail: %d", res);
-        ssize_t toWrite = sizeof(index);
-        writeGz(gzfp, index, toWrite, tmppath);
-
-        toWrite = len2 * sizeof(struct heatEntry);
-        writeGz(gzfp, buffer2, toWrite, tmppath);
-
-        gzclose(gzfp);
+        struct zwriter zw;
+        zwriterOpen(&zw, fd, ZCLASS_HEATMAP);
+        zwriterWrite(&zw, index, num_slices * sizeof(struct heatEntry));
+        // one slice at a time, the compressor never needs the whole file
+        for (int i = 0; i < num_slices; i++) {
+            size_t first = index[i].hex - num_slices;
+            zwriterWrite(&zw, &sorted[first], (offsets[i] - first) * sizeof(struct heatEntry));
+        }
+        if (zwriterClose(&zw) < 0)
+            fprintf(stderr, "heatmap: writing %s failed\n", tmppath);
     }
     if (rename(tmppath, pathbuf) == -1) {
         fprintf(stderr, "heatmap rename(): %s -> %s", tmppath, pathbuf);
         perror("");
     }
 
-    free(buffer);
-    free(buffer2);
-    free(slices);
+    uint64_t elapsed = mstime() - startTime;
+    if (elapsed > 10 * SECONDS)
+        fprintf(stderr, "heatmap: %s took %.1f s for %zu positions\n", pathbuf, elapsed / 1000.0, pts.len);
+
+    free(sorted);
+    free(offsets);
+    free(index);
+    free(pts.counts);
+}
+
+static void *heatmapEntryPoint(void *arg) {
+    MODES_NOTUSED(arg);
+    srandom(get_seed());
+    heatmapWrite(&heatmapJob);
+    __atomic_store_n(&heatmapBusy, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void handleHeatmap() {
+    time_t nowish = (mstime() - 30 * MINUTES)/1000;
+    struct tm utc;
+    gmtime_r(&nowish, &utc);
+    int half_hour = utc.tm_hour * 2 + utc.tm_min / 30;
+
+    // don't write on startup when persistent state isn't enabled
+    if (!Modes.state_dir && Modes.heatmap_current_interval == -1) {
+        Modes.heatmap_current_interval = half_hour;
+        return;
+    }
+    // only do this every 30 minutes.
+    if (half_hour == Modes.heatmap_current_interval)
+        return;
+    // the previous one is still being written, try again next time
+    if (__atomic_load_n(&heatmapBusy, __ATOMIC_ACQUIRE))
+        return;
+    if (heatmapStarted)
+        pthread_join(heatmapThread, NULL);
+
+    utc.tm_hour = half_hour / 2;
+    utc.tm_min = 30 * (half_hour % 2);
+    utc.tm_sec = 0;
+
+    heatmapJob.half_hour = half_hour;
+    heatmapJob.utc = utc;
+    heatmapJob.start = 1000 * (uint64_t) (timegm(&utc));
+    heatmapJob.end = heatmapJob.start + 30 * MINUTES;
+    heatmapJob.num_slices = (30 * MINUTES) / Modes.heatmap_interval;
+
+    Modes.heatmap_current_interval = half_hour;
+
+    heatmapBusy = 1;
+    if (pthread_create(&heatmapThread, NULL, heatmapEntryPoint, NULL)) {
+        fprintf(stderr, "heatmap: pthread_create failed, writing it on this thread\n");
+        heatmapStarted = 0;
+        heatmapEntryPoint(NULL);
+        return;
+    }
+    heatmapStarted = 1;
+}
+
+void heatmapCleanup() {
+    if (heatmapStarted)
+        pthread_join(heatmapThread, NULL);
+    heatmapStarted = 0;
 }
 
 
@@ -1376,6 +2137,14 @@ void checkNewDay() {
 
         snprintf(filename, PATH_MAX, "%s/%s/traces", Modes.globe_history_dir, tstring);
         chmod(filename, 0755);
+
+        if (Modes.history_packs && tracePackFiles) {
+            // nothing is written to the day before twenty_ago anymore
+            time_t finished = twenty_ago - 24 * 3600;
+            gmtime_r(&finished, &utc);
+            strftime (tstring, 100, "%Y-%m-%d", &utc);
+            tracePackSealDay(tstring);
+        }
     }
 
     // 2 seconds after midnight, start a permanent write of all traces
@@ -1405,7 +2174,7 @@ void checkNewDay() {
         if (mkdir(filename, 0700) && errno != EEXIST)
             perror(filename);
 
-        for (int i = 0; i < 256; i++) {
+        for (int i = 0; i < 256 && !Modes.history_packs; i++) {
             snprintf(filename, PATH_MAX, "%s/%s/traces/%02x", Modes.globe_history_dir, tstring, i);
             if (mkdir(filename, 0755) && errno != EEXIST)
                 perror(filename);
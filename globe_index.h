@@ -20,15 +20,29 @@ void checkNewDay();
 ssize_t check_write(int fd, const void *buf, size_t count, const char *error_context);
 int globe_index(double lat_in, double lon_in);
 int globe_index_index(int index);
+int globeAdaptiveUpdate();
+int globeAdaptiveCount();
+int globeAdaptiveRetired(int index, uint64_t now);
+int globeAdaptiveTile(int index, double *south, double *west, double *north, double *east);
 void init_globe_index(struct tile *s_tiles);
 //void write_trace(struct aircraft *a, uint64_t now);
-void *load_state(void *arg);
-void *load_blobs(void *arg);
+void trace_ranges(struct trace_view *v, uint64_t now, int *start24, int *start_recent);
+void legsReset(struct aircraft *a);
+void legsUpdate(struct aircraft *a);
+void legsDrop(struct aircraft *a, int points);
+int legsSorted(struct aircraft *a, uint64_t *ts);
+void load_state_all(int threads);
 void *save_state(void *arg);
-void save_blob(int blob);
+// returns -1 if the blob couldn't be written, the old one is kept then
+int save_blob(int blob);
 void *jsonTraceThreadEntryPoint(void *arg);
+void traceQueueInit(int threads);
+void traceQueueCleanup();
+void traceQueue(struct aircraft *a, uint64_t now);
+uint64_t traceQueueLength();
 
 void handleHeatmap();
+void heatmapCleanup();
 
 void unlink_trace(struct aircraft *a);
 
@@ -36,6 +50,7 @@ struct craftArray {
     struct aircraft **list;
     int len; // index of highest entry + 1
     int alloc; // memory allocated for aircraft pointers
+    pthread_mutex_t mutex; // ca_add / ca_remove vs. readers on other threads
 };
 
 
@@ -43,6 +58,7 @@ void ca_init (struct craftArray *ca);
 void ca_destroy (struct craftArray *ca);
 void ca_remove (struct craftArray *ca, struct aircraft *a);
 void ca_add (struct craftArray *ca, struct aircraft *a);
+struct aircraft **ca_copy (struct craftArray *ca, int *len);
 void set_globe_index (struct aircraft *a, int new_index);
 
 // this format is fixed, don't change.
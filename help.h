@@ -69,14 +69,20 @@ static struct argp_option options[] =
     {"write-prom", OptPromFile, "<filepath>", 0, "Periodically write prometheus output to <filepath>", 1},
     {"write-globe-history", OptGlobeHistoryDir, "<dir>", 0, "Extended Globe History", 1},
     {"write-state", OptStateDir, "<dir>", 0, "Write state to disk to have traces after a restart", 1},
+    {"state-wal", OptStateWal, 0, 0, "Log trace points and aircraft changes to the state directory as they happen, a crash only loses seconds (the state blobs are written less often)", 1},
+    {"history-packs", OptHistoryPacks, 0, 0, "Write the traces of each day in globe history to 256 pack files with an index instead of one file per aircraft (read them with oneoff/tracepack)", 1},
     {"heatmap-dir", OptHeatmapDir, "<dir>", 0, "Change the directory where heatmaps are saved (default is in globe history dir)", 1},
     {"heatmap", OptHeatmap, "<interval in seconds>", 0, "Make Heatmap, each aircraft at most every interval seconds (creates historydir/heatmap.bin and exit after that)", 1},
     {"write-json-every", OptJsonTime, "<t>", 0, "Write json output every t seconds (default 1)", 1},
     {"json-location-accuracy", OptJsonLocAcc , "<n>", 0, "Accuracy of receiver location in json metadata: 0=no location, 1=approximate, 2=exact", 1},
     {"write-json-globe-index", OptJsonGlobeIndex, 0, 0, "Write specially indexed globe_xxxx.json files (for tar1090)", 1},
+    {"globe-adaptive", OptGlobeAdaptive, "<aircraft>", 0, "Split globe tiles holding more than <aircraft> down to 1.25 degrees instead of using the fixed special tiles, the layout is written to globe_tiles.json", 1},
     {"write-receiver-id-json", OptNetReceiverIdJson, 0, 0, "Write receivers.json", 1},
     {"json-trace-interval", OptJsonTraceInt, "<seconds>", 0, "Interval after which a new position will guaranteed to be written to the trace and the json position output (default: 30)", 1},
     {"write-json-gzip", OptJsonGzip, 0, 0, "Write aircraft.json also as aircraft.json.gz", 1},
+    {"compression-levels", OptCompressionLevels, "<class=level,...>", 0, "gzip level 0-9 per file class: json, globe_bin, globe_json, trace_recent, trace_full, history, state, heatmap, http, net (defaults: 3,5,3,1,7,9,1,9,3,3)", 1},
+    {"trace-threads", OptTraceThreads, "<n>", 0, "Threads writing trace files (default: one per core, max 16)", 1},
+    {"compress-traces", OptCompressTraces, 0, 0, "Keep older trace points delta encoded in memory (less memory, more CPU for writing traces)", 1},
     {"json-reliable", OptJsonReliable,"<n>", 0, "Minimum position reliability to put it into json (default: 1, globe options will default set this to 2, disable speed filter: -1, max: 4)", 1},
 #endif
     {0,0,0,0, "Network options:", 2},
@@ -95,16 +101,22 @@ static struct argp_option options[] =
     {"net-vrs-port", OptNetVRSPorts, "<ports>", 0, "TCP VRS json output listen ports (default: 0)", 2},
     {"net-vrs-interval", OptNetVRSInterval, "<seconds>", 0, "TCP VRS json output interval (default: 5)", 2},
     {"net-json-port", OptNetJsonPorts, "<ports>", 0, "TCP json position output listen ports (requires --write-json-globe-index) (default: 0)", 2},
-    {"net-api-port", OptNetApiPorts, "<ports>", 0, "TCP API listen port (only for exactly one client, needs an external wrapper program communicating via this port) (work in progress) (default: 0)", 2},
+    {"net-api-port", OptNetApiPorts, "<ports>", 0, "TCP API listen port, line based queries: box <latMin> <latMax> <lonMin> <lonMax>, circle <lat> <lon> <nmi>, hex <hex>[,<hex>...], callsign <prefix>; append bin for binCraft instead of json (default: 0)", 2},
+    {"net-http-port", OptNetHttpPorts, "<ports>", 0, "HTTP listen port serving aircraft.json, stats.json, receiver.json, globe tiles and traces from memory, Prometheus metrics at /metrics (default: 0)", 2},
     {"net-beast-reduce-out-port", OptNetBeastReducePorts, "<ports>", 0, "TCP BeastReduce output listen ports (default: 0)", 2},
     {"net-beast-reduce-interval", OptNetBeastReduceInterval, "<seconds>", 0, "BeastReduce position update interval, longer means less data (default: 0.125, valid range: 0.000 - 14.999)", 2},
+    {"net-beast-reduce-tiers", OptNetBeastReduceTiers, "<seconds,...>", 0, "Additional BeastReduce tiers with longer intervals (up to 7, e.g. 0.5,2,10), a client picks one by sending \"REDUCE <seconds>\" or with reduce=<seconds> on a connector, CPR positions are still forwarded at least every 7 seconds", 2},
     {"net-receiver-id", OptNetReceiverId, 0, 0, "forward receiver ID", 2},
     {"net-ingest", OptNetIngest, 0, 0, "primary ingest node", 2},
     {"net-garbage", OptGarbage, "<ports>", 0, "timeout receivers, output messages from timed out receivers as beast on <ports>", 2},
     {"uuid-file", OptUuidFile, "<path>", 0, "path to UUID file", 2},
     {"net-ro-size", OptNetRoSize, "<size>", 0, "TCP output flush size (maximum amount of internally buffered data before writing to network) (default: 1200)", 2},
     {"net-ro-interval", OptNetRoIntervall, "<rate>", 0, "TCP output flush interval in seconds (maximum interval between two network writes of accumulated data)(default: 0.05, valid values 0.005 - 1.0)", 2},
-    {"net-connector", OptNetConnector, "<ip,port,protocol>", 0, "Establish connection, can be specified multiple times (e.g. 127.0.0.1,23004,beast_out) Protocols: beast_out, beast_in, raw_out, raw_in, sbs_out, vrs_out, json_out (one failover ip/address (same port) can be specified: primary-address,port,protocol,failover-address)", 2},
+    {"net-connector", OptNetConnector, "<ip,port,protocol>", 0, "Establish connection, can be specified multiple times (e.g. 127.0.0.1,23004,beast_out) Protocols: beast_out, beast_in, raw_out, raw_in, sbs_out, vrs_out, json_out (one failover ip/address (same port) can be specified: primary-address,port,protocol,failover-address) (beast_out, sbs_out and json_out take filter=<spec> as an additional field, see outfilter.h, beast_reduce_out takes reduce=<seconds>, beast_out, beast_reduce_out and beast_in take compress for a zlib compressed connection, the other side has to be a readsb that supports it)", 2},
+    {"net-beast-udp-out", OptNetBeastUdpOut, "<host,port>", 0, "Send beast output as UDP datagrams to host (unicast or multicast group), can be specified multiple times, optional third field ttl=<hops> for multicast (see BEAST_UDP_MAGIC in net_io.h)", 2},
+    {"net-beast-udp-in", OptNetBeastUdpIn, "<ports>", 0, "UDP Beast input ports, datagrams as sent by --net-beast-udp-out, the sender id is the receiverId (default: none)", 2},
+    {"net-shm", OptNetShm, "<name>", 0, "Publish beast frames and positions to the POSIX shared memory ring <name> for consumers on the same host, optional fields: size=<MiB> (default: 16), beast, positions (default: both) (see shmring.h, oneoff/shmcat reads it), the name must be unique per readsb instance", 2},
+    {"net-udp-size", OptNetUdpSize, "<bytes>", 0, "UDP datagram size including the header, larger datagrams are dropped on input (default: 1400, valid range: 256 - 65000)", 2},
     {"net-connector-delay", OptNetConnectorDelay, "<seconds>", 0, "Outbound re-connection delay (default: 30)", 2},
     {"net-heartbeat", OptNetHeartbeat, "<rate>", 0, "TCP heartbeat rate in seconds (default: 60 sec; 0 to disable)", 2},
     {"net-buffer", OptNetBuffer, "<n>", 0, "TCP buffer size 64Kb * (2^n) (default: n=2, 256Kb)", 2},
@@ -78,6 +78,9 @@
 
 static int handleApiRequest(struct client *c, char *p, int remote, uint64_t now);
 static int handleBeastCommand(struct client *c, char *p, int remote, uint64_t now);
+static int handleHTTPRequest(struct client *c, char *p, int remote, uint64_t now);
+static void httpCacheCleanup();
+static void modesCloseClient(struct client *c);
 static int decodeBinMessage(struct client *c, char *p, int remote, uint64_t now);
 static int decodeHexMessage(struct client *c, char *hex, int remote, uint64_t now);
 static int decodeSbsLine(struct client *c, char *line, int remote, uint64_t now);
@@ -103,7 +106,18 @@ static int hexDigitVal(int c);
 static void *pthreadGetaddrinfo(void *param);
 
 static char *sprintAircraftObject(char *p, char *end, struct aircraft *a, uint64_t now, int printMode);
+static int clientAppend(struct client *c, const char *data, int len);
+static int clientSend(struct client *c, const char *data, int len);
+static void clientDeflateStart(struct client *c);
+static void clientCompressFree(struct client *c);
+static void udpOutInit(struct net_service *service);
+static void udpOutCleanup();
+static void shmBeastOutput(struct modesMessage *mm);
+static void udpInInit(struct net_service *service);
+static void udpRead(struct client *c);
 static void flushClient(struct client *c, uint64_t now);
+static void writerMeasureLatency(struct net_writer *writer, latency_type_t type);
+static void writerFilterable(struct net_writer *writer);
 static void read_uuid(struct client *c, char *p, char *eod);
 
 //
@@ -112,6 +126,47 @@ static void read_uuid(struct client *c, char *p, char *eod);
 // Networking "stack" initialization
 //
 
+static const char *clientClassNames[CLIENT_CLASSES] = { "feeder", "request", "full", "reduced", "filtered" };
+
+const char *clientClassName(int cls) {
+    if (cls < 0 || cls >= CLIENT_CLASSES)
+        return "unknown";
+    return clientClassNames[cls];
+}
+
+// what a client does with us, the reduce tier and filter group can change while it is connected
+int clientClass(struct client *c) {
+    struct net_service *s = c->service;
+    if (!s->writer)
+        return s->read_handler == handleHTTPRequest ? CLIENT_REQUEST : CLIENT_FEEDER;
+    if (s->writer == &Modes.api_out)
+        return CLIENT_REQUEST;
+    if (s->writer->reduceTiers)
+        return CLIENT_REDUCED;
+    if (c->filter)
+        return CLIENT_FILTERED;
+    return CLIENT_FULL;
+}
+
+// TCP inputs are set up, they are read by ingestClients()
+int netFeedersConfigured() {
+    for (struct net_service *s = Modes.services; s; s = s->next) {
+        if (!s->writer && s->read_handler && s->read_handler != handleHTTPRequest && !s->udp
+                && (s->listener_count || s->pusher_count || s->connections))
+            return 1;
+    }
+    return 0;
+}
+
+// outputs that degrade slow clients (LAG_*) are set up
+int netLagConfigured() {
+    for (struct net_service *s = Modes.services; s; s = s->next) {
+        if (s->writer && s->writer->filterMasks && (s->listener_count || s->pusher_count || s->connections))
+            return 1;
+    }
+    return 0;
+}
+
 // Init a service with the given read/write characteristics, return the new service.
 // Doesn't arrange for the service to listen or connect
 struct net_service *serviceInit(const char *descr, struct net_writer *writer, heartbeat_fn hb, read_mode_t mode, const char *sep, read_fn handler) {
@@ -153,11 +208,60 @@ struct net_service *serviceInit(const char *descr, struct net_writer *writer, he
         service->writer->lastWrite = mstime();
         service->writer->send_heartbeat = hb;
         service->writer->lastReceiverId = 0;
+        service->writer->latencyCount = 0;
     }
 
     return service;
 }
 
+// Record the time messages spend waiting in this writer before
+// flushWrites hands them to the clients
+static void writerMeasureLatency(struct net_writer *writer, latency_type_t type) {
+    if (!writer->latencyStamps) {
+        // smallest message is a 11 byte mode A/C beast frame
+        if (!(writer->latencyStamps = malloc(MODES_OUT_BUF_SIZE / 11 * sizeof(uint64_t)))) {
+            fprintf(stderr, "Out of memory allocating latency buffer for service %s\n", writer->service->descr);
+            exit(1);
+        }
+    }
+    writer->latencyType = type;
+    writer->latencyCount = 0;
+}
+
+// keep the output filter mask and flags of every message so flushWrites() can filter per client
+static void writerFilterable(struct net_writer *writer) {
+    if (!writer->filterMasks) {
+        writer->filterMasks = malloc(MODES_OUT_BUF_SIZE / 11 * sizeof(uint64_t));
+        writer->filterEnds = malloc(MODES_OUT_BUF_SIZE / 11 * sizeof(int));
+        writer->filterFlags = malloc(MODES_OUT_BUF_SIZE / 11);
+        writer->filterRids = malloc(MODES_OUT_BUF_SIZE / 11 * sizeof(uint64_t));
+        if (!writer->filterMasks || !writer->filterEnds || !writer->filterFlags || !writer->filterRids) {
+            fprintf(stderr, "Out of memory allocating filter buffer for service %s\n", writer->service->descr);
+            exit(1);
+        }
+    }
+    writer->filterCount = 0;
+}
+
+// the tier with the interval closest to the one a client asked for
+static int beastReduceTier(double seconds) {
+    int best = 0;
+    double bestDiff = fabs(Modes.net_output_beast_reduce_interval - 1000 * seconds);
+    for (int k = 1; k < Modes.beast_reduce_tier_count; k++) {
+        double diff = fabs(Modes.beast_reduce_tiers[k - 1] - 1000 * seconds);
+        if (diff < bestDiff) {
+            best = k;
+            bestDiff = diff;
+        }
+    }
+    return best;
+}
+
+static inline void writerMarkLatency(struct net_writer *writer, struct modesMessage *mm) {
+    if (writer->latencyStamps && mm->sysMicros && writer->latencyCount < MODES_OUT_BUF_SIZE / 11)
+        writer->latencyStamps[writer->latencyCount++] = mm->sysMicros;
+}
+
 // Create a client attached to the given service using the provided socket FD
 struct client *createSocketClient(struct net_service *service, int fd) {
     anetSetSendBuffer(Modes.aneterr, fd, (MODES_NET_SNDBUF_SIZE << Modes.net_sndbuf_size));
@@ -315,26 +419,39 @@ struct client *checkServiceConnected(struct net_connector *con) {
     con->lastConnect = mstime();
     c->con = con;
 
+    if (con->filter) {
+        int group = outFilterAcquire(con->filter, 1);
+        if (group < 0) {
+            // never fall back to the unfiltered stream
+            fprintf(stderr, "%s: No output filter for %s port %s, retrying later: %s\n",
+                    con->service->descr, con->address, con->port, con->filter);
+            modesCloseClient(c);
+            con->next_reconnect = mstime() + Modes.net_connector_delay;
+            return NULL;
+        }
+        c->filter = group + 1;
+    }
+    if (con->reduce)
+        c->reduce_tier = beastReduceTier(atof(con->reduce));
+    if (con->compress) {
+        clientAppend(c, COMPRESS_LINE, COMPRESS_LINE_LEN);
+        if (c->service->writer)
+            clientDeflateStart(c);
+    }
+
     fprintf(stderr, "%s: Connection established: %s%s port %s\n",
             con->service->descr, con->address, con->resolved_addr, con->port);
 
     // sending UUID if hostname matches adsbexchange
-    if (c->sendq && strstr(con->address, "feed.adsbexchange.com")) {
-        char buf[130];
-        unsigned char *sendq = c->sendq;
-        sendq[0] = 0x1A;
-        sendq[1] = 0xE4;
+    if (c->service->writer && strstr(con->address, "feed.adsbexchange.com")) {
+        char uuid[130];
+        uuid[0] = 0x1A;
+        uuid[1] = 0xE4;
         int fd = open(Modes.uuidFile, O_RDONLY);
-        int res = (fd != -1) ? read(fd, c->sendq + 2, 128) : -1;
+        int res = (fd != -1) ? read(fd, uuid + 2, 128) : -1;
         if (res >= 16) {
-            if (res < 130)
-                buf[res] = '\0';
-            else
-                buf[129] = '\0';
-            strncpy(buf, c->sendq + 2, res);
-            fprintf(stderr, "UUID: %s\n", buf);
-            c->sendq_len = res + 2;
-            flushClient(c, mstime());
+            fprintf(stderr, "UUID: %.*s\n", res, uuid + 2);
+            clientSend(c, uuid, res + 2);
         } else {
             fprintf(stderr, "ERROR: Not a valid UUID: %s\n", Modes.uuidFile);
             fprintf(stderr, "Use this command to fix: sudo uuidgen > %s\n", Modes.uuidFile);
@@ -343,6 +460,8 @@ struct client *checkServiceConnected(struct net_connector *con) {
             close(fd);
         }
     }
+    if (c->sendq_len)
+        flushClient(c, mstime());
 
     return c;
 }
@@ -538,14 +657,34 @@ void modesInitNet(void) {
     api_out = serviceInit("API output", &Modes.api_out, NULL, READ_MODE_ASCII, "\n", handleApiRequest);
     serviceListen(api_out, Modes.net_bind_address, Modes.net_output_api_ports);
 
+    if (Modes.net_http) {
+        s = serviceInit("HTTP server", NULL, NULL, READ_MODE_ASCII, "\r\n\r\n", handleHTTPRequest);
+        serviceListen(s, Modes.net_bind_address, Modes.net_http_ports);
+    }
+
     raw_out = serviceInit("Raw TCP output", &Modes.raw_out, send_raw_heartbeat, READ_MODE_IGNORE, NULL, NULL);
     serviceListen(raw_out, Modes.net_bind_address, Modes.net_output_raw_ports);
 
     beast_out = serviceInit("Beast TCP output", &Modes.beast_out, send_beast_heartbeat, READ_MODE_BEAST_COMMAND, NULL, handleBeastCommand);
     serviceListen(beast_out, Modes.net_bind_address, Modes.net_output_beast_ports);
+    writerMeasureLatency(&Modes.beast_out, LATENCY_BEAST_OUT);
+    writerFilterable(&Modes.beast_out);
 
     beast_reduce_out = serviceInit("BeastReduce TCP output", &Modes.beast_reduce_out, send_beast_heartbeat, READ_MODE_IGNORE, NULL, NULL);
     serviceListen(beast_reduce_out, Modes.net_bind_address, Modes.net_output_beast_reduce_ports);
+    writerFilterable(&Modes.beast_reduce_out);
+    Modes.beast_reduce_out.reduceTiers = 1;
+
+    struct net_service *beast_udp_out = serviceInit("Beast UDP output", &Modes.beast_udp_out, send_beast_heartbeat, READ_MODE_IGNORE, NULL, NULL);
+    writerFilterable(&Modes.beast_udp_out);
+    Modes.beast_udp_out.udp = 1;
+    udpOutInit(beast_udp_out);
+
+    if (Modes.net_shm) {
+        Modes.shm = shmRingCreate(Modes.net_shm, Modes.net_shm_size);
+        if (!Modes.shm)
+            exit(1);
+    }
 
     garbage_out = serviceInit("Garbage TCP output", &Modes.garbage_out, send_beast_heartbeat, READ_MODE_IGNORE, NULL, NULL);
     serviceListen(garbage_out, Modes.net_bind_address, Modes.garbage_ports);
@@ -555,9 +694,12 @@ void modesInitNet(void) {
 
     json_out = serviceInit("Position json output", &Modes.json_out, NULL, READ_MODE_IGNORE, NULL, NULL);
     serviceListen(json_out, Modes.net_bind_address, Modes.net_output_json_ports);
+    writerFilterable(&Modes.json_out);
 
     sbs_out = serviceInit("Basestation TCP output", &Modes.sbs_out, send_sbs_heartbeat, READ_MODE_IGNORE, NULL, NULL);
     serviceListen(sbs_out, Modes.net_bind_address, Modes.net_output_sbs_ports);
+    writerMeasureLatency(&Modes.sbs_out, LATENCY_SBS_OUT);
+    writerFilterable(&Modes.sbs_out);
 
     sbs_out_replay = serviceInit("Basestation TCP output replay SBS IN", &Modes.sbs_out_replay, send_sbs_heartbeat, READ_MODE_IGNORE, NULL, NULL);
     sbs_out_prio = serviceInit("Basestation TCP output PRIO", &Modes.sbs_out_prio, send_sbs_heartbeat, READ_MODE_IGNORE, NULL, NULL);
@@ -619,6 +761,12 @@ void modesInitNet(void) {
     beast_in = makeBeastInputService();
     serviceListen(beast_in, Modes.net_bind_address, Modes.net_input_beast_ports);
 
+    if (Modes.net_beast_udp_in_ports) {
+        s = serviceInit("Beast UDP input", NULL, NULL, READ_MODE_BEAST, NULL, decodeBinMessage);
+        s->udp = 1;
+        udpInInit(s);
+    }
+
     /* Beast input from local Modes-S Beast via USB */
     if (Modes.sdr_type == SDR_MODESBEAST) {
         createGenericClient(beast_in, Modes.beast_fd);
@@ -752,6 +900,9 @@ static void modesCloseClient(struct client *c) {
     c->fd = -1;
     c->service = NULL;
     c->modeac_requested = 0;
+    outFilterRelease(c->filter - 1);
+    c->filter = 0;
+    clientCompressFree(c);
     c->sendq_len = 0;
     if (c->sendq) {
         free(c->sendq);
@@ -762,6 +913,118 @@ static void modesCloseClient(struct client *c) {
         autoset_modeac();
 }
 
+static void clientLag(struct client *c, int lag, uint64_t now) {
+    if (lag == c->lag)
+        return;
+    fprintf(stderr, "%s: %s %s: %s port %s (fd %d, SendQ %d)\n", c->service->descr,
+            lag > c->lag ? "Client lagging" : "Client recovering",
+            lag == LAG_NONE ? "full stream" : (lag == LAG_REDUCED ? "reduced stream" : "positions only"),
+            c->host, c->port, c->fd, c->sendq_len);
+    c->lag = lag;
+    c->lagChanged = now;
+}
+
+// Compressed connections (COMPRESS_LINE)
+
+static void clientDeflateStart(struct client *c) {
+    c->zout = calloc(1, sizeof(z_stream));
+    if (!c->zout || deflateInit(c->zout, Modes.compress_level[ZCLASS_NET]) != Z_OK) {
+        fprintf(stderr, "%s: out of memory setting up compression\n", c->service->descr);
+        exit(1);
+    }
+}
+
+// len bytes at data were received after the COMPRESS_LINE
+static void clientInflateStart(struct client *c, const char *data, int len) {
+    c->zin = calloc(1, sizeof(z_stream));
+    c->zbuf = malloc(MODES_CLIENT_BUF_SIZE);
+    if (!c->zin || !c->zbuf || inflateInit(c->zin) != Z_OK) {
+        fprintf(stderr, "%s: out of memory setting up decompression\n", c->service->descr);
+        exit(1);
+    }
+    memcpy(c->zbuf, data, len);
+    c->zin->next_in = (Bytef *) c->zbuf;
+    c->zin->avail_in = len;
+    c->zinWire += len;
+    Modes.stats_current.net_inflate_in += len;
+}
+
+static void clientCompressFree(struct client *c) {
+    if (c->zin) {
+        inflateEnd(c->zin);
+        free(c->zin);
+        c->zin = NULL;
+    }
+    if (c->zout) {
+        deflateEnd(c->zout);
+        free(c->zout);
+        c->zout = NULL;
+    }
+    free(c->zbuf);
+    c->zbuf = NULL;
+}
+
+// Compress len bytes to the end of the SendQ and sync flush, -1 if that doesn't fit
+static int clientDeflate(struct client *c, const char *data, int len) {
+    z_stream *z = c->zout;
+    struct timespec start, cpu = { 0, 0 };
+    if (!len)
+        return 0;
+    start_cpu_timing(&start);
+    z->next_in = (Bytef *) data;
+    z->avail_in = len;
+    z->next_out = (Bytef *) c->sendq + c->sendq_len;
+    z->avail_out = c->sendq_max - c->sendq_len;
+    int res = deflate(z, Z_SYNC_FLUSH);
+    int out = c->sendq_max - c->sendq_len - z->avail_out;
+    end_cpu_timing(&start, &cpu);
+    // no space left: the flush might not be complete
+    if (res != Z_OK || z->avail_in || !z->avail_out)
+        return -1;
+    if (c->sendq_len == 0)
+        c->last_flush = mstime();
+    c->sendq_len += out;
+    c->zoutPlain += len;
+    c->zoutWire += out;
+    zAccount(ZCLASS_NET, len, out, &cpu);
+    return 0;
+}
+
+static int clientSend(struct client *c, const char *data, int len) {
+    return c->zout ? clientDeflate(c, data, len) : clientAppend(c, data, len);
+}
+
+// Works like read(), fails with EAGAIN if the data received so far doesn't complete
+// any output yet and with EBADMSG if the stream is corrupt.
+static int clientInflate(struct client *c, char *buf, int len) {
+    z_stream *z = c->zin;
+    if (!z->avail_in) {
+        int n = recv(c->fd, c->zbuf, MODES_CLIENT_BUF_SIZE, 0);
+        if (n <= 0)
+            return n;
+        c->zinWire += n;
+        Modes.stats_current.net_inflate_in += n;
+        z->next_in = (Bytef *) c->zbuf;
+        z->avail_in = n;
+    }
+    z->next_out = (Bytef *) buf;
+    z->avail_out = len;
+    int res = inflate(z, Z_SYNC_FLUSH);
+    // the peer never ends the stream, Z_STREAM_END is an error as well
+    if (res != Z_OK && res != Z_BUF_ERROR) {
+        errno = EBADMSG;
+        return -1;
+    }
+    int out = len - z->avail_out;
+    if (!out) {
+        errno = EAGAIN;
+        return -1;
+    }
+    c->zinPlain += out;
+    Modes.stats_current.net_inflate_out += out;
+    return out;
+}
+
 static void flushClient(struct client *c, uint64_t now) {
 
     int towrite = c->sendq_len;
@@ -804,6 +1067,9 @@ static void flushClient(struct client *c, uint64_t now) {
     } while (!done && (loops < max_loops));
 
     if (total_nwritten > 0) {
+        c->service->bytesOut += total_nwritten;
+        c->service->bytesOutClass[clientClass(c)] += total_nwritten;
+        c->bytesSent += total_nwritten;
         c->last_send = now;	// If we wrote anything, update this.
         if (total_nwritten == c->sendq_len) {
             c->sendq_len = 0;
@@ -814,30 +1080,306 @@ static void flushClient(struct client *c, uint64_t now) {
         c->last_flush = now;
     }
 
-    // If writing has failed for 5 seconds, disconnect.
-    if (c->last_flush + 5000 < now) {
+    if (c->sendq_len == 0 && c->closeWhenFlushed) {
+        modesCloseClient(c);
+        return;
+    }
+
+    // If writing has failed for 5 seconds, degrade the stream or disconnect.
+    if (c->last_flush + 5000 < now && c->service->writer && c->service->writer->filterMasks && c->lag < LAG_POSITIONS) {
+        clientLag(c, c->lag + 1, now);
+        c->last_flush = now;
+    } else if (c->last_flush + 5000 < now) {
         fprintf(stderr, "%s: Unable to send data, disconnecting: %s port %s (fd %d, SendQ %d)\n", c->service->descr, c->host, c->port, c->fd, c->sendq_len);
         modesCloseClient(c);
     }
 }
 
+// Beast over UDP (BEAST_UDP_MAGIC)
+
+static struct {
+    char *buf; // the datagrams of one flush, back to back
+    struct iovec *iov;
+    struct mmsghdr *msgs;
+    uint32_t seq;
+    uint64_t senderId;
+    char rid[18]; // receiverId frame in effect
+    int ridLen;
+} udpOut;
+
+// length of the receiverId frame starting a message, 0 if there is none
+static int beastReceiverIdLen(const unsigned char *p, int len) {
+    if (len < 10 || p[0] != 0x1a || p[1] != 0xe3)
+        return 0;
+    int i = 2;
+    for (int j = 0; j < 8 && i < len; j++)
+        i += (p[i] == 0x1a) ? 2 : 1;
+    return i <= len ? i : 0;
+}
+
+// 0x1a 0xe3 and the escaped receiverId, big-endian, returns the end of the frame
+static char *beastReceiverIdFrame(char *p, uint64_t receiverId) {
+    unsigned char ch;
+    *p++ = 0x1a;
+    // other dump1090 / readsb versions or beast implementations should discard unknown message types
+    *p++ = 0xe3; // good enough guess no one is using this.
+    for (int i = 7; i >= 0; i--) {
+        *p++ = (ch = ((receiverId >> (8 * i)) & 0xFF));
+        if (0x1A == ch) {
+            *p++ = ch;
+        }
+    }
+    return p;
+}
+
+static char *udpHeader(char *p, uint32_t seq, uint64_t senderId) {
+    uint32_t magic = BEAST_UDP_MAGIC;
+    for (int i = 3; i >= 0; i--)
+        *p++ = magic >> (8 * i);
+    for (int i = 3; i >= 0; i--)
+        *p++ = seq >> (8 * i);
+    for (int i = 7; i >= 0; i--)
+        *p++ = senderId >> (8 * i);
+    return p;
+}
+
+// Split the writer buffer into datagrams at message boundaries, returns their number
+static int udpPack(struct net_writer *writer) {
+    int count = 0;
+    int start = 0;
+    char *p = udpOut.buf;
+    char *dg = NULL;
+
+    for (int i = 0; i < writer->filterCount; i++) {
+        const char *msg = (char *) writer->data + start;
+        int len = writer->filterEnds[i] - start;
+        start = writer->filterEnds[i];
+
+        int ridLen = beastReceiverIdLen((const unsigned char *) msg, len);
+        if (ridLen) {
+            memcpy(udpOut.rid, msg, ridLen);
+            udpOut.ridLen = ridLen;
+        }
+        if (!dg || (p - dg) + len > Modes.net_udp_size) {
+            if (dg)
+                udpOut.iov[count - 1].iov_len = p - dg;
+            dg = p;
+            p = udpHeader(p, udpOut.seq++, udpOut.senderId);
+            udpOut.iov[count++].iov_base = dg;
+            if (!ridLen && udpOut.ridLen) {
+                memcpy(p, udpOut.rid, udpOut.ridLen);
+                p += udpOut.ridLen;
+            }
+        }
+        memcpy(p, msg, len);
+        p += len;
+    }
+    if (dg)
+        udpOut.iov[count - 1].iov_len = p - dg;
+    return count;
+}
+
+static void udpSend(struct client *c, int count, uint64_t now) {
+    int sent = 0;
+    while (sent < count) {
+        int res = sendmmsg(c->fd, udpOut.msgs + sent, count - sent, 0);
+        if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)) {
+            // socket buffer full, the rest is lost
+            Modes.stats_current.udp_out_dropped += count - sent;
+            break;
+        }
+        if (res < 0) {
+            // error from an earlier datagram (ECONNREFUSED) or this one, go on with the next
+            Modes.stats_current.udp_out_dropped++;
+            sent++;
+            continue;
+        }
+        for (int i = sent; i < sent + res; i++) {
+            c->bytesSent += udpOut.iov[i].iov_len;
+            c->service->bytesOut += udpOut.iov[i].iov_len;
+            c->service->bytesOutClass[CLIENT_FULL] += udpOut.iov[i].iov_len;
+        }
+        Modes.stats_current.udp_out_datagrams += res;
+        sent += res;
+    }
+    c->last_send = now;
+    c->last_flush = now;
+}
+
+// one client per destination, the datagrams of a flush are sent to each of them
+static void udpOutInit(struct net_service *service) {
+    int max = MODES_OUT_BUF_SIZE / 11;
+    udpOut.buf = malloc(MODES_OUT_BUF_SIZE + max * (BEAST_UDP_HEADER_LEN + sizeof(udpOut.rid)));
+    udpOut.iov = calloc(max, sizeof(struct iovec));
+    udpOut.msgs = calloc(max, sizeof(struct mmsghdr));
+    if (!udpOut.buf || !udpOut.iov || !udpOut.msgs) {
+        fprintf(stderr, "Out of memory allocating UDP output buffers\n");
+        exit(1);
+    }
+    for (int i = 0; i < max; i++) {
+        udpOut.msgs[i].msg_hdr.msg_iov = &udpOut.iov[i];
+        udpOut.msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    udpOut.senderId = ((uint64_t) random() << 33) ^ ((uint64_t) random() << 11) ^ random();
+
+    for (int i = 0; i < Modes.net_beast_udp_out_count; i++) {
+        char *spec = strdup(Modes.net_beast_udp_out[i]);
+        char *host = strtok(spec, ",");
+        char *port = strtok(NULL, ",");
+        char *ttl = strtok(NULL, ",");
+        if (!host || !port || (ttl && strncmp(ttl, "ttl=", 4))) {
+            fprintf(stderr, "--net-beast-udp-out: Wrong format: %s\n", Modes.net_beast_udp_out[i]);
+            fprintf(stderr, "Correct syntax: --net-beast-udp-out=host,port[,ttl=<hops>]\n");
+            exit(1);
+        }
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM };
+        struct addrinfo *res;
+        int err = getaddrinfo(host, port, &hints, &res);
+        if (err) {
+            fprintf(stderr, "--net-beast-udp-out: %s port %s: %s\n", host, port, gai_strerror(err));
+            exit(1);
+        }
+        int fd = socket(res->ai_family, SOCK_DGRAM, 0);
+        if (fd < 0 || connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+            fprintf(stderr, "--net-beast-udp-out: %s port %s: %s\n", host, port, strerror(errno));
+            exit(1);
+        }
+        if (ttl) {
+            int hops = atoi(ttl + 4);
+            if (res->ai_family == AF_INET6)
+                setsockopt(fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops));
+            else
+                setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &hops, sizeof(hops));
+        }
+        freeaddrinfo(res);
+
+        struct client *c = createSocketClient(service, fd);
+        strncpy(c->host, host, sizeof(c->host) - 1);
+        strncpy(c->port, port, sizeof(c->port) - 1);
+        fprintf(stderr, "%s: sending to %s port %s\n", service->descr, host, port);
+        free(spec);
+    }
+}
+
+static void udpOutCleanup() {
+    free(udpOut.buf);
+    free(udpOut.iov);
+    free(udpOut.msgs);
+    for (int i = 0; i < Modes.net_beast_udp_out_count; i++)
+        free(Modes.net_beast_udp_out[i]);
+    free(Modes.net_beast_udp_out);
+    Modes.net_beast_udp_out_count = 0;
+}
+
 //
 //=========================================================================
 //
 // Send the write buffer for the specified writer to all connected clients
 //
+static int beastReceiverIdFrameLen(uint64_t receiverId) {
+    int len = 10;
+    for (int i = 0; i < 8; i++)
+        len += ((receiverId >> (8 * i)) & 0xFF) == 0x1A;
+    return len;
+}
+
+// What client c gets of the writer buffer: the messages passing its filter group / in its
+// reduce tier and only those a lagging client still gets.  The receiverId frame of the
+// writer is only in front of the message the id changed at, the client gets its own
+// frame whenever the id changes for it.  With out NULL only the length is returned.
+static int clientSelect(struct net_writer *writer, struct client *c, char *out) {
+    uint64_t bit = 0;
+    if (writer->reduceTiers && Modes.beast_reduce_tier_count > 1)
+        bit = 1ULL << c->reduce_tier;
+    else if (c->filter && !writer->reduceTiers)
+        bit = 1ULL << (c->filter - 1);
+    uint8_t flags = 0;
+    if (c->lag >= LAG_REDUCED)
+        flags |= WRITE_REDUCED;
+    if (c->lag >= LAG_POSITIONS)
+        flags |= WRITE_POSITION;
+
+    if (!writer->filterMasks || !(bit || flags)) {
+        // the whole buffer, it has the receiverId changes of the stream
+        int len = 0;
+        if (writer->filterMasks && Modes.netReceiverId && writer->filterCount
+                && writer->filterRids[0] != c->lastReceiverId
+                && !beastReceiverIdLen(writer->data, writer->filterEnds[0])) {
+            // the client got a different part of the stream before (lag, reduce tier)
+            len = beastReceiverIdFrameLen(writer->filterRids[0]);
+            if (out)
+                beastReceiverIdFrame(out, writer->filterRids[0]);
+        }
+        if (out) {
+            memcpy(out + len, writer->data, writer->dataUsed);
+            if (writer->filterMasks && writer->filterCount)
+                c->lastReceiverId = writer->filterRids[writer->filterCount - 1];
+        }
+        return len + writer->dataUsed;
+    }
+
+    uint64_t rid = c->lastReceiverId;
+    int outLen = 0;
+    int start = 0;
+    for (int i = 0; i < writer->filterCount; i++) {
+        char *msg = (char *) writer->data + start;
+        int len = writer->filterEnds[i] - start;
+        start = writer->filterEnds[i];
+        if ((bit && !(writer->filterMasks[i] & bit)) || (writer->filterFlags[i] & flags) != flags)
+            continue;
+        if (Modes.netReceiverId) {
+            int ridLen = beastReceiverIdLen((const unsigned char *) msg, len);
+            msg += ridLen;
+            len -= ridLen;
+            if (writer->filterRids[i] != rid) {
+                rid = writer->filterRids[i];
+                if (out)
+                    beastReceiverIdFrame(out + outLen, rid);
+                outLen += beastReceiverIdFrameLen(rid);
+            }
+        }
+        if (out)
+            memcpy(out + outLen, msg, len);
+        outLen += len;
+    }
+    if (out)
+        c->lastReceiverId = rid;
+    return outLen;
+}
+
 static void flushWrites(struct net_writer *writer) {
     struct client *c;
     uint64_t now = mstime();
+    static char *zscratch; // what a compressed client gets, before compression
+
+    if (writer->udp) {
+        int count = udpPack(writer);
+        for (c = writer->service->clients; c; c = c->next) {
+            if (c->service)
+                udpSend(c, count, now);
+        }
+    }
 
-    for (c = writer->service->clients; c; c = c->next) {
+    for (c = writer->udp ? NULL : writer->service->clients; c; c = c->next) {
         if (!c->service)
             continue;
         if (c->service->writer == writer->service->writer) {
-            uintptr_t psendq_end = (uintptr_t)c->sendq + c->sendq_len; // Pointer to end of sendq
+            if (c->zout && !zscratch && !(zscratch = malloc(MODES_OUT_BUF_SIZE + BEAST_RID_FRAME_MAX))) {
+                fprintf(stderr, "Out of memory allocating the compression buffer\n");
+                exit(1);
+            }
+
+            if (writer->filterMasks) {
+                // degrade the stream as the SendQ fills up, readClients() lets it recover
+                if (c->sendq_len > c->sendq_max / 2 && c->lag < LAG_POSITIONS)
+                    clientLag(c, LAG_POSITIONS, now);
+                else if (c->sendq_len > c->sendq_max / 4 && c->lag < LAG_REDUCED)
+                    clientLag(c, LAG_REDUCED, now);
+            }
 
             // Add the buffer to the client's SendQ
-            if ((c->sendq_len + writer->dataUsed) >= c->sendq_max) {
+            int outLen = clientSelect(writer, c, NULL);
+            if ((c->sendq_len + outLen) >= c->sendq_max) {
                 // Too much data in client SendQ.  Drop client - SendQ exceeded.
                 fprintf(stderr, "%s: Dropped due to full SendQ: %s port %s (fd %d, SendQ %d, RecvQ %d)\n",
                         c->service->descr, c->host, c->port,
@@ -845,18 +1387,38 @@ static void flushWrites(struct net_writer *writer) {
                 modesCloseClient(c);
                 continue;	// Go to the next client
             }
-            // Append the data to the end of the queue, increment len
-            memcpy((void*)psendq_end, writer->data, writer->dataUsed);
-            c->sendq_len += writer->dataUsed;
+            char *out = c->zout ? zscratch : (char *) c->sendq + c->sendq_len;
+            outLen = clientSelect(writer, c, out);
+            if (!c->zout) {
+                c->sendq_len += outLen;
+            } else if (clientDeflate(c, out, outLen)) {
+                fprintf(stderr, "%s: Dropped due to full SendQ: %s port %s (fd %d, SendQ %d, RecvQ %d)\n",
+                        c->service->descr, c->host, c->port,
+                        c->fd, c->sendq_len, c->buflen);
+                modesCloseClient(c);
+                continue;
+            }
             // Try flushing...
-            flushClient(c, now);
+            if (c->sendq_len)
+                flushClient(c, now);
         }
     }
+    if (writer->latencyCount) {
+        uint64_t micros = microtime();
+        for (int i = 0; i < writer->latencyCount; i++)
+            statsLatency(writer->latencyType, micros - writer->latencyStamps[i]);
+        writer->latencyCount = 0;
+    }
     writer->dataUsed = 0;
+    writer->filterCount = 0;
     writer->lastWrite = now;
     return;
 }
 
+// output filter groups the message currently being written passes and its WRITE_* flags
+static uint64_t writeFilterMask = ~0ULL;
+static uint8_t writeFlags = WRITE_REDUCED | WRITE_POSITION;
+
 // Prepare to write up to 'len' bytes to the given net_writer.
 // Returns a pointer to write to, or NULL to skip this write.
 static void *prepareWrite(struct net_writer *writer, int len) {
@@ -883,42 +1445,31 @@ static void *prepareWrite(struct net_writer *writer, int len) {
 static void completeWrite(struct net_writer *writer, void *endptr) {
     writer->dataUsed = endptr - writer->data;
 
+    if (writer->filterMasks) {
+        writer->filterMasks[writer->filterCount] = writeFilterMask;
+        writer->filterFlags[writer->filterCount] = writeFlags;
+        writer->filterRids[writer->filterCount] = writer->lastReceiverId;
+        writer->filterEnds[writer->filterCount] = writer->dataUsed;
+        if (++writer->filterCount == MODES_OUT_BUF_SIZE / 11) {
+            flushWrites(writer);
+            return;
+        }
+    }
+
     if (writer->dataUsed >= Modes.net_output_flush_size) {
         flushWrites(writer);
     }
 }
 
-//
-//=========================================================================
-//
-// Write raw output in Beast Binary format with Timestamp to TCP clients
-//
-static void modesSendBeastOutput(struct modesMessage *mm, struct net_writer *writer) {
+// one escaped beast frame without the receiverId, returns the end of the frame
+// or NULL if the message has no beast message type
+static char *beastFrame(char *p, struct modesMessage *mm) {
     int msgLen = mm->msgbits / 8;
-    char *p = prepareWrite(writer, 2 + 2 * (7 + 8 + msgLen));
     unsigned char ch;
     int j;
     int sig;
     unsigned char *msg = (Modes.net_verbatim ? mm->verbatim : mm->msg);
 
-    if (!p)
-        return;
-
-    // receiverId, big-endian, in own message to make it backwards compatible
-    // only send the receiverId when it changes
-    if (Modes.netReceiverId && writer->lastReceiverId != mm->receiverId) {
-        writer->lastReceiverId = mm->receiverId;
-        *p++ = 0x1a;
-        // other dump1090 / readsb versions or beast implementations should discard unknown message types
-        *p++ = 0xe3; // good enough guess no one is using this.
-        for (int i = 7; i >= 0; i--) {
-            *p++ = (ch = ((mm->receiverId >> (8 * i)) & 0xFF));
-            if (0x1A == ch) {
-                *p++ = ch;
-            }
-        }
-    }
-
     *p++ = 0x1a;
     if (msgLen == MODES_SHORT_MSG_BYTES) {
         *p++ = '2';
@@ -927,7 +1478,7 @@ static void modesSendBeastOutput(struct modesMessage *mm, struct net_writer *wri
     } else if (msgLen == MODEAC_MSG_BYTES) {
         *p++ = '1';
     } else {
-        return;
+        return NULL;
     }
 
     /* timestamp, big-endian */
@@ -973,6 +1524,33 @@ static void modesSendBeastOutput(struct modesMessage *mm, struct net_writer *wri
         }
     }
 
+    return p;
+}
+
+//
+//=========================================================================
+//
+// Write raw output in Beast Binary format with Timestamp to TCP clients
+//
+static void modesSendBeastOutput(struct modesMessage *mm, struct net_writer *writer) {
+    int msgLen = mm->msgbits / 8;
+    char *p = prepareWrite(writer, 2 + 2 * (7 + 8 + msgLen));
+
+    if (!p)
+        return;
+
+    // receiverId, big-endian, in own message to make it backwards compatible
+    // only send the receiverId when it changes
+    if (Modes.netReceiverId && writer->lastReceiverId != mm->receiverId) {
+        writer->lastReceiverId = mm->receiverId;
+        p = beastReceiverIdFrame(p, mm->receiverId);
+    }
+
+    p = beastFrame(p, mm);
+    if (!p)
+        return;
+
+    writerMarkLatency(writer, mm);
     completeWrite(writer, p);
 }
 
@@ -1253,7 +1831,9 @@ static int decodeSbsLine(struct client *c, char *line, int remote, uint64_t now)
 
     // record reception time as the time we read it.
     mm.sysTimestampMsg = now;
+    mm.sysMicros = c->readMicros;
 
+    statsLatency(LATENCY_NET_READ, microtime() - mm.sysMicros);
     useModesMessage(&mm);
 
     Modes.stats_current.remote_received_basestation_valid++;
@@ -1477,6 +2057,7 @@ static void modesSendSBSOutput(struct modesMessage *mm, struct aircraft *a) {
 
     p += sprintf(p, "\r\n");
 
+    writerMarkLatency(&Modes.sbs_out, mm);
     completeWrite(&Modes.sbs_out, p);
 }
 
@@ -1505,8 +2086,60 @@ void jsonPositionOutput(struct modesMessage *mm, struct aircraft *a) {
         return;
     char *end = p + 1000;
 
+    if (Modes.outfilter_active)
+        writeFilterMask = outFilterMask(mm, a, mm->sysTimestampMsg);
+    writeFlags = WRITE_POSITION | ((mm->reduce_forward & 1) ? WRITE_REDUCED : 0);
+
     p = sprintAircraftObject(p, end, a, mm->sysTimestampMsg, 2);
     completeWrite(&Modes.json_out, p);
+    writeFilterMask = ~0ULL;
+    writeFlags = WRITE_REDUCED | WRITE_POSITION;
+}
+
+static void shmBeastOutput(struct modesMessage *mm) {
+    char buf[2 + 2 * (7 + MODES_LONG_MSG_BYTES)];
+    char *end = beastFrame(buf, mm);
+    if (!end)
+        return;
+    shmRingPublish(Modes.shm, SHM_RECORD_BEAST, mm->receiverId, buf, end - buf);
+    Modes.stats_current.shm_records++;
+    Modes.stats_current.shm_bytes += end - buf;
+}
+
+void shmPositionOutput(struct modesMessage *mm, struct aircraft *a) {
+    if (!Modes.shm || !(Modes.net_shm_types & (1 << SHM_RECORD_POSITION)))
+        return;
+
+    struct shm_position pos = {
+        .timestamp = mm->sysTimestampMsg,
+        .addr = a->addr,
+        .addrtype = a->addrtype,
+        .source = mm->source,
+        .nic = a->pos_nic,
+        .lat = a->lat,
+        .lon = a->lon,
+    };
+    if (a->pos_surface)
+        pos.flags |= SHM_POS_GROUND;
+    if (trackDataValid(&a->altitude_baro_valid)) {
+        pos.flags |= SHM_POS_ALT_BARO;
+        pos.alt_baro = a->altitude_baro;
+    }
+    if (trackDataValid(&a->altitude_geom_valid)) {
+        pos.flags |= SHM_POS_ALT_GEOM;
+        pos.alt_geom = a->altitude_geom;
+    }
+    if (trackDataValid(&a->gs_valid)) {
+        pos.flags |= SHM_POS_GS;
+        pos.gs = a->gs;
+    }
+    if (trackDataValid(&a->track_valid)) {
+        pos.flags |= SHM_POS_TRACK;
+        pos.track = a->track;
+    }
+    shmRingPublish(Modes.shm, SHM_RECORD_POSITION, 0, &pos, sizeof(pos));
+    Modes.stats_current.shm_records++;
+    Modes.stats_current.shm_bytes += sizeof(pos);
 }
 //
 //=========================================================================
@@ -1520,6 +2153,10 @@ void modesQueueOutput(struct modesMessage *mm, struct aircraft *a) {
         return;
     }
 
+    if (Modes.outfilter_active)
+        writeFilterMask = outFilterMask(mm, a, mm->sysTimestampMsg);
+    writeFlags = ((mm->reduce_forward & 1) ? WRITE_REDUCED : 0) | ((mm->cpr_valid || mm->sbs_pos_valid) ? WRITE_POSITION : 0);
+
     if (a && !is_mlat && mm->correctedbits < 2) {
         // Don't ever forward 2-bit-corrected messages via SBS output.
         // Don't ever forward mlat messages via SBS output.
@@ -1536,10 +2173,19 @@ void modesQueueOutput(struct modesMessage *mm, struct aircraft *a) {
         // Forward 2-bit-corrected messages via beast output only if --net-verbatim is set
         // Forward mlat messages via beast output only if --forward-mlat is set
         modesSendBeastOutput(mm, &Modes.beast_out);
+        modesSendBeastOutput(mm, &Modes.beast_udp_out);
+        if (Modes.shm && (Modes.net_shm_types & (1 << SHM_RECORD_BEAST)))
+            shmBeastOutput(mm);
         if (mm->reduce_forward) {
+            uint64_t mask = writeFilterMask;
+            writeFilterMask = mm->reduce_forward;
             modesSendBeastOutput(mm, &Modes.beast_reduce_out);
+            writeFilterMask = mask;
         }
     }
+
+    writeFilterMask = ~0ULL;
+    writeFlags = WRITE_REDUCED | WRITE_POSITION;
 }
 
 // Decode a little-endian IEEE754 float (binary32)
@@ -1625,44 +2271,651 @@ void sendBeastSettings(int fd, const char *settings) {
 
     anetWrite(fd, buf, len);
 }
+//
+// API requests (--net-api-port), one request per line:
+//
+//   box <latMin> <latMax> <lonMin> <lonMax> [bin]   (lonMin > lonMax crosses the antimeridian)
+//   circle <lat> <lon> <radius in nmi> [bin]
+//   hex <hex>[,<hex>...] [bin]
+//   callsign <prefix> [bin]
+//
+// The default answer is one line of json with the aircraft objects as in
+// aircraft.json.  With bin it's a frame in host byte order: uint32 length of
+// the frame after this field, uint32 status (0: ok, 1: bad request),
+// uint64 now, uint32 element size, uint32 count, count binCraft elements.
+// Bad requests in json mode get {"error": "..."}.
+//
+static int apiRespond(struct client *c, struct apiList *res, int bin, const char *error, uint64_t now) {
+    size_t buflen = 1024 + (size_t) res->len * (bin ? sizeof(struct binCraft) : 2048);
+    char *buf = malloc(buflen);
+    char *p = buf;
+    char *end = buf + buflen;
+    if (!buf)
+        return -1;
+
+#define memWrite(p, var) do { memcpy(p, &var, sizeof(var)); p += sizeof(var); } while(0)
+    if (bin) {
+        uint32_t len = 0;
+        uint32_t status = error ? 1 : 0;
+        uint32_t elementSize = sizeof(struct binCraft);
+        uint32_t count = error ? 0 : res->len;
+        memWrite(p, len);
+        memWrite(p, status);
+        memWrite(p, now);
+        memWrite(p, elementSize);
+        memWrite(p, count);
+        for (uint32_t i = 0; i < count; i++) {
+            struct binCraft bc;
+            toBinCraft(res->list[i], &bc, now);
+            memWrite(p, bc);
+        }
+        len = p - buf - sizeof(len);
+        memcpy(buf, &len, sizeof(len));
+#undef memWrite
+    } else if (error) {
+        p = safe_snprintf(p, end, "{ \"error\" : \"%s\" }\n", error);
+    } else {
+        p = safe_snprintf(p, end, "{ \"now\" : %.3f, \"resultCount\" : %d, \"aircraft\" : [", now / 1000.0, res->len);
+        for (int i = 0; i < res->len; i++) {
+            if (i)
+                *p++ = ',';
+            p = sprintAircraftObject(p, end, res->list[i], now, 0);
+        }
+        // the aircraft objects contain line breaks, the response is one line
+        for (char *s = buf; s < p; s++) {
+            if (*s == '\n')
+                *s = ' ';
+        }
+        p = safe_snprintf(p, end, "] }\n");
+    }
+
+    int ret = 0;
+    if (p >= end) {
+        fprintf(stderr, "apiRespond: buffer overrun\n");
+        ret = -1;
+    } else if (clientAppend(c, buf, p - buf)) {
+        fprintf(stderr, "%s: response too large, disconnecting: %s port %s\n", c->service->descr, c->host, c->port);
+        ret = -1;
+    }
+    free(buf);
+    return ret;
+}
+
 static int handleApiRequest(struct client *c, char *p, int remote, uint64_t now) {
+    MODES_NOTUSED(remote);
+    int64_t start = microtime();
+    char *args[8];
+    int argc = 0;
+    char *saveptr = NULL;
+    for (char *tok = strtok_r(p, " \t\r", &saveptr); tok && argc < 8; tok = strtok_r(NULL, " \t\r", &saveptr))
+        args[argc++] = tok;
+
+    if (argc == 0)
+        return 0;
+
+    int bin = 0;
+    if (argc > 1 && !strcmp(args[argc - 1], "bin")) {
+        bin = 1;
+        argc--;
+    } else if (argc > 1 && !strcmp(args[argc - 1], "json")) {
+        argc--;
+    }
+
+    struct apiList res = { 0 };
+    const char *error = NULL;
+    double v[4];
+    int numeric = 1;
+    for (int i = 1; i < argc && i <= 4; i++) {
+        char *e;
+        v[i - 1] = strtod(args[i], &e);
+        if (*e || !isfinite(v[i - 1]))
+            numeric = 0;
+    }
+
+    if (!strcmp(args[0], "box")) {
+        if (argc != 5 || !numeric || fabs(v[0]) > 90 || fabs(v[1]) > 90 || fabs(v[2]) > 180 || fabs(v[3]) > 180)
+            error = "usage: box <latMin> <latMax> <lonMin> <lonMax>";
+        else
+            apiBox(&res, v[0], v[1], v[2], v[3], now);
+    } else if (!strcmp(args[0], "circle")) {
+        if (argc != 4 || !numeric || fabs(v[0]) > 90 || fabs(v[1]) > 180 || v[2] < 0)
+            error = "usage: circle <lat> <lon> <radius in nmi>";
+        else
+            apiCircle(&res, v[0], v[1], v[2] * 1852, now);
+    } else if (!strcmp(args[0], "hex")) {
+        if (argc != 2) {
+            error = "usage: hex <hex>[,<hex>...]";
+        } else {
+            for (char *tok = strtok_r(args[1], ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr)) {
+                int nonIcao = (tok[0] == '~');
+                char *e;
+                uint32_t addr = strtoul(tok + nonIcao, &e, 16);
+                if (*e || addr > 0xFFFFFF) {
+                    error = "bad hex";
+                    break;
+                }
+                apiHex(&res, addr | (nonIcao ? MODES_NON_ICAO_ADDRESS : 0), now);
+            }
+        }
+    } else if (!strcmp(args[0], "callsign")) {
+        if (argc != 2 || strlen(args[1]) > 8) {
+            error = "usage: callsign <prefix>";
+        } else {
+            for (char *s = args[1]; *s; s++)
+                *s = toupper(*s);
+            apiCallsign(&res, args[1], now);
+        }
+    } else {
+        error = "unknown request";
+    }
+
+    int ret = apiRespond(c, &res, bin, error, now);
+    free(res.list);
+
+    statsLatency(LATENCY_API_QUERY, microtime() - start);
+
+    return ret;
+}
+
+//
+// Handle a Beast command message.
+// Currently, we just look for the Mode A/C command message
+// and ignore everything else.
+//
+static int handleBeastCommand(struct client *c, char *p, int remote, uint64_t now) {
+    return 0; // disable this in this fork, no modeac unless it's enabled via config
+    MODES_NOTUSED(remote);
     MODES_NOTUSED(now);
-    p = p;
-    remote = remote;
-    c = c;
+    if (p[0] != '1') {
+        // huh?
+        return 0;
+    }
 
-    static uint32_t scratch[3 * API_INDEX_MAX];
+    switch (p[1]) {
+        case 'j':
+            c->modeac_requested = 0;
+            break;
+        case 'J':
+            c->modeac_requested = 1;
+            break;
+    }
+
+    autoset_modeac();
+    return 0;
+}
+
+//
+//=========================================================================
+//
+// Built-in HTTP/1.1 server
+//
+// aircraft.json, receiver.json, stats.json and the globe tiles are kept in
+// memory gzip compressed (see httpCachePut), traces are generated when they
+// are requested and kept briefly (see httpTraceCache).  Responses are queued
+// on the client SendQ and written non-blocking like all other output.
+//
+
+#define HTTP_CACHE_BUCKETS 4096
+#define HTTP_MAX_SENDQ (64 * 1024 * 1024)
+
+struct http_file {
+    struct http_file *next;
+    char *name;
+    char *data; // gzip compressed content
+    int len;
+    uint64_t etag;
+};
+
+static struct http_file *httpCache[HTTP_CACHE_BUCKETS];
+static pthread_mutex_t httpCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// decompress a gzip buffer for the rare client that doesn't accept gzip
+static int gunzipBuffer(const char *in, int len, char **out) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+        return -1;
+
+    int alloc = 4 * len + 1024;
+    *out = malloc(alloc);
+    strm.next_in = (Bytef *) in;
+    strm.avail_in = len;
+
+    int res = Z_OK;
+    while (*out && res == Z_OK) {
+        strm.next_out = (Bytef *) *out + strm.total_out;
+        strm.avail_out = alloc - strm.total_out;
+        res = inflate(&strm, Z_NO_FLUSH);
+        if (res == Z_OK || (res == Z_BUF_ERROR && strm.avail_out == 0)) {
+            res = Z_OK;
+            alloc *= 2;
+            char *grown = realloc(*out, alloc);
+            if (!grown)
+                break;
+            *out = grown;
+        }
+    }
+    int outLen = strm.total_out;
+    inflateEnd(&strm);
+    if (!*out || res != Z_STREAM_END) {
+        free(*out);
+        *out = NULL;
+        return -1;
+    }
+    return outLen;
+}
+
+static inline struct http_file **httpCacheBucket(const char *name) {
+    return &httpCache[fasthash64(name, strlen(name), 0x5a3c0f2e71d4b96bULL) % HTTP_CACHE_BUCKETS];
+}
+
+static inline uint64_t httpEtag(struct char_buffer cb) {
+    return fasthash64(cb.buffer, cb.len, 0x2127599bf4325c37ULL);
+}
+
+// Keep a copy of already compressed data for the HTTP server.
+static void httpCacheStore(const char *file, const char *gzData, int len, uint64_t etag) {
+    char *data = malloc(len);
+    if (!data) {
+        fprintf(stderr, "Out of memory allocating HTTP cache entry\n");
+        exit(1);
+    }
+    memcpy(data, gzData, len);
+
+    pthread_mutex_lock(&httpCacheMutex);
+
+    struct http_file **bucket = httpCacheBucket(file);
+    struct http_file *f;
+    for (f = *bucket; f; f = f->next) {
+        if (!strcmp(f->name, file))
+            break;
+    }
+    if (!f) {
+        f = calloc(1, sizeof(struct http_file));
+        if (!f || !(f->name = strdup(file))) {
+            fprintf(stderr, "Out of memory allocating HTTP cache entry\n");
+            exit(1);
+        }
+        f->next = *bucket;
+        *bucket = f;
+    }
+    char *old = f->data;
+    f->data = data;
+    f->len = len;
+    f->etag = etag;
+
+    pthread_mutex_unlock(&httpCacheMutex);
+
+    free(old);
+}
+
+// Keep a gzip compressed copy of a generated file for the HTTP server.
+// cb is not freed.
+void httpCachePut(const char *file, struct char_buffer cb, int zclass) {
+    struct char_buffer gz;
+    if (gzipBuffer(cb.buffer, cb.len, zclass, &gz) < 0) {
+        fprintf(stderr, "httpCachePut: compressing %s failed\n", file);
+        return;
+    }
+    // gz points to the per thread compression buffer, httpCacheStore() copies it
+    httpCacheStore(file, gz.buffer, gz.len, httpEtag(cb));
+}
+
+// Generated trace json, gzip compressed.  Clients poll the same aircraft and
+// generating trace_full is expensive: an entry is reused while the trace is
+// unchanged, for at most HTTP_TRACE_TTL as the 24h / recent window moves on.
+// Only used by the decode thread.
+#define HTTP_TRACE_SLOTS 64
+#define HTTP_TRACE_TTL (5 * SECONDS)
+
+struct http_trace {
+    uint32_t addr;
+    int full;
+    int len; // trace_len when generated
+    uint64_t last; // timestamp of the newest point when generated
+    uint64_t created;
+    char *data; // NULL: slot unused
+    int dataLen;
+    uint64_t etag;
+};
 
-    //writeJsonToNet(&Modes.api_out, generateAircraftJson(-1));
-    apiReq(50, 51, 10, 11, scratch);
+static struct http_trace httpTraceCache[HTTP_TRACE_SLOTS];
 
+static void httpTraceFree(struct http_trace *t) {
+    free(t->data);
+    t->data = NULL;
+}
+
+static void httpCacheCleanup() {
+    for (int i = 0; i < HTTP_TRACE_SLOTS; i++)
+        httpTraceFree(&httpTraceCache[i]);
+    for (int i = 0; i < HTTP_CACHE_BUCKETS; i++) {
+        struct http_file *f = httpCache[i], *next;
+        while (f) {
+            next = f->next;
+            free(f->name);
+            free(f->data);
+            free(f);
+            f = next;
+        }
+        httpCache[i] = NULL;
+    }
+}
+
+// Append to the client SendQ, growing it as needed
+static int clientAppend(struct client *c, const char *data, int len) {
+    if (c->sendq_len + len > c->sendq_max) {
+        int newMax = c->sendq_max ? c->sendq_max : MODES_NET_SNDBUF_SIZE;
+        while (newMax < c->sendq_len + len)
+            newMax *= 2;
+        if (newMax > HTTP_MAX_SENDQ)
+            return -1;
+        void *sendq = realloc(c->sendq, newMax);
+        if (!sendq)
+            return -1;
+        c->sendq = sendq;
+        c->sendq_max = newMax;
+    }
+    if (c->sendq_len == 0)
+        c->last_flush = mstime(); // start the send timeout now
+    memcpy((char *) c->sendq + c->sendq_len, data, len);
+    c->sendq_len += len;
     return 0;
 }
 
-//
-// Handle a Beast command message.
-// Currently, we just look for the Mode A/C command message
-// and ignore everything else.
-//
-static int handleBeastCommand(struct client *c, char *p, int remote, uint64_t now) {
-    return 0; // disable this in this fork, no modeac unless it's enabled via config
+struct http_request {
+    int head; // HEAD request, no body
+    int gzip; // client accepts gzip
+    int keepalive;
+    const char *ifNoneMatch; // NULL if not sent
+};
+
+static int httpRespond(struct client *c, struct http_request *req, int status, const char *type,
+        const char *body, int len, int gzipped, uint64_t etag) {
+    char header[512];
+    char *p = header, *end = header + sizeof(header);
+    const char *reason;
+    switch (status) {
+        case 200: reason = "OK"; break;
+        case 304: reason = "Not Modified"; break;
+        case 400: reason = "Bad Request"; break;
+        case 404: reason = "Not Found"; break;
+        case 405: reason = "Method Not Allowed"; break;
+        default: reason = "Internal Server Error"; break;
+    }
+    if (status == 304)
+        len = 0;
+
+    p = safe_snprintf(p, end, "HTTP/1.1 %d %s\r\n", status, reason);
+    p = safe_snprintf(p, end, "Server: readsb\r\n");
+    if (status != 304)
+        p = safe_snprintf(p, end, "Content-Type: %s\r\n", type);
+    p = safe_snprintf(p, end, "Content-Length: %d\r\n", len);
+    if (gzipped && status == 200)
+        p = safe_snprintf(p, end, "Content-Encoding: gzip\r\n");
+    if (etag) {
+        // weak: the same ETag is used for the gzip and identity encoding
+        p = safe_snprintf(p, end, "ETag: W/\"%016"PRIx64"\"\r\n", etag);
+        p = safe_snprintf(p, end, "Vary: Accept-Encoding\r\n");
+    }
+    p = safe_snprintf(p, end, "Cache-Control: no-cache\r\n");
+    p = safe_snprintf(p, end, "Access-Control-Allow-Origin: *\r\n");
+    p = safe_snprintf(p, end, "Connection: %s\r\n\r\n", req->keepalive ? "keep-alive" : "close");
+
+    if (clientAppend(c, header, p - header))
+        return -1;
+    if (!req->head && len > 0 && clientAppend(c, body, len))
+        return -1;
+    return 0;
+}
+
+// If-None-Match is "*" or a comma separated list of entity tags, W/"..." or "...",
+// comparison is weak (RFC 9110 13.1.2): the W/ prefix is ignored, the quoted tag must match exactly
+static int httpNotModified(struct http_request *req, uint64_t etag) {
+    char tag[20];
+    if (!req->ifNoneMatch || !etag)
+        return 0;
+    snprintf(tag, sizeof(tag), "%016"PRIx64, etag);
+    size_t tagLen = strlen(tag);
+
+    const char *p = req->ifNoneMatch;
+    while (*p) {
+        p += strspn(p, " \t,");
+        if (!*p)
+            break;
+        if (*p == '*')
+            return 1;
+        if (!strncmp(p, "W/", 2))
+            p += 2;
+        if (*p != '"')
+            return 0; // malformed, don't guess
+        const char *start = ++p;
+        const char *quote = strchr(start, '"');
+        if (!quote)
+            return 0;
+        if ((size_t) (quote - start) == tagLen && !strncmp(start, tag, tagLen))
+            return 1;
+        p = quote + 1;
+    }
+    return 0;
+}
+
+// Send a gzip compressed body, decompressing it if the client doesn't do gzip
+static int httpSendGzipped(struct client *c, struct http_request *req, const char *type,
+        const char *data, int len, uint64_t etag) {
+    if (httpNotModified(req, etag))
+        return httpRespond(c, req, 304, type, NULL, 0, 0, etag);
+    if (req->gzip)
+        return httpRespond(c, req, 200, type, data, len, 1, etag);
+
+    char *plain;
+    int plainLen = gunzipBuffer(data, len, &plain);
+    if (plainLen < 0)
+        return httpRespond(c, req, 500, "text/plain", NULL, 0, 0, 0);
+    int res = httpRespond(c, req, 200, type, plain, plainLen, 0, etag);
+    free(plain);
+    return res;
+}
+
+// trace_recent_<hex>.json / trace_full_<hex>.json, generated on request
+static int httpSendTrace(struct client *c, struct http_request *req, const char *name, uint64_t now) {
+    int full;
+    const char *p;
+    if ((p = strstr(name, "trace_recent_"))) {
+        full = 0;
+        p += strlen("trace_recent_");
+    } else if ((p = strstr(name, "trace_full_"))) {
+        full = 1;
+        p += strlen("trace_full_");
+    } else {
+        return httpRespond(c, req, 404, "text/plain", NULL, 0, 0, 0);
+    }
+    uint32_t addr = 0;
+    if (*p == '~') {
+        addr |= MODES_NON_ICAO_ADDRESS;
+        p++;
+    }
+    char *hexEnd;
+    addr |= strtoul(p, &hexEnd, 16) & 0xFFFFFF;
+    if (hexEnd == p || strcmp(hexEnd, ".json"))
+        return httpRespond(c, req, 404, "text/plain", NULL, 0, 0, 0);
+
+    // runs in the decode thread: the trace isn't modified while we read it
+    struct aircraft *a = aircraftGet(addr);
+    if (!a || !a->trace_len)
+        return httpRespond(c, req, 404, "text/plain", NULL, 0, 0, 0);
+
+    // drop what expired, the slots can hold large traces
+    for (int i = 0; i < HTTP_TRACE_SLOTS; i++) {
+        if (httpTraceCache[i].data && now > httpTraceCache[i].created + HTTP_TRACE_TTL)
+            httpTraceFree(&httpTraceCache[i]);
+    }
+
+    uint64_t last = trace_state(a, a->trace_len - 1)->timestamp;
+    struct http_trace *t = &httpTraceCache[(addr * 2 + full) % HTTP_TRACE_SLOTS];
+    if (t->data && t->addr == addr && t->full == full && t->len == a->trace_len && t->last == last)
+        return httpSendGzipped(c, req, "application/json", t->data, t->dataLen, t->etag);
+
+    struct trace_view view;
+    trace_view_init(&view, a);
+    int start24, start_recent;
+    trace_ranges(&view, now, &start24, &start_recent);
+    struct char_buffer cb = generateTraceJson(&view, full ? start24 : start_recent, -1);
+    trace_view_free(&view);
+
+    uint64_t etag = fasthash64(cb.buffer, cb.len, 0x2127599bf4325c37ULL);
+    struct char_buffer gz;
+    int res = gzipBuffer(cb.buffer, cb.len, ZCLASS_HTTP, &gz);
+    free(cb.buffer);
+    if (res < 0)
+        return httpRespond(c, req, 500, "text/plain", NULL, 0, 0, 0);
+
+    // gz points to the per thread compression buffer, keep a copy
+    httpTraceFree(t);
+    t->data = malloc(gz.len);
+    if (!t->data) {
+        fprintf(stderr, "Out of memory allocating HTTP trace cache entry\n");
+        exit(1);
+    }
+    memcpy(t->data, gz.buffer, gz.len);
+    t->dataLen = gz.len;
+    t->addr = addr;
+    t->full = full;
+    t->len = a->trace_len;
+    t->last = last;
+    t->created = now;
+    t->etag = etag;
+
+    return httpSendGzipped(c, req, "application/json", t->data, t->dataLen, t->etag);
+}
+
+// Prometheus scrape endpoint, rendered from the live counters
+static int httpSendMetrics(struct client *c, struct http_request *req) {
+    struct char_buffer cb = generatePromMetrics();
+    const char *type = "text/plain; version=0.0.4";
+    int res;
+    struct char_buffer gz;
+    if (req->gzip && gzipBuffer(cb.buffer, cb.len, ZCLASS_HTTP, &gz) == 0) {
+        res = httpRespond(c, req, 200, type, gz.buffer, gz.len, 1, 0);
+    } else {
+        res = httpRespond(c, req, 200, type, cb.buffer, cb.len, 0, 0);
+    }
+    free(cb.buffer);
+    return res;
+}
+
+static int httpSendCached(struct client *c, struct http_request *req, const char *name) {
+    char alias[64];
+    const char *type = "application/json";
+
+    // binCraft globe tiles are written as .ttf so web servers compress them, accept both names
+    const char *ext = strrchr(name, '.');
+    if (ext && (!strcmp(ext, ".ttf") || !strcmp(ext, ".binCraft"))) {
+        type = "application/octet-stream";
+        if (!strcmp(ext, ".binCraft") && ext - name < 50) {
+            snprintf(alias, sizeof(alias), "%.*s.ttf", (int) (ext - name), name);
+            name = alias;
+        }
+    }
+
+    pthread_mutex_lock(&httpCacheMutex);
+    struct http_file *f;
+    for (f = *httpCacheBucket(name); f; f = f->next) {
+        if (!strcmp(f->name, name))
+            break;
+    }
+    int res;
+    if (!f)
+        res = httpRespond(c, req, 404, "text/plain", NULL, 0, 0, 0);
+    else
+        res = httpSendGzipped(c, req, type, f->data, f->len, f->etag);
+    pthread_mutex_unlock(&httpCacheMutex);
+    return res;
+}
+
+// case insensitive header match, returns the header value or NULL
+static char *httpHeader(char *line, const char *name) {
+    size_t len = strlen(name);
+    if (strncasecmp(line, name, len) || line[len] != ':')
+        return NULL;
+    char *value = line + len + 1;
+    while (*value == ' ' || *value == '\t')
+        value++;
+    return value;
+}
+
+// p is the request header block, NUL terminated, without the final empty line
+static int handleHTTPRequest(struct client *c, char *p, int remote, uint64_t now) {
     MODES_NOTUSED(remote);
-    MODES_NOTUSED(now);
-    if (p[0] != '1') {
-        // huh?
+    struct http_request req = { 0 };
+
+    if (c->closeWhenFlushed)
+        return 0; // ignore pipelined requests after Connection: close
+
+    char *save;
+    char *line = strtok_r(p, "\r\n", &save);
+    if (!line)
+        return 1;
+
+    char method[16], target[256], version[16];
+    if (sscanf(line, "%15s %255s %15s", method, target, version) != 3) {
+        req.keepalive = 0;
+        httpRespond(c, &req, 400, "text/plain", NULL, 0, 0, 0);
+        c->closeWhenFlushed = 1;
         return 0;
     }
 
-    switch (p[1]) {
-        case 'j':
-            c->modeac_requested = 0;
-            break;
-        case 'J':
-            c->modeac_requested = 1;
-            break;
+    req.keepalive = !strcmp(version, "HTTP/1.1");
+    while ((line = strtok_r(NULL, "\r\n", &save))) {
+        char *value;
+        if ((value = httpHeader(line, "Connection"))) {
+            if (!strncasecmp(value, "close", 5))
+                req.keepalive = 0;
+            else if (!strncasecmp(value, "keep-alive", 10))
+                req.keepalive = 1;
+        } else if ((value = httpHeader(line, "Accept-Encoding"))) {
+            req.gzip = (strstr(value, "gzip") != NULL);
+        } else if ((value = httpHeader(line, "If-None-Match"))) {
+            req.ifNoneMatch = value;
+        }
     }
 
-    autoset_modeac();
+    if (Modes.debug & MODES_DEBUG_NET)
+        fprintf(stderr, "HTTP: %s %s from %s port %s\n", method, target, c->host, c->port);
+
+    // strip query string and leading /, tar1090 puts the files in data/
+    char *query = strchr(target, '?');
+    if (query)
+        *query = '\0';
+    char *name = target;
+    while (*name == '/')
+        name++;
+    if (!strncmp(name, "data/", 5))
+        name += 5;
+
+    int res;
+    if (!strcmp(method, "HEAD")) {
+        req.head = 1;
+    } else if (strcmp(method, "GET")) {
+        res = httpRespond(c, &req, 405, "text/plain", NULL, 0, 0, 0);
+        goto done;
+    }
+
+    if (!strcmp(name, "metrics"))
+        res = httpSendMetrics(c, &req);
+    else if (!strncmp(name, "traces/", 7))
+        res = httpSendTrace(c, &req, name, now);
+    else
+        res = httpSendCached(c, &req, name);
+
+done:
+    if (res < 0) {
+        fprintf(stderr, "HTTP: response too large, closing %s port %s\n", c->host, c->port);
+        return 1;
+    }
+    if (!req.keepalive)
+        c->closeWhenFlushed = 1;
+    // the SendQ is flushed by readClients()
     return 0;
 }
 
@@ -1766,6 +3019,7 @@ static int decodeBinMessage(struct client *c, char *p, int remote, uint64_t now)
 
     // record reception time as the time we read it.
     mm.sysTimestampMsg = now;
+    mm.sysMicros = c->readMicros;
 
     ch = *p++; // Grab the signal level
     mm.signalLevel = ((unsigned char) ch / 255.0);
@@ -1836,8 +3090,10 @@ static int decodeBinMessage(struct client *c, char *p, int remote, uint64_t now)
         mm.garbage = 1;
     }
 
-    if (result >= 0)
+    if (result >= 0) {
+        statsLatency(LATENCY_NET_READ, microtime() - mm.sysMicros);
         useModesMessage(&mm);
+    }
     return 0;
 }
 //
@@ -1953,6 +3209,7 @@ static int decodeHexMessage(struct client *c, char *hex, int remote, uint64_t no
 
     // record reception time as the time we read it.
     mm.sysTimestampMsg = now;
+    mm.sysMicros = c->readMicros;
 
     if (l == (MODEAC_MSG_BYTES * 2)) { // ModeA or ModeC
         Modes.stats_current.remote_received_modeac++;
@@ -1973,6 +3230,7 @@ static int decodeHexMessage(struct client *c, char *hex, int remote, uint64_t no
         }
     }
 
+    statsLatency(LATENCY_NET_READ, microtime() - mm.sysMicros);
     useModesMessage(&mm);
     return (0);
 }
@@ -2296,12 +3554,11 @@ struct char_buffer generateGlobeBin(int globe_index){
         fprintf(stderr, "generateAircraftJson: bad globe_index: %d\n", globe_index);
         good = 0;
     }
-    if (good && ca->list) {
-        for (int i = 0; i < ca->len; i++) {
-            a = ca->list[i];
-
-            if (a == NULL)
-                continue;
+    int len = 0;
+    struct aircraft **list = good ? ca_copy(ca, &len) : NULL;
+    if (list) {
+        for (int i = 0; i < len; i++) {
+            a = list[i];
 
             int use = 0;
 
@@ -2330,6 +3587,7 @@ struct char_buffer generateGlobeBin(int globe_index){
             if (p >= end)
                 fprintf(stderr, "buffer overrun globeBin\n");
         }
+        free(list);
     }
 
     cb.len = p - buf;
@@ -2339,6 +3597,30 @@ struct char_buffer generateGlobeBin(int globe_index){
 #undef memWrite
 }
 
+// layout of the adaptive tiles, the 10 degree cells not covered keep their usual index
+struct char_buffer generateGlobeTilesJson() {
+    struct char_buffer cb;
+    int count = globeAdaptiveCount();
+    size_t buflen = 1024 + count * 160;
+    char *buf = (char *) malloc(buflen), *p = buf, *end = buf + buflen;
+
+    p = safe_snprintf(p, end, "{ \"now\" : %.1f,\n", mstime() / 1000.0);
+    p = safe_snprintf(p, end, "  \"globeIndexGrid\" : %d,\n", GLOBE_INDEX_GRID);
+    p = safe_snprintf(p, end, "  \"globeIndexAdaptive\" : %d,\n", Modes.globe_adaptive);
+    p = safe_snprintf(p, end, "  \"tiles\" : [");
+    for (int i = 0; i < count; i++) {
+        double south, west, north, east;
+        globeAdaptiveTile(i, &south, &west, &north, &east);
+        p = safe_snprintf(p, end, "%s\n    { \"index\" : %d, \"south\" : %g, \"west\" : %g, \"north\" : %g, \"east\" : %g, \"aircraft\" : %d }",
+                i ? "," : "", i, south, west, north, east, Modes.globeLists[i].len);
+    }
+    p = safe_snprintf(p, end, "\n  ]\n}\n");
+
+    cb.len = p - buf;
+    cb.buffer = buf;
+    return cb;
+}
+
 struct char_buffer generateGlobeJson(int globe_index){
     struct char_buffer cb;
     uint64_t now = mstime();
@@ -2371,6 +3653,18 @@ struct char_buffer generateGlobeJson(int globe_index){
                 lon,
                 lat + grid,
                 lon + grid);
+    } else if (Modes.globe_adaptive) {
+        double south = 0, west = 0, north = 0, east = 0;
+        globeAdaptiveTile(globe_index, &south, &west, &north, &east);
+        p = safe_snprintf(p, end,
+                "\"south\" : %g, "
+                "\"west\" : %g, "
+                "\"north\" : %g, "
+                "\"east\" : %g,\n",
+                south,
+                west,
+                north,
+                east);
     } else {
         struct tile *tiles = Modes.json_globe_special_tiles;
         struct tile tile = tiles[globe_index];
@@ -2396,12 +3690,11 @@ struct char_buffer generateGlobeJson(int globe_index){
         fprintf(stderr, "generateAircraftJson: bad globe_index: %d\n", globe_index);
         good = 0;
     }
-    if (good && ca->list) {
-        for (int i = 0; i < ca->len; i++) {
-            a = ca->list[i];
-
-            if (a == NULL)
-                continue;
+    int len = 0;
+    struct aircraft **list = good ? ca_copy(ca, &len) : NULL;
+    if (list) {
+        for (int i = 0; i < len; i++) {
+            a = list[i];
 
             int use = 0;
 
@@ -2429,6 +3722,7 @@ struct char_buffer generateGlobeJson(int globe_index){
             if (p >= end)
                 fprintf(stderr, "buffer overrun aircraft json\n");
         }
+        free(list);
     }
     if (*(p-1) == ',')
         p--;
@@ -2440,9 +3734,12 @@ struct char_buffer generateGlobeJson(int globe_index){
     return cb;
 }
 
-struct char_buffer generateAircraftJson(){
+// with jl set, the aircraft with messages since jl->since are noted for the latency stats
+struct char_buffer generateAircraftJson(struct json_latency *jl) {
     struct char_buffer cb;
     uint64_t now = mstime();
+    if (jl)
+        jl->generated = now;
     struct aircraft *a;
     size_t buflen = 6*1024*1024; // The initial buffer is resized as needed
     char *buf = (char *) malloc(buflen), *p = buf, *end = buf + buflen;
@@ -2464,6 +3761,8 @@ struct char_buffer generateAircraftJson(){
                 continue;
             if (a->messages < 2)
                 continue;
+            if (jl && a->seen > jl->since && a->seen <= now)
+                statsJsonLatencyNote(jl, now - a->seen);
 
             // check if we have enough space
             if ((p + 1000) >= end) {
@@ -2494,12 +3793,93 @@ struct char_buffer generateAircraftJson(){
     return cb;
 }
 
-struct char_buffer generateTraceJson(struct aircraft *a, int start, int last) {
+// points start..last of a trace as json arrays, timestamps relative to base,
+// with comma set the first point is preceded by a comma as well
+static char *sprintTracePoints(char *p, char *end, struct trace_view *v, int start, int last, uint64_t base, int comma) {
+    struct aircraft *a = v->a;
+    uint64_t legs[LEG_HISTORY];
+    int nlegs = legsSorted(a, legs);
+    int leg = 0;
+
+    for (int i = start; i <= last; i++) {
+        struct state *trace = trace_view_state(v, i);
+
+        int32_t altitude = trace->altitude * 25;
+        int32_t rate = trace->rate * 32;
+        int rate_valid = trace->flags.rate_valid;
+        int rate_geom = trace->flags.rate_geom;
+        int stale = trace->flags.stale;
+        int on_ground = trace->flags.on_ground;
+        int altitude_valid = trace->flags.altitude_valid;
+        int gs_valid = trace->flags.gs_valid;
+        int track_valid = trace->flags.track_valid;
+        while (leg < nlegs && legs[leg] < trace->timestamp)
+            leg++;
+        // recent legs on packed points aren't marked yet
+        int leg_marker = trace->flags.leg_marker || (leg < nlegs && legs[leg] == trace->timestamp);
+        int altitude_geom = trace->flags.altitude_geom;
+
+        if (i > start || comma)
+            p = safe_snprintf(p, end, ",");
+
+        // in the air
+        p = safe_snprintf(p, end, "\n[%.1f,%f,%f",
+                (trace->timestamp - base) / 1000.0, trace->lat / 1E6, trace->lon / 1E6);
+
+        if (on_ground)
+            p = safe_snprintf(p, end, ",\"ground\"");
+        else if (altitude_valid)
+            p = safe_snprintf(p, end, ",%d", altitude);
+        else
+            p = safe_snprintf(p, end, ",null");
+
+        if (gs_valid)
+            p = safe_snprintf(p, end, ",%.1f", trace->gs / 10.0);
+        else
+            p = safe_snprintf(p, end, ",null");
+
+        if (track_valid)
+            p = safe_snprintf(p, end, ",%.1f", trace->track / 10.0);
+        else
+            p = safe_snprintf(p, end, ",null");
+
+        int bitfield = (altitude_geom << 3) | (rate_geom << 2) | (leg_marker << 1) | (stale << 0);
+        p = safe_snprintf(p, end, ",%d", bitfield);
+
+        if (rate_valid)
+            p = safe_snprintf(p, end, ",%d", rate);
+        else
+            p = safe_snprintf(p, end, ",null");
+
+        if (i % 4 == 0) {
+            uint64_t now = trace->timestamp;
+            struct state_all *all = trace_view_all(v, i);
+            struct aircraft b;
+            memset(&b, 0, sizeof(struct aircraft));
+            struct aircraft *ac = &b;
+            from_state_all(all, ac, now);
+
+            p = safe_snprintf(p, end, ",");
+            p = sprintAircraftObject(p, end, ac, now, 1);
+        } else {
+            p = safe_snprintf(p, end, ",null");
+        }
+        p = safe_snprintf(p, end, "]");
+    }
+
+    return p;
+}
+
+static char *sprintTraceHead(char *p, char *end, struct aircraft *a) {
+    return safe_snprintf(p, end, "{\"icao\":\"%s%06x\"", (a->addr & MODES_NON_ICAO_ADDRESS) ? "~" : "", a->addr & 0xFFFFFF);
+}
+
+struct char_buffer generateTraceJson(struct trace_view *v, int start, int last) {
     struct char_buffer cb;
-    size_t buflen = a->trace_len * 300 + 1024;
+    size_t buflen = v->len * 300 + 1024;
 
     if (last < 0)
-        last = a->trace_len - 1;
+        last = v->len - 1;
 
     if (!Modes.json_globe_index) {
         cb.len = 0;
@@ -2509,79 +3889,46 @@ struct char_buffer generateTraceJson(struct aircraft *a, int start, int last) {
 
     char *buf = (char *) malloc(buflen), *p = buf, *end = buf + buflen;
 
-    p = safe_snprintf(p, end, "{\"icao\":\"%s%06x\"", (a->addr & MODES_NON_ICAO_ADDRESS) ? "~" : "", a->addr & 0xFFFFFF);
+    p = sprintTraceHead(p, end, v->a);
 
-    if (start <= last && last < a->trace_len) {
-        p = safe_snprintf(p, end, ",\n\"timestamp\": %.3f", (a->trace + start)->timestamp / 1000.0);
+    if (start <= last && last < v->len) {
+        uint64_t base = trace_view_state(v, start)->timestamp;
+        p = safe_snprintf(p, end, ",\n\"timestamp\": %.3f", base / 1000.0);
 
         p = safe_snprintf(p, end, ",\n\"trace\":[ ");
 
-        for (int i = start; i <= last; i++) {
-            struct state *trace = &a->trace[i];
-
-            int32_t altitude = trace->altitude * 25;
-            int32_t rate = trace->rate * 32;
-            int rate_valid = trace->flags.rate_valid;
-            int rate_geom = trace->flags.rate_geom;
-            int stale = trace->flags.stale;
-            int on_ground = trace->flags.on_ground;
-            int altitude_valid = trace->flags.altitude_valid;
-            int gs_valid = trace->flags.gs_valid;
-            int track_valid = trace->flags.track_valid;
-            int leg_marker = trace->flags.leg_marker;
-            int altitude_geom = trace->flags.altitude_geom;
-
-                // in the air
-                p = safe_snprintf(p, end, "\n[%.1f,%f,%f",
-                        (trace->timestamp - (a->trace + start)->timestamp) / 1000.0, trace->lat / 1E6, trace->lon / 1E6);
-
-                if (on_ground)
-                    p = safe_snprintf(p, end, ",\"ground\"");
-                else if (altitude_valid)
-                    p = safe_snprintf(p, end, ",%d", altitude);
-                else
-                    p = safe_snprintf(p, end, ",null");
+        p = sprintTracePoints(p, end, v, start, last, base, 0);
 
-                if (gs_valid)
-                    p = safe_snprintf(p, end, ",%.1f", trace->gs / 10.0);
-                else
-                    p = safe_snprintf(p, end, ",null");
+        p = safe_snprintf(p, end, TRACE_JSON_TAIL);
+    } else {
+        p = safe_snprintf(p, end, " }\n");
+    }
 
-                if (track_valid)
-                    p = safe_snprintf(p, end, ",%.1f", trace->track / 10.0);
-                else
-                    p = safe_snprintf(p, end, ",null");
+    cb.len = p - buf;
+    cb.buffer = buf;
 
-                int bitfield = (altitude_geom << 3) | (rate_geom << 2) | (leg_marker << 1) | (stale << 0);
-                p = safe_snprintf(p, end, ",%d", bitfield);
+    if (p >= end) {
+        fprintf(stderr, "buffer overrun trace json %zu %zu\n", cb.len, buflen);
+    }
 
-                if (rate_valid)
-                    p = safe_snprintf(p, end, ",%d", rate);
-                else
-                    p = safe_snprintf(p, end, ",null");
-
-                if (i % 4 == 0) {
-                    uint64_t now = trace->timestamp;
-                    struct state_all *all = &(a->trace_all[i/4]);
-                    struct aircraft b;
-                    memset(&b, 0, sizeof(struct aircraft));
-                    struct aircraft *ac = &b;
-                    from_state_all(all, ac, now);
-
-                    p = safe_snprintf(p, end, ",");
-                    p = sprintAircraftObject(p, end, ac, now, 1);
-                } else {
-                    p = safe_snprintf(p, end, ",null");
-                }
-                p = safe_snprintf(p, end, "],");
-        }
+    return cb;
+}
 
-        p--; // remove last comma
+// Trace json without TRACE_JSON_TAIL for appendable files: with head set the object up to
+// and including the points, otherwise only the points preceded by a comma.
+struct char_buffer generateTraceJsonPart(struct trace_view *v, int start, int last, uint64_t base, int head) {
+    struct char_buffer cb;
+    size_t buflen = (last - start + 1) * 300 + 1024;
+
+    char *buf = (char *) malloc(buflen), *p = buf, *end = buf + buflen;
 
-        p = safe_snprintf(p, end, " ]\n");
+    if (head) {
+        p = sprintTraceHead(p, end, v->a);
+        p = safe_snprintf(p, end, ",\n\"timestamp\": %.3f", base / 1000.0);
+        p = safe_snprintf(p, end, ",\n\"trace\":[ ");
     }
 
-    p = safe_snprintf(p, end, " }\n");
+    p = sprintTracePoints(p, end, v, start, last, base, !head);
 
     cb.len = p - buf;
     cb.buffer = buf;
@@ -2620,8 +3967,11 @@ struct char_buffer generateReceiverJson() {
             p = safe_snprintf(p, end, "\"north\" : %d, ", tile.north);
             p = safe_snprintf(p, end, "\"west\" : %d }, ", tile.west);
         }
-        p -= 2; // get rid of comma and space at the end
+        if (tiles[0].south != 0 || tiles[0].north != 0)
+            p -= 2; // get rid of comma and space at the end
         p = safe_snprintf(p, end, " ]");
+        if (Modes.globe_adaptive)
+            p = safe_snprintf(p, end, ", \"globeIndexAdaptive\" : %d", Modes.globe_adaptive);
     }
 
     if (Modes.json_location_accuracy && (Modes.fUserLat != 0.0 || Modes.fUserLon != 0.0)) {
@@ -2648,15 +3998,13 @@ struct char_buffer generateReceiverJson() {
     return cb;
 }
 
-// Write JSON to file
-static inline void writeJsonTo (const char* dir, const char *file, struct char_buffer cb, int gzip) {
+// Write data to dir/file through a temporary file and rename, returns -1 on error
+static int writeFileData (const char* dir, const char *file, const char *data, int len) {
 #ifndef _WIN32
 
     char pathbuf[PATH_MAX];
     char tmppath[PATH_MAX];
     int fd;
-    int len = cb.len;
-    char *content = cb.buffer;
 
     if (!dir)
         snprintf(tmppath, PATH_MAX, "%s.%lx", file, random());
@@ -2668,9 +4016,7 @@ static inline void writeJsonTo (const char* dir, const char *file, struct char_b
     if (fd < 0) {
         fprintf(stderr, "writeJsonTo open(): ");
         perror(tmppath);
-        if (!gzip)
-            free(content);
-        return;
+        return -1;
     }
 
     if (!dir)
@@ -2680,79 +4026,78 @@ static inline void writeJsonTo (const char* dir, const char *file, struct char_b
 
     pathbuf[PATH_MAX - 1] = 0;
 
-    if (gzip < 0) {
-        /*
-        int brotliLvl = -gzip;
-        size_t outSize = len + 4096;
-        char *outBuf = malloc(outSize);
-        // BROTLI_MODE_TEXT  Compression mode for UTF-8 formatted text input. 
-        // BROTLI_MODE_GENERIC
-        int rc = BrotliEncoderCompress(
-                brotliLvl, 22, BROTLI_DEFAULT_MODE,
-                len, (uint8_t *) content, &outSize, (uint8_t *) outBuf);
-
-        if (rc == BROTLI_FALSE) {
-            goto error_1;
-        }
-
-        if (write(fd, outBuf, outSize) != (ssize_t) outSize)
-            goto error_1;
-
-        if (close(fd) < 0)
-            goto error_2;
-        */
-    } else if (gzip > 0) {
-        gzFile gzfp = gzdopen(fd, "wb");
-        if (!gzfp)
-            goto error_1;
-
-        gzbuffer(gzfp, 1024 * 1024);
-        gzsetparams(gzfp, gzip, Z_DEFAULT_STRATEGY);
-
-        int res = gzwrite(gzfp, content, len);
-        if (res != len) {
-            int error;
-            fprintf(stderr, "%s: gzwrite of length %d failed: %s (res == %d)\n", pathbuf, len, gzerror(gzfp, &error), res);
-        }
-
-        if (gzclose(gzfp) < 0)
-            goto error_2;
-    } else {
-        if (write(fd, content, len) != len) {
-            fprintf(stderr, "writeJsonTo write(): ");
-            perror(tmppath);
-            goto error_1;
-        }
-
-        if (close(fd) < 0)
-            goto error_2;
+    if (write(fd, data, len) != len) {
+        fprintf(stderr, "writeJsonTo write(): ");
+        perror(tmppath);
+        goto error_1;
     }
 
+    if (close(fd) < 0)
+        goto error_2;
+
     if (rename(tmppath, pathbuf) == -1) {
         fprintf(stderr, "writeJsonTo rename(): %s -> %s", tmppath, pathbuf);
         perror("");
         goto error_2;
     }
-    if (!gzip)
-        free(content);
-    return;
+    return 0;
 
 error_1:
     close(fd);
 error_2:
     unlink(tmppath);
-    if (!gzip)
-        free(content);
-    return;
+    return -1;
+#else
+    return -1;
 #endif
 }
 
+// Write JSON to file
+static inline void writeJsonTo (const char* dir, const char *file, struct char_buffer cb, int zclass) {
+    if (zclass > 0) {
+        struct char_buffer gz;
+        if (gzipBuffer(cb.buffer, cb.len, zclass, &gz) < 0) {
+            fprintf(stderr, "%s: compressing %zu bytes failed\n", file, cb.len);
+            return;
+        }
+        writeFileData(dir, file, gz.buffer, gz.len);
+    } else {
+        writeFileData(dir, file, cb.buffer, cb.len);
+        free(cb.buffer);
+    }
+}
+
 void writeJsonToFile (const char* dir, const char *file, struct char_buffer cb) {
     writeJsonTo(dir, file, cb, 0);
 }
 
-void writeJsonToGzip (const char* dir, const char *file, struct char_buffer cb, int gzip) {
-    writeJsonTo(dir, file, cb, gzip);
+void writeJsonToGzip (const char* dir, const char *file, struct char_buffer cb, int zclass) {
+    writeJsonTo(dir, file, cb, zclass);
+}
+
+// Hand a generated file to the HTTP server and / or write it to the json directory.
+// With zclass != ZCLASS_NONE the file is written compressed, cb is freed in any case.
+void publishJson(const char *file, struct char_buffer cb, int zclass) {
+    if (zclass == ZCLASS_NONE) {
+        if (Modes.net_http)
+            httpCachePut(file, cb, ZCLASS_HTTP);
+        if (Modes.json_dir)
+            writeJsonTo(Modes.json_dir, file, cb, ZCLASS_NONE);
+        else
+            free(cb.buffer);
+        return;
+    }
+    // compress once, the HTTP cache and the file get the same gzip data
+    struct char_buffer gz;
+    if (gzipBuffer(cb.buffer, cb.len, zclass, &gz) < 0) {
+        fprintf(stderr, "publishJson: compressing %s failed\n", file);
+    } else {
+        if (Modes.net_http)
+            httpCacheStore(file, gz.buffer, gz.len, httpEtag(cb));
+        if (Modes.json_dir)
+            writeFileData(Modes.json_dir, file, gz.buffer, gz.len);
+    }
+    free(cb.buffer);
 }
 
 static void periodicReadFromClient(struct client *c) {
@@ -2790,25 +4135,27 @@ static void periodicReadFromClient(struct client *c) {
 // The handler returns 0 on success, or 1 to signal this function we should
 // close the connection with the client in case of non-recoverable errors.
 //
-static void modesReadFromClient(struct client *c) {
+// At most budget bytes are read and the number read is returned.  With discard
+// set everything pending is read and dropped instead, see INGEST_DISCARD_AFTER.
+//
+static int modesReadFromClient(struct client *c, int budget, int discard) {
     int left;
     int nread;
     int bContinue = 1;
-    int discard = 0;
+    int total = 0;
+
+    uint64_t now = mstime();
 
-    uint64_t start = mstime();
-    uint64_t now = start;
+    if (discard) {
+        if (c->proxy_string[0] != '\0')
+            fprintf(stderr, "ERROR, not enough CPU: Discarding data from: %s\n", c->proxy_string);
+        else
+            fprintf(stderr, "%s: ERROR, not enough CPU: Discarding data from: %s port %s (fd %d)\n",
+                    c->service->descr, c->host, c->port, c->fd);
+    }
 
     for (int loop = 0; bContinue && loop < 32; loop++, now = mstime()) {
 
-        if (!discard && now > start + 200) {
-            discard = 1;
-            if (c->proxy_string[0] != '\0')
-                fprintf(stderr, "ERROR, not enough CPU: Discarding data from: %s\n", c->proxy_string);
-            else
-                fprintf(stderr, "%s: ERROR, not enough CPU: Discarding data from: %s port %s (fd %d)\n",
-                        c->service->descr, c->host, c->port, c->fd);
-        }
         if (discard)
             c->buflen = 0;
 
@@ -2821,16 +4168,24 @@ static void modesReadFromClient(struct client *c) {
             left = MODES_CLIENT_BUF_SIZE - c->buflen - 1; // leave 1 extra byte for NUL termination in the ASCII case
             // If there is garbage, read more to discard it ASAP
         }
+        if (!discard && left > budget - total) {
+            left = budget - total;
+            if (left <= 0)
+                break;
+        }
 #ifndef _WIN32
-        nread = read(c->fd, c->buf + c->buflen, left);
+        nread = c->zin ? clientInflate(c, c->buf + c->buflen, left) : read(c->fd, c->buf + c->buflen, left);
         int err = errno;
 #else
-        nread = recv(c->fd, c->buf + c->buflen, left, 0);
-        if (nread < 0) {
+        nread = c->zin ? clientInflate(c, c->buf + c->buflen, left) : recv(c->fd, c->buf + c->buflen, left, 0);
+        if (nread < 0 && !c->zin) {
             errno = WSAGetLastError();
         }
 #endif
 
+        if (nread > 0)
+            c->readMicros = microtime();
+
         // If we didn't get all the data we asked for, then return once we've processed what we did get.
         if (nread != left) {
             bContinue = 0;
@@ -2844,7 +4199,7 @@ static void modesReadFromClient(struct client *c) {
            ) {
             fprintf(stderr, "%s: No data received for 65 seconds, reconnecting: %s port %s\n", c->service->descr, c->host, c->port);
             modesCloseClient(c);
-            return;
+            return total;
         }
 
 #ifndef _WIN32
@@ -2853,7 +4208,7 @@ static void modesReadFromClient(struct client *c) {
         if (nread < 0 && errno == EWOULDBLOCK) // No data available (not really an error)
 #endif
         {
-            return;
+            return total;
         }
 
         if (nread < 0) { // Other errors
@@ -2868,7 +4223,7 @@ static void modesReadFromClient(struct client *c) {
                             c->fd, c->sendq_len, c->buflen);
                 }
             modesCloseClient(c);
-            return;
+            return total;
         }
 
         if (nread == 0) { // End of file
@@ -2888,14 +4243,19 @@ static void modesReadFromClient(struct client *c) {
                 }
             }
             modesCloseClient(c);
-            return;
+            return total;
         }
 
-        if (discard)
+        if (discard) {
+            c->ingestDiscarded += nread;
+            Modes.stats_current.ingest_discarded += nread;
             continue;
+        }
 
+        total += nread;
         c->buflen += nread;
         c->bytesReceived += nread;
+        c->service->bytesIn += nread;
 
         char *som = c->buf; // first byte of next message
         char *eod = som + c->buflen; // one byte past end of data
@@ -2940,6 +4300,52 @@ static void modesReadFromClient(struct client *c) {
             }
         }
 
+        // compressed connection, everything after the line is a zlib stream
+        if (!c->zin && c->service->read_mode != READ_MODE_ASCII && c->bytesReceived <= MODES_CLIENT_BUF_SIZE
+                && eod - som >= COMPRESS_LINE_LEN && !memcmp(som, COMPRESS_LINE, COMPRESS_LINE_LEN)) {
+            som += COMPRESS_LINE_LEN;
+            c->bytesReceived -= eod - som;
+            clientInflateStart(c, som, eod - som);
+            // answer on output ports, a connector has announced compression itself
+            if (c->sendq && !c->con && !c->zout) {
+                clientAppend(c, COMPRESS_LINE, COMPRESS_LINE_LEN);
+                clientDeflateStart(c);
+            }
+            if (Modes.debug & MODES_DEBUG_NET) {
+                fprintf(stderr, "%s: Compressed connection: %s port %s (fd %d)\n",
+                        c->service->descr, c->host, c->port, c->fd);
+            }
+            c->buflen = 0;
+            bContinue = 1;
+            continue;
+        }
+
+        // output filter / beast_reduce tier handshake, has to be the first line sent by the client
+        struct net_writer *writer = c->service->writer;
+        if (writer && writer->filterMasks && c->bytesReceived <= MODES_CLIENT_BUF_SIZE && eod - som > 7
+                && ((!writer->reduceTiers && !c->filter && !strncmp(som, "FILTER ", 7))
+                    || (writer->reduceTiers && !strncmp(som, "REDUCE ", 7)))) {
+            *eod = '\0';
+            char *eol = strchr(som, '\n');
+            if (!eol) // incomplete line
+                break;
+            *eol = '\0';
+            if (eol > som && eol[-1] == '\r')
+                eol[-1] = '\0';
+            if (writer->reduceTiers) {
+                c->reduce_tier = beastReduceTier(atof(som + 7));
+            } else {
+                int group = outFilterAcquire(som + 7, 0);
+                if (group < 0) {
+                    fprintf(stderr, "%s: Bad filter from %s port %s: %s\n", c->service->descr, c->host, c->port, som + 7);
+                    modesCloseClient(c);
+                    return total;
+                }
+                c->filter = group + 1;
+            }
+            som = eol + 1;
+        }
+
         switch (c->service->read_mode) {
             case READ_MODE_IGNORE:
                 // drop the bytes on the floor
@@ -2965,9 +4371,26 @@ static void modesReadFromClient(struct client *c) {
                         else
                             fprintf(stderr, "Garbage: Close: %s port %s sample: %s\n", c->host, c->port, sample);
                     }
-                    return;
+                    return total;
                 }
-                while (som < eod && ((p = memchr(som, (char) 0x1a, eod - som)) != NULL)) { // The first byte of buffer 'should' be 0x1a
+                while (som < eod) {
+                    // a beast_out listener answers our COMPRESS_LINE with its own, possibly after uncompressed
+                    // frames it had queued before reading ours: the zlib stream starts at that frame boundary
+                    if (*som == 'C' && !c->zin && c->con && c->con->compress) {
+                        int n = eod - som < COMPRESS_LINE_LEN ? eod - som : COMPRESS_LINE_LEN;
+                        if (!memcmp(som, COMPRESS_LINE, n)) {
+                            if (n < COMPRESS_LINE_LEN) // incomplete line, retry later
+                                break;
+                            som += COMPRESS_LINE_LEN;
+                            c->bytesReceived -= eod - som;
+                            clientInflateStart(c, som, eod - som);
+                            som = eod;
+                            bContinue = 1;
+                            break;
+                        }
+                    }
+                    if (!(p = memchr(som, (char) 0x1a, eod - som))) // The first byte of buffer 'should' be 0x1a
+                        break;
 
                     Modes.stats_current.remote_malformed_beast += p - som;
                     c->garbage += p - som;
@@ -3053,7 +4476,7 @@ static void modesReadFromClient(struct client *c) {
                     // Have a 0x1a followed by 1/2/3/4/5 - pass message to handler.
                     if (c->service->read_handler(c, som + 1, remote, now)) {
                         modesCloseClient(c);
-                        return;
+                        return total;
                     }
 
                     // if we get some valid data, reduce the garbage counter.
@@ -3105,7 +4528,7 @@ static void modesReadFromClient(struct client *c) {
                     // Have a 0x1a followed by 1 - pass message to handler.
                     if (c->service->read_handler(c, som + 1, remote, now)) {
                         modesCloseClient(c);
-                        return;
+                        return total;
                     }
 
                     // advance to next message
@@ -3130,7 +4553,7 @@ static void modesReadFromClient(struct client *c) {
                             fprintf(stderr, "%s: Closing connection from %s port %s\n", c->service->descr, c->host, c->port);
                         }
                         modesCloseClient(c); // Handler returns 1 on error to signal we .
-                        return; // should close the client connection
+                        return total; // should close the client connection
                     }
                     som = p + c->service->read_sep_len; // Move to start of next message
                 }
@@ -3154,9 +4577,10 @@ static void modesReadFromClient(struct client *c) {
             c->buflen = eod - som; //     Update the unprocessed buffer length
             memmove(c->buf, som, c->buflen); //     Move what's remaining to the start of the buffer
         } else { // If no message was decoded process the next client
-            return;
+            return total;
         }
     }
+    return total;
 }
 
 static inline unsigned unsigned_difference(unsigned v1, unsigned v2) {
@@ -3230,19 +4654,254 @@ void netFreeClients() {
         }
     }
 }
+// Beast over UDP input, datagrams received with one recvmmsg() call
+#define UDP_IN_BATCH 64
+
+static struct {
+    char *buf; // UDP_IN_BATCH buffers of Modes.net_udp_size bytes
+    struct iovec iov[UDP_IN_BATCH];
+    struct mmsghdr msgs[UDP_IN_BATCH];
+} udpIn;
+
+// SO_REUSEPORT: several processes can share a port, the kernel keeps each sender on one of them
+static void udpInInit(struct net_service *service) {
+    udpIn.buf = malloc((size_t) UDP_IN_BATCH * Modes.net_udp_size);
+    if (!udpIn.buf) {
+        fprintf(stderr, "Out of memory allocating UDP input buffers\n");
+        exit(1);
+    }
+    for (int i = 0; i < UDP_IN_BATCH; i++) {
+        udpIn.iov[i].iov_base = udpIn.buf + (size_t) i * Modes.net_udp_size;
+        udpIn.iov[i].iov_len = Modes.net_udp_size;
+        udpIn.msgs[i].msg_hdr.msg_iov = &udpIn.iov[i];
+        udpIn.msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    char *ports = strdup(Modes.net_beast_udp_in_ports);
+    for (char *port = strtok(ports, ","); port; port = strtok(NULL, ",")) {
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM, .ai_flags = AI_PASSIVE };
+        struct addrinfo *res;
+        int err = getaddrinfo(Modes.net_bind_address, port, &hints, &res);
+        if (err) {
+            fprintf(stderr, "--net-beast-udp-in: port %s: %s\n", port, gai_strerror(err));
+            exit(1);
+        }
+        for (struct addrinfo *ai = res; ai; ai = ai->ai_next) {
+            int on = 1;
+            int rcvbuf = 8 * 1024 * 1024;
+            int fd = socket(ai->ai_family, SOCK_DGRAM, 0);
+            if (fd < 0)
+                continue;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+            setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+            if (ai->ai_family == AF_INET6)
+                setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+                fprintf(stderr, "%s: bind to port %s failed: %s\n", service->descr, port, strerror(errno));
+                exit(1);
+            }
+            struct client *c = createGenericClient(service, fd);
+            snprintf(c->host, sizeof(c->host), "%s", ai->ai_family == AF_INET6 ? "::" : "0.0.0.0");
+            snprintf(c->port, sizeof(c->port), "%s", port);
+        }
+        freeaddrinfo(res);
+    }
+    free(ports);
+}
+
+// the beast frames of one datagram, they have to be complete and back to back
+static int udpDecodeFrames(struct client *c, char *p, char *eod, uint64_t now) {
+    while (p < eod) {
+        if (*p != 0x1a || p + 1 >= eod)
+            return -1;
+        unsigned char type = p[1];
+        int len;
+        if (type == '1')
+            len = MODEAC_MSG_BYTES + 7;
+        else if (type == '2')
+            len = MODES_SHORT_MSG_BYTES + 7;
+        else if (type == '3' || type == '4' || type == '5')
+            len = MODES_LONG_MSG_BYTES + 7;
+        else if (type == 0xe3)
+            len = 8;
+        else
+            return -1;
+
+        char *q = p + 2;
+        for (int k = 0; k < len; k++) {
+            if (q >= eod)
+                return -1;
+            if (*q == 0x1a) {
+                if (q + 1 >= eod || q[1] != 0x1a)
+                    return -1;
+                q++;
+            }
+            q++;
+        }
+
+        if (type == 0xe3) {
+            // like on TCP, an ingest node keeps the id it assigned (the sender id here)
+            if (!Modes.netIngest) {
+                uint64_t receiverId = 0;
+                for (char *r = p + 2; r < q; r++) {
+                    receiverId = receiverId << 8 | (unsigned char) *r;
+                    if (*r == 0x1a)
+                        r++;
+                }
+                c->receiverId = receiverId;
+            }
+        } else {
+            c->service->read_handler(c, p + 1, 1, now);
+        }
+        p = q;
+    }
+    return 0;
+}
+
+static inline uint64_t remoteAccepted() {
+    uint64_t sum = 0;
+    for (int j = 0; j <= MODES_MAX_BITERRORS; j++)
+        sum += Modes.stats_current.remote_accepted[j];
+    return sum;
+}
+
+static void udpRead(struct client *c) {
+    uint64_t now = mstime();
+
+    for (int loop = 0; loop < 32; loop++) {
+        int n = recvmmsg(c->fd, udpIn.msgs, UDP_IN_BATCH, MSG_DONTWAIT, NULL);
+        if (n <= 0)
+            return; // nothing there, errors aren't fatal for a UDP socket
+
+        c->readMicros = microtime();
+        c->last_read = now;
+        for (int i = 0; i < n; i++) {
+            unsigned char *d = udpIn.iov[i].iov_base;
+            int len = udpIn.msgs[i].msg_len;
+            c->bytesReceived += len;
+            c->service->bytesIn += len;
+            Modes.stats_current.udp_in_datagrams++;
+            uint32_t magic = 0;
+            uint32_t seq = 0;
+            uint64_t sender = 0;
+            for (int j = 0; j < 4 && j < len; j++)
+                magic = magic << 8 | d[j];
+            if (len < BEAST_UDP_HEADER_LEN || (udpIn.msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || magic != BEAST_UDP_MAGIC) {
+                Modes.stats_current.udp_in_bad++;
+                continue;
+            }
+            for (int j = 4; j < 8; j++)
+                seq = seq << 8 | d[j];
+            for (int j = 8; j < 16; j++)
+                sender = sender << 8 | d[j];
+
+            uint64_t accepted = remoteAccepted();
+            c->receiverId = sender;
+            c->receiverId2 = 0;
+            if (udpDecodeFrames(c, (char *) d + BEAST_UDP_HEADER_LEN, (char *) d + len, now))
+                Modes.stats_current.udp_in_bad++;
+            // only a sender whose frames pass the CRC gets a receiver entry
+            if (remoteAccepted() != accepted)
+                receiverUdpSequence(sender, seq, now);
+        }
+        if (n < UDP_IN_BATCH)
+            return;
+    }
+}
+
+// deficit round robin over the input clients, see INGEST_QUANTUM
+static void ingestClients(uint64_t now) {
+    uint64_t deadline = now + INGEST_TICK_TIME;
+    int pending = 1;
+
+    for (int round = 0; pending; round++) {
+        pending = 0;
+        for (struct net_service *s = Modes.services; s; s = s->next) {
+            if (!s->read_handler || s->udp)
+                continue;
+            for (struct client *c = s->clients; c; c = c->next) {
+                if (!c->service || (round > 0 && !c->ingestMore))
+                    continue;
+                // every client gets its turn in the first round
+                if (round > 0 && mstime() > deadline) {
+                    // out of time, the client keeps the credit for this round
+                    c->ingestDeficit += INGEST_QUANTUM;
+                    if (c->ingestDeficit > INGEST_DEFICIT_MAX)
+                        c->ingestDeficit = INGEST_DEFICIT_MAX;
+                    continue;
+                }
+
+                int discard = c->ingestBehindSince && now > c->ingestBehindSince + INGEST_DISCARD_AFTER;
+                c->ingestDeficit += INGEST_QUANTUM;
+                if (c->ingestDeficit > INGEST_DEFICIT_MAX)
+                    c->ingestDeficit = INGEST_DEFICIT_MAX;
+
+                int nread = modesReadFromClient(c, c->ingestDeficit, discard);
+                c->ingestDeficit -= nread;
+                c->ingestMore = !discard && c->service && c->ingestDeficit <= 0;
+                if (c->ingestMore)
+                    pending = 1;
+                else
+                    c->ingestDeficit = 0; // drained, an idle client doesn't accumulate credit
+            }
+        }
+    }
+
+    for (struct net_service *s = Modes.services; s; s = s->next) {
+        if (!s->read_handler || s->udp)
+            continue;
+        for (struct client *c = s->clients; c; c = c->next) {
+            if (!c->service)
+                continue;
+            if (!c->ingestMore) {
+                c->ingestBacklog = 0;
+                c->ingestBehindSince = 0;
+                continue;
+            }
+            int queued = 0;
+#ifndef _WIN32
+            ioctl(c->fd, FIONREAD, &queued);
+#endif
+            c->ingestBacklog = queued + c->buflen;
+            c->ingestDeferred++;
+            Modes.stats_current.ingest_deferred++;
+            if (!c->ingestBehindSince)
+                c->ingestBehindSince = now;
+        }
+    }
+}
+
 static void readClients() {
     uint64_t now = mstime();
+
+    ingestClients(now);
+
     for (struct net_service *s = Modes.services; s; s = s->next) {
         for (struct client *c = s->clients; c; c = c->next) {
             if (!c->service)
                 continue;
 
-            if (s->read_handler) {
-                modesReadFromClient(c);
+            if (s->udp) {
+                udpRead(c);
+                continue;
+            }
+
+            // filterable outputs read the filter handshake, input clients were read by ingestClients()
+            if (!s->read_handler && s->writer && s->writer->filterMasks && !s->writer->udp) {
+                modesReadFromClient(c, MODES_CLIENT_BUF_SIZE, 0);
+            }
+
+            // a lagging client gets the next better stream once its SendQ has stayed almost empty for a while
+            if (c->lag) {
+                if (c->sendq_len >= c->sendq_max / 16)
+                    c->sendqBusy = now;
+                else if (now > c->sendqBusy + 10 * SECONDS && now > c->lagChanged + 10 * SECONDS)
+                    clientLag(c, c->lag - 1, now);
             }
 
             // If there is a sendq, try to flush it
-            if (s->writer) {
+            if (c->service && (s->writer || c->sendq)) {
                 if (c->sendq_len == 0) {
                     c->last_flush = now;
                     continue;
@@ -3293,6 +4952,10 @@ void modesNetPeriodicWork(void) {
         }
     }
 
+    // once per pass instead of per record, readers get woken within the pass that decoded the message
+    if (Modes.shm)
+        shmRingWake(Modes.shm);
+
     serviceReconnectCallback(now);
 }
 
@@ -3313,7 +4976,7 @@ void modesReadSerialClient(void) {
             for (c = s->clients; c; c = c->next) {
                 if (!c->service)
                     continue;
-                modesReadFromClient(c);
+                modesReadFromClient(c, INT_MAX, 0);
             }
         }
     }
@@ -3730,6 +5393,7 @@ void cleanupNetwork(void) {
             nc = c->next;
 
             anetCloseSocket(c->fd);
+            clientCompressFree(c);
             c->sendq_len = 0;
             if (c->sendq) {
                 free(c->sendq);
@@ -3749,6 +5413,14 @@ void cleanupNetwork(void) {
             free(s->writer->data);
             s->writer->data = NULL;
         }
+        if (s->writer && s->writer->latencyStamps) {
+            free(s->writer->latencyStamps);
+            free(s->writer->filterMasks);
+            free(s->writer->filterEnds);
+            free(s->writer->filterFlags);
+            free(s->writer->filterRids);
+            s->writer->latencyStamps = NULL;
+        }
         if (s) free(s);
         s = ns;
     }
@@ -3768,6 +5440,13 @@ void cleanupNetwork(void) {
 
     Modes.net_connectors_count = 0;
 
+    udpOutCleanup();
+    free(udpIn.buf);
+
+    shmRingDestroy(Modes.shm);
+    Modes.shm = NULL;
+
+    httpCacheCleanup();
 }
 
 static void read_uuid(struct client *c, char *p, char *eod) {
@@ -3853,19 +5532,54 @@ struct char_buffer generateClientsJson() {
                 end = buf + buflen;
             }
 
+            // compression ratio (0 if the connection isn't compressed), then the ingest backlog:
+            // bytes pending, ticks that ended with data pending, bytes discarded (see INGEST_QUANTUM)
             double elapsed = (now - c->connectedSince) / 1000.0;
-            p = safe_snprintf(p, end, "[ \"%016"PRIx64"%016"PRIx64"\", \"%s\", %6.2f, %6.1f ],\n",
+            p = safe_snprintf(p, end, "[ \"%016"PRIx64"%016"PRIx64"\", \"%s\", %6.2f, %6.1f, %5.2f, %d, %"PRIu64", %"PRIu64" ],\n",
                     c->receiverId,
                     c->receiverId2,
                     c->proxy_string,
                     c->bytesReceived / 128.0 / elapsed,
-                    elapsed);
+                    elapsed,
+                    c->zinWire ? (double) c->zinPlain / c->zinWire : 0.0,
+                    c->ingestBacklog, c->ingestDeferred, c->ingestDiscarded);
 
             if (p >= end)
                 fprintf(stderr, "buffer overrun client json\n");
         }
     }
 
+    if (*(p-2) == ',')
+        *(p-2) = ' ';
+
+    // output clients: service, host, port, filter or reduce tier, kbit/s sent, seconds connected, lag level (LAG_*),
+    // compression ratio (0: not compressed)
+    p = safe_snprintf(p, end, "\n  ],\n  \"outputs\" : [\n");
+    for (struct net_service *s = Modes.services; s; s = s->next) {
+        if (!s->writer)
+            continue;
+        for (struct client *c = s->clients; c; c = c->next) {
+            if (!c->service)
+                continue;
+
+            if ((p + 1000) >= end) {
+                int used = p - buf;
+                buflen *= 2;
+                buf = (char *) realloc(buf, buflen);
+                p = buf + used;
+                end = buf + buflen;
+            }
+
+            char tier[32];
+            if (s->writer->reduceTiers)
+                snprintf(tier, sizeof(tier), "reduce:%g", (c->reduce_tier ? Modes.beast_reduce_tiers[c->reduce_tier - 1] : Modes.net_output_beast_reduce_interval) / 1000.0);
+            double elapsed = (now - c->connectedSince) / 1000.0;
+            p = safe_snprintf(p, end, "[ \"%s\", \"%s\", \"%s\", \"%s\", %8.2f, %6.1f, %d, %5.2f ],\n",
+                    s->descr, c->host, c->port, s->writer->reduceTiers ? tier : outFilterSpec(c->filter - 1),
+                    elapsed > 0 ? c->bytesSent / 128.0 / elapsed : 0.0, elapsed, c->lag,
+                    c->zoutWire ? (double) c->zoutPlain / c->zoutWire : 0.0);
+        }
+    }
     if (*(p-2) == ',')
         *(p-2) = ' ';
 
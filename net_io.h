@@ -29,6 +29,8 @@
 // Describes a networking service (group of connections)
 
 struct aircraft;
+struct trace_view;
+struct json_latency;
 struct modesMessage;
 struct client;
 struct net_service;
@@ -54,6 +56,16 @@ typedef enum
 
 // Describes one network service (a group of clients with common behaviour)
 
+// client classes for the labelled metrics, see clientClass()
+enum {
+    CLIENT_FEEDER = 0, // sends us messages
+    CLIENT_REQUEST = 1, // HTTP and API requests
+    CLIENT_FULL = 2, // gets the complete output stream
+    CLIENT_REDUCED = 3, // gets a beast_reduce tier
+    CLIENT_FILTERED = 4, // gets an output filter group
+    CLIENT_CLASSES
+};
+
 struct net_service
 {
     int listener_count; // number of listeners
@@ -69,8 +81,22 @@ struct net_service
     struct client *clients; // linked list of clients connected to this service
     int read_sep_len;
     const char *read_sep; // hander details for input data
+    uint64_t bytesIn; // totals over all clients, for metrics
+    uint64_t bytesOut;
+    uint64_t bytesOutClass[CLIENT_CLASSES]; // bytesOut by clientClass()
+    int udp; // one client per UDP socket receiving BEAST_UDP datagrams
 };
 
+// Compressed connections: a peer that sends this line as the first data (after
+// a PROXY header) sends a zlib stream from then on.  A listener that gets it
+// on an output port answers with the same line and compresses what it sends
+// to that client.  Both sides sync flush the stream after every write.
+// longest 0x1a 0xe3 receiverId frame, every byte of the id escaped
+#define BEAST_RID_FRAME_MAX 18
+
+#define COMPRESS_LINE "COMPRESS zlib\n"
+#define COMPRESS_LINE_LEN 14
+
 // Client connection
 struct net_connector
 {
@@ -80,6 +106,9 @@ struct net_connector
     int use_addr;
     char *port;
     char *protocol;
+    char *filter; // output filter spec (outfilter.h)
+    char *reduce; // beast_reduce interval in seconds, picks the tier
+    int compress; // announce and send a compressed stream
     struct net_service *service;
     int connected;
     int connecting;
@@ -96,6 +125,24 @@ struct net_connector
     pthread_mutex_t mutex;
 };
 
+// Slow clients of the filterable outputs are degraded before they are dropped
+enum {
+    LAG_NONE = 0,
+    LAG_REDUCED = 1, // only what beast_reduce tier 0 would forward
+    LAG_POSITIONS = 2, // only reduced messages with a position
+};
+
+// Input clients are read in rounds (readClients): every round each client with
+// data pending may read INGEST_QUANTUM more bytes, until all are drained or
+// INGEST_TICK_TIME is used up.  A client that still has data when the time is
+// up keeps the credit for its missed turn (deficit round robin), so a busy
+// feeder early in the client list can't starve the ones after it.  A client
+// that stays behind for INGEST_DISCARD_AFTER has its pending data discarded.
+#define INGEST_QUANTUM (16 * 1024)
+#define INGEST_DEFICIT_MAX (4 * INGEST_QUANTUM)
+#define INGEST_TICK_TIME 100 // ms
+#define INGEST_DISCARD_AFTER (2 * SECONDS)
+
 // Structure used to describe a networking client
 
 struct client
@@ -110,9 +157,31 @@ struct client
     uint64_t last_flush;
     uint64_t last_send;
     uint64_t last_read;  // This is used on write-only clients to help check for dead connections
+    uint64_t readMicros; // microtime() of the last successful read, for latency stats
     uint64_t connectedSince;
     char modeac_requested; // 1 if this Beast output connection has asked for A/C
     char receiverIdLocked; // receiverId has been transmitted by other side.
+    char closeWhenFlushed; // close the connection once the SendQ is empty (HTTP)
+    int filter; // output filter group + 1 (outfilter.h), 0: unfiltered
+    int reduce_tier; // beast_reduce tier
+    uint64_t lastReceiverId; // last receiverId frame a filtered beast client got
+    int lag; // LAG_*
+    uint64_t lagChanged;
+    uint64_t sendqBusy; // last time a lagging client's SendQ was seen above sendq_max / 16
+    uint64_t bytesSent;
+    z_stream *zin; // inflating what the client sends, NULL if not compressed
+    z_stream *zout; // deflating what is sent to the client
+    char *zbuf; // compressed data read from the socket, zin->next_in points into it
+    uint64_t zinWire; // received compressed bytes
+    uint64_t zinPlain; // and after inflating
+    uint64_t zoutPlain; // bytes sent before deflating
+    uint64_t zoutWire; // and after
+    int ingestDeficit; // bytes the client may read in the current round
+    int ingestMore; // the last read used up the budget, more data is likely pending
+    int ingestBacklog; // bytes pending in the socket at the end of the last tick that didn't drain it
+    uint64_t ingestBehindSince; // ticks end with data pending since then, 0: caught up
+    uint64_t ingestDeferred; // ticks that ended with data pending
+    uint64_t ingestDiscarded; // bytes discarded to catch up
     void *sendq;  // Write buffer - allocated later
     int sendq_len; // Amount of data in SendQ
     int sendq_max; // Max size of SendQ
@@ -124,6 +193,10 @@ struct client
     char port[NI_MAXSERV];
 };
 
+// per message flags kept by the filterable writers for lagging clients
+#define WRITE_REDUCED 0x1
+#define WRITE_POSITION 0x2
+
 // Common writer state for all output sockets of one type
 
 struct net_writer
@@ -137,8 +210,30 @@ struct net_writer
     heartbeat_fn send_heartbeat; // function that queues a heartbeat if needed
     uint64_t lastWrite; // time of last write to clients
     uint64_t lastReceiverId;
+    uint64_t *latencyStamps; // sysMicros of the messages in the buffer, NULL if latency isn't measured
+    int latencyCount;
+    int latencyType; // latency_type_t, see stats.h
+    uint64_t *filterMasks; // output filter groups each message in the buffer passes, NULL if not filterable
+    int *filterEnds; // end offset of each message in the buffer
+    uint8_t *filterFlags; // WRITE_* of each message in the buffer
+    uint64_t *filterRids; // receiverId in effect for each message (beast with --net-receiver-id)
+    int filterCount;
+    int reduceTiers; // beast_reduce: the masks are the tiers of the messages instead of filter groups
+    int udp; // the clients are UDP sockets, the buffer is sent as BEAST_UDP datagrams
 };
 
+// Beast over UDP (--net-beast-udp-out)
+//
+// Every datagram starts with a header, all fields big-endian:
+//   uint32 magic, BEAST_UDP_MAGIC
+//   uint32 sequence number, +1 for every datagram of a sender
+//   uint64 sender id, random per start of the sender
+// followed by complete beast frames escaped as on TCP, a frame is never split.
+// The receiverId frame (0x1a 0xe3) in effect is repeated at the start of a
+// datagram, a lost datagram doesn't mix up the receivers of the messages.
+#define BEAST_UDP_MAGIC 0x52425531 // "RBU1"
+#define BEAST_UDP_HEADER_LEN 16
+
 struct net_service *serviceInit (const char *descr, struct net_writer *writer, heartbeat_fn hb_handler, read_mode_t mode, const char *sep, read_fn read_handler);
 struct client *serviceConnect(struct net_connector *con);
 void serviceReconnectCallback(uint64_t now);
@@ -162,22 +257,34 @@ void sendBeastSettings (int fd, const char *settings);
 void modesInitNet (void);
 void modesQueueOutput (struct modesMessage *mm, struct aircraft *a);
 void jsonPositionOutput(struct modesMessage *mm, struct aircraft *a);
+// position record for the shared memory ring (--net-shm)
+void shmPositionOutput(struct modesMessage *mm, struct aircraft *a);
 void modesNetSecondWork(void);
 void modesNetPeriodicWork (void);
 void modesReadSerialClient(void);
 void cleanupNetwork(void);
 void netFreeClients();
+int clientClass(struct client *c);
+const char *clientClassName(int cls);
+int netFeedersConfigured();
+int netLagConfigured();
 
 // TODO: move these somewhere else
-struct char_buffer generateAircraftJson();
+struct char_buffer generateAircraftJson(struct json_latency *jl);
 struct char_buffer generateGlobeBin(int globe_index);
 struct char_buffer generateGlobeJson(int globe_index);
-struct char_buffer generateTraceJson(struct aircraft *a, int start, int last);
+struct char_buffer generateGlobeTilesJson();
+struct char_buffer generateTraceJson(struct trace_view *v, int start, int last);
+// closes the json from generateTraceJsonPart()
+#define TRACE_JSON_TAIL " ]\n }\n"
+struct char_buffer generateTraceJsonPart(struct trace_view *v, int start, int last, uint64_t base, int head);
 struct char_buffer generateReceiverJson ();
 struct char_buffer generateHistoryJson ();
 struct char_buffer generateClientsJson();
 void writeJsonToFile (const char* dir, const char *file, struct char_buffer cb);
-void writeJsonToGzip (const char* dir, const char *file, struct char_buffer cb, int gzip);
+void writeJsonToGzip (const char* dir, const char *file, struct char_buffer cb, int zclass);
+void publishJson(const char *file, struct char_buffer cb, int zclass);
+void httpCachePut(const char *file, struct char_buffer cb, int zclass);
 struct char_buffer generateVRS(int part, int n_parts, int reduced_data);
 void writeJsonToNet(struct net_writer *writer, struct char_buffer cb);
 
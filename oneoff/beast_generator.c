@@ -0,0 +1,576 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// beast_generator.c: synthetic beast traffic generator for load testing
+//
+// Simulates a number of aircraft flying straight tracks inside a circular
+// area and a number of feeders with overlapping coverage.  Every feeder
+// opens its own TCP connection to a beast input port and receives the
+// DF17 messages (position / velocity / identification) of the aircraft in
+// its range, framed exactly like modesSendBeastOutput() does it, including
+// the 0x1a 0xe3 receiverId prefix.
+//
+// Usage example (100k msg/s, 2000 aircraft, 500 feeders):
+//   oneoff/beast_generator --connect 127.0.0.1:30004 --rate 100000 --aircraft 2000 --feeders 500
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "../readsb.h"
+
+#include <getopt.h>
+#include <poll.h>
+
+#define GEN_TICK_MS 10
+#define GEN_SENDQ_SIZE (256 * 1024)
+#define GEN_RECONNECT_MS 5000
+#define GEN_STATS_MS 10000
+#define EARTH_RADIUS_KM 6371.0
+
+struct sim_aircraft {
+    uint32_t addr;
+    double lat;
+    double lon;
+    double alt; // ft
+    double gs; // kt
+    double track; // deg
+    double rate; // ft/min
+    char callsign[9];
+    uint32_t counter;
+};
+
+struct feeder {
+    double lat;
+    double lon;
+    uint64_t receiverId;
+    int fd;
+    int connecting;
+    int idSent;
+    uint64_t next_connect;
+    uint64_t clock_offset;
+    char *sendq;
+    int sendq_len;
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t dropped;
+};
+
+static struct {
+    char *host;
+    char *port;
+    int n_aircraft;
+    int n_feeders;
+    double rate; // messages per second generated (before coverage fan-out)
+    double center_lat;
+    double center_lon;
+    double area_km; // radius of the simulated area
+    double range_km; // receive range of a single feeder
+    int duration; // seconds, 0 = forever
+    unsigned seed;
+} gen = {
+    .host = "127.0.0.1",
+    .port = "30004",
+    .n_aircraft = 500,
+    .n_feeders = 50,
+    .rate = 10000,
+    .center_lat = 50.0,
+    .center_lon = 10.0,
+    .area_km = 800,
+    .range_km = 350,
+    .seed = 1,
+};
+
+static volatile sig_atomic_t exitNow;
+
+static void sigintHandler(int dummy) {
+    MODES_NOTUSED(dummy);
+    exitNow = 1;
+}
+
+static double frand(double min, double max) {
+    return min + (max - min) * (random() / (RAND_MAX + 1.0));
+}
+
+static double distance_km(double lat0, double lon0, double lat1, double lon1) {
+    double dlat = (lat1 - lat0) * M_PI / 180.0;
+    double dlon = (lon1 - lon0) * M_PI / 180.0 * cos((lat0 + lat1) / 2 * M_PI / 180.0);
+    return EARTH_RADIUS_KM * sqrt(dlat * dlat + dlon * dlon);
+}
+
+// random point inside a circle of radius km around lat / lon
+static void random_position(double radius, double *lat, double *lon) {
+    double r = radius * sqrt(frand(0, 1));
+    double phi = frand(0, 2 * M_PI);
+    *lat = gen.center_lat + (r * cos(phi) / EARTH_RADIUS_KM) * 180.0 / M_PI;
+    *lon = gen.center_lon + (r * sin(phi) / EARTH_RADIUS_KM) * 180.0 / M_PI / cos(gen.center_lat * M_PI / 180.0);
+}
+
+//
+// DF17 message construction
+//
+
+static void setBits(uint8_t *msg, int firstbit, int lastbit, uint32_t value) {
+    for (int bit = lastbit; bit >= firstbit; bit--) {
+        int byte = (bit - 1) / 8;
+        int shift = 7 - ((bit - 1) % 8);
+        if (value & 1)
+            msg[byte] |= (1 << shift);
+        else
+            msg[byte] &= ~(1 << shift);
+        value >>= 1;
+    }
+}
+
+static void df17Header(uint8_t *msg, uint32_t addr) {
+    memset(msg, 0, MODES_LONG_MSG_BYTES);
+    msg[0] = (17 << 3) | 5; // DF17, CA 5 (airborne)
+    msg[1] = addr >> 16;
+    msg[2] = addr >> 8;
+    msg[3] = addr;
+}
+
+static void df17Parity(uint8_t *msg) {
+    uint32_t crc = modesChecksum(msg, MODES_LONG_MSG_BITS);
+    msg[11] = crc >> 16;
+    msg[12] = crc >> 8;
+    msg[13] = crc;
+}
+
+static void encodeAirbornePosition(uint8_t *msg, struct sim_aircraft *a, int fflag) {
+    df17Header(msg, a->addr);
+    setBits(msg, 33, 37, 11); // TC 11, NUCp 7
+
+    // 25 ft altitude encoding with the Q bit set
+    int n = (int) nearbyint((a->alt + 1000) / 25);
+    if (n < 0)
+        n = 0;
+    uint32_t ac12 = ((n & 0x7F0) << 1) | 0x10 | (n & 0x0F);
+    setBits(msg, 41, 52, ac12);
+
+    int cprlat, cprlon;
+    encodeCPRairborne(a->lat, a->lon, fflag, &cprlat, &cprlon);
+    setBits(msg, 54, 54, fflag);
+    setBits(msg, 55, 71, cprlat);
+    setBits(msg, 72, 88, cprlon);
+    df17Parity(msg);
+}
+
+static void encodeVelocity(uint8_t *msg, struct sim_aircraft *a) {
+    df17Header(msg, a->addr);
+    setBits(msg, 33, 37, 19);
+    setBits(msg, 38, 40, 1); // subtype 1: ground speed, subsonic
+
+    double vew = a->gs * sin(a->track * M_PI / 180.0);
+    double vns = a->gs * cos(a->track * M_PI / 180.0);
+    int ew = (int) nearbyint(fabs(vew)) + 1;
+    int ns = (int) nearbyint(fabs(vns)) + 1;
+    if (ew > 1023)
+        ew = 1023;
+    if (ns > 1023)
+        ns = 1023;
+
+    setBits(msg, 46, 46, vew < 0);
+    setBits(msg, 47, 56, ew);
+    setBits(msg, 57, 57, vns < 0);
+    setBits(msg, 58, 67, ns);
+
+    int vr = (int) nearbyint(fabs(a->rate) / 64) + 1;
+    if (vr > 511)
+        vr = 511;
+    setBits(msg, 68, 68, 1); // baro rate
+    setBits(msg, 69, 69, a->rate < 0);
+    setBits(msg, 70, 78, vr);
+    df17Parity(msg);
+}
+
+static void encodeIdent(uint8_t *msg, struct sim_aircraft *a) {
+    df17Header(msg, a->addr);
+    setBits(msg, 33, 37, 4);
+    setBits(msg, 38, 40, 3); // category A3
+    for (int i = 0; i < 8; i++) {
+        char c = a->callsign[i];
+        uint32_t v = 32; // space
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A' + 1;
+        else if (c >= '0' && c <= '9')
+            v = c;
+        setBits(msg, 41 + 6 * i, 46 + 6 * i, v);
+    }
+    df17Parity(msg);
+}
+
+//
+// beast framing, same as modesSendBeastOutput in net_io.c
+//
+
+static inline char *beastByte(char *p, unsigned char ch) {
+    *p++ = ch;
+    if (0x1A == ch)
+        *p++ = ch;
+    return p;
+}
+
+static void queueBeast(struct feeder *f, uint8_t *msg, uint64_t timestamp, unsigned char sig) {
+    // worst case: receiverId message + escaped long message
+    if (f->sendq_len + 2 + 2 * (7 + 8 + MODES_LONG_MSG_BYTES) > GEN_SENDQ_SIZE) {
+        f->dropped++;
+        return;
+    }
+
+    char *p = f->sendq + f->sendq_len;
+
+    if (!f->idSent) {
+        f->idSent = 1;
+        *p++ = 0x1a;
+        *p++ = 0xe3;
+        for (int i = 7; i >= 0; i--)
+            p = beastByte(p, (f->receiverId >> (8 * i)) & 0xFF);
+    }
+
+    *p++ = 0x1a;
+    *p++ = '3';
+    for (int i = 5; i >= 0; i--)
+        p = beastByte(p, (timestamp >> (8 * i)) & 0xFF);
+    p = beastByte(p, sig);
+    for (int i = 0; i < MODES_LONG_MSG_BYTES; i++)
+        p = beastByte(p, msg[i]);
+
+    f->sendq_len = p - f->sendq;
+    f->frames++;
+}
+
+//
+// feeder connections
+//
+
+static void feederDisconnect(struct feeder *f, uint64_t now) {
+    if (f->fd >= 0)
+        anetCloseSocket(f->fd);
+    f->fd = -1;
+    f->connecting = 0;
+    f->sendq_len = 0;
+    f->next_connect = now + GEN_RECONNECT_MS;
+}
+
+static void feederConnect(struct feeder *f, uint64_t now) {
+    char err[ANET_ERR_LEN];
+    f->fd = anetTcpNonBlockConnect(err, gen.host, gen.port, NULL);
+    if (f->fd < 0) {
+        static uint64_t antiSpam;
+        if (now > antiSpam) {
+            fprintf(stderr, "%s:%s: %s\n", gen.host, gen.port, err);
+            antiSpam = now + GEN_RECONNECT_MS;
+        }
+        f->fd = -1;
+        f->next_connect = now + GEN_RECONNECT_MS;
+        return;
+    }
+    f->connecting = 1;
+    f->idSent = 0;
+    f->sendq_len = 0;
+}
+
+static void feederFlush(struct feeder *f, uint64_t now) {
+    if (f->connecting) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (getsockopt(f->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+            feederDisconnect(f, now);
+            return;
+        }
+        f->connecting = 0;
+    }
+    if (!f->sendq_len)
+        return;
+
+    int nwritten = send(f->fd, f->sendq, f->sendq_len, MSG_NOSIGNAL);
+    if (nwritten < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            feederDisconnect(f, now);
+        return;
+    }
+    f->bytes += nwritten;
+    f->sendq_len -= nwritten;
+    if (f->sendq_len)
+        memmove(f->sendq, f->sendq + nwritten, f->sendq_len);
+}
+
+//
+// simulation
+//
+
+static void initAircraft(struct sim_aircraft *a, int i) {
+    a->addr = 0x100000 + (i * 2654435761u) % 0xE00000;
+    random_position(gen.area_km, &a->lat, &a->lon);
+    a->alt = 1000 * (int) frand(5, 41);
+    a->gs = frand(180, 520);
+    a->track = frand(0, 360);
+    a->rate = 0;
+    a->counter = random();
+    snprintf(a->callsign, sizeof(a->callsign), "GEN%05d", i % 100000);
+}
+
+static void moveAircraft(struct sim_aircraft *a, double seconds) {
+    double km = a->gs * 1.852 * seconds / 3600.0;
+    double dlat = km * cos(a->track * M_PI / 180.0) / EARTH_RADIUS_KM * 180.0 / M_PI;
+    double dlon = km * sin(a->track * M_PI / 180.0) / EARTH_RADIUS_KM * 180.0 / M_PI / cos(a->lat * M_PI / 180.0);
+    a->lat += dlat;
+    a->lon += dlon;
+
+    // gentle wandering in heading and altitude to keep tracks plausible
+    a->track = fmod(a->track + frand(-0.5, 0.5) * seconds + 360, 360);
+    if (random() % 2000 == 0)
+        a->rate = (a->rate == 0) ? (frand(0, 1) < 0.5 ? -1500 : 1500) : 0;
+    a->alt += a->rate * seconds / 60.0;
+    if (a->alt < 2000 || a->alt > 43000)
+        a->rate = -a->rate;
+
+    // turn back when leaving the simulated area
+    if (distance_km(gen.center_lat, gen.center_lon, a->lat, a->lon) > gen.area_km)
+        a->track = fmod(a->track + 180, 360);
+}
+
+static void generateMessage(struct sim_aircraft *a, struct feeder *feeders, uint64_t now) {
+    uint8_t msg[MODES_LONG_MSG_BYTES];
+
+    // roughly the mix a real transponder produces:
+    // 2 positions, 2 velocities per second, an ident every 5 seconds
+    uint32_t c = a->counter++;
+    if (c % 20 == 0)
+        encodeIdent(msg, a);
+    else if (c % 2 == 0)
+        encodeVelocity(msg, a);
+    else
+        encodeAirbornePosition(msg, a, (c / 2) % 2);
+
+    for (int j = 0; j < gen.n_feeders; j++) {
+        struct feeder *f = &feeders[j];
+        if (f->fd < 0 || f->connecting)
+            continue;
+        double dist = distance_km(f->lat, f->lon, a->lat, a->lon);
+        if (dist > gen.range_km)
+            continue;
+        // 12 MHz counter, different epoch per feeder
+        uint64_t timestamp = (now * 12000 + f->clock_offset) & 0xFFFFFFFFFFFF;
+        double level = 1.0 - dist / gen.range_km;
+        unsigned char sig = (unsigned char) (10 + 200 * level * level);
+        queueBeast(f, msg, timestamp, sig);
+    }
+}
+
+static void showStats(struct feeder *feeders, uint64_t generated, uint64_t elapsed) {
+    uint64_t frames = 0, bytes = 0, dropped = 0, queued = 0;
+    int connected = 0;
+    for (int j = 0; j < gen.n_feeders; j++) {
+        struct feeder *f = &feeders[j];
+        frames += f->frames;
+        bytes += f->bytes;
+        dropped += f->dropped;
+        queued += f->sendq_len;
+        if (f->fd >= 0 && !f->connecting)
+            connected++;
+    }
+    double secs = elapsed / 1000.0;
+    fprintf(stderr, "%6.0fs: %d/%d feeders connected, generated %.0f msg/s, queued %.0f frames/s, "
+            "sent %.2f MB/s, dropped %.0f frames/s (sendq full), %"PRIu64" bytes pending\n",
+            secs, connected, gen.n_feeders, generated / secs, frames / secs,
+            bytes / secs / 1e6, dropped / secs, queued);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  --connect <host:port>   beast input to feed (default 127.0.0.1:30004)\n"
+            "  --rate <msg/s>          messages generated per second, before coverage fan-out (default 10000)\n"
+            "  --aircraft <n>          simulated aircraft (default 500)\n"
+            "  --feeders <n>           simulated feeders / TCP connections (default 50)\n"
+            "  --center <lat,lon>      center of the simulated area (default 50,10)\n"
+            "  --area <km>             radius of the simulated area (default 800)\n"
+            "  --range <km>            receive range of a feeder (default 350)\n"
+            "  --duration <s>          stop after this many seconds (default: run until interrupted)\n"
+            "  --seed <n>              random seed (default 1)\n",
+            name);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    static struct option long_options[] = {
+        {"connect", required_argument, 0, 'c'},
+        {"rate", required_argument, 0, 'r'},
+        {"aircraft", required_argument, 0, 'a'},
+        {"feeders", required_argument, 0, 'f'},
+        {"center", required_argument, 0, 'C'},
+        {"area", required_argument, 0, 'A'},
+        {"range", required_argument, 0, 'R'},
+        {"duration", required_argument, 0, 'd'},
+        {"seed", required_argument, 0, 's'},
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+        char *sep;
+        switch (opt) {
+            case 'c':
+                gen.host = strdup(optarg);
+                sep = strrchr(gen.host, ':');
+                if (!sep)
+                    usage(argv[0]);
+                *sep = '\0';
+                gen.port = sep + 1;
+                break;
+            case 'r':
+                gen.rate = atof(optarg);
+                break;
+            case 'a':
+                gen.n_aircraft = atoi(optarg);
+                break;
+            case 'f':
+                gen.n_feeders = atoi(optarg);
+                break;
+            case 'C':
+                if (sscanf(optarg, "%lf,%lf", &gen.center_lat, &gen.center_lon) != 2)
+                    usage(argv[0]);
+                break;
+            case 'A':
+                gen.area_km = atof(optarg);
+                break;
+            case 'R':
+                gen.range_km = atof(optarg);
+                break;
+            case 'd':
+                gen.duration = atoi(optarg);
+                break;
+            case 's':
+                gen.seed = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (gen.n_aircraft < 1 || gen.n_feeders < 1 || gen.rate <= 0 || gen.range_km <= 0 || gen.area_km <= 0)
+        usage(argv[0]);
+
+    signal(SIGINT, sigintHandler);
+    signal(SIGTERM, sigintHandler);
+    signal(SIGPIPE, SIG_IGN);
+
+    srandom(gen.seed);
+    modesChecksumInit(0);
+
+    struct sim_aircraft *aircraft = calloc(gen.n_aircraft, sizeof(struct sim_aircraft));
+    struct feeder *feeders = calloc(gen.n_feeders, sizeof(struct feeder));
+    struct pollfd *pfds = calloc(gen.n_feeders, sizeof(struct pollfd));
+    if (!aircraft || !feeders || !pfds) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+
+    for (int i = 0; i < gen.n_aircraft; i++)
+        initAircraft(&aircraft[i], i);
+
+    for (int j = 0; j < gen.n_feeders; j++) {
+        struct feeder *f = &feeders[j];
+        // feeders are placed in the inner part of the area so coverage overlaps
+        random_position(gen.area_km * 0.8, &f->lat, &f->lon);
+        f->receiverId = ((uint64_t) random() << 32) | (uint64_t) random();
+        f->clock_offset = ((uint64_t) random() << 16) ^ random();
+        f->fd = -1;
+        f->sendq = malloc(GEN_SENDQ_SIZE);
+        if (!f->sendq) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+
+    uint64_t start = mstime();
+    uint64_t last = start;
+    uint64_t next_stats = start + GEN_STATS_MS;
+    uint64_t generated = 0;
+    double owed = 0;
+    int next_aircraft = 0;
+
+    while (!exitNow) {
+        uint64_t now = mstime();
+        if (gen.duration && now > start + gen.duration * 1000ULL)
+            break;
+
+        double elapsed = (now - last) / 1000.0;
+        last = now;
+
+        for (int j = 0; j < gen.n_feeders; j++) {
+            if (feeders[j].fd < 0 && now >= feeders[j].next_connect)
+                feederConnect(&feeders[j], now);
+        }
+
+        for (int i = 0; i < gen.n_aircraft; i++)
+            moveAircraft(&aircraft[i], elapsed);
+
+        owed += gen.rate * elapsed;
+        // don't accumulate a huge backlog if we fell behind
+        if (owed > gen.rate)
+            owed = gen.rate;
+        while (owed >= 1) {
+            generateMessage(&aircraft[next_aircraft], feeders, now);
+            next_aircraft = (next_aircraft + 1) % gen.n_aircraft;
+            generated++;
+            owed -= 1;
+        }
+
+        int n = 0;
+        for (int j = 0; j < gen.n_feeders; j++) {
+            struct feeder *f = &feeders[j];
+            if (f->fd < 0 || (!f->connecting && !f->sendq_len))
+                continue;
+            pfds[n].fd = f->fd;
+            pfds[n].events = POLLOUT;
+            pfds[n].revents = 0;
+            n++;
+        }
+        // wait for writability until the next tick
+        int64_t wait = (int64_t) now + GEN_TICK_MS - (int64_t) mstime();
+        if (wait < 0)
+            wait = 0;
+        if (n)
+            poll(pfds, n, wait);
+        else if (wait)
+            usleep(wait * 1000);
+
+        now = mstime();
+        for (int j = 0, k = 0; j < gen.n_feeders && k < n; j++) {
+            struct feeder *f = &feeders[j];
+            if (f->fd != pfds[k].fd)
+                continue;
+            if (pfds[k].revents & (POLLOUT | POLLERR | POLLHUP))
+                feederFlush(f, now);
+            k++;
+        }
+
+        if (now > next_stats) {
+            showStats(feeders, generated, now - start);
+            next_stats = now + GEN_STATS_MS;
+        }
+    }
+
+    showStats(feeders, generated, mstime() - start);
+
+    for (int j = 0; j < gen.n_feeders; j++) {
+        if (feeders[j].fd >= 0)
+            anetCloseSocket(feeders[j].fd);
+        free(feeders[j].sendq);
+    }
+    free(pfds);
+    free(feeders);
+    free(aircraft);
+    crcCleanupTables();
+    return 0;
+}
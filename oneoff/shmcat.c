@@ -0,0 +1,147 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// shmcat.c: read the shared memory ring of readsb (--net-shm)
+//
+// Usage:
+//   oneoff/shmcat <name> beast        beast stream to stdout, like a beast_out connection
+//   oneoff/shmcat <name> positions    one line per position
+//   oneoff/shmcat <name> count        records per second, lost records and position delay
+//
+// Reference reader for the ring described in shmring.h.  Waits for readsb to
+// create the ring and attaches again when readsb restarts.
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "../readsb.h"
+
+enum { MODE_BEAST, MODE_POSITIONS, MODE_COUNT };
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s <name> beast|positions|count\n", name);
+    exit(1);
+}
+
+static void writeAll(const char *buf, size_t len) {
+    while (len) {
+        ssize_t res = write(STDOUT_FILENO, buf, len);
+        if (res <= 0) {
+            if (res < 0 && errno == EINTR)
+                continue;
+            exit(0); // reader of the pipe went away
+        }
+        buf += res;
+        len -= res;
+    }
+}
+
+static void beastOut(struct shm_record *rec, const char *data, uint64_t *lastReceiverId) {
+    if (rec->receiverId != *lastReceiverId) {
+        char id[2 + 16];
+        char *p = id;
+        unsigned char ch;
+        *lastReceiverId = rec->receiverId;
+        *p++ = 0x1a;
+        *p++ = 0xe3;
+        for (int i = 7; i >= 0; i--) {
+            *p++ = (ch = ((rec->receiverId >> (8 * i)) & 0xFF));
+            if (0x1A == ch)
+                *p++ = ch;
+        }
+        writeAll(id, p - id);
+    }
+    writeAll(data, rec->len);
+}
+
+static void positionOut(const struct shm_position *pos) {
+    printf("%.3f %s%06x %s %11.6f %11.6f", pos->timestamp / 1000.0, (pos->addr & MODES_NON_ICAO_ADDRESS) ? "~" : " ",
+            pos->addr & 0xFFFFFF, (pos->flags & SHM_POS_GROUND) ? "gnd" : "air", pos->lat, pos->lon);
+    if (pos->flags & SHM_POS_ALT_BARO)
+        printf(" alt %6d", pos->alt_baro);
+    if (pos->flags & SHM_POS_GS)
+        printf(" gs %5.1f", pos->gs);
+    if (pos->flags & SHM_POS_TRACK)
+        printf(" trk %5.1f", pos->track);
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3)
+        usage(argv[0]);
+    int mode;
+    if (!strcmp(argv[2], "beast"))
+        mode = MODE_BEAST;
+    else if (!strcmp(argv[2], "positions"))
+        mode = MODE_POSITIONS;
+    else if (!strcmp(argv[2], "count"))
+        mode = MODE_COUNT;
+    else
+        usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    struct shm_ring *ring = NULL;
+    struct shm_record rec;
+    char buf[4096];
+    uint64_t lastReceiverId = 0;
+    uint64_t records = 0, beast = 0, positions = 0, maxDelay = 0;
+    uint64_t nextReport = mstime() + 1000;
+
+    while (1) {
+        if (!ring) {
+            ring = shmRingAttach(argv[1]);
+            if (!ring) {
+                sleep(1);
+                continue;
+            }
+            fprintf(stderr, "attached to %s, ring size %llu\n", argv[1], (unsigned long long) ring->size);
+            lastReceiverId = 0;
+        }
+
+        int res = shmRingRead(ring, &rec, buf, sizeof(buf));
+        if (res < 0) {
+            fprintf(stderr, "readsb restarted or stopped, attaching again\n");
+            shmRingDetach(ring);
+            ring = NULL;
+            continue;
+        }
+        if (res == 0) {
+            if (mode == MODE_POSITIONS)
+                fflush(stdout);
+            shmRingWait(ring, 100);
+        } else if (rec.len <= sizeof(buf)) {
+            records++;
+            if (rec.type == SHM_RECORD_BEAST) {
+                beast++;
+                if (mode == MODE_BEAST)
+                    beastOut(&rec, buf, &lastReceiverId);
+            } else if (rec.type == SHM_RECORD_POSITION && rec.len >= sizeof(struct shm_position)) {
+                struct shm_position *pos = (struct shm_position *) buf;
+                uint64_t now = mstime();
+                positions++;
+                if (now > pos->timestamp && now - pos->timestamp > maxDelay)
+                    maxDelay = now - pos->timestamp;
+                if (mode == MODE_POSITIONS)
+                    positionOut(pos);
+            }
+        }
+
+        if (mode == MODE_COUNT && mstime() >= nextReport) {
+            nextReport += 1000;
+            printf("records %llu beast %llu positions %llu lost %llu max position delay %llu ms\n",
+                    (unsigned long long) records, (unsigned long long) beast, (unsigned long long) positions,
+                    (unsigned long long) ring->lost, (unsigned long long) maxDelay);
+            fflush(stdout);
+            records = beast = positions = maxDelay = 0;
+        }
+    }
+}
@@ -0,0 +1,265 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// tracepack.c: read, seal and benchmark globe_history pack files (--history-packs)
+//
+// Usage:
+//   oneoff/tracepack list <pack>               aircraft in the pack with record count and size
+//   oneoff/tracepack get <pack> <hex>          gzip trace_full json of one aircraft to stdout
+//   oneoff/tracepack seal <pack>...            append the index (readsb does this after the day)
+//   oneoff/tracepack bench <dir> [aircraft] [writes] [bytes] [fsync]
+//
+// bench simulates one day of history writes below <dir>, once the way the
+// history was written before (one file per aircraft, rewritten through a
+// temp file and rename), once with per aircraft files extended in place and
+// once with pack files, and reports the file system operations and the time
+// for each.  With fsync every write is synced, which makes the numbers
+// reflect the IOPS of the device.
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "../readsb.h"
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "usage: %s list <pack>\n"
+            "       %s get <pack> <hex>\n"
+            "       %s seal <pack>...\n"
+            "       %s bench <dir> [aircraft] [writes] [bytes] [fsync]\n",
+            name, name, name, name);
+    exit(1);
+}
+
+static int openRefs(const char *path, struct tracepack_ref **refs, uint32_t *count) {
+    uint64_t end;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (tracePackRefs(fd, refs, count, &end) < 0) {
+        fprintf(stderr, "%s: reading the index failed\n", path);
+        exit(1);
+    }
+    return fd;
+}
+
+static int cmdList(const char *path) {
+    struct tracepack_ref *refs;
+    uint32_t count;
+    int fd = openRefs(path, &refs, &count);
+    for (uint32_t i = 0; i < count;) {
+        uint32_t j = i;
+        uint64_t bytes = 0;
+        while (j < count && refs[j].addr == refs[i].addr)
+            bytes += refs[j++].len;
+        printf("%s%06x records %u bytes %llu\n", (refs[i].addr & MODES_NON_ICAO_ADDRESS) ? "~" : "",
+                refs[i].addr & 0xFFFFFF, j - i, (unsigned long long) bytes);
+        i = j;
+    }
+    free(refs);
+    close(fd);
+    return 0;
+}
+
+static int cmdGet(const char *path, const char *hex) {
+    struct tracepack_ref *refs;
+    uint32_t count;
+    uint32_t addr = strtoul(hex[0] == '~' ? hex + 1 : hex, NULL, 16);
+    if (hex[0] == '~')
+        addr |= MODES_NON_ICAO_ADDRESS;
+    int fd = openRefs(path, &refs, &count);
+    int res = tracePackExtract(fd, refs, count, addr, STDOUT_FILENO);
+    if (res < 0)
+        fprintf(stderr, "%s: %s not found or unreadable\n", path, hex);
+    free(refs);
+    close(fd);
+    return res < 0 ? 1 : 0;
+}
+
+// benchmark
+
+struct bench {
+    const char *dir;
+    int aircraft;
+    int writes;
+    int bytes;
+    int sync;
+    char *data;
+    uint64_t ops; // syscalls changing the file system
+    uint64_t written;
+    uint64_t created; // inodes created
+};
+
+static void benchWrite(struct bench *b, int fd, const void *buf, size_t len, off_t offset) {
+    ssize_t res = offset < 0 ? write(fd, buf, len) : pwrite(fd, buf, len, offset);
+    if (res != (ssize_t) len) {
+        perror("bench write");
+        exit(1);
+    }
+    if (b->sync)
+        fdatasync(fd);
+    b->ops++;
+    b->written += len;
+}
+
+static void benchMkdirs(struct bench *b, const char *mode) {
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s/%s", b->dir, mode);
+    mkdir(path, 0755);
+    for (int i = 0; i < 256 && strcmp(mode, "pack"); i++) {
+        snprintf(path, PATH_MAX, "%s/%s/%02x", b->dir, mode, i);
+        mkdir(path, 0755);
+        b->ops++;
+        b->created++;
+    }
+}
+
+static void benchRun(struct bench *b, const char *mode) {
+    char path[PATH_MAX];
+    char tmppath[PATH_MAX + 32];
+    int *packs = NULL;
+    struct timespec start, end;
+
+    b->ops = b->written = b->created = 0;
+    benchMkdirs(b, mode);
+
+    if (!strcmp(mode, "pack")) {
+        packs = malloc(TRACE_PACKS * sizeof(int));
+        for (int i = 0; i < TRACE_PACKS; i++)
+            packs[i] = -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int w = 0; w < b->writes; w++) {
+        for (int k = 0; k < b->aircraft; k++) {
+            uint32_t addr = 0x100000 + k * 7919;
+            if (!strcmp(mode, "rewrite")) {
+                snprintf(path, PATH_MAX, "%s/%s/%02x/trace_full_%06x.json", b->dir, mode, addr % 256, addr);
+                snprintf(tmppath, sizeof(tmppath), "%s.%lx", path, random());
+                int fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+                if (fd < 0) {
+                    perror(tmppath);
+                    exit(1);
+                }
+                b->ops++;
+                b->created++;
+                // the whole day so far
+                benchWrite(b, fd, b->data, (size_t) (w + 1) * b->bytes, -1);
+                close(fd);
+                rename(tmppath, path);
+                b->ops++;
+            } else if (!strcmp(mode, "append")) {
+                snprintf(path, PATH_MAX, "%s/%s/%02x/trace_full_%06x.json", b->dir, mode, addr % 256, addr);
+                int fd = open(path, O_WRONLY | O_CREAT, 0644);
+                if (fd < 0) {
+                    perror(path);
+                    exit(1);
+                }
+                if (w == 0) {
+                    b->ops++;
+                    b->created++;
+                }
+                benchWrite(b, fd, b->data, b->bytes, (off_t) w * b->bytes);
+                close(fd);
+            } else {
+                int *fd = &packs[addr % TRACE_PACKS];
+                if (*fd < 0) {
+                    snprintf(path, PATH_MAX, "%s/%s/pack_%02x", b->dir, mode, addr % TRACE_PACKS);
+                    *fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_TRUNC, 0644);
+                    if (*fd < 0) {
+                        perror(path);
+                        exit(1);
+                    }
+                    b->ops++;
+                    b->created++;
+                }
+                struct tracepack_record rec = {
+                    .magic = TRACE_PACK_MAGIC, .addr = addr, .len = b->bytes,
+                    .trailer = GZAPPEND_TRAILER_LEN(strlen(TRACE_JSON_TAIL)),
+                    .flags = w == 0 ? TRACE_PACK_FULL : 0,
+                };
+                memcpy(b->data, &rec, sizeof(rec));
+                benchWrite(b, *fd, b->data, sizeof(rec) + b->bytes, -1);
+            }
+        }
+    }
+    if (packs) {
+        for (int i = 0; i < TRACE_PACKS; i++) {
+            if (packs[i] >= 0)
+                close(packs[i]);
+        }
+        free(packs);
+        for (int i = 0; i < TRACE_PACKS; i++) {
+            snprintf(path, PATH_MAX, "%s/%s/pack_%02x", b->dir, mode, i);
+            tracePackSeal(path);
+            b->ops += 2;
+        }
+    }
+    if (b->sync)
+        sync();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%-8s %8.2f s %10llu ops %10.0f ops/s %8llu inodes %10.1f MB written\n", mode, seconds,
+            (unsigned long long) b->ops, b->ops / seconds, (unsigned long long) b->created, b->written / 1e6);
+}
+
+static int cmdBench(int argc, char **argv) {
+    struct bench b = { 0 };
+    b.dir = argv[2];
+    b.aircraft = argc > 3 ? atoi(argv[3]) : 20000;
+    b.writes = argc > 4 ? atoi(argv[4]) : 12;
+    b.bytes = argc > 5 ? atoi(argv[5]) : 2000;
+    b.sync = argc > 6 && !strcmp(argv[6], "fsync");
+    if (b.aircraft < 1 || b.writes < 1 || b.bytes < 1)
+        usage(argv[0]);
+    if (mkdir(b.dir, 0755) && errno != EEXIST) {
+        perror(b.dir);
+        return 1;
+    }
+    size_t dataLen = sizeof(struct tracepack_record) + (size_t) b.writes * b.bytes;
+    b.data = malloc(dataLen);
+    if (!b.data) {
+        fprintf(stderr, "bench: out of memory\n");
+        return 1;
+    }
+    for (size_t i = 0; i < dataLen; i++)
+        b.data[i] = random();
+
+    printf("%d aircraft, %d writes of %d bytes each%s\n", b.aircraft, b.writes, b.bytes, b.sync ? ", fsync" : "");
+    benchRun(&b, "rewrite");
+    benchRun(&b, "append");
+    benchRun(&b, "pack");
+    free(b.data);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3)
+        usage(argv[0]);
+    if (!strcmp(argv[1], "list") && argc == 3)
+        return cmdList(argv[2]);
+    if (!strcmp(argv[1], "get") && argc == 4)
+        return cmdGet(argv[2], argv[3]);
+    if (!strcmp(argv[1], "seal")) {
+        int res = 0;
+        for (int i = 2; i < argc; i++)
+            res |= tracePackSeal(argv[i]);
+        return res ? 1 : 0;
+    }
+    if (!strcmp(argv[1], "bench"))
+        return cmdBench(argc, argv);
+    usage(argv[0]);
+    return 1;
+}
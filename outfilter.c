@@ -0,0 +1,281 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// outfilter.c: per client filters on the streaming outputs, see outfilter.h
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "readsb.h"
+
+#define OUTFILTER_POLY_MAX 256
+#define OUTFILTER_FILE_LINES (1 << 20)
+
+enum {
+    OUTFILTER_BOX = 1,
+    OUTFILTER_POLY,
+    OUTFILTER_ICAO,
+};
+
+struct outfilter {
+    char *spec;
+    int clients; // references, the group is free when 0
+    int type;
+    double latMin, latMax, lonMin, lonMax; // the box or the bounding box of the polygon
+    int points;
+    double *poly; // lat, lon pairs
+    uint64_t *icao; // bitset over all 2^24 addresses
+};
+
+static struct outfilter groups[OUTFILTER_GROUPS];
+
+static void outFilterFree(struct outfilter *f) {
+    free(f->spec);
+    free(f->poly);
+    free(f->icao);
+    memset(f, 0, sizeof(*f));
+}
+
+static int icaoAdd(struct outfilter *f, const char *hex) {
+    char *end;
+    while (isspace(*hex))
+        hex++;
+    if (!*hex)
+        return 0;
+    unsigned long addr = strtoul(hex, &end, 16);
+    while (isspace(*end))
+        end++;
+    if (end == hex || *end || addr > 0xFFFFFF)
+        return -1;
+    f->icao[addr / 64] |= 1ULL << (addr % 64);
+    return 0;
+}
+
+static int icaoFile(struct outfilter *f, const char *path) {
+    FILE *in = fopen(path, "r");
+    if (!in) {
+        fprintf(stderr, "output filter: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    char line[256];
+    int res = 0;
+    int lines = 0;
+    while (fgets(line, sizeof(line), in)) {
+        if (line[0] == '#')
+            continue;
+        // an empty line ends the list, reading something like /dev/zero stops there
+        if (line[strspn(line, " \t\r\n")] == '\0')
+            break;
+        if (++lines > OUTFILTER_FILE_LINES) {
+            fprintf(stderr, "output filter: %s: more than %d lines\n", path, OUTFILTER_FILE_LINES);
+            res = -1;
+            break;
+        }
+        if (icaoAdd(f, line)) {
+            res = -1;
+            break;
+        }
+    }
+    fclose(in);
+    return res;
+}
+
+static int outFilterParse(struct outfilter *f, const char *spec, int local) {
+    char *copy = strdup(spec);
+    char *saveptr = NULL;
+    char *type = copy ? strtok_r(copy, ":", &saveptr) : NULL;
+    double v[2 * OUTFILTER_POLY_MAX];
+    int n = 0;
+    int res = -1;
+
+    if (!type)
+        goto out;
+
+    if (!strcmp(type, "icao")) {
+        f->type = OUTFILTER_ICAO;
+        f->icao = calloc((1 << 24) / 64, sizeof(uint64_t));
+        if (!f->icao)
+            goto out;
+        char *tok = strtok_r(NULL, ":", &saveptr);
+        if (!tok)
+            goto out;
+        if (tok[0] == '@') {
+            // a client could make us open any path on this host
+            if (local)
+                res = icaoFile(f, tok + 1);
+            goto out;
+        }
+        for (; tok; tok = strtok_r(NULL, ":", &saveptr)) {
+            if (icaoAdd(f, tok))
+                goto out;
+        }
+        res = 0;
+        goto out;
+    }
+
+    for (char *tok = strtok_r(NULL, ":", &saveptr); tok; tok = strtok_r(NULL, ":", &saveptr)) {
+        char *end;
+        if (n == 2 * OUTFILTER_POLY_MAX)
+            goto out;
+        v[n] = strtod(tok, &end);
+        if (*end || !isfinite(v[n]))
+            goto out;
+        n++;
+    }
+
+    if (!strcmp(type, "box") && n == 4) {
+        if (fabs(v[0]) > 90 || fabs(v[1]) > 90 || fabs(v[2]) > 180 || fabs(v[3]) > 180)
+            goto out;
+        f->type = OUTFILTER_BOX;
+        f->latMin = v[0];
+        f->latMax = v[1];
+        f->lonMin = v[2];
+        f->lonMax = v[3];
+        res = f->latMin <= f->latMax ? 0 : -1;
+    } else if (!strcmp(type, "poly") && n >= 6 && n % 2 == 0) {
+        f->type = OUTFILTER_POLY;
+        f->points = n / 2;
+        f->poly = malloc(n * sizeof(double));
+        if (!f->poly)
+            goto out;
+        memcpy(f->poly, v, n * sizeof(double));
+        f->latMin = f->lonMin = 1000;
+        f->latMax = f->lonMax = -1000;
+        for (int i = 0; i < f->points; i++) {
+            if (fabs(v[2 * i]) > 90 || fabs(v[2 * i + 1]) > 180)
+                goto out;
+            f->latMin = fmin(f->latMin, v[2 * i]);
+            f->latMax = fmax(f->latMax, v[2 * i]);
+            f->lonMin = fmin(f->lonMin, v[2 * i + 1]);
+            f->lonMax = fmax(f->lonMax, v[2 * i + 1]);
+        }
+        res = 0;
+    }
+out:
+    free(copy);
+    return res;
+}
+
+int outFilterAcquire(const char *spec, int local) {
+    int free_group = -1;
+    for (int i = 0; i < OUTFILTER_GROUPS; i++) {
+        if (groups[i].clients && !strcmp(groups[i].spec, spec)) {
+            groups[i].clients++;
+            return i;
+        }
+        if (!groups[i].clients && free_group < 0)
+            free_group = i;
+    }
+    if (free_group < 0) {
+        fprintf(stderr, "output filter: all %d filter groups are in use\n", OUTFILTER_GROUPS);
+        return -1;
+    }
+    struct outfilter *f = &groups[free_group];
+    if (outFilterParse(f, spec, local) || !(f->spec = strdup(spec))) {
+        outFilterFree(f);
+        return -1;
+    }
+    f->clients = 1;
+    Modes.outfilter_active |= 1ULL << free_group;
+    return free_group;
+}
+
+void outFilterRelease(int group) {
+    if (group < 0 || group >= OUTFILTER_GROUPS || !groups[group].clients)
+        return;
+    if (--groups[group].clients == 0) {
+        outFilterFree(&groups[group]);
+        Modes.outfilter_active &= ~(1ULL << group);
+    }
+}
+
+const char *outFilterSpec(int group) {
+    if (group < 0 || group >= OUTFILTER_GROUPS || !groups[group].clients)
+        return "";
+    return groups[group].spec;
+}
+
+// ray casting, the vertices are lat / lon pairs
+static int insidePoly(struct outfilter *f, double lat, double lon) {
+    int inside = 0;
+    double *p = f->poly;
+    for (int i = 0, j = f->points - 1; i < f->points; j = i++) {
+        double lati = p[2 * i], loni = p[2 * i + 1];
+        double latj = p[2 * j], lonj = p[2 * j + 1];
+        if ((lati > lat) != (latj > lat) && lon < (lonj - loni) * (lat - lati) / (latj - lati) + loni)
+            inside = !inside;
+    }
+    return inside;
+}
+
+static int outFilterMatch(struct outfilter *f, uint32_t addr, int pos, double lat, double lon) {
+    switch (f->type) {
+        case OUTFILTER_ICAO:
+            return !(addr & MODES_NON_ICAO_ADDRESS) && (f->icao[addr / 64] & (1ULL << (addr % 64)));
+        case OUTFILTER_BOX:
+            if (!pos || lat < f->latMin || lat > f->latMax)
+                return 0;
+            if (f->lonMin <= f->lonMax)
+                return lon >= f->lonMin && lon <= f->lonMax;
+            return lon >= f->lonMin || lon <= f->lonMax;
+        case OUTFILTER_POLY:
+            if (!pos || lat < f->latMin || lat > f->latMax || lon < f->lonMin || lon > f->lonMax)
+                return 0;
+            return insidePoly(f, lat, lon);
+    }
+    return 0;
+}
+
+// The evaluation time is sampled: one message per millisecond is timed and
+// counted for the messages since the previous sample.
+uint64_t outFilterMask(struct modesMessage *mm, struct aircraft *a, uint64_t now) {
+    static uint64_t sampled;
+    static uint64_t unsampled;
+
+    if (mm->filterDone)
+        return mm->filterMask;
+
+    int sample = (now != sampled);
+    struct timespec start;
+    if (sample)
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint32_t addr = a ? a->addr : mm->addr;
+    int pos = a && trackDataValid(&a->position_valid);
+    double lat = pos ? a->lat : 0;
+    double lon = pos ? a->lon : 0;
+
+    uint64_t mask = 0;
+    uint64_t active = Modes.outfilter_active;
+    while (active) {
+        int i = __builtin_ctzll(active);
+        active &= active - 1;
+        if (outFilterMatch(&groups[i], addr, pos, lat, lon))
+            mask |= 1ULL << i;
+        Modes.stats_current.outfilter_evals++;
+    }
+
+    if (sample) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        int64_t ns = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+        Modes.stats_current.outfilter_ns += ns * (unsampled + 1);
+        sampled = now;
+        unsampled = 0;
+    } else {
+        unsampled++;
+    }
+
+    mm->filterMask = mask;
+    mm->filterDone = 1;
+    return mask;
+}
@@ -0,0 +1,47 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// outfilter.h: per client filters on the streaming outputs
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef OUTFILTER_H
+#define OUTFILTER_H
+
+// Per client filters on the streaming outputs (beast_out, sbs_out, json_out)
+//
+// A listen client subscribes by sending "FILTER <spec>\n" before anything
+// else, a connector takes filter=<spec> as an additional field.  spec is one of
+//
+//   box:<latMin>:<latMax>:<lonMin>:<lonMax>     (lonMin > lonMax crosses the antimeridian)
+//   poly:<lat>:<lon>:<lat>:<lon>:<lat>:<lon>... (at least 3 vertices, not crossing the antimeridian)
+//   icao:<hex>[:<hex>...]
+//   icao:@<file>                                (one hex per line, connectors only)
+//
+// Clients with the same spec share a filter group.  Geographic filters use the
+// last position of the aircraft.  Every message is evaluated once per group,
+// the filterable writers keep the resulting mask for each message in their
+// buffer and flushWrites() only copies the matching messages to a filtered client.
+
+#define OUTFILTER_GROUPS 64
+
+// returns the group for spec or -1 if the spec is invalid or all groups are in use
+// files (icao:@<file>) are only read with local set, specs received from clients can't name one
+int outFilterAcquire(const char *spec, int local);
+void outFilterRelease(int group);
+const char *outFilterSpec(int group);
+
+// bit n set: the message passes the filter of group n
+uint64_t outFilterMask(struct modesMessage *mm, struct aircraft *a, uint64_t now);
+
+#endif
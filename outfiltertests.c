@@ -0,0 +1,261 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// outfiltertests.c - tests for the per client output filters
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "readsb.h"
+
+struct _Modes Modes;
+
+// specs as a client would send them: only the valid ones may get a group
+static const struct {
+    const char *spec;
+    int valid;
+} filterSpecs[] = {
+    { "box:50:52:-1:1", 1 },
+    { "box:50:52:179:-179", 1 }, // crosses the antimeridian
+    { "poly:50:0:52:0:52:2", 1 },
+    { "icao:3c6444", 1 },
+    { "icao:3c6444:a00001: 4b1805 ", 1 },
+    { "", 0 },
+    { ":", 0 },
+    { "box", 0 },
+    { "box:", 0 },
+    { "box:50:52:-1", 0 },
+    { "box:50:52:-1:1:5", 0 },
+    { "box:52:50:-1:1", 0 }, // latMin > latMax
+    { "box:91:92:-1:1", 0 },
+    { "box:50:52:-181:1", 0 },
+    { "box:nan:52:-1:1", 0 },
+    { "box:-inf:52:-1:1", 0 },
+    { "box:1e400:52:-1:1", 0 },
+    { "box:50x:52:-1:1", 0 },
+    { "box:50:52:-1:1\n", 0 },
+    { "poly:50:0:52:0", 0 }, // 2 vertices
+    { "poly:50:0:52:0:52", 0 }, // odd number of values
+    { "poly:50:0:52:0:95:2", 0 },
+    { "circle:50:0:10", 0 },
+    { "BOX:50:52:-1:1", 0 },
+    { "icao", 0 },
+    { "icao:", 0 },
+    { "icao:::", 0 },
+    { "icao:1000000", 0 }, // more than 24 bits
+    { "icao:-1", 0 },
+    { "icao:3c6444x", 0 },
+    { "icao:3c6444:zz", 0 },
+    { "icao:@/etc/passwd", 0 }, // clients can't name files
+    { "icao:@", 0 },
+    { "icao:3c6444:@/etc/passwd", 0 },
+};
+
+// poly and icao specs with more values than any filter holds
+static int testLongSpecs() {
+    int ok = 1;
+    size_t len = 64 * 1024;
+    char *spec = malloc(len);
+    if (!spec)
+        return 0;
+
+    char *p = spec, *end = spec + len;
+    p += snprintf(p, end - p, "poly");
+    for (int i = 0; i < 1000 && p < end; i++)
+        p += snprintf(p, end - p, ":%d.5:%d.5", i % 80, i % 170);
+    int group = outFilterAcquire(spec, 0);
+    if (group >= 0) {
+        ok = 0;
+        fprintf(stderr, "testLongSpecs[poly]: FAIL: 1000 vertices accepted\n");
+        outFilterRelease(group);
+    } else {
+        fprintf(stderr, "testLongSpecs[poly]:  PASS\n");
+    }
+
+    // many addresses are fine, the bitset covers all of them
+    p = spec;
+    p += snprintf(p, end - p, "icao");
+    for (int i = 0; i < 5000 && p < end - 8; i++)
+        p += snprintf(p, end - p, ":%06x", i * 3331);
+    group = outFilterAcquire(spec, 0);
+    if (group < 0) {
+        ok = 0;
+        fprintf(stderr, "testLongSpecs[icao]: FAIL: 5000 addresses refused\n");
+    } else {
+        fprintf(stderr, "testLongSpecs[icao]:  PASS\n");
+        outFilterRelease(group);
+    }
+
+    free(spec);
+    return ok;
+}
+
+static int testFilterSpecs() {
+    int ok = 1;
+    for (unsigned i = 0; i < sizeof(filterSpecs) / sizeof(filterSpecs[0]); ++i) {
+        int group = outFilterAcquire(filterSpecs[i].spec, 0);
+        if ((group >= 0) != filterSpecs[i].valid) {
+            ok = 0;
+            fprintf(stderr, "testFilterSpecs[%u]: FAIL: \"%s\" %s\n", i, filterSpecs[i].spec,
+                    group >= 0 ? "accepted" : "refused");
+        } else {
+            fprintf(stderr, "testFilterSpecs[%u]:  PASS\n", i);
+        }
+        outFilterRelease(group);
+    }
+    if (Modes.outfilter_active) {
+        ok = 0;
+        fprintf(stderr, "testFilterSpecs: FAIL: groups left active: %016llx\n", (unsigned long long) Modes.outfilter_active);
+    }
+    return ok;
+}
+
+// files are read for local specs only, an empty line ends the list
+static int testFilterFile() {
+    int ok = 1;
+    char path[] = "/tmp/outfiltertests.XXXXXX";
+    char spec[PATH_MAX + 8];
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 0;
+    }
+    const char *content = "# test\n3c6444\n a00001\n\nnot read\n";
+    if (write(fd, content, strlen(content)) != (ssize_t) strlen(content)) {
+        perror("write");
+        ok = 0;
+    }
+    close(fd);
+    snprintf(spec, sizeof(spec), "icao:@%s", path);
+
+    int remote = outFilterAcquire(spec, 0);
+    int local = outFilterAcquire(spec, 1);
+    if (remote >= 0 || local < 0) {
+        ok = 0;
+        fprintf(stderr, "testFilterFile: FAIL: remote group %d, local group %d\n", remote, local);
+    } else {
+        fprintf(stderr, "testFilterFile:  PASS\n");
+    }
+    outFilterRelease(remote);
+    outFilterRelease(local);
+
+    unlink(path);
+    if (outFilterAcquire(spec, 1) >= 0) {
+        ok = 0;
+        fprintf(stderr, "testFilterFile[missing]: FAIL: missing file accepted\n");
+    } else {
+        fprintf(stderr, "testFilterFile[missing]:  PASS\n");
+    }
+    return ok;
+}
+
+// the same spec shares a group, there are only OUTFILTER_GROUPS of them
+static int testFilterGroups() {
+    int ok = 1;
+    int group[OUTFILTER_GROUPS];
+    char spec[64];
+
+    for (int i = 0; i < OUTFILTER_GROUPS; i++) {
+        snprintf(spec, sizeof(spec), "icao:%06x", i);
+        group[i] = outFilterAcquire(spec, 0);
+        if (group[i] < 0)
+            ok = 0;
+    }
+    int full = outFilterAcquire("icao:ffffff", 0);
+    int shared = outFilterAcquire("icao:000005", 0);
+    if (!ok || full >= 0 || shared != group[5] || strcmp(outFilterSpec(shared), "icao:000005")) {
+        ok = 0;
+        fprintf(stderr, "testFilterGroups: FAIL: extra group %d, shared group %d (expected %d)\n", full, shared, group[5]);
+    }
+    outFilterRelease(shared);
+    for (int i = 0; i < OUTFILTER_GROUPS; i++)
+        outFilterRelease(group[i]);
+    if (Modes.outfilter_active) {
+        ok = 0;
+        fprintf(stderr, "testFilterGroups: FAIL: groups left active: %016llx\n", (unsigned long long) Modes.outfilter_active);
+    }
+    if (ok)
+        fprintf(stderr, "testFilterGroups:  PASS\n");
+    return ok;
+}
+
+static const struct {
+    uint32_t addr;
+    int pos;
+    double lat, lon;
+    int box, antimeridian, poly, icao; // expected matches
+} filterAircraft[] = {
+    { 0x3c6444, 1, 51.0, -0.5, 1, 0, 0, 1 },
+    { 0x3c6444, 0, 51.0, -0.5, 0, 0, 0, 1 }, // no position: only the icao filter
+    { 0x123456, 1, 51.0, 0.5, 1, 0, 1, 0 },
+    { 0x123456, 1, 51.9, 1.5, 0, 0, 1, 0 },
+    { 0x123456, 1, 50.5, 1.5, 0, 0, 0, 0 }, // inside the bounding box of the triangle, outside of it
+    { 0x123456, 1, 51.0, 179.5, 0, 1, 0, 0 },
+    { 0x123456, 1, 51.0, -179.5, 0, 1, 0, 0 },
+    { 0x123456, 1, 51.0, 178.0, 0, 0, 0, 0 },
+    { 0x3c6444 | MODES_NON_ICAO_ADDRESS, 1, 51.0, -0.5, 1, 0, 0, 0 },
+};
+
+static int testFilterMask() {
+    int ok = 1;
+    int box = outFilterAcquire("box:50:52:-1:1", 0);
+    int antimeridian = outFilterAcquire("box:50:52:179:-179", 0);
+    int poly = outFilterAcquire("poly:50:0:52:0:52:2", 0);
+    int icao = outFilterAcquire("icao:3c6444", 0);
+    struct aircraft *a = calloc(1, sizeof(struct aircraft));
+    struct modesMessage mm;
+
+    if (!a || box < 0 || antimeridian < 0 || poly < 0 || icao < 0) {
+        fprintf(stderr, "testFilterMask: FAIL: setup failed\n");
+        ok = 0;
+        goto out;
+    }
+
+    for (unsigned i = 0; i < sizeof(filterAircraft) / sizeof(filterAircraft[0]); ++i) {
+        memset(&mm, 0, sizeof(mm));
+        a->addr = filterAircraft[i].addr;
+        a->lat = filterAircraft[i].lat;
+        a->lon = filterAircraft[i].lon;
+        a->position_valid.source = filterAircraft[i].pos ? SOURCE_ADSB : SOURCE_INVALID;
+
+        uint64_t mask = outFilterMask(&mm, a, 1000 + i);
+        uint64_t expected = 0;
+        expected |= (uint64_t) filterAircraft[i].box << box;
+        expected |= (uint64_t) filterAircraft[i].antimeridian << antimeridian;
+        expected |= (uint64_t) filterAircraft[i].poly << poly;
+        expected |= (uint64_t) filterAircraft[i].icao << icao;
+        if (mask != expected) {
+            ok = 0;
+            fprintf(stderr, "testFilterMask[%u]: FAIL: mask %llx (expected %llx)\n", i,
+                    (unsigned long long) mask, (unsigned long long) expected);
+        } else {
+            fprintf(stderr, "testFilterMask[%u]:  PASS\n", i);
+        }
+    }
+out:
+    free(a);
+    outFilterRelease(box);
+    outFilterRelease(antimeridian);
+    outFilterRelease(poly);
+    outFilterRelease(icao);
+    return ok;
+}
+
+int main(int __attribute__ ((unused)) argc, char __attribute__ ((unused)) **argv) {
+    int ok = 1;
+    ok = testFilterSpecs() && ok;
+    ok = testLongSpecs() && ok;
+    ok = testFilterFile() && ok;
+    ok = testFilterGroups() && ok;
+    ok = testFilterMask() && ok;
+    return ok ? 0 : 1;
+}
@@ -135,7 +135,7 @@ static void cond_broadcast_all() {
     if (Modes.jsonGlobeThread)
         pthread_cond_broadcast(&Modes.jsonGlobeThreadCond);
 
-    for (int i = 0; i < TRACE_THREADS; i++) {
+    for (int i = 0; i < TRACE_THREADS_MAX; i++) {
         if (Modes.jsonTraceThread[i])
             pthread_cond_broadcast(&Modes.jsonTraceThreadCond[i]);
     }
@@ -170,7 +170,8 @@ static void sigtermHandler(int dummy) {
 
 void receiverPositionChanged(float lat, float lon, float alt) {
     log_with_timestamp("Autodetected receiver location: %.5f, %.5f at %.0fm AMSL", lat, lon, alt);
-    writeJsonToFile(Modes.json_dir, "receiver.json", generateReceiverJson()); // location changed
+    if (Modes.json_dir || Modes.net_http)
+        publishJson("receiver.json", generateReceiverJson(), ZCLASS_NONE); // location changed
 }
 
 
@@ -198,11 +199,14 @@ static void modesInitConfig(void) {
     Modes.net_output_beast_ports = strdup("0");
     Modes.net_output_beast_reduce_ports = strdup("0");
     Modes.net_output_beast_reduce_interval = 125;
+    Modes.beast_reduce_tier_count = 1;
     Modes.net_output_vrs_ports = strdup("0");
     Modes.net_output_vrs_interval = 5 * SECONDS;
     Modes.net_output_json_ports = strdup("0");
     Modes.net_output_api_ports = strdup("0");
+    Modes.net_http_ports = strdup("0");
     Modes.net_connector_delay = 30 * 1000;
+    Modes.net_udp_size = 1400;
     Modes.interactive_display_ttl = MODES_INTERACTIVE_DISPLAY_TTL;
     Modes.json_interval = 1000;
     Modes.json_location_accuracy = 1;
@@ -222,6 +226,17 @@ static void modesInitConfig(void) {
     Modes.heatmap_interval = 60 * SECONDS;
     Modes.json_reliable = -13;
 
+    Modes.compress_level[ZCLASS_JSON] = 3;
+    Modes.compress_level[ZCLASS_GLOBE_BIN] = 5;
+    Modes.compress_level[ZCLASS_GLOBE_JSON] = 3;
+    Modes.compress_level[ZCLASS_TRACE_RECENT] = 1;
+    Modes.compress_level[ZCLASS_TRACE_FULL] = 7;
+    Modes.compress_level[ZCLASS_HISTORY] = 9;
+    Modes.compress_level[ZCLASS_STATE] = 1;
+    Modes.compress_level[ZCLASS_HEATMAP] = 9;
+    Modes.compress_level[ZCLASS_HTTP] = 3;
+    Modes.compress_level[ZCLASS_NET] = 3;
+
     Modes.cpr_focus = 0xc0ffeeba;
     //Modes.cpr_focus = 0x43BF95;
     //
@@ -272,16 +287,21 @@ static void modesInit(void) {
     pthread_mutex_init(&Modes.decodeThreadMutex, NULL);
     pthread_mutex_init(&Modes.jsonThreadMutex, NULL);
     pthread_mutex_init(&Modes.jsonGlobeThreadMutex, NULL);
+    pthread_mutex_init(&Modes.heatmapMutex, NULL);
 
     pthread_cond_init(&Modes.decodeThreadCond, NULL);
     pthread_cond_init(&Modes.jsonThreadCond, NULL);
     pthread_cond_init(&Modes.jsonGlobeThreadCond, NULL);
 
-    for (int i = 0; i < TRACE_THREADS; i++) {
+    for (int i = 0; i < TRACE_THREADS_MAX; i++) {
         pthread_mutex_init(&Modes.jsonTraceThreadMutex[i], NULL);
         pthread_cond_init(&Modes.jsonTraceThreadCond[i], NULL);
     }
 
+    for (int i = 0; i <= GLOBE_MAX_INDEX; i++) {
+        ca_init(&Modes.globeLists[i]);
+    }
+
     geomag_init();
 
     Modes.sample_rate = (double)2400000.0;
@@ -351,9 +371,14 @@ static void modesInit(void) {
         Modes.net_connector_delay = 30 * 1000;
     }
 
-    if (Modes.api) {
-        Modes.byLat = malloc(API_INDEX_MAX * sizeof(struct av));
-        Modes.byLon = malloc(API_INDEX_MAX * sizeof(struct av));
+    if (Modes.api)
+        apiInit();
+
+    for (int k = 1; k < Modes.beast_reduce_tier_count; k++) {
+        if (Modes.beast_reduce_tiers[k - 1] <= Modes.net_output_beast_reduce_interval) {
+            fprintf(stderr, "--net-beast-reduce-tiers: the tiers must be longer than --net-beast-reduce-interval\n");
+            exit(1);
+        }
     }
 
     // Prepare error correction tables
@@ -365,7 +390,9 @@ static void modesInit(void) {
         icaoFilterAdd(Modes.show_only);
 
     Modes.json_globe_special_tiles = calloc(GLOBE_SPECIAL_INDEX, sizeof(struct tile));
-    init_globe_index(Modes.json_globe_special_tiles);
+    // the adaptive tiles take the place of the special tiles
+    if (!Modes.globe_adaptive)
+        init_globe_index(Modes.json_globe_special_tiles);
 }
 
 //
@@ -406,6 +433,7 @@ static void *jsonThreadEntryPoint(void *arg) {
     pthread_mutex_lock(&Modes.jsonThreadMutex);
 
     uint64_t next_history = mstime();
+    struct json_latency jsonLatency = { .since = mstime() };
 
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
@@ -426,16 +454,18 @@ static void *jsonThreadEntryPoint(void *arg) {
 
         uint64_t now = mstime();
 
-        struct char_buffer cb = generateAircraftJson();
-        if (Modes.json_gzip)
-            writeJsonToGzip(Modes.json_dir, "aircraft.json.gz", cb, 3);
-        writeJsonToFile(Modes.json_dir, "aircraft.json", cb);
+        struct char_buffer cb = generateAircraftJson(&jsonLatency);
+        if (Modes.json_dir && Modes.json_gzip)
+            writeJsonToGzip(Modes.json_dir, "aircraft.json.gz", cb, ZCLASS_JSON);
+        publishJson("aircraft.json", cb, ZCLASS_NONE);
 
-        if ((ALL_JSON) && now >= next_history) {
+        statsAircraftJsonLatency(&jsonLatency, mstime());
+
+        if ((ALL_JSON) && Modes.json_dir && now >= next_history) {
             char filebuf[PATH_MAX];
 
             snprintf(filebuf, PATH_MAX, "history_%d.json", Modes.json_aircraft_history_next);
-            writeJsonToFile(Modes.json_dir, filebuf, generateAircraftJson());
+            writeJsonToFile(Modes.json_dir, filebuf, generateAircraftJson(NULL));
 
             if (!Modes.json_aircraft_history_full) {
                 writeJsonToFile(Modes.json_dir, "receiver.json", generateReceiverJson()); // number of history entries changed
@@ -451,6 +481,7 @@ static void *jsonThreadEntryPoint(void *arg) {
     }
 
     pthread_mutex_unlock(&Modes.jsonThreadMutex);
+    free(jsonLatency.age);
 
 #ifndef _WIN32
     pthread_exit(NULL);
@@ -493,25 +524,26 @@ static void *jsonGlobeThreadEntryPoint(void *arg) {
         struct timespec start_time;
         start_cpu_timing(&start_time);
 
+        uint64_t now = mstime();
+        int special = Modes.globe_adaptive ? GLOBE_MIN_INDEX : GLOBE_SPECIAL_INDEX;
         for (int i = 0; i <= GLOBE_MAX_INDEX; i++) {
-            if (i == GLOBE_SPECIAL_INDEX)
+            if (i == special)
                 i = GLOBE_MIN_INDEX;
 
             if (i % n_parts != part)
                 continue;
 
-            if (i >= GLOBE_MIN_INDEX && globe_index_index(i) < GLOBE_MIN_INDEX)
+            // tiles of an earlier adaptive layout are written empty for a while
+            if (i < GLOBE_MIN_INDEX && Modes.globe_adaptive && i >= globeAdaptiveCount() && !globeAdaptiveRetired(i, now))
+                continue;
+            if (i >= GLOBE_MIN_INDEX && globe_index_index(i) < GLOBE_MIN_INDEX && !globeAdaptiveRetired(i, now))
                 continue;
 
             snprintf(filename, 31, "globe_%04d.ttf", i);
-            struct char_buffer cb2 = generateGlobeBin(i);
-            writeJsonToGzip(Modes.json_dir, filename, cb2, 5);
-            free(cb2.buffer);
+            publishJson(filename, generateGlobeBin(i), ZCLASS_GLOBE_BIN);
 
             snprintf(filename, 31, "globe_%04d.json", i);
-            struct char_buffer cb = generateGlobeJson(i);
-            writeJsonToGzip(Modes.json_dir, filename, cb, 3);
-            free(cb.buffer);
+            publishJson(filename, generateGlobeJson(i), ZCLASS_GLOBE_JSON);
 
         }
 
@@ -747,8 +779,7 @@ static void cleanup_and_exit(int code) {
     /* Free only when pointing to string in heap (strdup allocated when given as run parameter)
      * otherwise points to const string
      */
-    free(Modes.byLat);
-    free(Modes.byLon);
+    apiCleanup();
     free(Modes.prom_file);
     free(Modes.json_dir);
     free(Modes.globe_history_dir);
@@ -759,6 +790,8 @@ static void cleanup_and_exit(int code) {
     free(Modes.net_input_beast_ports);
     free(Modes.net_output_beast_ports);
     free(Modes.net_output_beast_reduce_ports);
+    free(Modes.net_beast_udp_in_ports);
+    free(Modes.net_shm);
     free(Modes.net_output_vrs_ports);
     free(Modes.net_input_raw_ports);
     free(Modes.net_output_raw_ports);
@@ -766,6 +799,7 @@ static void cleanup_and_exit(int code) {
     free(Modes.net_input_sbs_ports);
     free(Modes.net_output_json_ports);
     free(Modes.net_output_api_ports);
+    free(Modes.net_http_ports);
     free(Modes.beast_serial);
     free(Modes.json_globe_special_tiles);
     free(Modes.uuidFile);
@@ -778,16 +812,15 @@ static void cleanup_and_exit(int code) {
 
                 if (a->first_message)
                     free(a->first_message);
-                if (a->trace) {
-                    free(a->trace);
-                    free(a->trace_all);
-                }
+                if (a->trace_blocks)
+                    trace_free(a);
 
                 free(a);
             }
             a = na;
         }
     }
+    trace_chunks_cleanup();
 
     int i;
     for (i = 0; i < MODES_MAG_BUFFERS; ++i) {
@@ -947,6 +980,26 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case OptJsonGzip:
             Modes.json_gzip = 1;
             break;
+        case OptCompressionLevels:
+            if (compressParseLevels(arg))
+                return 1;
+            break;
+        case OptCompressTraces:
+            Modes.trace_pack = 1;
+            break;
+        case OptHistoryPacks:
+            Modes.history_packs = 1;
+            break;
+        case OptStateWal:
+            Modes.state_wal = 1;
+            break;
+        case OptTraceThreads:
+            Modes.trace_threads = atoi(arg);
+            if (Modes.trace_threads < 1 || Modes.trace_threads > TRACE_THREADS_MAX) {
+                fprintf(stderr, "--trace-threads: must be 1 to %d\n", TRACE_THREADS_MAX);
+                return 1;
+            }
+            break;
         case OptJsonTraceInt:
             if (atof(arg) > 0)
                 Modes.json_trace_interval = 1000 * atof(arg);
@@ -954,6 +1007,13 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
         case OptJsonGlobeIndex:
             Modes.json_globe_index = 1;
             break;
+        case OptGlobeAdaptive:
+            Modes.globe_adaptive = atoi(arg);
+            if (Modes.globe_adaptive < 1) {
+                fprintf(stderr, "--globe-adaptive: the target has to be at least 1 aircraft per tile\n");
+                return 1;
+            }
+            break;
 #endif
         case OptNetHeartbeat:
             Modes.net_heartbeat_interval = (uint64_t) (1000 * atof(arg));
@@ -993,6 +1053,27 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             if (Modes.net_output_beast_reduce_interval > 15000)
                 Modes.net_output_beast_reduce_interval = 15000;
             break;
+        case OptNetBeastReduceTiers: {
+            char *tiers = strdup(arg);
+            Modes.beast_reduce_tier_count = 1;
+            for (char *tok = strtok(tiers, ","); tok; tok = strtok(NULL, ",")) {
+                if (Modes.beast_reduce_tier_count == BEAST_REDUCE_TIERS) {
+                    fprintf(stderr, "--net-beast-reduce-tiers: at most %d tiers\n", BEAST_REDUCE_TIERS - 1);
+                    free(tiers);
+                    return 1;
+                }
+                double seconds = atof(tok);
+                // reduceTiers() divides by the interval in ms
+                if (seconds < 0.001 || seconds > 3600) {
+                    fprintf(stderr, "--net-beast-reduce-tiers: invalid interval: %s\n", tok);
+                    free(tiers);
+                    return 1;
+                }
+                Modes.beast_reduce_tiers[Modes.beast_reduce_tier_count++ - 1] = (uint32_t) (1000 * seconds);
+            }
+            free(tiers);
+            break;
+        }
         case OptNetBindAddr:
             free(Modes.net_bind_address);
             Modes.net_bind_address = strdup(arg);
@@ -1010,6 +1091,11 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             Modes.net_output_api_ports = strdup(arg);
             Modes.api = 1;
             break;
+        case OptNetHttpPorts:
+            free(Modes.net_http_ports);
+            Modes.net_http_ports = strdup(arg);
+            Modes.net_http = strcmp(arg, "0") && strcmp(arg, "");
+            break;
         case OptNetSbsInPorts:
             free(Modes.net_input_sbs_ports);
             Modes.net_input_sbs_ports = strdup(arg);
@@ -1044,6 +1130,56 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             free(Modes.uuidFile);
             Modes.uuidFile = strdup(arg);
             break;
+        case OptNetBeastUdpOut:
+            Modes.net_beast_udp_out = realloc(Modes.net_beast_udp_out, (Modes.net_beast_udp_out_count + 1) * sizeof(char *));
+            if (!Modes.net_beast_udp_out)
+                return 1;
+            Modes.net_beast_udp_out[Modes.net_beast_udp_out_count++] = strdup(arg);
+            break;
+        case OptNetBeastUdpIn:
+            free(Modes.net_beast_udp_in_ports);
+            Modes.net_beast_udp_in_ports = strdup(arg);
+            break;
+        case OptNetShm:
+            {
+                char *spec = strdup(arg);
+                char *saveptr = NULL;
+                char *name = strtok_r(spec, ",", &saveptr);
+                if (!name) {
+                    fprintf(stderr, "--net-shm: name missing\n");
+                    free(spec);
+                    return 1;
+                }
+                free(Modes.net_shm);
+                Modes.net_shm = strdup(name);
+                Modes.net_shm_size = 16 * 1024 * 1024;
+                Modes.net_shm_types = 0;
+                char *token;
+                while ((token = strtok_r(NULL, ",", &saveptr))) {
+                    if (!strncmp(token, "size=", 5) && atoi(token + 5) > 0) {
+                        Modes.net_shm_size = (uint64_t) atoi(token + 5) * 1024 * 1024;
+                    } else if (!strcmp(token, "beast")) {
+                        Modes.net_shm_types |= 1 << SHM_RECORD_BEAST;
+                    } else if (!strcmp(token, "positions")) {
+                        Modes.net_shm_types |= 1 << SHM_RECORD_POSITION;
+                    } else {
+                        fprintf(stderr, "--net-shm: unknown field %s\n", token);
+                        free(spec);
+                        return 1;
+                    }
+                }
+                if (!Modes.net_shm_types)
+                    Modes.net_shm_types = (1 << SHM_RECORD_BEAST) | (1 << SHM_RECORD_POSITION);
+                free(spec);
+            }
+            break;
+        case OptNetUdpSize:
+            Modes.net_udp_size = atoi(arg);
+            if (Modes.net_udp_size < 256 || Modes.net_udp_size > 65000) {
+                fprintf(stderr, "--net-udp-size: must be 256 to 65000\n");
+                return 1;
+            }
+            break;
         case OptNetConnector:
             if (!Modes.net_connectors || Modes.net_connectors_count + 1 > Modes.net_connectors_size) {
                 Modes.net_connectors_size = Modes.net_connectors_count * 2 + 8;
@@ -1059,7 +1195,16 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
             con->address0 = con->address;
             con->port = strtok(NULL, ",");
             con->protocol = strtok(NULL, ",");
-            con->address1 = strtok(NULL, ",");
+            for (char *tok = strtok(NULL, ","); tok; tok = strtok(NULL, ",")) {
+                if (!strncmp(tok, "filter=", 7))
+                    con->filter = tok + 7;
+                else if (!strncmp(tok, "reduce=", 7))
+                    con->reduce = tok + 7;
+                else if (!strcmp(tok, "compress"))
+                    con->compress = 1;
+                else if (!con->address1)
+                    con->address1 = tok;
+            }
             if (pthread_mutex_init(&con->mutex, NULL)) {
                 fprintf(stderr, "Unable to initialize connector mutex!\n");
                 exit(1);
@@ -1094,6 +1239,27 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
                         "vrs_out, json_out\n");
                 return 1;
             }
+            if (con->reduce && strcmp(con->protocol, "beast_reduce_out")) {
+                fprintf(stderr, "--net-connector: reduce is only supported for beast_reduce_out\n");
+                return 1;
+            }
+            if (con->compress && strcmp(con->protocol, "beast_out") && strcmp(con->protocol, "beast_reduce_out")
+                    && strcmp(con->protocol, "beast_in")) {
+                fprintf(stderr, "--net-connector: compress is only supported for beast_out, beast_reduce_out and beast_in\n");
+                return 1;
+            }
+            if (con->filter) {
+                if (strcmp(con->protocol, "beast_out") && strcmp(con->protocol, "sbs_out") && strcmp(con->protocol, "json_out")) {
+                    fprintf(stderr, "--net-connector: filter is only supported for beast_out, sbs_out and json_out\n");
+                    return 1;
+                }
+                int group = outFilterAcquire(con->filter, 1);
+                if (group < 0) {
+                    fprintf(stderr, "--net-connector: invalid filter: %s\n", con->filter);
+                    return 1;
+                }
+                outFilterRelease(group);
+            }
             if (strcmp(con->address, "") == 0 || strcmp(con->address, "") == 0) {
                 fprintf(stderr, "--net-connector: ip and port can't be empty!\n");
                 fprintf(stderr, "Correct syntax: --net-connector=ip,port,protocol\n");
@@ -1281,6 +1447,11 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (Modes.state_wal && !Modes.state_dir) {
+        fprintf(stderr, "--state-wal requires --write-state or --write-globe-history, disabling it!\n");
+        Modes.state_wal = 0;
+    }
+
     if (Modes.json_globe_index) {
         Modes.keep_traces = 24 * HOURS + 40 * MINUTES; // include 40 minutes overlap, tar1090 needs at least 30 minutes currently
     } else if (Modes.heatmap) {
@@ -1289,35 +1460,13 @@ int main(int argc, char **argv) {
 
     if (Modes.state_dir) {
         fprintf(stderr, "loading state .....\n");
-        pthread_t threads[IO_THREADS];
-        int numbers[IO_THREADS];
-        for (int i = 0; i < IO_THREADS; i++) {
-            numbers[i] = i;
-            pthread_create(&threads[i], NULL, load_state, &numbers[i]);
-        }
-        for (int i = 0; i < IO_THREADS; i++) {
-            pthread_join(threads[i], NULL);
-        }
-        for (int i = 0; i < IO_THREADS; i++) {
-            numbers[i] = i;
-            pthread_create(&threads[i], NULL, load_blobs, &numbers[i]);
-        }
-        for (int i = 0; i < IO_THREADS; i++) {
-            pthread_join(threads[i], NULL);
-        }
-        uint32_t count_ac = 0;
-        uint64_t now = mstime();
-        for (int j = 0; j < AIRCRAFT_BUCKETS; j++) {
-            for (struct aircraft *a = Modes.aircraft[j]; a; a = a->next) {
-                int new_index = a->globe_index;
-                a->globe_index = -5;
-                set_globe_index(a, new_index);
-                count_ac++;
-                updateValidities(a, now);
-            }
-        }
-        fprintf(stderr, " .......... done, loaded %u aircraft!\n", count_ac);
-        Modes.aircraftCount = count_ac;
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        // at least 2 so reading from disk overlaps with inflating
+        int threads = cores < 2 ? 2 : (cores > LOAD_THREADS_MAX ? LOAD_THREADS_MAX : cores);
+        load_state_all(threads);
+        if (Modes.state_wal)
+            walReplay();
+        fprintf(stderr, " .......... done, loaded %"PRIu64" aircraft!\n", Modes.aircraftCount);
         fprintf(stderr, "aircraft table fill: %0.1f\n", Modes.aircraftCount / (double) AIRCRAFT_BUCKETS );
 
         char pathbuf[PATH_MAX];
@@ -1326,13 +1475,26 @@ int main(int argc, char **argv) {
 
         if (mkdir(Modes.state_dir, 0755) && errno != EEXIST)
             perror(pathbuf);
+
+        if (Modes.state_wal)
+            walInit();
     }
 
-    if (Modes.json_dir) {
+    if (Modes.json_dir || Modes.net_http) {
         // write initial json files so they're not missing
-        writeJsonToFile(Modes.json_dir, "receiver.json", generateReceiverJson());
+        publishJson("receiver.json", generateReceiverJson(), ZCLASS_NONE);
         //writeJsonToFile(Modes.json_dir, "stats.json", generateStatsJson()); // rather don't do this.
-        writeJsonToFile(Modes.json_dir, "aircraft.json", generateAircraftJson());
+        publishJson("aircraft.json", generateAircraftJson(NULL), ZCLASS_NONE);
+    }
+
+    if (Modes.json_globe_index && Modes.json_dir) {
+        if (!Modes.trace_threads) {
+            long cores = sysconf(_SC_NPROCESSORS_ONLN);
+            Modes.trace_threads = cores < 1 ? 1 : (cores > TRACE_THREADS_MAX ? TRACE_THREADS_MAX : cores);
+        }
+        traceQueueInit(Modes.trace_threads);
+    } else {
+        Modes.trace_threads = 0;
     }
 
     // go over the aircraft list once and do other stuff before starting the threads.
@@ -1340,11 +1502,17 @@ int main(int argc, char **argv) {
 
     pthread_create(&Modes.decodeThread, NULL, decodeThreadEntryPoint, NULL);
 
-    if (Modes.json_dir) {
+    if (Modes.json_dir || Modes.net_http) {
 
         pthread_create(&Modes.jsonThread, NULL, jsonThreadEntryPoint, NULL);
 
         if (Modes.json_globe_index) {
+            // globe_xxxx.json
+            pthread_create(&Modes.jsonGlobeThread, NULL, jsonGlobeThreadEntryPoint, NULL);
+        }
+
+        // without json_dir the HTTP server generates traces on request
+        if (Modes.json_globe_index && Modes.json_dir) {
 
             char pathbuf[PATH_MAX];
             snprintf(pathbuf, PATH_MAX, "%s/traces", Modes.json_dir);
@@ -1354,11 +1522,8 @@ int main(int argc, char **argv) {
                 mkdir(pathbuf, 0755);
             }
 
-            // globe_xxxx.json
-            pthread_create(&Modes.jsonGlobeThread, NULL, jsonGlobeThreadEntryPoint, NULL);
-
             // trace_xxxxxxxxx.json
-            for (int i = 0; i < TRACE_THREADS; i++) {
+            for (int i = 0; i < Modes.trace_threads; i++) {
                 pthread_create(&Modes.jsonTraceThread[i], NULL, jsonTraceThreadEntryPoint, &Modes.threadNumber[i]);
             }
         }
@@ -1386,18 +1551,21 @@ int main(int argc, char **argv) {
 
     pthread_mutex_unlock(&Modes.mainThreadMutex);
 
-    if (Modes.json_dir) {
+    if (Modes.json_dir || Modes.net_http) {
 
         pthread_join(Modes.jsonThread, NULL); // Wait on json writer thread exit
 
-        char pathbuf[PATH_MAX];
-        snprintf(pathbuf, PATH_MAX, "%s/receiver.json", Modes.json_dir);
-        unlink(pathbuf);
+        if (Modes.json_dir) {
+            char pathbuf[PATH_MAX];
+            snprintf(pathbuf, PATH_MAX, "%s/receiver.json", Modes.json_dir);
+            unlink(pathbuf);
+        }
 
-        if (Modes.json_globe_index) {
+        if (Modes.json_globe_index)
             pthread_join(Modes.jsonGlobeThread, NULL); // Wait on json writer thread exit
 
-            for (int i = 0; i < TRACE_THREADS; i++) {
+        if (Modes.json_globe_index && Modes.json_dir) {
+            for (int i = 0; i < Modes.trace_threads; i++) {
                 pthread_join(Modes.jsonTraceThread[i], NULL); // Wait on json writer thread exit
             }
         }
@@ -1405,9 +1573,13 @@ int main(int argc, char **argv) {
 
     pthread_join(Modes.decodeThread, NULL); // Wait on json writer thread exit
 
+    heatmapCleanup();
+
     /* Cleanup network setup */
     cleanupNetwork();
 
+    traceQueueCleanup();
+
     if (Modes.state_dir) {
         fprintf(stderr, "saving state .....\n");
 
@@ -1417,9 +1589,17 @@ int main(int argc, char **argv) {
             numbers[i] = i;
             pthread_create(&threads[i], NULL, save_state, &numbers[i]);
         }
+        intptr_t failed = 0;
         for (int i = 0; i < IO_THREADS; i++) {
-            pthread_join(threads[i], NULL);
+            void *res;
+            pthread_join(threads[i], &res);
+            failed += (intptr_t) res;
         }
+        // the blobs hold everything now, unless some couldn't be written: then the log is still needed
+        if (failed)
+            fprintf(stderr, "saving %d state blobs failed%s\n", (int) failed, Modes.state_wal ? ", keeping the write-ahead log" : "");
+        if (Modes.state_wal)
+            walCleanup(!failed);
         fprintf(stderr, "............. done!\n");
     }
 
@@ -1427,10 +1607,11 @@ int main(int argc, char **argv) {
     pthread_mutex_destroy(&Modes.decodeThreadMutex);
     pthread_mutex_destroy(&Modes.jsonThreadMutex);
     pthread_mutex_destroy(&Modes.jsonGlobeThreadMutex);
+    pthread_mutex_destroy(&Modes.heatmapMutex);
     pthread_cond_destroy(&Modes.decodeThreadCond);
     pthread_cond_destroy(&Modes.jsonThreadCond);
     pthread_cond_destroy(&Modes.jsonGlobeThreadCond);
-    for (int i = 0; i < TRACE_THREADS; i++) {
+    for (int i = 0; i < TRACE_THREADS_MAX; i++) {
         pthread_mutex_destroy(&Modes.jsonTraceThreadMutex[i]);
         pthread_cond_destroy(&Modes.jsonTraceThreadCond[i]);
     }
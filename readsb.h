@@ -88,6 +88,7 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <limits.h>
 #include <sys/types.h>
@@ -135,6 +136,10 @@
 #define MODES_OUT_FLUSH_SIZE       (15*1024)
 #define MODES_OUT_FLUSH_INTERVAL   (60000)
 
+// beast_reduce tiers including the default one, one bit each in reduce_forward
+#define BEAST_REDUCE_TIERS 8
+#define REDUCE_FORWARD_ALL 0xFF
+
 #define MODES_USER_LATLON_VALID (1<<0)
 
 #define INVALID_ALTITUDE (-9999)
@@ -305,7 +310,8 @@ typedef enum {
 #define GLOBE_STEP 32
 #define STATE_BLOBS 256
 #define IO_THREADS 8
-#define TRACE_THREADS 4
+#define LOAD_THREADS_MAX 64
+#define TRACE_THREADS_MAX 16
 
 #define STAT_BUCKETS 90 // 90 * 10 seconds = 15 min (max interval in stats.json)
 
@@ -322,6 +328,9 @@ typedef enum {
 #include "fasthash.h"
 #include "anet.h"
 #include "net_io.h"
+#include "compress.h"
+#include "tracepack.h"
+#include "shmring.h"
 #include "crc.h"
 #include "demod_2400.h"
 #include "stats.h"
@@ -373,13 +382,15 @@ struct _Modes
     pthread_mutex_t decodeThreadMutex;
     pthread_mutex_t jsonThreadMutex;
     pthread_mutex_t jsonGlobeThreadMutex;
+    pthread_mutex_t heatmapMutex; // held by the heatmap thread while it reads aircraft
     pthread_cond_t decodeThreadCond;
     pthread_cond_t jsonThreadCond;
     pthread_cond_t jsonGlobeThreadCond;
 
-    pthread_t jsonTraceThread[TRACE_THREADS]; // thread writing icao trace jsons
-    pthread_mutex_t jsonTraceThreadMutex[TRACE_THREADS];
-    pthread_cond_t jsonTraceThreadCond[TRACE_THREADS];
+    pthread_t jsonTraceThread[TRACE_THREADS_MAX]; // thread writing icao trace jsons
+    pthread_mutex_t jsonTraceThreadMutex[TRACE_THREADS_MAX];
+    pthread_cond_t jsonTraceThreadCond[TRACE_THREADS_MAX];
+    int trace_threads; // number of trace writer threads, 0: one per core up to TRACE_THREADS_MAX
 
     unsigned first_free_buffer; // Entry in mag_buffers that will next be filled with input.
     unsigned first_filled_buffer; // Entry in mag_buffers that has valid data and will be demodulated next. If equal to next_free_buffer, there is no unprocessed data.
@@ -406,6 +417,7 @@ struct _Modes
     struct net_writer raw_out; // Raw output
     struct net_writer beast_out; // Beast-format output
     struct net_writer beast_reduce_out; // Reduced data Beast-format output
+    struct net_writer beast_udp_out; // Beast-format UDP datagrams
     struct net_writer garbage_out; // Beast-format output
     struct net_writer sbs_out; // SBS-format output
     struct net_writer sbs_out_replay; // SBS-format output
@@ -417,9 +429,8 @@ struct _Modes
     struct net_writer fatsv_out; // FATSV-format output
     struct net_writer api_out; // some sort of api, who knows really?
     int api; // enable api output
-    int avLen;
-    struct av *byLat;
-    struct av *byLon;
+    uint64_t outfilter_active; // output filter groups in use (outfilter.h)
+    int net_http; // enable built-in HTTP server
 
 #ifdef _WIN32
     WSADATA wsaData; // Windows socket initialisation
@@ -465,7 +476,9 @@ struct _Modes
     uint64_t receiver_focus;
 
     int net_output_flush_size; // Minimum Size of output data
-    uint32_t net_output_beast_reduce_interval; // Position update interval for data reduction
+    uint32_t net_output_beast_reduce_interval; // Position update interval for data reduction, beast_reduce tier 0
+    uint32_t beast_reduce_tiers[BEAST_REDUCE_TIERS - 1]; // intervals of the tiers 1 and up
+    int beast_reduce_tier_count; // including tier 0
     uint32_t net_connector_delay;
     uint32_t net_heartbeat_interval; // TCP heartbeat interval (milliseconds)
     uint32_t net_output_flush_interval; // Maximum interval (in milliseconds) between outputwrites
@@ -485,9 +498,18 @@ struct _Modes
     char *net_output_beast_reduce_ports; // List of Beast output TCP ports
     char *net_output_json_ports;
     char *net_output_api_ports;
+    char *net_http_ports; // built-in HTTP server listen ports
     char *garbage_ports;
     char *net_output_vrs_ports; // List of VRS output TCP ports
     uint64_t net_output_vrs_interval;
+    char **net_beast_udp_out; // UDP beast output destinations, host,port[,ttl=<n>]
+    int net_beast_udp_out_count;
+    char *net_beast_udp_in_ports; // UDP beast input ports
+    int net_udp_size; // UDP datagram size limit
+    char *net_shm; // shared memory ring name
+    uint64_t net_shm_size;
+    int net_shm_types; // bit 1 << SHM_RECORD_* set: publish these records
+    struct shm_ring *shm;
     struct net_connector **net_connectors; // client connectors
     int net_connectors_count;
     int net_connectors_size;
@@ -508,7 +530,12 @@ struct _Modes
     int json_ac_count_pos;
     int json_ac_count_no_pos;
     struct tile *json_globe_special_tiles;
+    int globe_adaptive; // target aircraft per adaptive globe tile, 0: fixed tiles
     int json_gzip; // Enable extra globe indexed json files.
+    int compress_level[ZCLASS_COUNT]; // gzip level per file class
+    int trace_pack; // keep older trace points delta encoded in memory
+    int history_packs; // write the globe_history traces to daily pack files (tracepack.h)
+    int state_wal; // write-ahead log for the persistent state (wal.h)
     char *beast_serial; // Modes-S Beast device path
 
     int net_sndbuf_size; // TCP output buffer size (64Kb * 2^n)
@@ -583,6 +610,7 @@ struct modesMessage
 {
     uint64_t timestampMsg; // Timestamp of the message (12MHz clock)
     uint64_t sysTimestampMsg; // Timestamp of the message (system time)
+    uint64_t sysMicros; // System time in microseconds the message was read from the socket / SDR, 0 if unknown
     uint64_t receiverId; // zero if not transmitted
     // Generic fields
     unsigned char msg[MODES_LONG_MSG_BYTES]; // Binary message.
@@ -596,12 +624,14 @@ struct modesMessage
     int score; // Scoring from scoreModesMessage, if used
     bool remote; // If set this message is from a remote station
     bool sbs_in; // Signifies this message is coming from basestation input
-    bool reduce_forward; // forward this message for reduced beast output
+    uint8_t reduce_forward; // bit n: forward this message on beast_reduce tier n
     bool garbage; // from garbage receiver
     bool duplicate; // associated position is a duplicate
     bool pos_ignore; // associated position is old / delayed / misc error
     bool pos_bad; // speed_check failed
     bool jsonPos; // output a json position
+    bool filterDone; // filterMask is set
+    uint64_t filterMask; // output filter groups the message passes (outfilter.c)
     datasource_t source; // Characterizes the overall message source
     double signalLevel; // RSSI, in the range [0..1], as a fraction of full-scale power
     // Raw data, just extracted directly from the message
@@ -837,15 +867,21 @@ enum {
     OptShowOnly,
     OptJsonDir,
     OptJsonGzip,
+    OptCompressionLevels,
+    OptCompressTraces,
+    OptHistoryPacks,
+    OptTraceThreads,
     OptJsonReliable,
     OptPromFile,
     OptGlobeHistoryDir,
     OptStateDir,
+    OptStateWal,
     OptHeatmap,
     OptHeatmapDir,
     OptJsonTime,
     OptJsonLocAcc,
     OptJsonGlobeIndex,
+    OptGlobeAdaptive,
     OptJsonTraceInt,
     OptDcFilter,
     OptBiasTee,
@@ -860,14 +896,20 @@ enum {
     OptNetBoPorts,
     OptNetBeastReducePorts,
     OptNetBeastReduceInterval,
+    OptNetBeastReduceTiers,
     OptNetVRSPorts,
     OptNetVRSInterval,
     OptNetJsonPorts,
     OptNetApiPorts,
+    OptNetHttpPorts,
     OptNetRoSize,
     OptNetRoRate,
     OptNetRoIntervall,
     OptNetConnector,
+    OptNetBeastUdpOut,
+    OptNetBeastUdpIn,
+    OptNetUdpSize,
+    OptNetShm,
     OptNetConnectorDelay,
     OptNetHeartbeat,
     OptNetBuffer,
@@ -898,6 +940,8 @@ enum {
 
 // This one needs modesMessage:
 #include "track.h"
+#include "wal.h"
+#include "outfilter.h"
 #include "mode_s.h"
 #include "comm_b.h"
 
@@ -84,6 +84,39 @@ void receiverCleanup() {
         }
     }
 }
+// a jump in the sequence by more than this is a restart of the sender
+#define UDP_SEQ_RESTART 65536
+
+// call only for datagrams with frames that decoded, the header alone is easily spoofed
+void receiverUdpSequence(uint64_t id, uint32_t seq, uint64_t now) {
+    struct receiver *r = receiverCreate(id);
+    if (!r)
+        return;
+    int32_t diff = seq - r->udpSeq;
+    if (!r->udpReceived || diff > UDP_SEQ_RESTART || diff < -UDP_SEQ_RESTART) {
+        r->udpSeq = seq + 1;
+        r->udpMissing = 0;
+    } else if (diff >= 0) {
+        r->udpLost += diff;
+        Modes.stats_current.udp_in_lost += diff;
+        r->udpSeq = seq + 1;
+        // bit 0 is seq itself, bits 1 to diff the gap before it
+        uint64_t gap = diff >= 63 ? ~1ULL : ((1ULL << diff) - 1) << 1;
+        r->udpMissing = (diff >= 63 ? 0 : r->udpMissing << (diff + 1)) | gap;
+    } else if (-diff - 1 < 64 && (r->udpMissing & (1ULL << (-diff - 1)))) {
+        // counted as lost when the gap showed up
+        r->udpMissing &= ~(1ULL << (-diff - 1));
+        r->udpReordered++;
+        Modes.stats_current.udp_in_reordered++;
+        r->udpLost--;
+        if (Modes.stats_current.udp_in_lost)
+            Modes.stats_current.udp_in_lost--;
+    }
+    // anything else before udpSeq is a duplicate or too late to tell, a gap stays counted as lost
+    r->udpReceived++;
+    r->lastSeen = now;
+}
+
 void receiverPositionReceived(struct aircraft *a, uint64_t id, double lat, double lon, uint64_t now) {
     if (bogus_lat_lon(lat, lon))
         return;
@@ -250,14 +283,18 @@ struct char_buffer generateReceiversJson() {
             }
 
             double elapsed = (r->lastSeen - r->firstSeen) / 1000.0 + 1.0;
-            p = safe_snprintf(p, end, "[ \"%016"PRIx64"\", %6.2f, %6.2f, %0.2f, %0.2f, %0.2f, %0.2f ],\n",
+            // the last three: UDP datagrams received, lost and reordered
+            p = safe_snprintf(p, end, "[ \"%016"PRIx64"\", %6.2f, %6.2f, %0.2f, %0.2f, %0.2f, %0.2f, %"PRIu64", %"PRIu64", %"PRIu64" ],\n",
                     r->id,
                     r->positionCounter / elapsed,
                     r->timedOutCounter * 3600.0 / elapsed,
                     r->latMin,
                     r->latMax,
                     r->lonMin,
-                    r->lonMax);
+                    r->lonMax,
+                    r->udpReceived,
+                    r->udpLost,
+                    r->udpReordered);
 
 
 
@@ -20,6 +20,12 @@ typedef struct receiver {
     // reset both counters on timing out a receiver.
     uint64_t timedOutUntil;
     uint32_t timedOutCounter; // how many times a receiver has been timed out
+    // beast over UDP (--net-beast-udp-in)
+    uint32_t udpSeq; // next expected sequence number
+    uint64_t udpReceived;
+    uint64_t udpLost; // gaps in the sequence not filled by late datagrams
+    uint64_t udpReordered; // datagrams arriving after a later one
+    uint64_t udpMissing; // bit k set: sequence number udpSeq - 1 - k was counted as lost
 } receiver;
 
 
@@ -29,6 +35,8 @@ struct receiver *receiverCreate(uint64_t id);
 
 struct char_buffer generateReceiversJson();
 
+// count loss and reordering of the datagrams of a UDP sender
+void receiverUdpSequence(uint64_t id, uint32_t seq, uint64_t now);
 void receiverPositionReceived(struct aircraft *a, uint64_t id, double lat, double lon, uint64_t now);
 void receiverTimeout(int part, int nParts);
 void receiverCleanup();
@@ -0,0 +1,286 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// shmring.c: shared memory ring for consumers on the same host, see shmring.h
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "readsb.h"
+#include <sys/mman.h>
+#include <sys/file.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define SHM_ALIGN(len) (((len) + 7) & ~7ULL)
+
+static char *shmPath(const char *name) {
+    char *path = malloc(strlen(name) + 2);
+    if (!path)
+        return NULL;
+    sprintf(path, "%s%s", name[0] == '/' ? "" : "/", name);
+    return path;
+}
+
+static int shmMap(struct shm_ring *ring, int prot) {
+    ring->mapLen = SHM_RING_HEADER_SIZE + ring->size;
+    void *map = mmap(NULL, ring->mapLen, prot, MAP_SHARED, ring->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    ring->header = map;
+    ring->data = (char *) map + SHM_RING_HEADER_SIZE;
+    return 0;
+}
+
+// 1 if the object at path was left behind by a readsb that is gone
+static int shmRingStale(const char *path) {
+    int fd = shm_open(path, O_RDWR, 0);
+    if (fd < 0)
+        return errno == ENOENT;
+
+    int stale = 1;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK) {
+            stale = 0;
+        } else {
+            // no flock on shared memory here, go by the magic, a crashed readsb leaves it set
+            struct stat st;
+            struct shm_ring_header h;
+            if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(h)
+                    && pread(fd, &h, sizeof(h), 0) == sizeof(h) && h.magic == SHM_RING_MAGIC) {
+                stale = 0;
+            }
+        }
+    }
+    close(fd);
+    return stale;
+}
+
+struct shm_ring *shmRingCreate(const char *name, uint64_t size) {
+    struct shm_ring *ring = calloc(1, sizeof(struct shm_ring));
+    if (!ring)
+        return NULL;
+    ring->fd = -1;
+    ring->name = shmPath(name);
+    if (!ring->name) {
+        fprintf(stderr, "shm ring %s: out of memory\n", name);
+        goto fail;
+    }
+    ring->size = 64 * 1024;
+    while (ring->size < size)
+        ring->size *= 2;
+
+    ring->fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (ring->fd < 0 && errno == EEXIST) {
+        if (!shmRingStale(ring->name)) {
+            fprintf(stderr, "shm ring %s: in use by another readsb, every instance needs its own name\n", ring->name);
+            goto fail;
+        }
+        // don't reuse the old object: readers still attached to it would see it change size
+        shm_unlink(ring->name);
+        ring->fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    }
+    if (ring->fd < 0) {
+        fprintf(stderr, "shm_open(%s): %s\n", ring->name, strerror(errno));
+        goto fail;
+    }
+    // held until readsb exits, shmRingStale() of another instance checks it
+    if (flock(ring->fd, LOCK_EX | LOCK_NB) < 0 && errno == EWOULDBLOCK) {
+        fprintf(stderr, "shm ring %s: in use by another readsb, every instance needs its own name\n", ring->name);
+        close(ring->fd);
+        ring->fd = -1;
+        goto fail;
+    }
+    if (ftruncate(ring->fd, SHM_RING_HEADER_SIZE + ring->size) < 0 || shmMap(ring, PROT_READ | PROT_WRITE) < 0) {
+        fprintf(stderr, "shm ring %s: %s\n", ring->name, strerror(errno));
+        shm_unlink(ring->name);
+        goto fail;
+    }
+
+    struct shm_ring_header *h = ring->header;
+    h->version = SHM_RING_VERSION;
+    h->size = ring->size;
+    h->epoch = ((uint64_t) random() << 32) ^ random() ^ microtime();
+    // readers check the magic first
+    __atomic_store_n(&h->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    return ring;
+
+fail:
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring->name);
+    free(ring);
+    return NULL;
+}
+
+void shmRingDestroy(struct shm_ring *ring) {
+    if (!ring)
+        return;
+    __atomic_store_n(&ring->header->magic, 0, __ATOMIC_RELEASE);
+    shmRingWake(ring);
+    shm_unlink(ring->name);
+    munmap(ring->header, ring->mapLen);
+    close(ring->fd);
+    free(ring->name);
+    free(ring);
+}
+
+void shmRingPublish(struct shm_ring *ring, uint16_t type, uint64_t receiverId, const void *data, uint32_t len) {
+    struct shm_ring_header *h = ring->header;
+    uint64_t need = SHM_ALIGN(sizeof(struct shm_record) + len);
+    if (need > ring->size / 4)
+        return;
+
+    uint64_t pos = h->head; // only written here
+    uint64_t off = pos & (ring->size - 1);
+    uint64_t pad = (off + need > ring->size) ? ring->size - off : 0;
+
+    // invalidate what is about to be overwritten before touching it
+    __atomic_store_n(&h->reserve, pos + pad + need, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    if (pad) {
+        // less than a record header left: readers skip to the start of the ring by themselves
+        if (pad >= sizeof(struct shm_record)) {
+            struct shm_record fill = { .len = pad - sizeof(struct shm_record), .type = SHM_RECORD_PAD };
+            memcpy(ring->data + off, &fill, sizeof(fill));
+        }
+        off = 0;
+    }
+    struct shm_record rec = { .len = len, .type = type, .seq = ++ring->seq, .receiverId = receiverId };
+    memcpy(ring->data + off, &rec, sizeof(rec));
+    memcpy(ring->data + off + sizeof(rec), data, len);
+
+    __atomic_store_n(&h->head, pos + pad + need, __ATOMIC_RELEASE);
+}
+
+void shmRingWake(struct shm_ring *ring) {
+    struct shm_ring_header *h = ring->header;
+    if (ring->woken == h->head && h->magic)
+        return;
+    ring->woken = h->head;
+    __atomic_fetch_add(&h->wake, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+    // shared futex, the readers are other processes
+    syscall(SYS_futex, &h->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+struct shm_ring *shmRingAttach(const char *name) {
+    struct shm_ring *ring = calloc(1, sizeof(struct shm_ring));
+    if (!ring)
+        return NULL;
+    ring->fd = -1;
+    ring->name = shmPath(name);
+    if (!ring->name)
+        goto fail;
+    ring->fd = shm_open(ring->name, O_RDONLY, 0);
+    if (ring->fd < 0)
+        goto fail;
+
+    struct shm_ring_header h;
+    if (pread(ring->fd, &h, sizeof(h), 0) != sizeof(h) || h.magic != SHM_RING_MAGIC || h.version != SHM_RING_VERSION
+            || !h.size || (h.size & (h.size - 1))) {
+        errno = EINVAL;
+        goto fail;
+    }
+    ring->size = h.size;
+    if (shmMap(ring, PROT_READ) < 0)
+        goto fail;
+    ring->epoch = h.epoch;
+    ring->pos = __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+    return ring;
+
+fail:
+    if (ring->fd >= 0)
+        close(ring->fd);
+    free(ring->name);
+    free(ring);
+    return NULL;
+}
+
+void shmRingDetach(struct shm_ring *ring) {
+    if (!ring)
+        return;
+    munmap(ring->header, ring->mapLen);
+    close(ring->fd);
+    free(ring->name);
+    free(ring);
+}
+
+int shmRingRead(struct shm_ring *ring, struct shm_record *rec, void *buf, uint32_t bufSize) {
+    struct shm_ring_header *h = ring->header;
+
+    while (1) {
+        if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC || h->epoch != ring->epoch)
+            return -1;
+
+        uint64_t head = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+        if (ring->pos == head)
+            return 0;
+        if (head - ring->pos > ring->size) {
+            // overrun, the next record read tells how many were lost
+            ring->pos = head;
+            continue;
+        }
+
+        uint64_t off = ring->pos & (ring->size - 1);
+        uint64_t left = ring->size - off;
+        if (left < sizeof(struct shm_record)) {
+            ring->pos += left;
+            continue;
+        }
+        memcpy(rec, ring->data + off, sizeof(struct shm_record));
+        // bound the copy, a torn header is caught below
+        uint32_t len = rec->len;
+        if (len > left - sizeof(struct shm_record))
+            len = left - sizeof(struct shm_record);
+        if (rec->type != SHM_RECORD_PAD)
+            memcpy(buf, ring->data + off + sizeof(struct shm_record), len < bufSize ? len : bufSize);
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->reserve, __ATOMIC_RELAXED) - ring->pos > ring->size) {
+            // the writer lapped us while copying
+            ring->pos = __atomic_load_n(&h->head, __ATOMIC_ACQUIRE);
+            continue;
+        }
+
+        if (rec->type == SHM_RECORD_PAD) {
+            ring->pos += left;
+            continue;
+        }
+        ring->pos += SHM_ALIGN(sizeof(struct shm_record) + rec->len);
+        if (ring->nextSeq && rec->seq > ring->nextSeq)
+            ring->lost += rec->seq - ring->nextSeq;
+        ring->nextSeq = rec->seq + 1;
+        return 1;
+    }
+}
+
+void shmRingWait(struct shm_ring *ring, int timeout_ms) {
+    struct shm_ring_header *h = ring->header;
+    uint32_t wake = __atomic_load_n(&h->wake, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&h->head, __ATOMIC_ACQUIRE) != ring->pos || h->magic != SHM_RING_MAGIC)
+        return;
+#ifdef __linux__
+    struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    syscall(SYS_futex, &h->wake, FUTEX_WAIT, wake, &ts, NULL, 0);
+#else
+    MODES_NOTUSED(wake);
+    struct timespec ts = { 0, 1000000L };
+    if (timeout_ms < 1)
+        ts.tv_nsec = 0;
+    nanosleep(&ts, NULL);
+#endif
+}
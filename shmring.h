@@ -0,0 +1,138 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// shmring.h: shared memory ring for consumers on the same host
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+// Shared memory ring for consumers on the same host (--net-shm)
+//
+// readsb creates the POSIX shared memory object <name> (/dev/shm/<name> on
+// Linux): a header page followed by a ring of size bytes.  Beast messages and
+// accepted positions are appended as records, readsb neither waits for nor
+// knows about readers: a reader maps the object read-only and follows the
+// write position at its own pace, attaching or detaching doesn't affect the
+// writer or other readers.  A reader that falls more than the ring size behind
+// loses the overwritten records and continues at the current write position,
+// the sequence numbers tell it how many records it missed.
+//
+// Writing a record: reserve is advanced past the end of the record, the record
+// is copied into the ring, then head is advanced.  A reader copies a record
+// below head and then checks that reserve hasn't moved more than the ring size
+// past the start of the record, otherwise the copy may be torn.
+//
+// Records start at 8 byte aligned ring offsets and don't wrap: when a record
+// doesn't fit before the end of the ring, a SHM_RECORD_PAD record fills the
+// rest and the record is written at ring offset 0.  Positions in the ring are
+// byte counters that never wrap, the ring offset is position & (size - 1).
+//
+// Readers waiting for data can sleep on the futex word wake: readsb increments
+// it and wakes the sleepers once per network processing pass that published
+// records, not per record.  On shutdown readsb clears the magic and removes
+// the name, a restarted readsb creates a new object with a new epoch.
+//
+// The name has to be unique per readsb: the writer holds an flock on the
+// object, a second readsb with the same name refuses to start.  An object
+// without the lock (its readsb crashed) is replaced.
+
+#define SHM_RING_MAGIC 0x67525352 // "RSRg"
+#define SHM_RING_VERSION 1
+#define SHM_RING_HEADER_SIZE 4096
+
+enum {
+    SHM_RECORD_PAD = 0,
+    SHM_RECORD_BEAST = 1, // one beast frame as sent to beast_out clients, escaped, starting with 0x1a
+    SHM_RECORD_POSITION = 2, // struct shm_position
+};
+
+// host byte order, readers are on the same host
+struct shm_ring_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size; // ring size in bytes, a power of 2
+    uint64_t epoch; // random, changes with every start of readsb
+    uint64_t reserve; // end of the record being written
+    uint64_t head; // end of the last complete record
+    uint32_t wake; // futex word
+    uint32_t pad;
+};
+
+struct shm_record {
+    uint32_t len; // payload bytes following the header, the next record starts 8 byte aligned
+    uint16_t type;
+    uint16_t flags;
+    uint64_t seq; // counts the records that aren't padding
+    uint64_t receiverId; // of the message, 0 for positions
+};
+
+#define SHM_POS_ALT_BARO 0x1
+#define SHM_POS_ALT_GEOM 0x2
+#define SHM_POS_GS 0x4
+#define SHM_POS_TRACK 0x8
+#define SHM_POS_GROUND 0x10
+
+struct shm_position {
+    uint64_t timestamp; // ms since the epoch
+    uint32_t addr; // MODES_NON_ICAO_ADDRESS set for non-ICAO addresses
+    uint8_t addrtype; // addrtype_t
+    uint8_t source; // datasource_t
+    uint8_t nic;
+    uint8_t flags; // SHM_POS_*, which of the fields below are valid
+    double lat;
+    double lon;
+    int32_t alt_baro; // feet
+    int32_t alt_geom; // feet
+    float gs; // knots
+    float track; // degrees
+};
+
+struct shm_ring {
+    struct shm_ring_header *header;
+    char *data;
+    uint64_t size;
+    size_t mapLen;
+    int fd;
+    // writer
+    uint64_t seq;
+    uint64_t woken; // head at the last shmRingWake()
+    char *name;
+    // reader
+    uint64_t pos;
+    uint64_t nextSeq;
+    uint64_t epoch;
+    uint64_t lost;
+};
+
+// writer: create or replace the shared memory object, size is rounded up to a power of 2
+// returns NULL on error
+struct shm_ring *shmRingCreate(const char *name, uint64_t size);
+// removes the shared memory object, attached readers keep their mapping
+void shmRingDestroy(struct shm_ring *ring);
+// never blocks, overwrites the oldest records
+void shmRingPublish(struct shm_ring *ring, uint16_t type, uint64_t receiverId, const void *data, uint32_t len);
+// wake readers sleeping in shmRingWait() if records were published since the last call
+void shmRingWake(struct shm_ring *ring);
+
+// reader: returns NULL on error, starts reading at the current head
+struct shm_ring *shmRingAttach(const char *name);
+void shmRingDetach(struct shm_ring *ring);
+// copies the next record to rec and its payload to buf (at most bufSize bytes)
+// returns 1 for a record, 0 if there is none yet, -1 if the writer restarted (reattach)
+int shmRingRead(struct shm_ring *ring, struct shm_record *rec, void *buf, uint32_t bufSize);
+// sleep until there might be new records or timeout_ms passed
+void shmRingWait(struct shm_ring *ring, int timeout_ms);
+
+#endif
@@ -282,7 +282,7 @@ void add_stats(const struct stats *st1, const struct stats *st2, struct stats *t
     add_timespecs(&st1->globe_json_cpu, &st2->globe_json_cpu, &target->globe_json_cpu);
     add_timespecs(&st1->heatmap_and_state_cpu, &st2->heatmap_and_state_cpu, &target->heatmap_and_state_cpu);
     add_timespecs(&st1->remove_stale_cpu, &st2->remove_stale_cpu, &target->remove_stale_cpu);
-    for (i = 0; i < TRACE_THREADS; i ++) {
+    for (i = 0; i < TRACE_THREADS_MAX; i ++) {
         add_timespecs(&st1->trace_json_cpu[i], &st2->trace_json_cpu[i], &target->trace_json_cpu[i]);
     }
     for (i = 0; i < NUM_TYPES; i ++) {
@@ -357,6 +357,223 @@ void add_stats(const struct stats *st1, const struct stats *st2, struct stats *t
         target->distance_min = st1->distance_min;
     else
         target->distance_min = st2->distance_min;
+
+    // latency histograms
+    for (int t = 0; t < LATENCY_TYPES; t++) {
+        for (i = 0; i < LATENCY_BUCKETS; ++i)
+            target->latency[t][i] = st1->latency[t][i] + st2->latency[t][i];
+        target->latency_sum[t] = st1->latency_sum[t] + st2->latency_sum[t];
+    }
+
+    for (int z = 0; z < ZCLASS_COUNT; z++) {
+        target->compress_in[z] = st1->compress_in[z] + st2->compress_in[z];
+        target->compress_out[z] = st1->compress_out[z] + st2->compress_out[z];
+        target->compress_cpu_ns[z] = st1->compress_cpu_ns[z] + st2->compress_cpu_ns[z];
+    }
+
+    target->net_inflate_in = st1->net_inflate_in + st2->net_inflate_in;
+    target->net_inflate_out = st1->net_inflate_out + st2->net_inflate_out;
+
+    target->udp_out_datagrams = st1->udp_out_datagrams + st2->udp_out_datagrams;
+    target->udp_out_dropped = st1->udp_out_dropped + st2->udp_out_dropped;
+    target->udp_in_datagrams = st1->udp_in_datagrams + st2->udp_in_datagrams;
+    target->udp_in_bad = st1->udp_in_bad + st2->udp_in_bad;
+    target->udp_in_lost = st1->udp_in_lost + st2->udp_in_lost;
+    target->udp_in_reordered = st1->udp_in_reordered + st2->udp_in_reordered;
+
+    target->ingest_deferred = st1->ingest_deferred + st2->ingest_deferred;
+    target->ingest_discarded = st1->ingest_discarded + st2->ingest_discarded;
+
+    target->shm_records = st1->shm_records + st2->shm_records;
+    target->shm_bytes = st1->shm_bytes + st2->shm_bytes;
+
+    target->outfilter_evals = st1->outfilter_evals + st2->outfilter_evals;
+    target->outfilter_ns = st1->outfilter_ns + st2->outfilter_ns;
+}
+
+static inline int latencyBucket(uint64_t micros) {
+    if (micros < (1 << LATENCY_SUB_BITS))
+        return micros;
+    int msb = 63 - __builtin_clzll(micros);
+    if (msb >= LATENCY_MAX_BITS)
+        return LATENCY_BUCKETS - 1;
+    int sub = (micros >> (msb - LATENCY_SUB_BITS)) & ((1 << LATENCY_SUB_BITS) - 1);
+    return (msb - LATENCY_SUB_BITS + 1) * (1 << LATENCY_SUB_BITS) + sub;
+}
+
+// lowest value that ends up in bucket
+static uint64_t latencyBucketStart(int bucket) {
+    if (bucket < (1 << LATENCY_SUB_BITS))
+        return bucket;
+    int msb = bucket / (1 << LATENCY_SUB_BITS) + LATENCY_SUB_BITS - 1;
+    int sub = bucket % (1 << LATENCY_SUB_BITS);
+    return ((uint64_t) ((1 << LATENCY_SUB_BITS) + sub)) << (msb - LATENCY_SUB_BITS);
+}
+
+// add a latency sample to the current stats bucket
+void statsLatency(latency_type_t type, int64_t micros) {
+    if (micros < 0)
+        micros = 0; // clock adjustments
+    Modes.stats_current.latency[type][latencyBucket(micros)]++;
+    Modes.stats_current.latency_sum[type] += micros;
+}
+
+// for threads that don't hold the decode lock (stats_current is only reset under lockThreads())
+void statsLatencyShared(latency_type_t type, int64_t micros) {
+    if (micros < 0)
+        micros = 0;
+    __atomic_fetch_add(&Modes.stats_current.latency[type][latencyBucket(micros)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&Modes.stats_current.latency_sum[type], micros, __ATOMIC_RELAXED);
+}
+
+void statsJsonLatencyNote(struct json_latency *jl, uint32_t age) {
+    if (jl->count == jl->alloc) {
+        jl->alloc = jl->alloc ? 2 * jl->alloc : 1024;
+        jl->age = realloc(jl->age, jl->alloc * sizeof(uint32_t));
+        if (!jl->age) {
+            fprintf(stderr, "Out of memory for aircraft.json latency\n");
+            exit(1);
+        }
+    }
+    jl->age[jl->count++] = age;
+}
+
+// runs on the json thread: bucket the samples locally, then merge them with atomic adds like statsLatencyShared()
+void statsAircraftJsonLatency(struct json_latency *jl, uint64_t written) {
+    uint32_t histo[LATENCY_BUCKETS] = { 0 };
+    uint64_t sum = 0;
+    for (int i = 0; i < jl->count; i++) {
+        int64_t micros = (int64_t) (jl->age[i] + written - jl->generated) * 1000;
+        if (micros < 0)
+            micros = 0;
+        histo[latencyBucket(micros)]++;
+        sum += micros;
+    }
+    if (jl->count) {
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            if (histo[i])
+                __atomic_fetch_add(&Modes.stats_current.latency[LATENCY_AIRCRAFT_JSON][i], histo[i], __ATOMIC_RELAXED);
+        }
+        __atomic_fetch_add(&Modes.stats_current.latency_sum[LATENCY_AIRCRAFT_JSON], sum, __ATOMIC_RELAXED);
+    }
+    jl->count = 0;
+    jl->since = jl->generated;
+}
+
+static uint64_t latencyCount(const uint32_t *histo) {
+    uint64_t count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        count += histo[i];
+    return count;
+}
+
+// returns the percentile p in milliseconds, using the middle of the bucket
+static double latencyPercentile(const uint32_t *histo, uint64_t count, double p) {
+    if (!count)
+        return 0;
+    uint64_t target = (uint64_t) ceil(p * count);
+    if (target < 1)
+        target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histo[i];
+        if (seen >= target) {
+            if (i == LATENCY_BUCKETS - 1)
+                return latencyBucketStart(i) / 1000.0;
+            return (latencyBucketStart(i) + latencyBucketStart(i + 1)) / 2.0 / 1000.0;
+        }
+    }
+    return latencyBucketStart(LATENCY_BUCKETS - 1) / 1000.0;
+}
+
+static const char *latencyName(latency_type_t type) {
+    switch (type) {
+        case LATENCY_NET_READ: return "net_read";
+        case LATENCY_DEMOD: return "demod";
+        case LATENCY_BEAST_OUT: return "beast_out";
+        case LATENCY_SBS_OUT: return "sbs_out";
+        case LATENCY_AIRCRAFT_JSON: return "aircraft_json";
+        case LATENCY_TRACE_WRITE: return "trace_write";
+        case LATENCY_API_QUERY: return "api_query";
+        default: return "unknown";
+    }
+}
+
+// The uint32 counters of struct stats wrap after some weeks on a busy receiver,
+// the ones exported as Prometheus counters are summed into uint64 from the
+// 10 second buckets (see generatePromMetrics()).
+struct prom_counters {
+    uint64_t demod_accepted[MODES_MAX_BITERRORS + 1];
+    uint64_t remote_accepted[MODES_MAX_BITERRORS + 1];
+    uint64_t pos_by_type[NUM_TYPES];
+    uint64_t latency[LATENCY_TYPES][LATENCY_BUCKETS];
+    uint64_t demod_rejected_bad;
+    uint64_t demod_rejected_unknown_icao;
+    uint64_t demod_modeac;
+    uint64_t demod_preambles;
+    uint64_t strong_signal_count;
+    uint64_t remote_rejected_bad;
+    uint64_t remote_rejected_unknown_icao;
+    uint64_t remote_received_modeac;
+    uint64_t remote_received_basestation_valid;
+    uint64_t remote_received_basestation_invalid;
+    uint64_t remote_malformed_beast;
+    uint64_t messages_total;
+    uint64_t cpr_airborne;
+    uint64_t cpr_surface;
+    uint64_t cpr_global_ok;
+    uint64_t cpr_global_bad;
+    uint64_t cpr_global_range_checks;
+    uint64_t cpr_global_speed_checks;
+    uint64_t cpr_global_skipped;
+    uint64_t cpr_local_ok;
+    uint64_t cpr_local_range_checks;
+    uint64_t cpr_local_speed_checks;
+    uint64_t cpr_local_skipped;
+    uint64_t cpr_filtered;
+    uint64_t unique_aircraft;
+    uint64_t single_message_aircraft;
+};
+
+static struct prom_counters promAlltime;
+
+static void promCount(const struct stats *st, struct prom_counters *c) {
+    for (int i = 0; i <= MODES_MAX_BITERRORS; i++) {
+        c->demod_accepted[i] += st->demod_accepted[i];
+        c->remote_accepted[i] += st->remote_accepted[i];
+    }
+    for (int i = 0; i < NUM_TYPES; i++)
+        c->pos_by_type[i] += st->pos_by_type[i];
+    for (int t = 0; t < LATENCY_TYPES; t++) {
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+            c->latency[t][i] += st->latency[t][i];
+    }
+    c->demod_rejected_bad += st->demod_rejected_bad;
+    c->demod_rejected_unknown_icao += st->demod_rejected_unknown_icao;
+    c->demod_modeac += st->demod_modeac;
+    c->demod_preambles += st->demod_preambles;
+    c->strong_signal_count += st->strong_signal_count;
+    c->remote_rejected_bad += st->remote_rejected_bad;
+    c->remote_rejected_unknown_icao += st->remote_rejected_unknown_icao;
+    c->remote_received_modeac += st->remote_received_modeac;
+    c->remote_received_basestation_valid += st->remote_received_basestation_valid;
+    c->remote_received_basestation_invalid += st->remote_received_basestation_invalid;
+    c->remote_malformed_beast += st->remote_malformed_beast;
+    c->messages_total += st->messages_total;
+    c->cpr_airborne += st->cpr_airborne;
+    c->cpr_surface += st->cpr_surface;
+    c->cpr_global_ok += st->cpr_global_ok;
+    c->cpr_global_bad += st->cpr_global_bad;
+    c->cpr_global_range_checks += st->cpr_global_range_checks;
+    c->cpr_global_speed_checks += st->cpr_global_speed_checks;
+    c->cpr_global_skipped += st->cpr_global_skipped;
+    c->cpr_local_ok += st->cpr_local_ok;
+    c->cpr_local_range_checks += st->cpr_local_range_checks;
+    c->cpr_local_speed_checks += st->cpr_local_speed_checks;
+    c->cpr_local_skipped += st->cpr_local_skipped;
+    c->cpr_filtered += st->cpr_filtered;
+    c->unique_aircraft += st->unique_aircraft;
+    c->single_message_aircraft += st->single_message_aircraft;
 }
 
 int statsUpdate(uint64_t now) {
@@ -383,6 +600,7 @@ int statsUpdate(uint64_t now) {
         Modes.stats_10[Modes.stats_bucket] = Modes.stats_current;
 
         add_stats(&Modes.stats_current, &Modes.stats_alltime, &Modes.stats_alltime);
+        promCount(&Modes.stats_current, &promAlltime);
         add_stats(&Modes.stats_current, &Modes.stats_periodic, &Modes.stats_periodic);
 
         reset_stats(&Modes.stats_1min);
@@ -508,7 +726,7 @@ static char * appendStatsJson(char *p, char *end, struct stats *st, const char *
         CPU_MILLIS(remove_stale);
 #undef CPU_MILLIS
         uint64_t trace_json_cpu_millis_sum = 0;
-        for (i = 0; i < TRACE_THREADS; i ++) {
+        for (i = 0; i < TRACE_THREADS_MAX; i ++) {
             trace_json_cpu_millis_sum += (uint64_t) st->trace_json_cpu[i].tv_sec * 1000UL + st->trace_json_cpu[i].tv_nsec / 1000000UL;
         }
 
@@ -537,8 +755,7 @@ static char * appendStatsJson(char *p, char *end, struct stats *st, const char *
                 ",\"tracks\":{\"all\":%u"
                 ",\"single_message\":%u}"
                 ",\"messages\":%u"
-                ",\"max_distance\":%ld"
-                "}",
+                ",\"max_distance\":%ld",
             st->cpr_surface,
             st->cpr_airborne,
             st->cpr_global_ok,
@@ -568,6 +785,53 @@ static char * appendStatsJson(char *p, char *end, struct stats *st, const char *
             (long) st->distance_max);
     }
 
+    // latency percentiles in milliseconds
+    p = safe_snprintf(p, end, ",\"latency\":{");
+    for (int t = 0; t < LATENCY_TYPES; t++) {
+        uint64_t count = latencyCount(st->latency[t]);
+        p = safe_snprintf(p, end, "%s\"%s\":{\"count\":%"PRIu64",\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f}",
+                t ? "," : "", latencyName(t), count,
+                latencyPercentile(st->latency[t], count, 0.5),
+                latencyPercentile(st->latency[t], count, 0.99),
+                latencyPercentile(st->latency[t], count, 0.999));
+    }
+    p = safe_snprintf(p, end, "}");
+
+    // compression: bytes in / out and CPU nanoseconds per input byte
+    p = safe_snprintf(p, end, ",\"compression\":{");
+    int first = 1;
+    for (int z = ZCLASS_NONE + 1; z < ZCLASS_COUNT; z++) {
+        if (!st->compress_in[z])
+            continue;
+        p = safe_snprintf(p, end, "%s\"%s\":{\"in\":%"PRIu64",\"out\":%"PRIu64",\"cpu_ms\":%.1f,\"ns_per_byte\":%.2f}",
+                first ? "" : ",", zclassName(z), st->compress_in[z], st->compress_out[z],
+                st->compress_cpu_ns[z] / 1e6, (double) st->compress_cpu_ns[z] / st->compress_in[z]);
+        first = 0;
+    }
+    if (st->net_inflate_in) {
+        p = safe_snprintf(p, end, "%s\"net_inflate\":{\"in\":%"PRIu64",\"out\":%"PRIu64"}",
+                first ? "" : ",", st->net_inflate_in, st->net_inflate_out);
+    }
+    p = safe_snprintf(p, end, "}");
+
+    p = safe_snprintf(p, end, ",\"udp\":{\"out_datagrams\":%"PRIu64",\"out_dropped\":%"PRIu64
+            ",\"in_datagrams\":%"PRIu64",\"in_bad\":%"PRIu64",\"in_lost\":%"PRIu64",\"in_reordered\":%"PRIu64"}",
+            st->udp_out_datagrams, st->udp_out_dropped,
+            st->udp_in_datagrams, st->udp_in_bad, st->udp_in_lost, st->udp_in_reordered);
+
+    p = safe_snprintf(p, end, ",\"ingest\":{\"deferred\":%"PRIu64",\"discarded_bytes\":%"PRIu64"}",
+            st->ingest_deferred, st->ingest_discarded);
+
+    if (Modes.shm) {
+        p = safe_snprintf(p, end, ",\"shm\":{\"records\":%"PRIu64",\"bytes\":%"PRIu64"}",
+                st->shm_records, st->shm_bytes);
+    }
+
+    // output filters: evaluations of a message against a filter group
+    p = safe_snprintf(p, end, ",\"output_filter\":{\"evaluations\":%"PRIu64",\"cpu_ms\":%.1f,\"ns_per_evaluation\":%.1f}}",
+            st->outfilter_evals, st->outfilter_ns / 1e6,
+            st->outfilter_evals ? (double) st->outfilter_ns / st->outfilter_evals : 0.0);
+
     return p;
 }
 
@@ -612,7 +876,7 @@ struct char_buffer generatePromFile() {
     struct stats *st = &Modes.stats_1min;
 
     unsigned long long trace_json_cpu_millis_sum = 0;
-    for (int i = 0; i < TRACE_THREADS; i ++) {
+    for (int i = 0; i < TRACE_THREADS_MAX; i ++) {
         trace_json_cpu_millis_sum += (uint64_t) st->trace_json_cpu[i].tv_sec * 1000UL + st->trace_json_cpu[i].tv_nsec / 1000000UL;
     }
 
@@ -693,6 +957,17 @@ struct char_buffer generatePromFile() {
     p = safe_snprintf(p, end, "readsb_tracks_all %u\n", st->unique_aircraft);
     p = safe_snprintf(p, end, "readsb_tracks_single_message %u\n", st->single_message_aircraft);
 
+    for (int t = 0; t < LATENCY_TYPES; t++) {
+        uint64_t count = latencyCount(st->latency[t]);
+        if (!count)
+            continue;
+        const char *name = latencyName(t);
+        p = safe_snprintf(p, end, "readsb_latency_%s_seconds{quantile=\"0.5\"} %.6f\n", name, latencyPercentile(st->latency[t], count, 0.5) / 1000.0);
+        p = safe_snprintf(p, end, "readsb_latency_%s_seconds{quantile=\"0.99\"} %.6f\n", name, latencyPercentile(st->latency[t], count, 0.99) / 1000.0);
+        p = safe_snprintf(p, end, "readsb_latency_%s_seconds{quantile=\"0.999\"} %.6f\n", name, latencyPercentile(st->latency[t], count, 0.999) / 1000.0);
+        p = safe_snprintf(p, end, "readsb_latency_%s_seconds_count %"PRIu64"\n", name, count);
+    }
+
     p = safe_snprintf(p, end, "readsb_position_count_total %u\n", st->pos_all);
     for (int i = 0; i < NUM_TYPES; i++) {
         const char *key = addrtype_enum_string(i);
@@ -747,6 +1022,286 @@ struct char_buffer generatePromFile() {
     return cb;
 }
 
+// Prometheus text exposition format, rendered on request for the /metrics
+// endpoint of the HTTP server.  Unlike generatePromFile() the message counters
+// are cumulative since startup (counters, not 1 minute gauges) and labelled.
+// The output size depends only on the number of services and connectors.
+// Must be called with the decodeThreadMutex held (statsUpdate uses it as well).
+
+#define PROM_HEAD(name, type, help) \
+    p = safe_snprintf(p, end, "# HELP " name " " help "\n# TYPE " name " " type "\n")
+
+static char *promTimespec(char *p, char *end, const char *label, const struct timespec *ts) {
+    return safe_snprintf(p, end, "readsb_cpu_seconds_total{thread=\"%s\"} %.3f\n",
+            label, ts->tv_sec + ts->tv_nsec / 1e9);
+}
+
+// le bounds in seconds for the latency histograms, exported from the finer internal buckets
+static const double promLatencyBounds[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60 };
+
+struct char_buffer generatePromMetrics() {
+    struct char_buffer cb;
+    int services = 0;
+    for (struct net_service *s = Modes.services; s; s = s->next)
+        services++;
+    size_t alloc = 48 * 1024 + 2048 * services + 512 * Modes.net_connectors_count;
+    char *buf = (char *) malloc(alloc), *p = buf, *end = buf + alloc;
+    uint64_t now = mstime();
+
+    // totals since startup: alltime plus the current 10 second bucket
+    static struct stats total;
+    add_stats(&Modes.stats_alltime, &Modes.stats_current, &total);
+    struct stats *st = &total;
+    static struct prom_counters counters;
+    counters = promAlltime;
+    promCount(&Modes.stats_current, &counters);
+    struct prom_counters *c = &counters;
+
+    PROM_HEAD("readsb_messages_total", "counter", "Messages by source and result");
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"demod\",result=\"accepted\"} %"PRIu64"\n", c->demod_accepted[0]);
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"demod\",result=\"accepted_fixed_bit\"} %"PRIu64"\n", c->demod_accepted[1]);
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"demod\",result=\"bad\"} %"PRIu64"\n", c->demod_rejected_bad);
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"demod\",result=\"unknown_icao\"} %"PRIu64"\n", c->demod_rejected_unknown_icao);
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"demod\",result=\"modeac\"} %"PRIu64"\n", c->demod_modeac);
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"remote\",result=\"accepted\"} %"PRIu64"\n", c->remote_accepted[0]);
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"remote\",result=\"accepted_fixed_bit\"} %"PRIu64"\n", c->remote_accepted[1]);
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"remote\",result=\"bad\"} %"PRIu64"\n", c->remote_rejected_bad);
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"remote\",result=\"unknown_icao\"} %"PRIu64"\n", c->remote_rejected_unknown_icao);
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"remote\",result=\"modeac\"} %"PRIu64"\n", c->remote_received_modeac);
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"basestation\",result=\"accepted\"} %"PRIu64"\n", c->remote_received_basestation_valid);
+    p = safe_snprintf(p, end, "readsb_messages_total{source=\"basestation\",result=\"bad\"} %"PRIu64"\n", c->remote_received_basestation_invalid);
+
+    PROM_HEAD("readsb_messages_valid_total", "counter", "Messages used for tracking");
+    p = safe_snprintf(p, end, "readsb_messages_valid_total %"PRIu64"\n", c->messages_total);
+
+    PROM_HEAD("readsb_network_malformed_beast_bytes_total", "counter", "Bytes of malformed beast input");
+    p = safe_snprintf(p, end, "readsb_network_malformed_beast_bytes_total %"PRIu64"\n", c->remote_malformed_beast);
+
+    PROM_HEAD("readsb_cpr_messages_total", "counter", "CPR messages by surface / airborne");
+    p = safe_snprintf(p, end, "readsb_cpr_messages_total{kind=\"airborne\"} %"PRIu64"\n", c->cpr_airborne);
+    p = safe_snprintf(p, end, "readsb_cpr_messages_total{kind=\"surface\"} %"PRIu64"\n", c->cpr_surface);
+
+    PROM_HEAD("readsb_cpr_decodes_total", "counter", "CPR decoding results");
+    p = safe_snprintf(p, end, "readsb_cpr_decodes_total{method=\"global\",result=\"ok\"} %"PRIu64"\n", c->cpr_global_ok);
+    p = safe_snprintf(p, end, "readsb_cpr_decodes_total{method=\"global\",result=\"bad\"} %"PRIu64"\n", c->cpr_global_bad);
+    p = safe_snprintf(p, end, "readsb_cpr_decodes_total{method=\"global\",result=\"bad_range\"} %"PRIu64"\n", c->cpr_global_range_checks);
+    p = safe_snprintf(p, end, "readsb_cpr_decodes_total{method=\"global\",result=\"bad_speed\"} %"PRIu64"\n", c->cpr_global_speed_checks);
+    p = safe_snprintf(p, end, "readsb_cpr_decodes_total{method=\"global\",result=\"skipped\"} %"PRIu64"\n", c->cpr_global_skipped);
+    p = safe_snprintf(p, end, "readsb_cpr_decodes_total{method=\"local\",result=\"ok\"} %"PRIu64"\n", c->cpr_local_ok);
+    p = safe_snprintf(p, end, "readsb_cpr_decodes_total{method=\"local\",result=\"bad_range\"} %"PRIu64"\n", c->cpr_local_range_checks);
+    p = safe_snprintf(p, end, "readsb_cpr_decodes_total{method=\"local\",result=\"bad_speed\"} %"PRIu64"\n", c->cpr_local_speed_checks);
+    p = safe_snprintf(p, end, "readsb_cpr_decodes_total{method=\"local\",result=\"skipped\"} %"PRIu64"\n", c->cpr_local_skipped);
+    p = safe_snprintf(p, end, "readsb_cpr_decodes_total{method=\"local\",result=\"filtered\"} %"PRIu64"\n", c->cpr_filtered);
+
+    PROM_HEAD("readsb_positions_total", "counter", "Positions by address type");
+    for (int i = 0; i < NUM_TYPES; i++)
+        p = safe_snprintf(p, end, "readsb_positions_total{type=\"%s\"} %"PRIu64"\n", addrtype_enum_string(i), c->pos_by_type[i]);
+
+    PROM_HEAD("readsb_tracks_total", "counter", "New aircraft tracks");
+    p = safe_snprintf(p, end, "readsb_tracks_total{kind=\"all\"} %"PRIu64"\n", c->unique_aircraft);
+    p = safe_snprintf(p, end, "readsb_tracks_total{kind=\"single_message\"} %"PRIu64"\n", c->single_message_aircraft);
+
+    PROM_HEAD("readsb_cpu_seconds_total", "counter", "CPU time used per thread");
+    p = promTimespec(p, end, "demod", &st->demod_cpu);
+    p = promTimespec(p, end, "reader", &st->reader_cpu);
+    p = promTimespec(p, end, "background", &st->background_cpu);
+    p = promTimespec(p, end, "aircraft_json", &st->aircraft_json_cpu);
+    p = promTimespec(p, end, "globe_json", &st->globe_json_cpu);
+    p = promTimespec(p, end, "heatmap_and_state", &st->heatmap_and_state_cpu);
+    p = promTimespec(p, end, "remove_stale", &st->remove_stale_cpu);
+    for (int i = 0; i < Modes.trace_threads; i++) {
+        char label[32];
+        snprintf(label, sizeof(label), "trace_json_%d", i);
+        p = promTimespec(p, end, label, &st->trace_json_cpu[i]);
+    }
+
+    PROM_HEAD("readsb_latency_seconds", "histogram", "Pipeline latency per stage");
+    for (int t = 0; t < LATENCY_TYPES; t++) {
+        const char *name = latencyName(t);
+        uint64_t cumulative = 0;
+        int bucket = 0;
+        for (size_t k = 0; k < sizeof(promLatencyBounds) / sizeof(double); k++) {
+            uint64_t limit = promLatencyBounds[k] * 1e6;
+            // internal buckets entirely below the bound, resolution is 12.5%
+            while (bucket < LATENCY_BUCKETS - 1 && latencyBucketStart(bucket + 1) <= limit)
+                cumulative += c->latency[t][bucket++];
+            p = safe_snprintf(p, end, "readsb_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %"PRIu64"\n",
+                    name, promLatencyBounds[k], cumulative);
+        }
+        uint64_t count = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+            count += c->latency[t][i];
+        p = safe_snprintf(p, end, "readsb_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %"PRIu64"\n", name, count);
+        p = safe_snprintf(p, end, "readsb_latency_seconds_sum{stage=\"%s\"} %.6f\n", name, st->latency_sum[t] / 1e6);
+        p = safe_snprintf(p, end, "readsb_latency_seconds_count{stage=\"%s\"} %"PRIu64"\n", name, count);
+    }
+
+    PROM_HEAD("readsb_compress_input_bytes_total", "counter", "Bytes compressed per file class");
+    for (int z = ZCLASS_NONE + 1; z < ZCLASS_COUNT; z++)
+        p = safe_snprintf(p, end, "readsb_compress_input_bytes_total{class=\"%s\"} %"PRIu64"\n", zclassName(z), st->compress_in[z]);
+    PROM_HEAD("readsb_compress_output_bytes_total", "counter", "Compressed bytes produced per file class");
+    for (int z = ZCLASS_NONE + 1; z < ZCLASS_COUNT; z++)
+        p = safe_snprintf(p, end, "readsb_compress_output_bytes_total{class=\"%s\"} %"PRIu64"\n", zclassName(z), st->compress_out[z]);
+    PROM_HEAD("readsb_compress_cpu_seconds_total", "counter", "CPU time spent compressing per file class");
+    for (int z = ZCLASS_NONE + 1; z < ZCLASS_COUNT; z++)
+        p = safe_snprintf(p, end, "readsb_compress_cpu_seconds_total{class=\"%s\"} %.3f\n", zclassName(z), st->compress_cpu_ns[z] / 1e9);
+
+    PROM_HEAD("readsb_net_inflate_input_bytes_total", "counter", "Compressed bytes received on compressed connections");
+    p = safe_snprintf(p, end, "readsb_net_inflate_input_bytes_total %"PRIu64"\n", st->net_inflate_in);
+    PROM_HEAD("readsb_net_inflate_output_bytes_total", "counter", "Bytes received on compressed connections after inflating");
+    p = safe_snprintf(p, end, "readsb_net_inflate_output_bytes_total %"PRIu64"\n", st->net_inflate_out);
+
+    PROM_HEAD("readsb_udp_out_datagrams_total", "counter", "Beast UDP datagrams sent, per destination");
+    p = safe_snprintf(p, end, "readsb_udp_out_datagrams_total %"PRIu64"\n", st->udp_out_datagrams);
+    PROM_HEAD("readsb_udp_out_dropped_total", "counter", "Beast UDP datagrams not sent because the socket buffer was full or sending failed");
+    p = safe_snprintf(p, end, "readsb_udp_out_dropped_total %"PRIu64"\n", st->udp_out_dropped);
+    PROM_HEAD("readsb_udp_in_datagrams_total", "counter", "Beast UDP datagrams received");
+    p = safe_snprintf(p, end, "readsb_udp_in_datagrams_total %"PRIu64"\n", st->udp_in_datagrams);
+    PROM_HEAD("readsb_udp_in_bad_total", "counter", "Beast UDP datagrams dropped as truncated or malformed");
+    p = safe_snprintf(p, end, "readsb_udp_in_bad_total %"PRIu64"\n", st->udp_in_bad);
+    PROM_HEAD("readsb_udp_in_lost_total", "counter", "Beast UDP datagrams missing from the sequence of their sender");
+    p = safe_snprintf(p, end, "readsb_udp_in_lost_total %"PRIu64"\n", st->udp_in_lost);
+    PROM_HEAD("readsb_udp_in_reordered_total", "counter", "Beast UDP datagrams received after a later one of the same sender");
+    p = safe_snprintf(p, end, "readsb_udp_in_reordered_total %"PRIu64"\n", st->udp_in_reordered);
+
+    if (netFeedersConfigured()) {
+        PROM_HEAD("readsb_ingest_deferred_total", "counter", "Network input clients left with data pending at the end of a read pass");
+        p = safe_snprintf(p, end, "readsb_ingest_deferred_total %"PRIu64"\n", st->ingest_deferred);
+        PROM_HEAD("readsb_ingest_discarded_bytes_total", "counter", "Bytes discarded from network input clients that stayed behind");
+        p = safe_snprintf(p, end, "readsb_ingest_discarded_bytes_total %"PRIu64"\n", st->ingest_discarded);
+    }
+
+    if (Modes.shm) {
+        PROM_HEAD("readsb_shm_records_total", "counter", "Records published to the shared memory ring");
+        p = safe_snprintf(p, end, "readsb_shm_records_total %"PRIu64"\n", st->shm_records);
+        PROM_HEAD("readsb_shm_bytes_total", "counter", "Payload bytes published to the shared memory ring");
+        p = safe_snprintf(p, end, "readsb_shm_bytes_total %"PRIu64"\n", st->shm_bytes);
+    }
+
+    PROM_HEAD("readsb_output_filter_evaluations_total", "counter", "Messages evaluated against an output filter group");
+    p = safe_snprintf(p, end, "readsb_output_filter_evaluations_total %"PRIu64"\n", st->outfilter_evals);
+    PROM_HEAD("readsb_output_filter_cpu_seconds_total", "counter", "Time spent evaluating output filters");
+    p = safe_snprintf(p, end, "readsb_output_filter_cpu_seconds_total %.3f\n", st->outfilter_ns / 1e9);
+
+    PROM_HEAD("readsb_net_connections", "gauge", "Connected clients per service");
+    for (struct net_service *s = Modes.services; s; s = s->next) {
+        if (s->listener_count || s->connections)
+            p = safe_snprintf(p, end, "readsb_net_connections{service=\"%s\"} %d\n", s->descr, s->connections);
+    }
+    PROM_HEAD("readsb_net_received_bytes_total", "counter", "Bytes received per service");
+    for (struct net_service *s = Modes.services; s; s = s->next) {
+        if (s->listener_count || s->connections || s->bytesIn)
+            p = safe_snprintf(p, end, "readsb_net_received_bytes_total{service=\"%s\"} %"PRIu64"\n", s->descr, s->bytesIn);
+    }
+    PROM_HEAD("readsb_net_sent_bytes_total", "counter", "Bytes sent per service");
+    for (struct net_service *s = Modes.services; s; s = s->next) {
+        if (s->listener_count || s->connections || s->bytesOut)
+            p = safe_snprintf(p, end, "readsb_net_sent_bytes_total{service=\"%s\"} %"PRIu64"\n", s->descr, s->bytesOut);
+    }
+
+    // client classes (clientClass() in net_io.c): a line for every class a service has had
+    PROM_HEAD("readsb_net_clients", "gauge", "Connected clients per service and client class");
+    for (struct net_service *s = Modes.services; s; s = s->next) {
+        int count[CLIENT_CLASSES] = { 0 };
+        for (struct client *cl = s->clients; cl; cl = cl->next) {
+            if (cl->service)
+                count[clientClass(cl)]++;
+        }
+        for (int k = 0; k < CLIENT_CLASSES; k++) {
+            if (count[k] || s->bytesOutClass[k])
+                p = safe_snprintf(p, end, "readsb_net_clients{service=\"%s\",class=\"%s\"} %d\n", s->descr, clientClassName(k), count[k]);
+        }
+    }
+    PROM_HEAD("readsb_net_class_sent_bytes_total", "counter", "Bytes sent per service and client class");
+    for (struct net_service *s = Modes.services; s; s = s->next) {
+        for (int k = 0; k < CLIENT_CLASSES; k++) {
+            if (s->bytesOutClass[k])
+                p = safe_snprintf(p, end, "readsb_net_class_sent_bytes_total{service=\"%s\",class=\"%s\"} %"PRIu64"\n", s->descr, clientClassName(k), s->bytesOutClass[k]);
+        }
+    }
+
+    if (netLagConfigured()) {
+        PROM_HEAD("readsb_net_clients_lagging", "gauge", "Output clients degraded because they don't keep up, per service and lag level");
+        for (struct net_service *s = Modes.services; s; s = s->next) {
+            if (!s->writer || !s->writer->filterMasks || !(s->listener_count || s->pusher_count || s->connections))
+                continue;
+            int lagging[LAG_POSITIONS + 1] = { 0 };
+            for (struct client *cl = s->clients; cl; cl = cl->next) {
+                if (cl->service && cl->lag > LAG_NONE && cl->lag <= LAG_POSITIONS)
+                    lagging[cl->lag]++;
+            }
+            p = safe_snprintf(p, end, "readsb_net_clients_lagging{service=\"%s\",level=\"reduced\"} %d\n", s->descr, lagging[LAG_REDUCED]);
+            p = safe_snprintf(p, end, "readsb_net_clients_lagging{service=\"%s\",level=\"positions\"} %d\n", s->descr, lagging[LAG_POSITIONS]);
+        }
+    }
+
+    if (Modes.net_connectors_count) {
+        PROM_HEAD("readsb_net_connector_status", "gauge", "0: connected, 1: connected less than 30 seconds, 2: disconnected");
+        for (int i = 0; i < Modes.net_connectors_count; i++) {
+            struct net_connector *con = Modes.net_connectors[i];
+            int value = 0;
+            if (!con->connected)
+                value = 2;
+            else if (now < con->lastConnect + 30 * SECONDS)
+                value = 1;
+            p = safe_snprintf(p, end, "readsb_net_connector_status{host=\"%s\",port=\"%s\"} %d\n",
+                    con->address, con->port, value);
+        }
+    }
+
+    // aircraft gauges, these are from the last statsCount pass (updated every stats interval)
+    PROM_HEAD("readsb_aircraft", "gauge", "Aircraft currently tracked by address type");
+    for (int i = 0; i < NUM_TYPES; i++)
+        p = safe_snprintf(p, end, "readsb_aircraft{type=\"%s\"} %u\n", addrtype_enum_string(i), Modes.type_counts[i]);
+    PROM_HEAD("readsb_aircraft_with_position", "gauge", "Aircraft currently tracked with position");
+    p = safe_snprintf(p, end, "readsb_aircraft_with_position %u\n", Modes.readsb_aircraft_with_position);
+    PROM_HEAD("readsb_aircraft_rssi_dbfs", "gauge", "Signal level distribution of tracked aircraft");
+    p = safe_snprintf(p, end, "readsb_aircraft_rssi_dbfs{quantile=\"0\"} %.1f\n", Modes.readsb_aircraft_rssi_min);
+    p = safe_snprintf(p, end, "readsb_aircraft_rssi_dbfs{quantile=\"0.25\"} %.1f\n", Modes.readsb_aircraft_rssi_quart1);
+    p = safe_snprintf(p, end, "readsb_aircraft_rssi_dbfs{quantile=\"0.5\"} %.1f\n", Modes.readsb_aircraft_rssi_median);
+    p = safe_snprintf(p, end, "readsb_aircraft_rssi_dbfs{quantile=\"0.75\"} %.1f\n", Modes.readsb_aircraft_rssi_quart3);
+    p = safe_snprintf(p, end, "readsb_aircraft_rssi_dbfs{quantile=\"1\"} %.1f\n", Modes.readsb_aircraft_rssi_max);
+
+    if (!Modes.net_only) {
+        PROM_HEAD("readsb_demod_samples_total", "counter", "Samples processed / dropped");
+        p = safe_snprintf(p, end, "readsb_demod_samples_total{result=\"processed\"} %"PRIu64"\n", st->samples_processed);
+        p = safe_snprintf(p, end, "readsb_demod_samples_total{result=\"dropped\"} %"PRIu64"\n", st->samples_dropped);
+        PROM_HEAD("readsb_demod_preambles_total", "counter", "Preambles found");
+        p = safe_snprintf(p, end, "readsb_demod_preambles_total %"PRIu64"\n", c->demod_preambles);
+        PROM_HEAD("readsb_signal_strong_total", "counter", "Messages with signal > -3 dBFS");
+        p = safe_snprintf(p, end, "readsb_signal_strong_total %"PRIu64"\n", c->strong_signal_count);
+        PROM_HEAD("readsb_sdr_gain_db", "gauge", "SDR gain");
+        p = safe_snprintf(p, end, "readsb_sdr_gain_db %.1f\n", Modes.gain / 10.0);
+    }
+
+    uint64_t chunksUsed, chunksFree, packedBlocks, packedBytes;
+    trace_chunks_stats(&chunksUsed, &chunksFree, &packedBlocks, &packedBytes);
+    PROM_HEAD("readsb_trace_chunks", "gauge", "Trace chunks in use / on the free list");
+    p = safe_snprintf(p, end, "readsb_trace_chunks{state=\"used\"} %"PRIu64"\n", chunksUsed);
+    p = safe_snprintf(p, end, "readsb_trace_chunks{state=\"free\"} %"PRIu64"\n", chunksFree);
+    PROM_HEAD("readsb_trace_chunk_bytes", "gauge", "Size of one trace chunk");
+    p = safe_snprintf(p, end, "readsb_trace_chunk_bytes %zu\n", sizeof(struct trace_chunk));
+    PROM_HEAD("readsb_trace_packed_chunks", "gauge", "Trace chunks stored delta encoded (--compress-traces)");
+    p = safe_snprintf(p, end, "readsb_trace_packed_chunks %"PRIu64"\n", packedBlocks);
+    PROM_HEAD("readsb_trace_packed_bytes", "gauge", "Memory used by delta encoded trace chunks");
+    p = safe_snprintf(p, end, "readsb_trace_packed_bytes %"PRIu64"\n", packedBytes);
+
+    PROM_HEAD("readsb_trace_queue_length", "gauge", "Aircraft waiting for their trace to be written");
+    p = safe_snprintf(p, end, "readsb_trace_queue_length %"PRIu64"\n", traceQueueLength());
+
+    PROM_HEAD("readsb_uptime_seconds", "gauge", "Seconds since startup");
+    p = safe_snprintf(p, end, "readsb_uptime_seconds %.1f\n", now > Modes.startup_time ? (now - Modes.startup_time) / 1000.0 : 0);
+
+    if (p >= end)
+        fprintf(stderr, "buffer overrun prom metrics\n");
+
+    cb.len = p - buf;
+    cb.buffer = buf;
+    return cb;
+}
+
+#undef PROM_HEAD
+
 void statsReset() {
     memset(&Modes.type_counts, 0, sizeof(Modes.type_counts));
 
@@ -875,8 +1430,8 @@ static void statsCalc() {
 void statsWrite() {
         statsCalc(); // calculate statistics stuff
 
-        if (Modes.json_dir)
-            writeJsonToFile(Modes.json_dir, "stats.json", generateStatsJson());
+        if (Modes.json_dir || Modes.net_http)
+            publishJson("stats.json", generateStatsJson(), ZCLASS_NONE);
 
         if (Modes.prom_file)
             writeJsonToFile(NULL, Modes.prom_file, generatePromFile());
@@ -54,6 +54,25 @@
 #ifndef DUMP1090_STATS_H
 #define DUMP1090_STATS_H
 
+// latency histograms, log-linear buckets of microseconds (HDR style):
+// values below 2^LATENCY_SUB_BITS get their own bucket, above that every
+// power of two is split into 2^LATENCY_SUB_BITS buckets (12.5% resolution).
+// The last bucket (2^27 us, about 134 seconds) catches everything larger.
+#define LATENCY_SUB_BITS 3
+#define LATENCY_MAX_BITS 27
+#define LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BITS + 1) * (1 << LATENCY_SUB_BITS))
+
+typedef enum {
+    LATENCY_NET_READ, // socket read -> useModesMessage
+    LATENCY_DEMOD, // sample block timestamp -> useModesMessage
+    LATENCY_BEAST_OUT, // message received -> flushWrites on beast output
+    LATENCY_SBS_OUT, // message received -> flushWrites on SBS output
+    LATENCY_AIRCRAFT_JSON, // last message of an aircraft -> aircraft.json written
+    LATENCY_TRACE_WRITE, // trace changed -> trace json written
+    LATENCY_API_QUERY, // API request line received -> response queued
+    LATENCY_TYPES
+} latency_type_t;
+
 struct stats
 {
   uint64_t start;
@@ -82,7 +101,7 @@ struct stats
   struct timespec reader_cpu;
   struct timespec background_cpu;
   struct timespec aircraft_json_cpu;
-  struct timespec trace_json_cpu[TRACE_THREADS];
+  struct timespec trace_json_cpu[TRACE_THREADS_MAX];
   struct timespec globe_json_cpu;
   struct timespec heatmap_and_state_cpu;
   struct timespec remove_stale_cpu;
@@ -129,6 +148,32 @@ struct stats
   uint32_t range_histogram[RANGE_BUCKET_COUNT];
   double distance_max; // Longest range decoded, in *metres*
   double distance_min; // Shortest range decoded, in *metres*
+  // latency histograms
+  uint32_t latency[LATENCY_TYPES][LATENCY_BUCKETS];
+  uint64_t latency_sum[LATENCY_TYPES]; // microseconds
+  // compression, per file class (see compress.h)
+  uint64_t compress_in[ZCLASS_COUNT];
+  uint64_t compress_out[ZCLASS_COUNT];
+  uint64_t compress_cpu_ns[ZCLASS_COUNT];
+  // compressed network connections, received bytes before / after inflating
+  uint64_t net_inflate_in;
+  uint64_t net_inflate_out;
+  // beast over UDP
+  uint64_t udp_out_datagrams;
+  uint64_t udp_out_dropped; // socket buffer full or send errors
+  uint64_t udp_in_datagrams;
+  uint64_t udp_in_bad; // truncated, wrong magic or malformed frames
+  uint64_t udp_in_lost; // sequence gaps, see receiverUdpSequence()
+  uint64_t udp_in_reordered;
+  // input clients, see INGEST_QUANTUM
+  uint64_t ingest_deferred; // ticks a client ended with data pending, summed over the clients
+  uint64_t ingest_discarded; // bytes discarded from clients behind for too long
+  // shared memory ring
+  uint64_t shm_records;
+  uint64_t shm_bytes;
+  // output filters, evaluations of one message against one group
+  uint64_t outfilter_evals;
+  uint64_t outfilter_ns;
 };
 
 void add_stats (const struct stats *st1, const struct stats *st2, struct stats *target);
@@ -139,10 +184,27 @@ void add_timespecs (const struct timespec *x, const struct timespec *y, struct t
 
 struct char_buffer generateStatsJson();
 struct char_buffer generatePromFile();
+struct char_buffer generatePromMetrics();
 
 int statsUpdate(uint64_t now);
 void statsReset();
 void statsCount(struct aircraft *a, uint64_t now);
 void statsWrite();
 
+void statsLatency(latency_type_t type, int64_t micros);
+void statsLatencyShared(latency_type_t type, int64_t micros);
+
+// aircraft.json latency: generateAircraftJson() notes the aircraft that received
+// messages since the previous aircraft.json, the samples are recorded once the
+// file is written
+struct json_latency {
+    uint64_t since;
+    uint64_t generated;
+    uint32_t *age; // ms from the last message of an aircraft to generated
+    int count;
+    int alloc;
+};
+void statsJsonLatencyNote(struct json_latency *jl, uint32_t age);
+void statsAircraftJsonLatency(struct json_latency *jl, uint64_t written);
+
 #endif
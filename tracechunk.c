@@ -0,0 +1,135 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// tracechunk.c: delta encoding of full trace chunks
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "readsb.h"
+
+//
+// Packed chunks
+//
+// The first point and the first state_all of a chunk are stored as is.
+// Every other point is stored as zig-zag varint deltas to the previous point
+// (flags as XOR), a few bytes for typical position updates.  Each further
+// state_all is a varint bitmask of the bytes that differ from the previous one,
+// followed by those bytes: callsign, squawk and most of the nav settings
+// rarely change.  Chunks are decoded as a whole, random access is per chunk.
+//
+
+static inline unsigned char *put_varint(unsigned char *p, uint64_t v) {
+    while (v >= 0x80) {
+        *p++ = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    *p++ = v;
+    return p;
+}
+
+static inline uint64_t get_varint(const unsigned char **p) {
+    uint64_t v = 0;
+    int shift = 0;
+    const unsigned char *q = *p;
+    while (*q & 0x80) {
+        v |= (uint64_t) (*q++ & 0x7f) << shift;
+        shift += 7;
+    }
+    v |= (uint64_t) *q++ << shift;
+    *p = q;
+    return v;
+}
+
+static inline uint64_t zigzag(int64_t v) {
+    return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+    return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+static inline uint16_t flags_bits(const struct state *s) {
+    uint16_t bits;
+    memcpy(&bits, &s->flags, sizeof(bits));
+    return bits;
+}
+
+unsigned char *trace_chunk_pack(unsigned char *p, const struct trace_chunk *chunk) {
+    _Static_assert(sizeof(struct state_all) <= 64, "state_all byte mask needs to fit 64 bits");
+    _Static_assert(sizeof(struct state_flags) == sizeof(uint16_t), "state_flags must be 16 bits");
+
+    memcpy(p, &chunk->state[0], sizeof(struct state));
+    p += sizeof(struct state);
+    for (int i = 1; i < TRACE_CHUNK_POINTS; i++) {
+        const struct state *s = &chunk->state[i];
+        const struct state *prev = &chunk->state[i - 1];
+        p = put_varint(p, zigzag((int64_t) s->timestamp - (int64_t) prev->timestamp));
+        p = put_varint(p, flags_bits(s) ^ flags_bits(prev));
+        p = put_varint(p, zigzag((int64_t) s->lat - prev->lat));
+        p = put_varint(p, zigzag((int64_t) s->lon - prev->lon));
+        p = put_varint(p, zigzag(s->altitude - prev->altitude));
+        p = put_varint(p, zigzag(s->gs - prev->gs));
+        p = put_varint(p, zigzag(s->track - prev->track));
+        p = put_varint(p, zigzag(s->rate - prev->rate));
+    }
+
+    memcpy(p, &chunk->all[0], sizeof(struct state_all));
+    p += sizeof(struct state_all);
+    for (int i = 1; i < TRACE_CHUNK_POINTS / 4; i++) {
+        const unsigned char *cur = (const unsigned char *) &chunk->all[i];
+        const unsigned char *prev = (const unsigned char *) &chunk->all[i - 1];
+        uint64_t mask = 0;
+        for (size_t k = 0; k < sizeof(struct state_all); k++) {
+            if (cur[k] != prev[k])
+                mask |= 1ULL << k;
+        }
+        p = put_varint(p, mask);
+        for (size_t k = 0; k < sizeof(struct state_all); k++) {
+            if (mask & (1ULL << k))
+                *p++ = cur[k];
+        }
+    }
+    return p;
+}
+
+void trace_chunk_unpack(struct trace_chunk *chunk, const struct trace_packed *packed) {
+    const unsigned char *p = packed->data;
+
+    memcpy(&chunk->state[0], p, sizeof(struct state));
+    p += sizeof(struct state);
+    for (int i = 1; i < TRACE_CHUNK_POINTS; i++) {
+        struct state *s = &chunk->state[i];
+        const struct state *prev = &chunk->state[i - 1];
+        s->timestamp = prev->timestamp + unzigzag(get_varint(&p));
+        uint16_t bits = flags_bits(prev) ^ (uint16_t) get_varint(&p);
+        memcpy(&s->flags, &bits, sizeof(bits));
+        s->lat = prev->lat + unzigzag(get_varint(&p));
+        s->lon = prev->lon + unzigzag(get_varint(&p));
+        s->altitude = prev->altitude + unzigzag(get_varint(&p));
+        s->gs = prev->gs + unzigzag(get_varint(&p));
+        s->track = prev->track + unzigzag(get_varint(&p));
+        s->rate = prev->rate + unzigzag(get_varint(&p));
+    }
+
+    memcpy(&chunk->all[0], p, sizeof(struct state_all));
+    p += sizeof(struct state_all);
+    for (int i = 1; i < TRACE_CHUNK_POINTS / 4; i++) {
+        unsigned char *cur = (unsigned char *) &chunk->all[i];
+        memcpy(cur, &chunk->all[i - 1], sizeof(struct state_all));
+        uint64_t mask = get_varint(&p);
+        for (size_t k = 0; k < sizeof(struct state_all); k++) {
+            if (mask & (1ULL << k))
+                cur[k] = *p++;
+        }
+    }
+}
@@ -0,0 +1,155 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// tracechunktests.c - tests for the delta encoding of trace chunks
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "readsb.h"
+
+enum chunk_kind {
+    CHUNK_FLIGHT, // small steps like a real trace
+    CHUNK_EXTREME, // every field jumps between its minimum and maximum
+    CHUNK_RANDOM, // random bytes everywhere
+    CHUNK_CONSTANT, // nothing changes
+    CHUNK_KINDS
+};
+
+static const char *chunkKindNames[CHUNK_KINDS] = { "flight", "extreme", "random", "constant" };
+
+static void randomBytes(void *p, size_t len) {
+    unsigned char *c = p;
+    for (size_t i = 0; i < len; i++)
+        c[i] = random();
+}
+
+static void fillChunk(struct trace_chunk *chunk, enum chunk_kind kind) {
+    memset(chunk, 0, sizeof(*chunk));
+
+    for (int i = 0; i < TRACE_CHUNK_POINTS; i++) {
+        struct state *s = &chunk->state[i];
+        switch (kind) {
+            case CHUNK_FLIGHT:
+                s->timestamp = 1700000000000ULL + i * 4000 + random() % 500;
+                s->lat = 51500000 + i * 300 + random() % 10;
+                s->lon = -120000 - i * 500;
+                s->altitude = 3000 + i * 2;
+                s->gs = 2500 + random() % 20;
+                s->track = 9000 - i;
+                s->rate = (i % 8) * 64 - 256;
+                s->flags.on_ground = 0;
+                s->flags.stale = (i % 13 == 0);
+                s->flags.leg_marker = (i == 17);
+                break;
+            case CHUNK_EXTREME:
+                s->timestamp = (i & 1) ? 0xFFFFFFFFFFFFULL : 0;
+                s->lat = (i & 1) ? INT32_MAX : INT32_MIN;
+                s->lon = (i & 1) ? INT32_MIN : INT32_MAX;
+                s->altitude = (i & 1) ? INT16_MAX : INT16_MIN;
+                s->gs = (i & 1) ? INT16_MIN : INT16_MAX;
+                s->track = (i & 1) ? INT16_MAX : INT16_MIN;
+                s->rate = (i & 1) ? INT16_MIN : INT16_MAX;
+                memset(&s->flags, (i & 1) ? 0xFF : 0, sizeof(s->flags));
+                break;
+            case CHUNK_RANDOM:
+                randomBytes(s, sizeof(*s));
+                break;
+            case CHUNK_CONSTANT:
+                s->timestamp = 1700000000000ULL;
+                s->lat = 1;
+                s->lon = -1;
+                break;
+            default:
+                break;
+        }
+    }
+
+    for (int i = 0; i < TRACE_CHUNK_POINTS / 4; i++) {
+        struct state_all *all = &chunk->all[i];
+        switch (kind) {
+            case CHUNK_FLIGHT:
+                memcpy(all->callsign, "DLH4AB  ", 8);
+                all->squawk = (i < 8) ? 0x1000 : 0x7421;
+                all->nav_qnh = 10132;
+                all->baro_rate = i * 16;
+                break;
+            case CHUNK_EXTREME:
+                memset(all, (i & 1) ? 0xFF : 0, sizeof(*all));
+                break;
+            case CHUNK_RANDOM:
+                randomBytes(all, sizeof(*all));
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static int testChunkRoundTrip() {
+    int ok = 1;
+    static unsigned char buf[TRACE_PACK_MAX];
+    struct trace_chunk *chunk = malloc(sizeof(struct trace_chunk));
+    struct trace_chunk *decoded = malloc(sizeof(struct trace_chunk));
+    struct trace_packed *packed = malloc(sizeof(struct trace_packed) + TRACE_PACK_MAX);
+    if (!chunk || !decoded || !packed) {
+        fprintf(stderr, "testChunkRoundTrip: FAIL: out of memory\n");
+        free(chunk);
+        free(decoded);
+        free(packed);
+        return 0;
+    }
+
+    srandom(1);
+    for (int kind = 0; kind < CHUNK_KINDS; kind++) {
+        fillChunk(chunk, kind);
+        size_t len = trace_chunk_pack(buf, chunk) - buf;
+
+        memset(decoded, 0x5a, sizeof(*decoded));
+        packed->first_ts = chunk->state[0].timestamp;
+        packed->len = len;
+        memcpy(packed->data, buf, len);
+        trace_chunk_unpack(decoded, packed);
+
+        if (len > TRACE_PACK_MAX
+                || memcmp(decoded->state, chunk->state, sizeof(chunk->state))
+                || memcmp(decoded->all, chunk->all, sizeof(chunk->all))) {
+            ok = 0;
+            fprintf(stderr, "testChunkRoundTrip[%s]: FAIL: %zu bytes (max %zu), decoded chunk differs\n",
+                    chunkKindNames[kind], len, (size_t) TRACE_PACK_MAX);
+        } else {
+            fprintf(stderr, "testChunkRoundTrip[%s]:  PASS (%zu of %zu bytes)\n",
+                    chunkKindNames[kind], len, sizeof(chunk->state) + sizeof(chunk->all));
+        }
+    }
+
+    // a typical trace has to get smaller, otherwise --compress-traces is pointless
+    fillChunk(chunk, CHUNK_FLIGHT);
+    size_t len = trace_chunk_pack(buf, chunk) - buf;
+    if (len * 2 > sizeof(chunk->state) + sizeof(chunk->all)) {
+        ok = 0;
+        fprintf(stderr, "testChunkRoundTrip[size]: FAIL: flight chunk packed to %zu bytes\n", len);
+    } else {
+        fprintf(stderr, "testChunkRoundTrip[size]:  PASS\n");
+    }
+
+    free(chunk);
+    free(decoded);
+    free(packed);
+    return ok;
+}
+
+int main(int __attribute__ ((unused)) argc, char __attribute__ ((unused)) **argv) {
+    int ok = 1;
+    ok = testChunkRoundTrip() && ok;
+    return ok ? 0 : 1;
+}
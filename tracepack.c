@@ -0,0 +1,254 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// tracepack.c: daily history pack files, see tracepack.h
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "readsb.h"
+
+struct scan_ref {
+    struct tracepack_ref ref;
+    uint16_t flags;
+};
+
+static int readAt(int fd, void *buf, size_t len, uint64_t offset) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t res = pread(fd, p, len, offset);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return -1;
+        p += res;
+        len -= res;
+        offset += res;
+    }
+    return 0;
+}
+
+static int readFooter(int fd, uint64_t size, struct tracepack_footer *footer) {
+    if (size < sizeof(struct tracepack_footer))
+        return -1;
+    if (readAt(fd, footer, sizeof(struct tracepack_footer), size - sizeof(struct tracepack_footer)))
+        return -1;
+    if (footer->magic != TRACE_PACK_SEALED
+            || footer->index + (uint64_t) footer->count * sizeof(struct tracepack_ref) + sizeof(struct tracepack_footer) != size)
+        return -1;
+    return 0;
+}
+
+static int scanRefCompare(const void *p1, const void *p2) {
+    const struct tracepack_ref *r1 = &((const struct scan_ref *) p1)->ref;
+    const struct tracepack_ref *r2 = &((const struct scan_ref *) p2)->ref;
+    if (r1->addr != r2->addr)
+        return r1->addr < r2->addr ? -1 : 1;
+    if (r1->offset != r2->offset)
+        return r1->offset < r2->offset ? -1 : 1;
+    return 0;
+}
+
+int tracePackRefs(int fd, struct tracepack_ref **refs, uint32_t *count, uint64_t *end) {
+    struct stat st;
+    struct tracepack_footer footer;
+
+    *refs = NULL;
+    *count = 0;
+    *end = 0;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    uint64_t size = st.st_size;
+
+    if (readFooter(fd, size, &footer) == 0) {
+        *refs = malloc(footer.count * sizeof(struct tracepack_ref) + 1);
+        if (!*refs || readAt(fd, *refs, footer.count * sizeof(struct tracepack_ref), footer.index)) {
+            free(*refs);
+            *refs = NULL;
+            return -1;
+        }
+        *count = footer.count;
+        *end = footer.index;
+        return 0;
+    }
+
+    // not sealed, scan the record headers
+    struct scan_ref *all = NULL;
+    uint32_t n = 0;
+    uint32_t alloc = 0;
+    uint64_t offset = 0;
+    struct tracepack_record rec;
+
+    while (offset + sizeof(rec) <= size) {
+        if (readAt(fd, &rec, sizeof(rec), offset))
+            break;
+        // a record that was cut short or the start of an interrupted seal
+        if (rec.magic != TRACE_PACK_MAGIC || offset + sizeof(rec) + rec.len > size)
+            break;
+        if (n == alloc) {
+            alloc = alloc ? 2 * alloc : 1024;
+            struct scan_ref *grown = realloc(all, alloc * sizeof(struct scan_ref));
+            if (!grown) {
+                free(all);
+                return -1;
+            }
+            all = grown;
+        }
+        all[n].ref.addr = rec.addr;
+        all[n].ref.len = sizeof(rec) + rec.len;
+        all[n].ref.offset = offset;
+        all[n].flags = rec.flags;
+        n++;
+        offset += sizeof(rec) + rec.len;
+    }
+    *end = offset;
+
+    qsort(all, n, sizeof(struct scan_ref), scanRefCompare);
+
+    // only keep the last full record of each address and the ones after it
+    *refs = malloc(n * sizeof(struct tracepack_ref) + 1);
+    if (!*refs) {
+        free(all);
+        return -1;
+    }
+    uint32_t out = 0;
+    for (uint32_t i = 0; i < n;) {
+        uint32_t j = i;
+        int full = -1;
+        while (j < n && all[j].ref.addr == all[i].ref.addr) {
+            if (all[j].flags & TRACE_PACK_FULL)
+                full = j;
+            j++;
+        }
+        for (int k = full; k >= 0 && k < (int) j; k++)
+            (*refs)[out++] = all[k].ref;
+        i = j;
+    }
+    *count = out;
+    free(all);
+    return 0;
+}
+
+int tracePackSealed(int fd) {
+    struct stat st;
+    struct tracepack_footer footer;
+    if (fstat(fd, &st) < 0)
+        return 0;
+    return readFooter(fd, st.st_size, &footer) == 0;
+}
+
+int64_t tracePackRepair(int fd) {
+    struct stat st;
+    struct tracepack_ref *refs;
+    uint32_t count;
+    uint64_t end;
+
+    if (fstat(fd, &st) < 0)
+        return -1;
+    if (st.st_size == 0 || tracePackSealed(fd))
+        return 0;
+    if (tracePackRefs(fd, &refs, &count, &end) < 0)
+        return -1;
+    free(refs);
+    if (end >= (uint64_t) st.st_size)
+        return 0;
+    if (ftruncate(fd, end) < 0)
+        return -1;
+    return st.st_size - end;
+}
+
+int tracePackSeal(const char *path) {
+    struct stat st;
+    struct tracepack_footer footer;
+    struct tracepack_ref *refs;
+    uint32_t count;
+    uint64_t end;
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        if (errno == ENOENT)
+            return 0;
+        perror(path);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || readFooter(fd, st.st_size, &footer) == 0) {
+        // already sealed
+        close(fd);
+        return 0;
+    }
+    if (tracePackRefs(fd, &refs, &count, &end) < 0) {
+        fprintf(stderr, "%s: reading records failed\n", path);
+        close(fd);
+        return -1;
+    }
+
+    footer.index = end;
+    footer.count = count;
+    footer.magic = TRACE_PACK_SEALED;
+
+    int res = 0;
+    size_t len = count * sizeof(struct tracepack_ref);
+    if (ftruncate(fd, end) < 0
+            || pwrite(fd, refs, len, end) != (ssize_t) len
+            || pwrite(fd, &footer, sizeof(footer), end + len) != (ssize_t) sizeof(footer)) {
+        fprintf(stderr, "tracePackSeal: ");
+        perror(path);
+        res = -1;
+    }
+
+    free(refs);
+    if (close(fd) < 0)
+        res = -1;
+    return res;
+}
+
+int tracePackExtract(int fd, struct tracepack_ref *refs, uint32_t count, uint32_t addr, int out_fd) {
+    // first reference for addr
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (refs[mid].addr < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == count || refs[lo].addr != addr)
+        return -1;
+
+    int res = 0;
+    char *buf = NULL;
+    for (uint32_t i = lo; i < count && refs[i].addr == addr && !res; i++) {
+        struct tracepack_record *rec;
+        char *grown = realloc(buf, refs[i].len);
+        if (!grown) {
+            res = -1;
+            break;
+        }
+        buf = grown;
+        rec = (struct tracepack_record *) buf;
+        if (refs[i].len < sizeof(*rec) || readAt(fd, buf, refs[i].len, refs[i].offset)
+                || rec->magic != TRACE_PACK_MAGIC || rec->addr != addr
+                || sizeof(*rec) + rec->len != refs[i].len || rec->trailer > rec->len) {
+            res = -1;
+            break;
+        }
+        size_t len = rec->len;
+        int last = (i + 1 == count || refs[i + 1].addr != addr);
+        if (!last)
+            len -= rec->trailer;
+        if (write(out_fd, buf + sizeof(*rec), len) != (ssize_t) len)
+            res = -1;
+    }
+    free(buf);
+    return res;
+}
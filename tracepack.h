@@ -0,0 +1,81 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// tracepack.h: daily history pack files
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef TRACEPACK_H
+#define TRACEPACK_H
+
+// Daily history pack files (--history-packs)
+//
+// Instead of one file per aircraft and day, the history traces of a day are
+// appended to TRACE_PACKS files: globe_history/<date>/traces/pack_XX with
+// XX = addr % 256 in hex.  Every write of a trace is one record, the data is
+// what gzappendBuild() produced for it.  A record with TRACE_PACK_FULL starts
+// a new gzip file, the records after it continue that file: the trace of an
+// aircraft is the data of its last full record and all following records
+// with the trailer cut off, except for the last one.
+//
+// After the day is over the pack is sealed: an index sorted by address listing
+// the records that make up each trace and a footer pointing to it are
+// appended.  Readers of unsealed packs have to scan the records.
+
+#define TRACE_PACKS 256
+#define TRACE_PACK_MAGIC 0x6b505452 // "RTPk"
+#define TRACE_PACK_SEALED 0x6c615353 // "SSal"
+
+#define TRACE_PACK_FULL 0x1
+
+// host byte order like the state files
+struct tracepack_record {
+    uint32_t magic;
+    uint32_t addr;
+    uint32_t len; // data bytes following the header
+    uint16_t trailer; // bytes at the end of the data replaced by the next record
+    uint16_t flags;
+    uint64_t timestamp; // last point in the record
+};
+
+struct tracepack_ref {
+    uint32_t addr;
+    uint32_t len; // record length including the header
+    uint64_t offset; // of the record header
+};
+
+struct tracepack_footer {
+    uint64_t index; // offset of the tracepack_ref array
+    uint32_t count;
+    uint32_t magic;
+};
+
+// references to the records of all traces in the pack, sorted by address then offset
+// returns -1 on error, *end is where the last complete record ends
+int tracePackRefs(int fd, struct tracepack_ref **refs, uint32_t *count, uint64_t *end);
+
+// append the index to a pack that isn't sealed yet, returns -1 on error
+int tracePackSeal(const char *path);
+
+// 1 if the pack has its index and footer, a sealed pack is final: records appended
+// to it would go after the footer and the index wouldn't be found anymore
+int tracePackSealed(int fd);
+
+// cut off a record torn by a crash at the end of an unsealed pack, so the next
+// record isn't appended behind it, returns the bytes removed or -1 on error
+int64_t tracePackRepair(int fd);
+
+// write the gzip trace of addr to out_fd, returns -1 on error or if addr isn't in the pack
+int tracePackExtract(int fd, struct tracepack_ref *refs, uint32_t count, uint32_t addr, int out_fd);
+
+#endif
@@ -0,0 +1,289 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// tracepacktests.c - tests for the history pack files
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "readsb.h"
+
+// records written to the test pack, trailer is the length of the "tt" suffix
+static const struct {
+    uint32_t addr;
+    uint16_t flags;
+    const char *data;
+    uint16_t trailer;
+} packRecords[] = {
+    { 0x3c6444, TRACE_PACK_FULL, "AAAAtt", 2 },
+    { 0x000042, 0, "xxtt", 2 }, // continues a full record from a previous day, dropped
+    { 0x3c6444, 0, "BBtt", 2 },
+    { 0xa00001, TRACE_PACK_FULL, "oldtt", 2 }, // replaced by the next full record
+    { 0x3c6444, 0, "CCtt", 2 },
+    { 0xa00001, TRACE_PACK_FULL, "newtt", 2 },
+    { 0xa00001, 0, "DDtt", 2 },
+};
+
+// expected tracePackExtract() output
+static const struct {
+    uint32_t addr;
+    const char *trace; // NULL: not in the pack
+} packTraces[] = {
+    { 0x3c6444, "AAAABBCCtt" },
+    { 0xa00001, "newDDtt" },
+    { 0x000042, NULL },
+    { 0x123456, NULL },
+};
+
+static int packTemp(char *path) {
+    snprintf(path, PATH_MAX, "/tmp/tracepacktests.XXXXXX");
+    int fd = mkstemp(path);
+    if (fd < 0)
+        perror("mkstemp");
+    return fd;
+}
+
+static int writeRecord(int fd, uint32_t addr, uint16_t flags, const char *data, uint16_t trailer, uint64_t timestamp) {
+    struct tracepack_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = TRACE_PACK_MAGIC;
+    rec.addr = addr;
+    rec.len = strlen(data);
+    rec.trailer = trailer;
+    rec.flags = flags;
+    rec.timestamp = timestamp;
+    if (write(fd, &rec, sizeof(rec)) != (ssize_t) sizeof(rec))
+        return -1;
+    if (write(fd, data, rec.len) != (ssize_t) rec.len)
+        return -1;
+    return 0;
+}
+
+static int writePack(int fd) {
+    for (unsigned i = 0; i < sizeof(packRecords) / sizeof(packRecords[0]); ++i) {
+        if (writeRecord(fd, packRecords[i].addr, packRecords[i].flags, packRecords[i].data,
+                    packRecords[i].trailer, 1000 * (i + 1)) < 0) {
+            perror("write");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static off_t fileSize(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return -1;
+    return st.st_size;
+}
+
+// extract all packTraces from fd and compare them, name is the test name for the output
+static int checkTraces(const char *name, int fd) {
+    int ok = 1;
+    struct tracepack_ref *refs;
+    uint32_t count;
+    uint64_t end;
+
+    if (tracePackRefs(fd, &refs, &count, &end) < 0) {
+        fprintf(stderr, "%s: FAIL: tracePackRefs() failed\n", name);
+        return 0;
+    }
+
+    for (unsigned i = 0; i < sizeof(packTraces) / sizeof(packTraces[0]); ++i) {
+        char path[PATH_MAX];
+        char buf[64];
+        int out = packTemp(path);
+        if (out < 0) {
+            ok = 0;
+            continue;
+        }
+        unlink(path);
+
+        int res = tracePackExtract(fd, refs, count, packTraces[i].addr, out);
+        ssize_t len = pread(out, buf, sizeof(buf) - 1, 0);
+        close(out);
+        buf[len > 0 ? len : 0] = '\0';
+
+        const char *expected = packTraces[i].trace;
+        if ((expected == NULL) != (res < 0) || (expected && strcmp(buf, expected))) {
+            ok = 0;
+            fprintf(stderr,
+                    "%s[%06x]: FAIL: tracePackExtract() returned %d, trace \"%s\" (expected \"%s\")\n",
+                    name, packTraces[i].addr, res, buf, expected ? expected : "not found");
+        } else {
+            fprintf(stderr, "%s[%06x]:  PASS\n", name, packTraces[i].addr);
+        }
+    }
+
+    free(refs);
+    return ok;
+}
+
+static int testRecordFormat() {
+    int ok = 1;
+    char path[PATH_MAX];
+    struct tracepack_ref *refs;
+    uint32_t count;
+    uint64_t end;
+
+    int fd = packTemp(path);
+    if (fd < 0 || writePack(fd) < 0)
+        return 0;
+
+    if (tracePackRefs(fd, &refs, &count, &end) < 0) {
+        fprintf(stderr, "testRecordFormat: FAIL: tracePackRefs() failed\n");
+        ok = 0;
+    } else {
+        // 3 records of 3c6444, the last 2 of a00001, sorted by address then offset
+        int sorted = 1;
+        for (uint32_t i = 1; i < count; i++) {
+            if (refs[i - 1].addr > refs[i].addr
+                    || (refs[i - 1].addr == refs[i].addr && refs[i - 1].offset >= refs[i].offset))
+                sorted = 0;
+        }
+        uint64_t expectedEnd = 0;
+        for (unsigned i = 0; i < sizeof(packRecords) / sizeof(packRecords[0]); ++i)
+            expectedEnd += sizeof(struct tracepack_record) + strlen(packRecords[i].data);
+
+        if (count != 5 || !sorted || refs[0].addr != 0x3c6444 || refs[3].addr != 0xa00001
+                || refs[3].len != sizeof(struct tracepack_record) + strlen("newtt")
+                || end != expectedEnd || (off_t) end != fileSize(fd)) {
+            ok = 0;
+            fprintf(stderr, "testRecordFormat: FAIL: %u refs (expected 5), sorted %d, end %llu (expected %llu)\n",
+                    count, sorted, (unsigned long long) end, (unsigned long long) expectedEnd);
+        } else {
+            fprintf(stderr, "testRecordFormat:  PASS\n");
+        }
+        free(refs);
+    }
+
+    ok = checkTraces("testRecordFormat", fd) && ok;
+
+    if (tracePackSealed(fd)) {
+        ok = 0;
+        fprintf(stderr, "testRecordFormat: FAIL: unsealed pack reported as sealed\n");
+    }
+
+    close(fd);
+    unlink(path);
+    return ok;
+}
+
+static int testSeal() {
+    int ok = 1;
+    char path[PATH_MAX];
+
+    int fd = packTemp(path);
+    if (fd < 0 || writePack(fd) < 0)
+        return 0;
+    off_t records = fileSize(fd);
+
+    if (tracePackSeal(path) < 0 || !tracePackSealed(fd)) {
+        ok = 0;
+        fprintf(stderr, "testSeal: FAIL: pack not sealed\n");
+    }
+    off_t sealed = fileSize(fd);
+
+    // sealing twice doesn't add a second index, repairing doesn't cut the index off
+    if (tracePackSeal(path) < 0 || fileSize(fd) != sealed) {
+        ok = 0;
+        fprintf(stderr, "testSeal: FAIL: second seal changed the size from %lld to %lld\n",
+                (long long) sealed, (long long) fileSize(fd));
+    }
+    if (tracePackRepair(fd) != 0 || fileSize(fd) != sealed) {
+        ok = 0;
+        fprintf(stderr, "testSeal: FAIL: repair truncated a sealed pack\n");
+    }
+
+    off_t expected = records + 5 * sizeof(struct tracepack_ref) + sizeof(struct tracepack_footer);
+    if (sealed != expected) {
+        ok = 0;
+        fprintf(stderr, "testSeal: FAIL: sealed size %lld (expected %lld)\n", (long long) sealed, (long long) expected);
+    }
+    if (ok)
+        fprintf(stderr, "testSeal:  PASS\n");
+
+    // the index gives the same traces as the record scan
+    ok = checkTraces("testSeal", fd) && ok;
+
+    close(fd);
+    unlink(path);
+    return ok;
+}
+
+static int testRepair() {
+    int ok = 1;
+    char path[PATH_MAX];
+
+    int fd = packTemp(path);
+    if (fd < 0 || writePack(fd) < 0)
+        return 0;
+    off_t records = fileSize(fd);
+
+    // a crash in the middle of the next record: the header is there, the data is cut short
+    struct tracepack_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = TRACE_PACK_MAGIC;
+    rec.addr = 0x3c6444;
+    rec.len = 100;
+    if (write(fd, &rec, sizeof(rec)) != (ssize_t) sizeof(rec) || write(fd, "EE", 2) != 2) {
+        perror("write");
+        close(fd);
+        unlink(path);
+        return 0;
+    }
+
+    int64_t removed = tracePackRepair(fd);
+    if (removed != (int64_t) (sizeof(rec) + 2) || fileSize(fd) != records) {
+        ok = 0;
+        fprintf(stderr, "testRepair: FAIL: removed %lld bytes (expected %lld), size %lld (expected %lld)\n",
+                (long long) removed, (long long) (sizeof(rec) + 2), (long long) fileSize(fd), (long long) records);
+    } else if (tracePackRepair(fd) != 0) {
+        ok = 0;
+        fprintf(stderr, "testRepair: FAIL: second repair removed data\n");
+    } else {
+        fprintf(stderr, "testRepair:  PASS\n");
+    }
+
+    // without the torn record the traces are intact
+    ok = checkTraces("testRepair", fd) && ok;
+
+    // and the next record is found after it
+    struct tracepack_ref *refs;
+    uint32_t count;
+    uint64_t end;
+    lseek(fd, 0, SEEK_END);
+    if (writeRecord(fd, 0x3c6444, 0, "EEtt", 2, 9000) < 0 || tracePackRefs(fd, &refs, &count, &end) < 0) {
+        ok = 0;
+        fprintf(stderr, "testRepair: FAIL: appending after the repair failed\n");
+    } else {
+        if (count != 6 || (off_t) end != fileSize(fd)) {
+            ok = 0;
+            fprintf(stderr, "testRepair[append]: FAIL: %u refs (expected 6)\n", count);
+        } else {
+            fprintf(stderr, "testRepair[append]:  PASS\n");
+        }
+        free(refs);
+    }
+
+    close(fd);
+    unlink(path);
+    return ok;
+}
+
+int main(int __attribute__ ((unused)) argc, char __attribute__ ((unused)) **argv) {
+    int ok = 1;
+    ok = testRecordFormat() && ok;
+    ok = testSeal() && ok;
+    ok = testRepair() && ok;
+    return ok ? 0 : 1;
+}
@@ -73,6 +73,23 @@ static const char *source_string(datasource_t source);
 // Should we accept some new data from the given source?
 // If so, update the validity and return 1
 
+// Tier 0 of beast_reduce forwards every time the reduce interval has passed.
+// The slower tiers forward the first of those in every window of their interval,
+// the windows are offset per aircraft so the forwards don't all happen at once.
+// Like tier 0, tiers carrying CPR positions use windows of at most 7 seconds so global CPR stays possible.
+static uint8_t reduceTiers(uint32_t addr, uint64_t previous, uint64_t now, int cpr) {
+    uint8_t tiers = 1;
+    for (int k = 1; k < Modes.beast_reduce_tier_count; k++) {
+        uint64_t interval = Modes.beast_reduce_tiers[k - 1];
+        if (cpr && interval > 7000)
+            interval = 7000;
+        uint64_t offset = (addr * 2654435761u) % interval;
+        if ((now + offset) / interval != (previous + offset) / interval)
+            tiers |= 1 << k;
+    }
+    return tiers;
+}
+
 static int accept_data(data_validity *d, datasource_t source, struct modesMessage *mm, int reduce_often) {
     uint64_t receiveTime = mm->sysTimestampMsg;
 
@@ -105,16 +122,26 @@ static int accept_data(data_validity *d, datasource_t source, struct modesMessag
     d->stale = 0;
 
     if (receiveTime > d->next_reduce_forward && !mm->sbs_in) {
+        uint64_t delay = Modes.net_output_beast_reduce_interval;
+        if (d->reduce_delay == REDUCE_DELAY_SLOW)
+            delay *= 4;
+        if (d->reduce_delay == REDUCE_DELAY_CPR)
+            delay = 7000;
+        uint64_t previous = d->next_reduce_forward > delay ? d->next_reduce_forward - delay : 0;
+
         if (mm->msgtype == 17 || reduce_often) {
             d->next_reduce_forward = receiveTime + Modes.net_output_beast_reduce_interval;
+            d->reduce_delay = REDUCE_DELAY_INTERVAL;
         } else {
             d->next_reduce_forward = receiveTime + Modes.net_output_beast_reduce_interval * 4;
+            d->reduce_delay = REDUCE_DELAY_SLOW;
         }
         // make sure global CPR stays possible even at high interval:
         if (Modes.net_output_beast_reduce_interval > 7000 && mm->cpr_valid) {
             d->next_reduce_forward = receiveTime + 7000;
+            d->reduce_delay = REDUCE_DELAY_CPR;
         }
-        mm->reduce_forward = 1;
+        mm->reduce_forward |= reduceTiers(mm->addr, previous, receiveTime, mm->cpr_valid);
     }
     return 1;
 }
@@ -588,6 +615,9 @@ static void setPosition(struct aircraft *a, struct modesMessage *mm, uint64_t no
     a->pos_nic = mm->decoded_nic;
     a->pos_rc = mm->decoded_rc;
 
+    if (Modes.api)
+        apiUpdate(a);
+
     a->pos_surface = trackDataValid(&a->airground_valid) && a->airground == AG_GROUND;
 
     if (mm->cpr_valid)
@@ -596,6 +626,8 @@ static void setPosition(struct aircraft *a, struct modesMessage *mm, uint64_t no
     if (mm->jsonPos)
         jsonPositionOutput(mm, a);
 
+    shmPositionOutput(mm, a);
+
     if (a->pos_reliable_odd >= 2 && a->pos_reliable_even >= 2 && mm->source == SOURCE_ADSB) {
         update_range_histogram(mm->decoded_lat, mm->decoded_lon);
     }
@@ -1406,7 +1438,7 @@ end_alt:
         if (a->airground == AG_UNCERTAIN || mm->airground != AG_UNCERTAIN ||
                 (mm->airground == AG_UNCERTAIN && now > a->airground_valid.updated + TRACK_EXPIRE_LONG)) {
             if (mm->airground != a->airground)
-                mm->reduce_forward = 1;
+                mm->reduce_forward = REDUCE_FORWARD_ALL;
             if (accept_data(&a->airground_valid, mm->source, mm, 0)) {
                 a->airground = mm->airground;
 
@@ -1537,12 +1569,12 @@ end_alt:
         if (a->last_cpr_type == CPR_SURFACE && mm->cpr_type == CPR_AIRBORNE
                 && accept_data(&a->airground_valid, mm->source, mm, 0)) {
             a->airground = AG_AIRBORNE;
-            mm->reduce_forward = 1;
+            mm->reduce_forward = REDUCE_FORWARD_ALL;
         }
         if (a->last_cpr_type == CPR_AIRBORNE && mm->cpr_type == CPR_SURFACE
                 && accept_data(&a->airground_valid, mm->source, mm, 0)) {
             a->airground = AG_GROUND;
-            mm->reduce_forward = 1;
+            mm->reduce_forward = REDUCE_FORWARD_ALL;
         }
 
         updatePosition(a, mm, now);
@@ -1558,8 +1590,8 @@ end_alt:
         int old_jaero = 0;
         if (mm->source == SOURCE_JAERO && a->trace_len > 0) {
             for (int i = max(0, a->trace_len - 10); i < a->trace_len; i++) {
-                if ( (int32_t) (mm->decoded_lat * 1E6) == a->trace[i].lat
-                        && (int32_t) (mm->decoded_lon * 1E6) == a->trace[i].lon )
+                if ( (int32_t) (mm->decoded_lat * 1E6) == trace_state(a, i)->lat
+                        && (int32_t) (mm->decoded_lon * 1E6) == trace_state(a, i)->lon )
                     old_jaero = 1;
             }
         }
@@ -1618,9 +1650,11 @@ end_alt:
     }
 
     if (mm->msgtype == 11 && mm->IID == 0 && mm->correctedbits == 0 && now > a->next_reduce_forward_DF11) {
+        uint64_t delay = Modes.net_output_beast_reduce_interval * 4;
+        uint64_t previous = a->next_reduce_forward_DF11 > delay ? a->next_reduce_forward_DF11 - delay : 0;
 
-        a->next_reduce_forward_DF11 = now + Modes.net_output_beast_reduce_interval * 4;
-        mm->reduce_forward = 1;
+        a->next_reduce_forward_DF11 = now + delay;
+        mm->reduce_forward |= reduceTiers(mm->addr, previous, now, 0);
     }
 
     if (haveScratch && (mm->garbage || mm->pos_bad || mm->duplicate)) {
@@ -1741,9 +1775,6 @@ static void trackRemoveStaleAircraft(struct aircraft **freeList, uint64_t now) {
     if (now > Modes.next_stats_update)
         statsReset();
 
-    if (Modes.api)
-        apiClear();
-
     int full_write = 0;
     if (Modes.doFullTraceWrite) {
         Modes.doFullTraceWrite = 0;
@@ -1778,6 +1809,7 @@ static void trackRemoveStaleAircraft(struct aircraft **freeList, uint64_t now) {
 
                 // remove from the globeList
                 set_globe_index(a, -5);
+                apiRemove(a);
 
                 // Remove the element from the linked list, with care
                 // if we are removing the first element
@@ -1800,16 +1832,19 @@ static void trackRemoveStaleAircraft(struct aircraft **freeList, uint64_t now) {
                     && (now < a->seen + 30 * SECONDS && a->messages >= 2))
                         statsCount(a, now);
 
-                if (Modes.api)
-                    apiAdd(a, now);
+                if (Modes.state_wal && a->seen > a->wal_logged && now > a->wal_logged + WAL_AIRCRAFT_INTERVAL)
+                    walAircraft(a, now);
 
                 if (Modes.keep_traces && a->trace_alloc) {
 
                     if (Modes.json_globe_index) {
                         if (now > a->trace_next_fw) {
                             resize_trace(a, now);
-                            a->trace_write = 1;
+                            traceQueue(a, now);
                         }
+                        // changed while it was being written
+                        if (a->trace_write && !a->trace_queued)
+                            traceQueue(a, now);
 
                         if (full_write) {
                             a->trace_next_fw = now + random() % (2 * MINUTES); // spread over 2 mins
@@ -1837,18 +1872,20 @@ static void trackRemoveStaleAircraft(struct aircraft **freeList, uint64_t now) {
 
 
 static void lockThreads() {
-    for (int i = 0; i < TRACE_THREADS; i++) {
+    for (int i = 0; i < Modes.trace_threads; i++) {
         pthread_mutex_lock(&Modes.jsonTraceThreadMutex[i]);
     }
     pthread_mutex_lock(&Modes.jsonThreadMutex);
     pthread_mutex_lock(&Modes.jsonGlobeThreadMutex);
+    pthread_mutex_lock(&Modes.heatmapMutex);
     pthread_mutex_lock(&Modes.decodeThreadMutex);
 }
 static void unlockThreads() {
     pthread_mutex_unlock(&Modes.decodeThreadMutex);
     pthread_mutex_unlock(&Modes.jsonThreadMutex);
     pthread_mutex_unlock(&Modes.jsonGlobeThreadMutex);
-    for (int i = 0; i < TRACE_THREADS; i++) {
+    pthread_mutex_unlock(&Modes.heatmapMutex);
+    for (int i = 0; i < Modes.trace_threads; i++) {
         pthread_mutex_unlock(&Modes.jsonTraceThreadMutex[i]);
     }
 }
@@ -1892,10 +1929,17 @@ void trackPeriodicUpdate() {
 
     netFreeClients();
 
+    int tilesChanged = 0;
+    if (Modes.globe_adaptive && Modes.json_globe_index && counter % 60 == 0)
+        tilesChanged = globeAdaptiveUpdate();
+
     int64_t elapsed = end_cpu_timing(&start_time, &Modes.stats_current.remove_stale_cpu);
 
     unlockThreads();
 
+    if (Modes.state_wal)
+        walFlush(mstime());
+
     if (elapsed > 80) {
         static int antiSpam;
         if (--antiSpam <= 0) {
@@ -1909,10 +1953,8 @@ void trackPeriodicUpdate() {
 
     cleanupAircraft(freeList);
 
-    if (Modes.api)
-        apiSort();
-
-    if (counter % (3000 / STATE_BLOBS) == 0) {
+    // with the wal the blobs are only snapshots to compact it into
+    if (counter % ((Modes.state_wal ? 4 : 1) * 3000 / STATE_BLOBS) == 0) {
         save_blob(blob++ % STATE_BLOBS);
     }
 
@@ -1922,9 +1964,12 @@ void trackPeriodicUpdate() {
     if (writeStats)
         statsWrite();
 
-    if (Modes.netIngest && Modes.json_dir && counter % 5 == 0)
+    if (Modes.net && Modes.json_dir && counter % 5 == 0)
         writeJsonToFile(Modes.json_dir, "clients.json", generateClientsJson());
 
+    if (Modes.globe_adaptive && Modes.json_dir && (tilesChanged || counter == 1))
+        writeJsonToFile(Modes.json_dir, "globe_tiles.json", generateGlobeTilesJson());
+
     if (Modes.netReceiverIdJson && Modes.json_dir && counter % 5 == 0)
         writeJsonToFile(Modes.json_dir, "receivers.json", generateReceiversJson());
 
@@ -1999,20 +2044,19 @@ static void globe_stuff(struct aircraft *a, struct modesMessage *mm, double new_
                 (a->pos_reliable_odd < Modes.json_reliable || a->pos_reliable_even < Modes.json_reliable))
             goto no_save_state;
 
-        if (!a->trace) {
+        if (!a->trace_blocks) {
 
-            a->trace_alloc = GLOBE_STEP;
-            a->trace = malloc(a->trace_alloc * sizeof(struct state));
-            a->trace_all = malloc((1 + a->trace_alloc / 4) * sizeof(struct state_all));
-            a->trace->timestamp = now;
+            trace_grow(a, GLOBE_STEP);
+            trace_state(a, 0)->timestamp = now;
+            legsReset(a);
             a->trace_full_write = 9999; // rewrite full history file
 
             //fprintf(stderr, "%06x: new trace\n", a->addr);
 
         } else if (a->trace_len > 5) {
             for (int i = a->trace_len - 1; i >= a->trace_len - 5; i--) {
-                if ( (int32_t) (new_lat * 1E6) == a->trace[i].lat
-                        && (int32_t) (new_lon * 1E6) == a->trace[i].lon ) {
+                if ( (int32_t) (new_lat * 1E6) == trace_state(a, i)->lat
+                        && (int32_t) (new_lon * 1E6) == trace_state(a, i)->lon ) {
                     return;
                 }
             }
@@ -2026,9 +2070,7 @@ static void globe_stuff(struct aircraft *a, struct modesMessage *mm, double new_
             goto no_save_state;
         }
 
-        struct state *trace = a->trace;
-
-        struct state *new = &(trace[a->trace_len]);
+        struct state *new = trace_state(a, a->trace_len);
         memset(new, 0, sizeof(struct state));
 
         if (now > a->seenPosReliable + 15 * SECONDS) {
@@ -2062,7 +2104,7 @@ static void globe_stuff(struct aircraft *a, struct modesMessage *mm, double new_
 
 
 
-        last = &(trace[a->trace_len-1]);
+        last = trace_state(a, a->trace_len - 1);
         float track_diff = fabs(track - last->track / 10.0);
         uint64_t elapsed = now - last->timestamp;
         if (now < last->timestamp)
@@ -2224,7 +2266,7 @@ save_state:
         // trace_all stuff:
 
         if (a->trace_len % 4 == 0) {
-            struct state_all *new_all = &(a->trace_all[a->trace_len/4]);
+            struct state_all *new_all = trace_state_all(a, a->trace_len);
             memset(new_all, 0, sizeof(struct state_all));
 
             to_state_all(a, new_all, now);
@@ -2235,9 +2277,14 @@ save_state:
         a->trace_llon = new_lon;
 
         (a->trace_len)++;
-        a->trace_write = 1;
+        traceQueue(a, now);
         a->trace_full_write++;
 
+        if (Modes.state_wal)
+            walTracePoint(a, now);
+
+        legsUpdate(a);
+
         //fprintf(stderr, "Added to trace for %06x (%d).\n", a->addr, a->trace_len);
 
 no_save_state:
@@ -2314,6 +2361,280 @@ static void position_bad(struct modesMessage *mm, struct aircraft *a) {
     }
 }
 
+//
+// Trace chunk slab allocator
+//
+// Chunks are carved from 1 MB slabs and recycled through a free list, slabs
+// are only released at exit.  With all traces made of identically sized
+// chunks the heap doesn't fragment no matter how traces grow and expire.
+//
+
+#define TRACE_SLAB_SIZE (1024 * 1024)
+#define TRACE_SLAB_CHUNKS ((TRACE_SLAB_SIZE - sizeof(void *)) / sizeof(struct trace_chunk))
+
+struct trace_slab {
+    struct trace_slab *next;
+    struct trace_chunk chunks[TRACE_SLAB_CHUNKS];
+};
+
+static pthread_mutex_t traceSlabMutex = PTHREAD_MUTEX_INITIALIZER; // state loading allocates from several threads
+static struct trace_slab *traceSlabs;
+static struct trace_chunk *traceFreeChunks;
+static uint64_t traceChunksTotal;
+static uint64_t traceChunksFree;
+
+static struct trace_chunk *trace_chunk_alloc() {
+    pthread_mutex_lock(&traceSlabMutex);
+    if (!traceFreeChunks) {
+        struct trace_slab *slab = malloc(sizeof(struct trace_slab));
+        if (!slab) {
+            fprintf(stderr, "Out of memory allocating trace slab\n");
+            exit(1);
+        }
+        slab->next = traceSlabs;
+        traceSlabs = slab;
+        for (int i = TRACE_SLAB_CHUNKS - 1; i >= 0; i--) {
+            slab->chunks[i].next_free = traceFreeChunks;
+            traceFreeChunks = &slab->chunks[i];
+        }
+        traceChunksTotal += TRACE_SLAB_CHUNKS;
+        traceChunksFree += TRACE_SLAB_CHUNKS;
+    }
+    struct trace_chunk *chunk = traceFreeChunks;
+    traceFreeChunks = chunk->next_free;
+    traceChunksFree--;
+    pthread_mutex_unlock(&traceSlabMutex);
+    return chunk;
+}
+
+static void trace_chunk_free(struct trace_chunk *chunk) {
+    pthread_mutex_lock(&traceSlabMutex);
+    chunk->next_free = traceFreeChunks;
+    traceFreeChunks = chunk;
+    traceChunksFree++;
+    pthread_mutex_unlock(&traceSlabMutex);
+}
+
+static uint64_t tracePackedBlocks;
+static uint64_t tracePackedBytes;
+
+void trace_chunks_stats(uint64_t *used, uint64_t *free, uint64_t *packed, uint64_t *packedBytes) {
+    pthread_mutex_lock(&traceSlabMutex);
+    *used = traceChunksTotal - traceChunksFree;
+    *free = traceChunksFree;
+    pthread_mutex_unlock(&traceSlabMutex);
+    *packed = __atomic_load_n(&tracePackedBlocks, __ATOMIC_RELAXED);
+    *packedBytes = __atomic_load_n(&tracePackedBytes, __ATOMIC_RELAXED);
+}
+
+void trace_chunks_cleanup() {
+    struct trace_slab *slab = traceSlabs, *next;
+    while (slab) {
+        next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    traceSlabs = NULL;
+    traceFreeChunks = NULL;
+    traceChunksTotal = traceChunksFree = 0;
+}
+
+// size of the chunk directory for n chunks, a power of 2
+static int trace_dir_size(int n) {
+    int size = 2;
+    while (size < n)
+        size *= 2;
+    return size;
+}
+
+static void trace_block_free(struct trace_block *block) {
+    if (block->packed) {
+        __atomic_fetch_sub(&tracePackedBlocks, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&tracePackedBytes, block->packed->len, __ATOMIC_RELAXED);
+        free(block->packed);
+    } else {
+        trace_chunk_free(block->chunk);
+    }
+    block->chunk = NULL;
+    block->packed = NULL;
+}
+
+// make room for at least points more points
+void trace_grow(struct aircraft *a, int points) {
+    while (a->trace_alloc < a->trace_len + points) {
+        if (!a->trace_blocks || a->trace_nchunks == trace_dir_size(a->trace_nchunks)) {
+            int size = a->trace_blocks ? trace_dir_size(a->trace_nchunks + 1) : trace_dir_size(1);
+            a->trace_blocks = realloc(a->trace_blocks, size * sizeof(struct trace_block));
+            if (!a->trace_blocks) {
+                fprintf(stderr, "Out of memory allocating trace\n");
+                exit(1);
+            }
+        }
+        struct trace_block *block = &a->trace_blocks[a->trace_nchunks++];
+        block->chunk = trace_chunk_alloc();
+        block->packed = NULL;
+        a->trace_alloc += TRACE_CHUNK_POINTS;
+    }
+}
+
+// remove the oldest points, a multiple of 4 unless the whole trace is removed
+void trace_drop(struct aircraft *a, int points) {
+    if (points >= a->trace_len) {
+        points = a->trace_len;
+    } else if (points % 4) {
+        fprintf(stderr, "trace_drop: not divisible by 4: %d %d\n", points, a->trace_len);
+        points -= points % 4;
+    }
+    a->trace_len -= points;
+    a->trace_start += points;
+    a->trace_alloc -= points;
+    legsDrop(a, points);
+
+    int release = a->trace_start / TRACE_CHUNK_POINTS;
+    if (release == 0)
+        return;
+    for (int i = 0; i < release; i++)
+        trace_block_free(&a->trace_blocks[i]);
+    a->trace_nchunks -= release;
+    memmove(a->trace_blocks, a->trace_blocks + release, a->trace_nchunks * sizeof(struct trace_block));
+    a->trace_start -= release * TRACE_CHUNK_POINTS;
+}
+
+void trace_free(struct aircraft *a) {
+    for (int i = 0; i < a->trace_nchunks; i++)
+        trace_block_free(&a->trace_blocks[i]);
+    free(a->trace_blocks);
+    a->trace_blocks = NULL;
+    a->trace_nchunks = 0;
+    a->trace_start = 0;
+    a->trace_alloc = 0;
+    a->trace_len = 0;
+}
+
+// timestamp of the first point of chunk k (may be an expired point for chunk 0)
+static uint64_t trace_block_first_ts(struct aircraft *a, int k) {
+    struct trace_block *block = &a->trace_blocks[k];
+    return block->packed ? block->packed->first_ts : block->chunk->state[0].timestamp;
+}
+
+// set leg_marker on the first point of a leg, packed chunks are packed again
+static void trace_mark_leg(struct aircraft *a, uint64_t ts, unsigned char *buf) {
+    int end = a->trace_start + a->trace_len;
+    int k = (end - 1) / TRACE_CHUNK_POINTS;
+    while (k > 0 && trace_block_first_ts(a, k) > ts)
+        k--;
+    struct trace_block *block = &a->trace_blocks[k];
+    struct trace_chunk *chunk = block->chunk;
+    if (block->packed) {
+        chunk = trace_chunk_alloc();
+        trace_chunk_unpack(chunk, block->packed);
+    }
+    int from = max(a->trace_start - k * TRACE_CHUNK_POINTS, 0);
+    int to = min(end - k * TRACE_CHUNK_POINTS, TRACE_CHUNK_POINTS);
+    for (int i = from; i < to; i++) {
+        struct state *s = &chunk->state[i];
+        if (s->timestamp < ts)
+            continue;
+        if (s->timestamp == ts && !s->flags.leg_marker) {
+            s->flags.leg_marker = 1;
+            if (block->packed) {
+                // the marker usually costs a byte or two
+                uint32_t len = trace_chunk_pack(buf, chunk) - buf;
+                struct trace_packed *packed = malloc(sizeof(struct trace_packed) + len);
+                if (!packed) {
+                    fprintf(stderr, "Out of memory packing trace\n");
+                    exit(1);
+                }
+                packed->first_ts = block->packed->first_ts;
+                packed->len = len;
+                memcpy(packed->data, buf, len);
+                __atomic_fetch_add(&tracePackedBytes, len - block->packed->len, __ATOMIC_RELAXED);
+                free(block->packed);
+                block->packed = packed;
+            }
+        }
+        break;
+    }
+    if (block->packed)
+        trace_chunk_free(chunk);
+}
+
+// Pack the full chunks that can't be appended to anymore, the newest
+// TRACE_CHUNK_POINTS points always stay raw (see trace_state()).
+// Also marks the legs that were found on points packed already.
+// Call only when no other thread can access the trace.
+void trace_pack(struct aircraft *a) {
+    static __thread unsigned char buf[TRACE_PACK_MAX];
+
+    struct leg_state *l = &a->legs;
+    if (l->count - l->marked > LEG_HISTORY)
+        l->marked = l->count - LEG_HISTORY; // can't happen between two passes, those legs are lost
+    if (a->trace_len > 0) {
+        for (; l->marked != l->count; l->marked++)
+            trace_mark_leg(a, l->ts[l->marked % LEG_HISTORY], buf);
+    }
+    l->marked = l->count;
+
+    if (!Modes.trace_pack)
+        return;
+    int packable = (a->trace_start + a->trace_len - TRACE_CHUNK_POINTS) / TRACE_CHUNK_POINTS;
+    for (int k = 0; k < packable; k++) {
+        struct trace_block *block = &a->trace_blocks[k];
+        if (block->packed)
+            continue;
+        uint32_t len = trace_chunk_pack(buf, block->chunk) - buf;
+        if (len >= sizeof(struct trace_chunk))
+            continue; // not worth it, can only happen for garbage
+        struct trace_packed *packed = malloc(sizeof(struct trace_packed) + len);
+        if (!packed) {
+            fprintf(stderr, "Out of memory packing trace\n");
+            exit(1);
+        }
+        packed->first_ts = block->chunk->state[0].timestamp;
+        packed->len = len;
+        memcpy(packed->data, buf, len);
+        trace_chunk_free(block->chunk);
+        block->chunk = NULL;
+        block->packed = packed;
+        __atomic_fetch_add(&tracePackedBlocks, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&tracePackedBytes, len, __ATOMIC_RELAXED);
+    }
+}
+
+void trace_view_init(struct trace_view *v, struct aircraft *a) {
+    v->a = a;
+    v->len = a->trace_len;
+    v->start = a->trace_start;
+    v->nchunks = a->trace_nchunks;
+    v->chunks = NULL;
+    if (!v->nchunks)
+        return;
+    v->chunks = malloc(v->nchunks * sizeof(struct trace_chunk *));
+    if (!v->chunks) {
+        fprintf(stderr, "Out of memory allocating trace view\n");
+        exit(1);
+    }
+    for (int k = 0; k < v->nchunks; k++)
+        v->chunks[k] = a->trace_blocks[k].chunk;
+}
+
+struct trace_chunk *trace_view_decode(struct trace_view *v, int k) {
+    struct trace_chunk *chunk = trace_chunk_alloc();
+    trace_chunk_unpack(chunk, v->a->trace_blocks[k].packed);
+    v->chunks[k] = chunk;
+    return chunk;
+}
+
+void trace_view_free(struct trace_view *v) {
+    for (int k = 0; k < v->nchunks; k++) {
+        if (v->chunks[k] && v->a->trace_blocks[k].packed)
+            trace_chunk_free(v->chunks[k]);
+    }
+    free(v->chunks);
+    v->chunks = NULL;
+    v->nchunks = 0;
+}
+
 static void resize_trace(struct aircraft *a, uint64_t now) {
 
     if (a->trace_alloc == 0) {
@@ -2322,12 +2643,7 @@ static void resize_trace(struct aircraft *a, uint64_t now) {
 
     if (a->trace_len == 0) {
 
-        free(a->trace);
-        free(a->trace_all);
-
-        a->trace_alloc = 0;
-        a->trace = NULL;
-        a->trace_all = NULL;
+        trace_free(a);
 
         unlink_trace(a);
         // if the trace length is zero, the trace is deleted from run
@@ -2343,15 +2659,26 @@ static void resize_trace(struct aircraft *a, uint64_t now) {
     if (a->addr & MODES_NON_ICAO_ADDRESS)
         keep_after = now - TRACK_AIRCRAFT_NON_ICAO_TTL;
 
-    if (a->trace_len == GLOBE_TRACE_SIZE || a->trace->timestamp < keep_after - 20 * MINUTES ) {
+    struct trace_view view;
+    trace_view_init(&view, a);
+
+    if (a->trace_len >= GLOBE_TRACE_SIZE || trace_view_state(&view, 0)->timestamp < keep_after - 20 * MINUTES ) {
         int new_start = a->trace_len;
 
         if (a->trace_len + GLOBE_STEP / 2 >= GLOBE_TRACE_SIZE) {
             new_start = GLOBE_TRACE_SIZE / 64;
         } else {
+            // skip chunks that are expired as a whole without decoding them
+            int first = 0;
+            int k = 1;
+            while (k < a->trace_nchunks && k * TRACE_CHUNK_POINTS < a->trace_start + a->trace_len
+                    && trace_block_first_ts(a, k) <= keep_after) {
+                first = k * TRACE_CHUNK_POINTS - a->trace_start;
+                k++;
+            }
             int found = 0;
-            for (int i = 0; i < a->trace_len; i++) {
-                struct state *state = &a->trace[i];
+            for (int i = first; i < a->trace_len; i++) {
+                struct state *state = trace_view_state(&view, i);
                 if (state->timestamp > keep_after) {
                     new_start = i;
                     found = 1;
@@ -2362,43 +2689,37 @@ static void resize_trace(struct aircraft *a, uint64_t now) {
                 new_start = a->trace_len;
         }
 
-        if (new_start != a->trace_len) {
+        if (new_start != a->trace_len)
             new_start -= (new_start % 4);
 
-            if (new_start % 4 != 0)
-                fprintf(stderr, "not divisible by 4: %d %d\n", new_start, a->trace_len);
-        }
-
-
-        a->trace_len -= new_start;
+        // the view can't outlive the chunks it refers to
+        trace_view_free(&view);
 
-        memmove(a->trace, a->trace + new_start, a->trace_len * sizeof(struct state));
-        memmove(a->trace_all, a->trace_all + new_start / 4, a->trace_len / 4 * sizeof(struct state_all));
+        // releases the chunks that only held expired points
+        trace_drop(a, new_start);
 
         //a->trace_write = 1;
         //a->trace_full_write = 9999; // rewrite full history file
 
+    } else {
+        trace_view_free(&view);
     }
 
-    if (a->trace_len && a->trace_len + GLOBE_STEP / 2 >= a->trace_alloc) {
-        a->trace_alloc = a->trace_alloc * 5 / 4;
-        if (a->trace_alloc > GLOBE_TRACE_SIZE)
-            a->trace_alloc = GLOBE_TRACE_SIZE;
-        a->trace = realloc(a->trace, a->trace_alloc * sizeof(struct state));
-        a->trace_all = realloc(a->trace_all, (1 + a->trace_alloc / 4) * sizeof(struct state_all));
+    if (a->trace_len == 0) {
+        // keep one chunk, the next position would allocate it anyway
+        return;
+    }
+
+    // appending doesn't allocate (the trace threads read concurrently),
+    // always keep some free space
+    if (a->trace_len + GLOBE_STEP / 2 >= a->trace_alloc && a->trace_len < GLOBE_TRACE_SIZE) {
+        trace_grow(a, GLOBE_STEP);
 
         if (a->trace_len >= GLOBE_TRACE_SIZE / 2)
             fprintf(stderr, "Quite a long trace: %06x (%d).\n", a->addr, a->trace_len);
-
-        if (a->trace_alloc > GLOBE_TRACE_SIZE)
-            fprintf(stderr, "GLOBE_TRACE_SIZE EXCEEDED!: %06x (%d).\n", a->addr, a->trace_len);
     }
 
-    if (a->trace_len < (a->trace_alloc * 7 / 10) && a->trace_alloc >= 2 * GLOBE_STEP) {
-        a->trace_alloc = a->trace_alloc * 4 / 5;
-        a->trace = realloc(a->trace, a->trace_alloc * sizeof(struct state));
-        a->trace_all = realloc(a->trace_all, (1 + a->trace_alloc / 4) * sizeof(struct state_all));
-    }
+    trace_pack(a);
 }
 
 void to_state_all(struct aircraft *a, struct state_all *new, uint64_t now) {
@@ -2533,10 +2854,10 @@ static void calc_wind(struct aircraft *a, uint64_t now) {
 
     // don't use this code for now
     /*
-    if (a->trace && a->trace_len >= 2) {
-        struct state *last = &(a->trace[a->trace_len-1]);
+    if (a->trace_blocks && a->trace_len >= 2) {
+        struct state *last = trace_state(a, a->trace_len - 1);
         if (now + 1500 < last->timestamp)
-            last = &(a->trace[a->trace_len-2]);
+            last = trace_state(a, a->trace_len - 2);
         float track_diff = fabs(a->track - last->track / 10.0);
         if (last->flags.track_valid && track_diff > 0.5)
             return;
@@ -2759,10 +3080,8 @@ static const char *source_string(datasource_t source) {
 void freeAircraft(struct aircraft *a) {
         if (a->first_message)
             free(a->first_message);
-        if (a->trace) {
-            free(a->trace);
-            free(a->trace_all);
-        }
+        if (a->trace_blocks)
+            trace_free(a);
         free(a);
 }
 void updateValidities(struct aircraft *a, uint64_t now) {
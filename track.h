@@ -103,6 +103,13 @@
 //  stale: data is valid. Updates from a less reliable source are accepted.
 //  expired: data is not valid.
 
+// delays next_reduce_forward is set with, the previous forward is needed for the beast_reduce tiers
+enum {
+    REDUCE_DELAY_INTERVAL = 0,
+    REDUCE_DELAY_SLOW = 1, // 4 * interval
+    REDUCE_DELAY_CPR = 2, // 7 seconds
+};
+
 typedef struct
 {
   uint64_t updated; /* when it arrived */
@@ -110,7 +117,8 @@ typedef struct
   datasource_t source:8; /* where the data came from */
   datasource_t last_source:8; /* where the data came from */
   int8_t stale; /* if it's stale 1 / 0 */
-  unsigned padding:8;
+  unsigned reduce_delay:2; /* REDUCE_DELAY_*: delay next_reduce_forward was set with */
+  unsigned padding:6;
 } data_validity;
 
 struct state_flags
@@ -241,6 +249,84 @@ struct state_all
 } __attribute__ ((__packed__));
 
 /* Structure used to describe the state of one tracked aircraft */
+// Traces are stored in fixed size chunks from a slab allocator (see track.c).
+// Appending never moves points, expiring old points releases whole chunks.
+// Must be a multiple of 4 (one state_all every 4 points) and larger than GLOBE_STEP.
+#define TRACE_CHUNK_POINTS 64
+
+struct trace_chunk
+{
+  struct trace_chunk *next_free; // slab free list
+  struct state state[TRACE_CHUNK_POINTS];
+  struct state_all all[TRACE_CHUNK_POINTS / 4];
+};
+
+// With --compress-traces, full chunks that are no longer appended to are
+// replaced by a delta encoded copy (see trace_pack() in track.c).
+struct trace_packed
+{
+  uint64_t first_ts; // timestamp of the first point, lets expiry skip whole blocks
+  uint32_t len; // bytes in data
+  unsigned char data[];
+};
+
+// enough for the worst case: 8 varints per point, a 64 bit mask plus all bytes per state_all
+#define TRACE_PACK_MAX (sizeof(struct state) + sizeof(struct state_all) \
+        + TRACE_CHUNK_POINTS * 8 * 10 + TRACE_CHUNK_POINTS / 4 * (10 + sizeof(struct state_all)))
+
+// tracechunk.c: encode a full chunk to p (at most TRACE_PACK_MAX bytes), returns the end
+// of the encoded data, decode it again into chunk
+unsigned char *trace_chunk_pack(unsigned char *p, const struct trace_chunk *chunk);
+void trace_chunk_unpack(struct trace_chunk *chunk, const struct trace_packed *packed);
+
+// entry of the trace directory, exactly one of the pointers is set
+struct trace_block
+{
+  struct trace_chunk *chunk;
+  struct trace_packed *packed;
+};
+
+// The first point of a leg has flags.leg_marker set.  Points in packed chunks
+// only get it with the next trace_pack(), until then the recent legs are
+// remembered here; appending trace files also looks at them.
+#define LEG_HISTORY 16
+
+// Leg detection runs incrementally as positions are added to the trace
+// (legsUpdate() in globe_index.c), indices are adjusted when points expire.
+struct leg_state
+{
+  int next; // next trace index to look at
+  int prev; // last index with a usable altitude
+  int high;
+  int low;
+  int last_five[5];
+  uint32_t five_pos;
+  int was_ground;
+  int major_climb_index;
+  int major_descent_index;
+  int last_low_index;
+  uint64_t major_climb;
+  uint64_t major_descent;
+  uint64_t last_high;
+  uint64_t last_low;
+  uint64_t last_airborne;
+  uint64_t last_ground;
+  double alt_sum; // altitude sum and point count for the climb / descent threshold
+  uint32_t alt_count;
+  uint32_t count; // legs found, the newest is ts[(count - 1) % LEG_HISTORY]
+  uint32_t marked; // legs before this one have leg_marker set on their point
+  uint64_t ts[LEG_HISTORY]; // timestamp of the first point of each leg
+};
+
+// what an appendable trace file on disk holds (trace_file_write() in globe_index.c)
+struct trace_file_mark
+{
+  uint64_t first; // timestamp of the first point, point timestamps in the file are relative to it
+  uint64_t last; // timestamp of the last point written
+  uint32_t legs; // legs.count when the file was written
+  struct gzappend gz; // gz.size == 0: the file is written from scratch next time
+};
+
 struct aircraft
 {
   struct aircraft *next; // Next aircraft in our linked list
@@ -254,14 +340,15 @@ struct aircraft
   int trace_len; // current number of points in the trace
   int trace_write; // signal for writing the trace
   int trace_full_write; // signal for writing the complete trace
-  int trace_alloc; // current number of allocated points
+  int trace_alloc; // current number of allocated points (trace_nchunks * TRACE_CHUNK_POINTS - trace_start)
   int destroy; // aircraft is being deleted
   int signalNext; // next index of signalLevel to use
 
   // ----
 
-  struct state *trace; // array of positions representing the aircrafts trace/trail
-  struct state_all *trace_all;
+  struct trace_block *trace_blocks; // chunks holding the positions representing the aircrafts trace/trail
+  int trace_start; // index of the first point in the first chunk, multiple of 4
+  int trace_nchunks;
   int altitude_baro; // Altitude (Baro)
   int alt_reliable;
   int altitude_geom; // Altitude (Geometric)
@@ -271,6 +358,9 @@ struct aircraft
   uint64_t trace_next_fw; // timestamp for next full trace write to history_dir (disk)
   double trace_llat; // last saved lat
   double trace_llon; // last saved lon
+  struct trace_file_mark trace_full_mark; // trace_full on /run
+  struct trace_file_mark trace_hist_mark; // the current days file in globe_history
+  struct leg_state legs;
 
   // ----
 
@@ -283,10 +373,10 @@ struct aircraft
   uint64_t rr_seen; // when we noted this rough position
   uint64_t category_updated;
   unsigned category; // Aircraft category A0 - D7 encoded as a single hex byte. 00 = unset
-  unsigned paddingabc;
+  int globe_slot; // position in Modes.globeLists[globe_index] (ca_add() in globe_index.c)
 
 
-  uint64_t padding23;
+  uint64_t wal_logged; // last time the aircraft was written to the state wal
   uint64_t addrtype_updated;
   float tat;
   uint16_t no_signal_count; // consecutive messages without signal strength specified
@@ -301,7 +391,7 @@ struct aircraft
   double lat, lon; // Coordinates obtained from CPR encoded data
   int pos_reliable_odd; // Number of good global CPRs, indicates position reliability
   int pos_reliable_even;
-  int padding1234; // unused
+  int trace_queued; // in the trace write queue or being written (globe_index.c)
   float gs_last_pos; // Save a groundspeed associated with the last position
 
   float wind_speed;
@@ -318,7 +408,7 @@ struct aircraft
   unsigned ias;
   unsigned tas;
   unsigned squawk; // Squawk
-  unsigned padding2344;
+  unsigned api_cell; // cell + 1 in the API grid, 0: not in it (aircraft.c)
   unsigned nav_altitude_mcp; // FCU/MCP selected altitude
   unsigned nav_altitude_fms; // FMS selected altitude
   unsigned cpr_odd_lat;
@@ -482,6 +572,66 @@ trackDataAge (uint64_t now, const data_validity *v)
 double greatcircle(double lat0, double lon0, double lat1, double lon1);
 void to_state_all(struct aircraft *a, struct state_all *new, uint64_t now);
 
+// point i of the trace
+// Only for points in raw chunks: the newest TRACE_CHUNK_POINTS points and
+// traces being loaded.  Everything else reads through a trace_view.
+static inline struct state *trace_state(struct aircraft *a, int i) {
+    int pos = a->trace_start + i;
+    return &a->trace_blocks[pos / TRACE_CHUNK_POINTS].chunk->state[pos % TRACE_CHUNK_POINTS];
+}
+// number of points from point i to the end of its chunk (always a multiple of 4)
+static inline int trace_chunk_remaining(struct aircraft *a, int i) {
+    return TRACE_CHUNK_POINTS - (a->trace_start + i) % TRACE_CHUNK_POINTS;
+}
+// state_all belonging to point i, i must be a multiple of 4
+static inline struct state_all *trace_state_all(struct aircraft *a, int i) {
+    int pos = a->trace_start + i;
+    return &a->trace_blocks[pos / TRACE_CHUNK_POINTS].chunk->all[(pos % TRACE_CHUNK_POINTS) / 4];
+}
+
+// Read access to the whole trace, packed chunks are decoded on first access.
+// The directory must not change while the view is in use: the periodic update
+// only resizes and packs traces with all threads locked (lockThreads()).
+// Modifying points through the view only changes the trace for raw chunks.
+struct trace_view
+{
+  struct aircraft *a;
+  int len; // trace_len when the view was created
+  int start;
+  int nchunks;
+  struct trace_chunk **chunks; // NULL for packed chunks not decoded yet
+};
+
+void trace_view_init(struct trace_view *v, struct aircraft *a);
+void trace_view_free(struct trace_view *v);
+struct trace_chunk *trace_view_decode(struct trace_view *v, int k);
+
+static inline struct trace_chunk *trace_view_chunk(struct trace_view *v, int pos) {
+    struct trace_chunk *chunk = v->chunks[pos / TRACE_CHUNK_POINTS];
+    if (!chunk)
+        chunk = trace_view_decode(v, pos / TRACE_CHUNK_POINTS);
+    return chunk;
+}
+static inline struct state *trace_view_state(struct trace_view *v, int i) {
+    int pos = v->start + i;
+    return &trace_view_chunk(v, pos)->state[pos % TRACE_CHUNK_POINTS];
+}
+// i must be a multiple of 4
+static inline struct state_all *trace_view_all(struct trace_view *v, int i) {
+    int pos = v->start + i;
+    return &trace_view_chunk(v, pos)->all[(pos % TRACE_CHUNK_POINTS) / 4];
+}
+static inline int trace_view_remaining(struct trace_view *v, int i) {
+    return TRACE_CHUNK_POINTS - (v->start + i) % TRACE_CHUNK_POINTS;
+}
+
+void trace_grow(struct aircraft *a, int points);
+void trace_drop(struct aircraft *a, int points);
+void trace_free(struct aircraft *a);
+void trace_pack(struct aircraft *a);
+void trace_chunks_stats(uint64_t *used, uint64_t *free, uint64_t *packed, uint64_t *packedBytes);
+void trace_chunks_cleanup();
+
 /* Update aircraft state from data in the provided mesage.
  * Return the tracked aircraft.
  */
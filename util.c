@@ -66,6 +66,13 @@ uint64_t mstime(void) {
     return mst;
 }
 
+uint64_t microtime(void) {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return ((uint64_t) tv.tv_sec) * 1000 * 1000 + tv.tv_usec;
+}
+
 uint64_t msThreadTime(void) {
     struct timespec ts;
     clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
@@ -29,6 +29,9 @@
 /* Returns system time in milliseconds */
 uint64_t mstime (void);
 
+/* Returns system time in microseconds */
+uint64_t microtime (void);
+
 uint64_t msThreadTime(void);
 
 /* Returns the time elapsed, in nanoseconds, from t1 to t2,
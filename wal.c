@@ -0,0 +1,453 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// wal.c: write-ahead log for the persistent state, see wal.h
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "readsb.h"
+
+#define WAL_MAGIC 0x216c6177 // "wal!"
+#define WAL_FRAME_MAX (256 * 1024 * 1024)
+
+enum {
+    WAL_AIRCRAFT = 1, // struct aircraft
+    WAL_POINT = 2, // struct state followed by struct state_all, replay may place the point at any trace index
+};
+
+// every flush is one frame: header and a gzip member holding the records
+struct wal_frame {
+    uint32_t magic;
+    uint32_t zlen;
+    uint32_t len;
+};
+
+struct wal_record {
+    uint32_t type;
+    uint32_t addr;
+    uint32_t len;
+};
+
+struct wal_segment {
+    uint32_t number;
+    uint64_t closed;
+};
+
+static struct {
+    pthread_mutex_t mutex;
+    char *buf; // records not flushed yet
+    size_t len;
+    size_t alloc;
+    char *spare; // swapped with buf for flushing
+    size_t spareAlloc;
+    int fd;
+    uint32_t segment;
+    uint64_t segmentStart;
+    uint64_t started;
+    uint64_t blobSaved[STATE_BLOBS]; // when the last save of each blob started
+    struct wal_segment *closed;
+    int nclosed;
+    int closedAlloc;
+} wal = { .fd = -1 };
+
+static void walPath(char *path, uint32_t number) {
+    snprintf(path, PATH_MAX, "%s/wal_%08x", Modes.state_dir, number);
+}
+
+static void walAppend(uint32_t type, uint32_t addr, const void *data, size_t len, const void *data2, size_t len2) {
+    struct wal_record rec = { .type = type, .addr = addr, .len = len + len2 };
+    size_t need = sizeof(rec) + len + len2;
+
+    pthread_mutex_lock(&wal.mutex);
+    if (wal.len + need > wal.alloc) {
+        size_t alloc = 2 * wal.alloc;
+        if (alloc < wal.len + need + 64 * 1024)
+            alloc = wal.len + need + 64 * 1024;
+        char *grown = realloc(wal.buf, alloc);
+        if (!grown) {
+            pthread_mutex_unlock(&wal.mutex);
+            fprintf(stderr, "walAppend: out of memory\n");
+            return;
+        }
+        wal.buf = grown;
+        wal.alloc = alloc;
+    }
+    char *p = wal.buf + wal.len;
+    memcpy(p, &rec, sizeof(rec));
+    memcpy(p + sizeof(rec), data, len);
+    if (len2)
+        memcpy(p + sizeof(rec) + len, data2, len2);
+    wal.len += need;
+    pthread_mutex_unlock(&wal.mutex);
+}
+
+void walAircraft(struct aircraft *a, uint64_t now) {
+    if (a->addr & MODES_NON_ICAO_ADDRESS)
+        return;
+    a->wal_logged = now;
+    walAppend(WAL_AIRCRAFT, a->addr, a, sizeof(struct aircraft), NULL, 0);
+}
+
+void walTracePoint(struct aircraft *a, uint64_t now) {
+    if (a->addr & MODES_NON_ICAO_ADDRESS || a->trace_len < 1)
+        return;
+    // replay needs the aircraft before its points
+    if (a->wal_logged < wal.started)
+        walAircraft(a, now);
+    int i = a->trace_len - 1;
+    // the trace only keeps state_all for every 4th point, but replay can land this point on
+    // a different index (points already in the blob, lost frames), so always log one
+    if (i % 4 == 0) {
+        walAppend(WAL_POINT, a->addr, trace_state(a, i), sizeof(struct state), trace_state_all(a, i), sizeof(struct state_all));
+    } else {
+        struct state_all all;
+        memset(&all, 0, sizeof(struct state_all));
+        to_state_all(a, &all, now);
+        walAppend(WAL_POINT, a->addr, trace_state(a, i), sizeof(struct state), &all, sizeof(struct state_all));
+    }
+}
+
+static void walOpenSegment(uint64_t now) {
+    char path[PATH_MAX];
+    walPath(path, wal.segment);
+    wal.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (wal.fd < 0) {
+        fprintf(stderr, "walOpenSegment: ");
+        perror(path);
+    }
+    wal.segmentStart = now;
+}
+
+static void walSegmentClosed(uint32_t number, uint64_t closed) {
+    if (wal.nclosed == wal.closedAlloc) {
+        wal.closedAlloc = wal.closedAlloc ? 2 * wal.closedAlloc : 64;
+        wal.closed = realloc(wal.closed, wal.closedAlloc * sizeof(struct wal_segment));
+        if (!wal.closed) {
+            fprintf(stderr, "walSegmentClosed: out of memory\n");
+            exit(1);
+        }
+    }
+    wal.closed[wal.nclosed++] = (struct wal_segment) { .number = number, .closed = closed };
+}
+
+// delete the segments all blobs have been saved after
+static void walPrune() {
+    char path[PATH_MAX];
+    uint64_t oldest = wal.blobSaved[0];
+    for (int i = 1; i < STATE_BLOBS; i++) {
+        if (wal.blobSaved[i] < oldest)
+            oldest = wal.blobSaved[i];
+    }
+
+    int kept = 0;
+    for (int i = 0; i < wal.nclosed; i++) {
+        if (wal.closed[i].closed < oldest) {
+            walPath(path, wal.closed[i].number);
+            if (unlink(path) && errno != ENOENT)
+                perror(path);
+        } else {
+            wal.closed[kept++] = wal.closed[i];
+        }
+    }
+    wal.nclosed = kept;
+}
+
+void walFlush(uint64_t now) {
+    if (!Modes.state_wal)
+        return;
+
+    pthread_mutex_lock(&wal.mutex);
+    char *buf = wal.buf;
+    size_t len = wal.len;
+    size_t alloc = wal.alloc;
+    wal.buf = wal.spare;
+    wal.alloc = wal.spareAlloc;
+    wal.len = 0;
+    pthread_mutex_unlock(&wal.mutex);
+
+    struct char_buffer gz;
+    if (len > 0 && wal.fd >= 0) {
+        if (gzipBuffer(buf, len, ZCLASS_STATE, &gz) < 0) {
+            fprintf(stderr, "walFlush: compressing %zu bytes failed\n", len);
+        } else {
+            struct wal_frame frame = { .magic = WAL_MAGIC, .zlen = gz.len, .len = len };
+            struct iovec iov[2] = {
+                { .iov_base = &frame, .iov_len = sizeof(frame) },
+                { .iov_base = gz.buffer, .iov_len = gz.len },
+            };
+            if (writev(wal.fd, iov, 2) != (ssize_t) (sizeof(frame) + gz.len)) {
+                perror("walFlush: writev");
+                // a partial frame ends the segment for replay, continue in a new one
+                now = wal.segmentStart + WAL_SEGMENT_TIME + 1;
+            } else if (fdatasync(wal.fd) < 0) {
+                perror("walFlush: fdatasync");
+            }
+        }
+    }
+
+    wal.spare = buf;
+    wal.spareAlloc = alloc;
+
+    if (now > wal.segmentStart + WAL_SEGMENT_TIME) {
+        if (wal.fd >= 0)
+            close(wal.fd);
+        walSegmentClosed(wal.segment, now);
+        wal.segment++;
+        walOpenSegment(now);
+        walPrune();
+    }
+}
+
+void walBlobSaved(int blob, uint64_t started) {
+    if (blob >= 0 && blob < STATE_BLOBS)
+        wal.blobSaved[blob] = started;
+}
+
+// replay
+
+static void walApplyAircraft(struct aircraft *rec, uint64_t now) {
+    if (rec->size_struct_aircraft != sizeof(struct aircraft))
+        return;
+
+    struct aircraft *old = aircraftGet(rec->addr);
+    if (old && old->seen >= rec->seen)
+        return;
+
+    struct aircraft *a = malloc(sizeof(struct aircraft));
+    if (!a) {
+        fprintf(stderr, "walApplyAircraft: out of memory\n");
+        exit(1);
+    }
+    memcpy(a, rec, sizeof(struct aircraft));
+
+    // the trace comes from the blob and the logged points
+    a->trace_blocks = NULL;
+    a->trace_start = 0;
+    a->trace_nchunks = 0;
+    a->trace_len = 0;
+    a->trace_alloc = 0;
+    a->trace_queued = 0;
+    a->first_message = NULL;
+    if (Modes.history_packs)
+        a->trace_hist_mark.gz.size = 0;
+    int new_index = a->globe_index > GLOBE_MAX_INDEX ? -5 : a->globe_index;
+    a->globe_index = -5;
+    a->api_cell = 0;
+    if (a->seen > now)
+        a->seen = now;
+
+    uint32_t hash = aircraftHash(a->addr);
+    if (old) {
+        a->trace_blocks = old->trace_blocks;
+        a->trace_start = old->trace_start;
+        a->trace_nchunks = old->trace_nchunks;
+        a->trace_len = old->trace_len;
+        a->trace_alloc = old->trace_alloc;
+        a->legs = old->legs;
+        old->trace_blocks = NULL;
+
+        struct aircraft **c = (struct aircraft **) &Modes.aircraft[hash];
+        while (*c && *c != old)
+            c = &((*c)->next);
+        a->next = old->next;
+        *c = a;
+        set_globe_index(old, -5);
+        apiRemove(old);
+        freeAircraft(old);
+    } else {
+        a->next = Modes.aircraft[hash];
+        Modes.aircraft[hash] = a;
+        Modes.aircraftCount++;
+    }
+    set_globe_index(a, new_index);
+    if (a->seen_pos)
+        apiUpdate(a);
+    updateValidities(a, now);
+}
+
+static int walApplyPoint(uint32_t addr, char *data, uint32_t len) {
+    struct aircraft *a = aircraftGet(addr);
+    struct state *state = (struct state *) data;
+    struct state_all *all = len >= sizeof(struct state) + sizeof(struct state_all) ? (struct state_all *) (data + sizeof(struct state)) : NULL;
+
+    if (!a || !Modes.keep_traces || len < sizeof(struct state))
+        return 0;
+    if (a->trace_len > 0 && trace_state(a, a->trace_len - 1)->timestamp >= state->timestamp)
+        return 0; // already in the blob
+    if (a->trace_len % 4 == 0 && !all)
+        return 0; // the aircraft as it is now doesn't describe this point, leave it out
+
+    if (!a->trace_blocks) {
+        trace_grow(a, GLOBE_STEP);
+        legsReset(a);
+    } else if (a->trace_len + 1 >= a->trace_alloc) {
+        trace_grow(a, GLOBE_STEP);
+    }
+
+    memcpy(trace_state(a, a->trace_len), state, sizeof(struct state));
+    if (a->trace_len % 4 == 0)
+        memcpy(trace_state_all(a, a->trace_len), all, sizeof(struct state_all));
+    a->trace_len++;
+    legsUpdate(a);
+    return 1;
+}
+
+static int walReplaySegment(const char *path, uint64_t now, uint64_t *records) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    struct wal_frame frame;
+    char *zbuf = NULL;
+    char *buf = NULL;
+    size_t zalloc = 0;
+    size_t alloc = 0;
+    off_t offset = 0;
+    int complete = 1;
+
+    while (1) {
+        ssize_t res = pread(fd, &frame, sizeof(frame), offset);
+        if (res == 0)
+            break;
+        if (res != sizeof(frame) || frame.magic != WAL_MAGIC || frame.zlen > WAL_FRAME_MAX || frame.len > WAL_FRAME_MAX) {
+            complete = 0;
+            break;
+        }
+        if (frame.zlen > zalloc) {
+            zalloc = frame.zlen;
+            free(zbuf);
+            zbuf = malloc(zalloc);
+        }
+        if (frame.len > alloc) {
+            alloc = frame.len;
+            free(buf);
+            buf = malloc(alloc);
+        }
+        if (!zbuf || !buf) {
+            fprintf(stderr, "walReplay: out of memory\n");
+            exit(1);
+        }
+        if (pread(fd, zbuf, frame.zlen, offset + sizeof(frame)) != (ssize_t) frame.zlen
+                || gunzipToBuffer(zbuf, frame.zlen, buf, frame.len) != (long) frame.len) {
+            // the write of this frame was interrupted
+            complete = 0;
+            break;
+        }
+        offset += sizeof(frame) + frame.zlen;
+
+        for (char *p = buf; p + sizeof(struct wal_record) <= buf + frame.len;) {
+            struct wal_record rec;
+            memcpy(&rec, p, sizeof(rec));
+            p += sizeof(rec);
+            if (p + rec.len > buf + frame.len)
+                break;
+            if (rec.type == WAL_AIRCRAFT && rec.len == sizeof(struct aircraft)) {
+                struct aircraft *ac = malloc(sizeof(struct aircraft));
+                memcpy(ac, p, sizeof(struct aircraft));
+                walApplyAircraft(ac, now);
+                free(ac);
+                (*records)++;
+            } else if (rec.type == WAL_POINT) {
+                *records += walApplyPoint(rec.addr, p, rec.len);
+            }
+            p += rec.len;
+        }
+    }
+
+    free(zbuf);
+    free(buf);
+    close(fd);
+    if (!complete)
+        fprintf(stderr, "%s: ends with an incomplete frame at %lld\n", path, (long long) offset);
+    return 0;
+}
+
+static int walNumberCompare(const void *p1, const void *p2) {
+    uint32_t n1 = *(const uint32_t *) p1;
+    uint32_t n2 = *(const uint32_t *) p2;
+    return n1 < n2 ? -1 : (n1 > n2 ? 1 : 0);
+}
+
+// apply the log on top of the loaded blobs, before walInit()
+void walReplay() {
+    char path[PATH_MAX];
+    uint64_t now = mstime();
+    uint32_t *numbers = NULL;
+    int count = 0;
+    int alloc = 0;
+
+    DIR *dir = opendir(Modes.state_dir);
+    if (!dir)
+        return;
+    struct dirent *ep;
+    while ((ep = readdir(dir))) {
+        unsigned number;
+        char extra;
+        if (sscanf(ep->d_name, "wal_%8x%c", &number, &extra) != 1)
+            continue;
+        if (count == alloc) {
+            alloc = alloc ? 2 * alloc : 64;
+            numbers = realloc(numbers, alloc * sizeof(uint32_t));
+            if (!numbers) {
+                fprintf(stderr, "walReplay: out of memory\n");
+                exit(1);
+            }
+        }
+        numbers[count++] = number;
+    }
+    closedir(dir);
+
+    qsort(numbers, count, sizeof(uint32_t), walNumberCompare);
+
+    uint64_t records = 0;
+    for (int i = 0; i < count; i++) {
+        walPath(path, numbers[i]);
+        walReplaySegment(path, now, &records);
+        // until every blob has been saved again
+        walSegmentClosed(numbers[i], now);
+        wal.segment = numbers[i] + 1;
+    }
+    if (count)
+        fprintf(stderr, "state wal: replayed %"PRIu64" records from %d segments\n", records, count);
+    free(numbers);
+}
+
+void walInit() {
+    pthread_mutex_init(&wal.mutex, NULL);
+    wal.started = mstime();
+    walOpenSegment(wal.started);
+}
+
+void walCleanup(int saved) {
+    char path[PATH_MAX];
+    if (wal.fd >= 0)
+        close(wal.fd);
+    wal.fd = -1;
+    if (saved) {
+        for (int i = 0; i < wal.nclosed; i++) {
+            walPath(path, wal.closed[i].number);
+            unlink(path);
+        }
+        walPath(path, wal.segment);
+        unlink(path);
+    }
+    free(wal.closed);
+    free(wal.buf);
+    free(wal.spare);
+    wal.closed = NULL;
+    wal.buf = wal.spare = NULL;
+    wal.nclosed = wal.closedAlloc = 0;
+    pthread_mutex_destroy(&wal.mutex);
+}
@@ -0,0 +1,45 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// wal.h: write-ahead log for the persistent state
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef WAL_H
+#define WAL_H
+
+// Write-ahead log for the persistent state (--state-wal)
+//
+// Trace points are logged as they are added, aircraft structs when they have
+// changed but at most every WAL_AIRCRAFT_INTERVAL.  The log is flushed every
+// second to state_dir/wal_XXXXXXXX segments.  The state blobs are the snapshots
+// the log is compacted into: a segment is deleted once every blob has been
+// saved after the segment was closed.  On startup the segments are replayed on
+// top of the blobs; records older than what the blobs hold are skipped.
+
+#define WAL_SEGMENT_TIME (5 * MINUTES)
+#define WAL_AIRCRAFT_INTERVAL (60 * SECONDS)
+
+void walReplay();
+void walInit();
+// saved: the complete state was written to the blobs, the log isn't needed anymore
+void walCleanup(int saved);
+
+// caller holds the decode lock
+void walTracePoint(struct aircraft *a, uint64_t now);
+void walAircraft(struct aircraft *a, uint64_t now);
+
+void walFlush(uint64_t now);
+void walBlobSaved(int blob, uint64_t started);
+
+#endif
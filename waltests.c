@@ -0,0 +1,175 @@
+// Part of readsb, a Mode-S/ADSB/TIS message decoder.
+//
+// waltests.c - tests for the write-ahead log of the persistent state
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "readsb.h"
+
+struct _Modes Modes;
+
+#define WAL_TEST_ADDR 0x3c6444
+#define WAL_TEST_POINTS 23 // not a multiple of 4 on purpose
+
+// first logged point, after walInit() like in a running readsb
+static uint64_t walT0;
+
+// state_all of every logged point, as the aircraft described it when the point was added
+static struct state_all walExpected[WAL_TEST_POINTS];
+
+static struct aircraft *testAircraft(uint64_t seen) {
+    struct aircraft *a = calloc(1, sizeof(struct aircraft));
+    if (!a) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    a->size_struct_aircraft = sizeof(struct aircraft);
+    a->addr = WAL_TEST_ADDR;
+    a->globe_index = -5;
+    a->seen = seen;
+
+    uint32_t hash = aircraftHash(a->addr);
+    a->next = Modes.aircraft[hash];
+    Modes.aircraft[hash] = a;
+    Modes.aircraftCount++;
+    return a;
+}
+
+static void removeAircraft(struct aircraft *a) {
+    uint32_t hash = aircraftHash(a->addr);
+    struct aircraft **c = (struct aircraft **) &Modes.aircraft[hash];
+    while (*c && *c != a)
+        c = &((*c)->next);
+    if (*c)
+        *c = a->next;
+    Modes.aircraftCount--;
+    freeAircraft(a);
+}
+
+// append a point like updatePosition() does, without the logging
+static void addPoint(struct aircraft *a, uint64_t timestamp, int n) {
+    if (!a->trace_blocks || a->trace_len + 1 >= a->trace_alloc)
+        trace_grow(a, GLOBE_STEP);
+
+    struct state *s = trace_state(a, a->trace_len);
+    memset(s, 0, sizeof(struct state));
+    s->timestamp = timestamp;
+    s->lat = 51000000 + n * 1000;
+    s->lon = -100000 - n * 1000;
+    s->altitude = 3000 + n;
+    s->flags.altitude_valid = 1;
+
+    if (a->trace_len % 4 == 0) {
+        struct state_all *all = trace_state_all(a, a->trace_len);
+        memset(all, 0, sizeof(struct state_all));
+        to_state_all(a, all, timestamp);
+    }
+    a->trace_len++;
+}
+
+// log an aircraft with WAL_TEST_POINTS points, the squawk changes with every point
+static void writeLog() {
+    // newer than the blob aircraft, but not in the future for the replay
+    struct aircraft *a = testAircraft(walT0 - 5000);
+    for (int i = 0; i < WAL_TEST_POINTS; i++) {
+        uint64_t now = walT0 + i * 1000;
+        a->squawk = 0x1000 + i;
+        snprintf(a->callsign, sizeof(a->callsign), "TEST%04d", i);
+        memset(&walExpected[i], 0, sizeof(struct state_all));
+        to_state_all(a, &walExpected[i], now);
+        addPoint(a, now, i);
+        walTracePoint(a, now);
+    }
+    walFlush(walT0 + WAL_TEST_POINTS * 1000);
+    removeAircraft(a);
+}
+
+// replay the log on top of a blob trace of blobPoints points, the first blobFromLog of
+// them are the logged points, the others older points the log doesn't have
+static int testReplay(const char *name, int blobPoints, int blobFromLog) {
+    int ok = 1;
+    struct aircraft *a = testAircraft(walT0 - 10000);
+    int older = blobPoints - blobFromLog;
+    for (int i = 0; i < older; i++)
+        addPoint(a, walT0 - (older - i) * 1000, -1 - i);
+    for (int i = 0; i < blobFromLog; i++) {
+        a->squawk = 0x1000 + i;
+        snprintf(a->callsign, sizeof(a->callsign), "TEST%04d", i);
+        addPoint(a, walT0 + i * 1000, i);
+    }
+
+    walReplay();
+
+    a = aircraftGet(WAL_TEST_ADDR);
+    int expectedLen = older + WAL_TEST_POINTS;
+    if (!a || a->trace_len != expectedLen || a->seen != walT0 - 5000) {
+        fprintf(stderr, "testReplay[%s]: FAIL: trace_len %d (expected %d)\n", name, a ? a->trace_len : -1, expectedLen);
+        if (a)
+            removeAircraft(a);
+        return 0;
+    }
+
+    for (int i = 0; i < WAL_TEST_POINTS; i++) {
+        int k = older + i;
+        struct state *s = trace_state(a, k);
+        if (s->timestamp != walT0 + i * 1000 || s->lat != 51000000 + i * 1000 || s->altitude != 3000 + i) {
+            ok = 0;
+            fprintf(stderr, "testReplay[%s]: FAIL: point %d at index %d differs\n", name, i, k);
+        }
+        // the logged point lands on an index with a state_all, it has to be the one logged with it
+        if (k % 4 == 0 && memcmp(trace_state_all(a, k), &walExpected[i], sizeof(struct state_all))) {
+            ok = 0;
+            fprintf(stderr, "testReplay[%s]: FAIL: state_all at index %d (point %d): squawk %04x (expected %04x)\n",
+                    name, k, i, trace_state_all(a, k)->squawk, walExpected[i].squawk);
+        }
+    }
+    if (ok)
+        fprintf(stderr, "testReplay[%s]:  PASS\n", name);
+
+    removeAircraft(a);
+    return ok;
+}
+
+int main(int __attribute__ ((unused)) argc, char __attribute__ ((unused)) **argv) {
+    int ok = 1;
+    char dir[] = "/tmp/waltests.XXXXXX";
+
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    Modes.state_dir = dir;
+    Modes.state_wal = 1;
+    Modes.keep_traces = 24 * HOURS;
+    for (int i = 0; i < ZCLASS_COUNT; i++)
+        Modes.compress_level[i] = 1;
+
+    walInit();
+    walT0 = mstime() + 1000;
+    writeLog();
+
+    ok = testReplay("empty", 0, 0) && ok;
+    // logged points shift by 1 to 3 places: the points without a state_all in the trace land on multiples of 4
+    ok = testReplay("shift1", 1, 0) && ok;
+    ok = testReplay("shift2", 2, 0) && ok;
+    ok = testReplay("shift3", 3, 0) && ok;
+    // points the blob has already are skipped
+    ok = testReplay("inblob", 6, 6) && ok;
+    ok = testReplay("inblob+shift", 7, 5) && ok;
+
+    walCleanup(1);
+    if (rmdir(dir) < 0)
+        perror(dir);
+    return ok ? 0 : 1;
+}